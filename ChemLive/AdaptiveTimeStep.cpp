@@ -0,0 +1,88 @@
+#include "pch.h"
+#include "AdaptiveTimeStep.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <ppl.h>
+#include <stdexcept>
+
+namespace Simulation
+{
+	// Atoms per task
+	static const size_t ReduceBlock = 16384;
+
+	AdaptiveTimeStep::AdaptiveTimeStep(const AdaptiveTimeStepSettings& settings) :
+		m_settings(settings),
+		m_contactTime(std::numeric_limits<double>::infinity()),
+		m_overlap(0.0f),
+		m_statistics()
+	{
+		if (!(settings.minimum > 0.0) || !(settings.maximum >= settings.minimum) ||
+			!(settings.travel > 0.0f) || !(settings.approach > 0.0f) || !(settings.overlap > 0.0f))
+			throw std::runtime_error("AdaptiveTimeStep: the bounds must be positive and in order, with positive fractions");
+
+		m_statistics.smallest = std::numeric_limits<double>::infinity();
+	}
+
+	double AdaptiveTimeStep::Propose(const std::vector<Atom*>& atoms)
+	{
+		// max |v|^2 / r^2 - one square root at the end instead of one per atom
+		const size_t count = atoms.size();
+		const size_t blocks = (count + ReduceBlock - 1) / ReduceBlock;
+		std::vector<float> rates(blocks, 0.0f);
+		concurrency::parallel_for(size_t(0), blocks, [&](size_t block)
+			{
+				float rate = 0.0f;
+				size_t end = std::min(count, (block + 1) * ReduceBlock);
+				for (size_t iii = block * ReduceBlock; iii < end; ++iii)
+				{
+					const XMFLOAT3 velocity = atoms[iii]->Velocity();
+					const float radius = atoms[iii]->Radius();
+					rate = std::max(rate, (velocity.x * velocity.x + velocity.y * velocity.y + velocity.z * velocity.z) / (radius * radius));
+				}
+				rates[block] = rate;
+			});
+
+		float rate = 0.0f;
+		for (float part : rates)
+			rate = std::max(rate, part);
+
+		const double travelTime = rate > 0.0f ? m_settings.travel / std::sqrt(static_cast<double>(rate)) : std::numeric_limits<double>::infinity();
+		const double approachTime = m_settings.approach * m_contactTime;
+		m_contactTime = std::numeric_limits<double>::infinity();
+		m_overlap = 0.0f;
+
+		double timeStep = std::min(travelTime, approachTime);
+		if (timeStep < m_settings.maximum && timeStep > m_settings.minimum)
+		{
+			if (travelTime <= approachTime)
+				++m_statistics.velocityLimited;
+			else
+				++m_statistics.approachLimited;
+		}
+		return std::max(m_settings.minimum, std::min(m_settings.maximum, timeStep));
+	}
+
+	void AdaptiveTimeStep::Gather(double contactTime, float overlap)
+	{
+		m_contactTime = std::min(m_contactTime, contactTime);
+		m_overlap = std::max(m_overlap, overlap);
+	}
+
+	bool AdaptiveTimeStep::Accept(double timeStep)
+	{
+		if (m_overlap > m_settings.overlap && timeStep > m_settings.minimum)
+		{
+			++m_statistics.rejected;
+			m_contactTime = std::numeric_limits<double>::infinity();
+			m_overlap = 0.0f;
+			return false;
+		}
+
+		++m_statistics.accepted;
+		m_statistics.timeStep = timeStep;
+		m_statistics.smallest = std::min(m_statistics.smallest, timeStep);
+		m_statistics.largest = std::max(m_statistics.largest, timeStep);
+		return true;
+	}
+}
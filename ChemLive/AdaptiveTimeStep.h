@@ -0,0 +1,73 @@
+#pragma once
+
+#include "pch.h"
+#include "Atom.h"
+#include <algorithm>
+#include <vector>
+
+namespace Simulation
+{
+	struct AdaptiveTimeStepSettings
+	{
+		double	minimum = 1.0e-5;		// ps - no step is ever smaller, rejected or not
+		double	maximum = 1.0e-2;		// ps
+		float	travel = 0.1f;			// Fraction of its radius an atom may move in one step
+		float	approach = 0.5f;		// Fraction of the time to the nearest contact a step may take
+		float	overlap = 0.2f;			// Deepest overlap a step may leave, as a fraction of the contact distance
+	};
+
+	struct AdaptiveTimeStepStatistics
+	{
+		double				timeStep;		// ps - of the last step taken
+		double				smallest;		// Over every step taken
+		double				largest;
+		unsigned long long	accepted;
+		unsigned long long	rejected;		// Taken again with half the step
+		unsigned long long	velocityLimited;	// Steps set by the fastest atom rather than the nearest contact or a bound
+		unsigned long long	approachLimited;
+	};
+
+	/*
+	*	Chooses the time step before every step instead of taking a fixed or wall clock one:
+	*
+	*		travel		every atom moves at most 'travel' of its radius - a parallel reduction of
+	*					max |v| / r over the atoms
+	*		approach	no pair closes more than 'approach' of its gap - the time to the nearest
+	*					contact, which the time stepped collision pass gathers while it tests every
+	*					pair anyway (see Gather)
+	*
+	*	whichever is smaller, within [minimum, maximum]. Calm scenes run at the maximum, a fast
+	*	hydrogen heading for a neighbour brings the step down for just as long as it takes.
+	*
+	*	A step that still leaves two atoms overlapping deeper than 'overlap' is rejected - the
+	*	caller rolls the atoms back and takes it again with half the step, down to the minimum.
+	*/
+	class AdaptiveTimeStep
+	{
+	public:
+		AdaptiveTimeStep(const AdaptiveTimeStepSettings& settings = AdaptiveTimeStepSettings());
+
+		// The step to take next. Forgets whatever the last collision pass gathered.
+		double Propose(const std::vector<Atom*>& atoms);
+
+		// From the collision pass of the step just taken: the shortest time to contact of any
+		// approaching pair, and the deepest overlap as a fraction of the contact distance
+		void Gather(double contactTime, float overlap);
+
+		// Whether 'timeStep' may stand - false means take it again with Retry's step
+		bool Accept(double timeStep);
+		double Retry(double timeStep) const { return std::max(m_settings.minimum, 0.5 * timeStep); }
+
+		// GET
+		AdaptiveTimeStepStatistics		Statistics() const { return m_statistics; }
+		const AdaptiveTimeStepSettings&	Settings() const { return m_settings; }
+
+	private:
+		AdaptiveTimeStepSettings	m_settings;
+
+		double						m_contactTime;		// Gathered by the last collision pass
+		float						m_overlap;
+
+		AdaptiveTimeStepStatistics	m_statistics;
+	};
+}
@@ -0,0 +1,753 @@
+#include "pch.h"
+#include "AsyncIO.h"
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <utility>
+
+#if !defined(_WIN32)
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define CHEMLIVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+namespace Simulation
+{
+	// ==============================================================================================
+	// IoFile
+
+	IoFile::IoFile() :
+#if defined(_WIN32)
+		m_file(INVALID_HANDLE_VALUE)
+#else
+		m_file(-1)
+#endif
+	{
+	}
+
+	IoFile::IoFile(const std::wstring& filename, Mode mode) :
+		IoFile()
+	{
+#if defined(_WIN32)
+		if (mode == Mode::Read)
+			m_file = CreateFile2(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING, nullptr);
+		else
+			m_file = CreateFile2(filename.c_str(), GENERIC_READ | GENERIC_WRITE, 0, CREATE_ALWAYS, nullptr);
+		if (m_file == INVALID_HANDLE_VALUE)
+			throw std::runtime_error("IoFile: unable to open file");
+#else
+		int flags = mode == Mode::Read ? O_RDONLY : O_RDWR | O_CREAT | O_TRUNC;
+		m_file = open(std::filesystem::path(filename).c_str(), flags | O_CLOEXEC, 0644);
+		if (m_file < 0)
+			throw std::runtime_error("IoFile: unable to open file");
+#endif
+	}
+
+	IoFile::~IoFile()
+	{
+		Close();
+	}
+
+	IoFile::IoFile(IoFile&& other) noexcept :
+		m_file(other.m_file)
+	{
+#if defined(_WIN32)
+		other.m_file = INVALID_HANDLE_VALUE;
+#else
+		other.m_file = -1;
+#endif
+	}
+
+	IoFile& IoFile::operator=(IoFile&& other) noexcept
+	{
+		if (this != &other)
+		{
+			Close();
+			std::swap(m_file, other.m_file);
+		}
+		return *this;
+	}
+
+	void IoFile::Close()
+	{
+#if defined(_WIN32)
+		if (m_file != INVALID_HANDLE_VALUE)
+			CloseHandle(m_file);
+		m_file = INVALID_HANDLE_VALUE;
+#else
+		if (m_file >= 0)
+			close(m_file);
+		m_file = -1;
+#endif
+	}
+
+	bool IoFile::IsOpen() const
+	{
+#if defined(_WIN32)
+		return m_file != INVALID_HANDLE_VALUE;
+#else
+		return m_file >= 0;
+#endif
+	}
+
+	size_t IoFile::ReadAt(uint64_t offset, void* data, size_t size)
+	{
+		uint8_t* bytes = static_cast<uint8_t*>(data);
+		size_t done = 0;
+		while (done < size)
+		{
+			size_t request = std::min<size_t>(size - done, 1u << 30);
+#if defined(_WIN32)
+			OVERLAPPED position = {};
+			position.Offset = static_cast<DWORD>(offset + done);
+			position.OffsetHigh = static_cast<DWORD>((offset + done) >> 32);
+			DWORD read = 0;
+			if (!ReadFile(m_file, bytes + done, static_cast<DWORD>(request), &read, &position))
+			{
+				if (GetLastError() == ERROR_HANDLE_EOF)
+					break;
+				throw std::runtime_error("IoFile: read failed");
+			}
+#else
+			ssize_t read = pread(m_file, bytes + done, request, static_cast<off_t>(offset + done));
+			if (read < 0 && errno == EINTR)
+				continue;
+			if (read < 0)
+				throw std::runtime_error("IoFile: read failed");
+#endif
+			if (read == 0)
+				break;
+			done += static_cast<size_t>(read);
+		}
+		return done;
+	}
+
+	void IoFile::WriteAt(uint64_t offset, const void* data, size_t size)
+	{
+		const uint8_t* bytes = static_cast<const uint8_t*>(data);
+		size_t done = 0;
+		while (done < size)
+		{
+			size_t request = std::min<size_t>(size - done, 1u << 30);
+#if defined(_WIN32)
+			OVERLAPPED position = {};
+			position.Offset = static_cast<DWORD>(offset + done);
+			position.OffsetHigh = static_cast<DWORD>((offset + done) >> 32);
+			DWORD written = 0;
+			if (!WriteFile(m_file, bytes + done, static_cast<DWORD>(request), &written, &position) || written == 0)
+				throw std::runtime_error("IoFile: write failed");
+#else
+			ssize_t written = pwrite(m_file, bytes + done, request, static_cast<off_t>(offset + done));
+			if (written < 0 && errno == EINTR)
+				continue;
+			if (written <= 0)
+				throw std::runtime_error("IoFile: write failed");
+#endif
+			done += static_cast<size_t>(written);
+		}
+	}
+
+	void IoFile::Sync()
+	{
+#if defined(_WIN32)
+		if (!FlushFileBuffers(m_file))
+#else
+		if (fsync(m_file) != 0)
+#endif
+			throw std::runtime_error("IoFile: unable to flush file to disk");
+	}
+
+	uint64_t IoFile::Size()
+	{
+#if defined(_WIN32)
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(m_file, &size))
+			throw std::runtime_error("IoFile: unable to query file size");
+		return static_cast<uint64_t>(size.QuadPart);
+#else
+		struct stat status;
+		if (fstat(m_file, &status) != 0)
+			throw std::runtime_error("IoFile: unable to query file size");
+		return static_cast<uint64_t>(status.st_size);
+#endif
+	}
+
+	// ==============================================================================================
+	// IoQueue - io_uring backend
+	//
+	// Talks to the kernel directly rather than through liburing: the submission and completion
+	// rings are shared memory, a request is one 64 byte entry, and io_uring_enter both submits
+	// the entries written since the last call and (optionally) waits for completions.
+
+#if defined(CHEMLIVE_IO_URING)
+	struct IoQueue::Ring
+	{
+		int				fd = -1;
+		void*			sqMemory = MAP_FAILED;
+		size_t			sqMemorySize = 0;
+		void*			cqMemory = MAP_FAILED;
+		size_t			cqMemorySize = 0;
+		io_uring_sqe*	sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+		size_t			sqesSize = 0;
+
+		unsigned int*	sqHead = nullptr;
+		unsigned int*	sqTail = nullptr;
+		unsigned int	sqMask = 0;
+		unsigned int*	sqArray = nullptr;
+		unsigned int*	cqHead = nullptr;
+		unsigned int*	cqTail = nullptr;
+		unsigned int	cqMask = 0;
+		io_uring_cqe*	cqes = nullptr;
+
+		unsigned int	unsubmitted = 0;		// Entries written to the ring but not yet passed to the kernel
+		bool			registered = false;		// Buffers are registered
+	};
+
+	static int RingSetup(unsigned int entries, io_uring_params* params)
+	{
+		return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+	}
+	static int RingEnter(int fd, unsigned int submit, unsigned int minComplete, unsigned int flags)
+	{
+		return static_cast<int>(syscall(__NR_io_uring_enter, fd, submit, minComplete, flags, nullptr, 0));
+	}
+	static int RingRegister(int fd, unsigned int opcode, const void* arguments, unsigned int count)
+	{
+		return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arguments, count));
+	}
+
+	bool IoQueue::CreateRing()
+	{
+		std::unique_ptr<Ring> ring(new Ring());
+
+		io_uring_params params = {};
+		ring->fd = RingSetup(static_cast<unsigned int>(m_operations.size()), &params);
+		if (ring->fd < 0)
+			return false;		// Old kernel, or io_uring disabled (seccomp, sysctl)
+		m_ring = std::move(ring);
+
+		// Plain IORING_OP_READ / WRITE arrived together with this feature (Linux 5.6)
+		if (!(params.features & IORING_FEAT_RW_CUR_POS))
+		{
+			DestroyRing();
+			return false;
+		}
+
+		Ring& r = *m_ring;
+		r.sqMemorySize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+		r.cqMemorySize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		if (params.features & IORING_FEAT_SINGLE_MMAP)
+			r.sqMemorySize = r.cqMemorySize = std::max(r.sqMemorySize, r.cqMemorySize);
+
+		r.sqMemory = mmap(nullptr, r.sqMemorySize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r.fd, IORING_OFF_SQ_RING);
+		if (r.sqMemory == MAP_FAILED)
+		{
+			DestroyRing();
+			return false;
+		}
+		if (params.features & IORING_FEAT_SINGLE_MMAP)
+			r.cqMemory = r.sqMemory;
+		else
+		{
+			r.cqMemory = mmap(nullptr, r.cqMemorySize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r.fd, IORING_OFF_CQ_RING);
+			if (r.cqMemory == MAP_FAILED)
+			{
+				DestroyRing();
+				return false;
+			}
+		}
+
+		r.sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+		r.sqes = static_cast<io_uring_sqe*>(mmap(nullptr, r.sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r.fd, IORING_OFF_SQES));
+		if (r.sqes == MAP_FAILED)
+		{
+			DestroyRing();
+			return false;
+		}
+
+		uint8_t* sq = static_cast<uint8_t*>(r.sqMemory);
+		uint8_t* cq = static_cast<uint8_t*>(r.cqMemory);
+		r.sqHead = reinterpret_cast<unsigned int*>(sq + params.sq_off.head);
+		r.sqTail = reinterpret_cast<unsigned int*>(sq + params.sq_off.tail);
+		r.sqMask = *reinterpret_cast<unsigned int*>(sq + params.sq_off.ring_mask);
+		r.sqArray = reinterpret_cast<unsigned int*>(sq + params.sq_off.array);
+		r.cqHead = reinterpret_cast<unsigned int*>(cq + params.cq_off.head);
+		r.cqTail = reinterpret_cast<unsigned int*>(cq + params.cq_off.tail);
+		r.cqMask = *reinterpret_cast<unsigned int*>(cq + params.cq_off.ring_mask);
+		r.cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+		return true;
+	}
+
+	void IoQueue::DestroyRing()
+	{
+		if (m_ring == nullptr)
+			return;
+
+		Ring& r = *m_ring;
+		if (r.sqes != MAP_FAILED)
+			munmap(r.sqes, r.sqesSize);
+		if (r.cqMemory != MAP_FAILED && r.cqMemory != r.sqMemory)
+			munmap(r.cqMemory, r.cqMemorySize);
+		if (r.sqMemory != MAP_FAILED)
+			munmap(r.sqMemory, r.sqMemorySize);
+		if (r.fd >= 0)
+			close(r.fd);
+		m_ring = nullptr;
+	}
+
+	void IoQueue::PrepareRing(unsigned int slot)
+	{
+		Ring& r = *m_ring;
+		Operation& operation = m_operations[slot];
+		const IoRequest& request = operation.request;
+
+		// At most queueDepth requests are in flight and the ring has at least that many entries,
+		// so there is always a free entry here
+		unsigned int tail = *r.sqTail;
+		unsigned int index = tail & r.sqMask;
+		io_uring_sqe& sqe = r.sqes[index];
+		std::memset(&sqe, 0, sizeof(sqe));
+
+		bool fixed = request.buffer >= 0 && r.registered;
+		if (request.operation == IoOperation::Read)
+			sqe.opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+		else
+			sqe.opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+
+		sqe.fd = request.file->Descriptor();
+		sqe.off = request.offset + operation.done;
+		sqe.user_data = slot;
+		if (fixed)
+		{
+			sqe.addr = reinterpret_cast<uint64_t>(static_cast<uint8_t*>(request.data) + operation.done);
+			sqe.len = static_cast<uint32_t>(request.size - operation.done);
+			sqe.buf_index = static_cast<uint16_t>(request.buffer);
+		}
+		else
+		{
+			sqe.addr = reinterpret_cast<uint64_t>(static_cast<uint8_t*>(request.data) + operation.done);
+			sqe.len = static_cast<uint32_t>(request.size - operation.done);
+		}
+
+		r.sqArray[index] = index;
+		__atomic_store_n(r.sqTail, tail + 1, __ATOMIC_RELEASE);
+		++r.unsubmitted;
+	}
+
+	void IoQueue::SubmitRing()
+	{
+		Ring& r = *m_ring;
+		while (r.unsubmitted > 0)
+		{
+			int submitted = RingEnter(r.fd, r.unsubmitted, 0, 0);
+			if (submitted < 0 && errno == EINTR)
+				continue;
+			if (submitted < 0)
+				throw std::runtime_error("IoQueue: io_uring submission failed");
+			r.unsubmitted -= static_cast<unsigned int>(submitted);
+		}
+	}
+
+	void IoQueue::ReapRing(bool wait)
+	{
+		Ring& r = *m_ring;
+		SubmitRing();
+
+		unsigned int head = *r.cqHead;
+		if (wait && head == __atomic_load_n(r.cqTail, __ATOMIC_ACQUIRE))
+		{
+			while (RingEnter(r.fd, 0, 1, IORING_ENTER_GETEVENTS) < 0)
+			{
+				if (errno != EINTR)
+					throw std::runtime_error("IoQueue: waiting for io_uring completions failed");
+			}
+		}
+
+		bool resubmit = false;
+		unsigned int tail = __atomic_load_n(r.cqTail, __ATOMIC_ACQUIRE);
+		for (; head != tail; ++head)
+		{
+			const io_uring_cqe& cqe = r.cqes[head & r.cqMask];
+			unsigned int slot = static_cast<unsigned int>(cqe.user_data);
+			Operation& operation = m_operations[slot];
+
+			if (cqe.res < 0)
+			{
+				m_completions.push_back({ operation.request.tag, cqe.res });
+			}
+			else
+			{
+				operation.done += static_cast<uint64_t>(cqe.res);
+				if (cqe.res > 0 && operation.done < operation.request.size)
+				{
+					// Short transfer - carry on from where it stopped
+					PrepareRing(slot);
+					resubmit = true;
+					continue;
+				}
+
+				// Only a read may end early (at the end of the file) - a write that stops short, as
+				// one to a full disk does, has failed
+				if (operation.request.operation == IoOperation::Write && operation.done < operation.request.size)
+					m_completions.push_back({ operation.request.tag, -EIO });
+				else
+					m_completions.push_back({ operation.request.tag, static_cast<int64_t>(operation.done) });
+			}
+
+			m_freeSlots.push_back(slot);
+			--m_inFlight;
+		}
+		__atomic_store_n(r.cqHead, head, __ATOMIC_RELEASE);
+
+		if (resubmit)
+			SubmitRing();
+	}
+#else
+	struct IoQueue::Ring
+	{
+	};
+
+	bool IoQueue::CreateRing() { return false; }
+	void IoQueue::DestroyRing() {}
+	void IoQueue::PrepareRing(unsigned int) {}
+	void IoQueue::SubmitRing() {}
+	void IoQueue::ReapRing(bool) {}
+#endif
+
+	// ==============================================================================================
+	// IoQueue
+
+	IoQueue::IoQueue(const IoQueueSettings& settings) :
+		m_backend(IoBackend::ThreadPool),
+		m_inFlight(0),
+		m_stopping(false)
+	{
+		unsigned int depth = std::max(1u, settings.queueDepth);
+		m_operations.resize(depth);
+		for (unsigned int slot = depth; slot > 0; --slot)
+			m_freeSlots.push_back(slot - 1);
+
+		if (settings.backend != IoBackend::ThreadPool)
+		{
+			if (CreateRing())
+				m_backend = IoBackend::IoUring;
+			else if (settings.backend == IoBackend::IoUring)
+				throw std::runtime_error("IoQueue: io_uring is not available");
+		}
+
+		if (m_backend == IoBackend::ThreadPool)
+		{
+			unsigned int threads = std::max(1u, std::min(settings.workerThreads, depth));
+			for (unsigned int iii = 0; iii < threads; ++iii)
+				m_workers.emplace_back(&IoQueue::WorkerThread, this);
+		}
+	}
+
+	IoQueue::~IoQueue()
+	{
+		// The kernel or a worker may still be writing into caller memory - let it finish
+		try
+		{
+			while (m_inFlight > 0)
+				Reap(true);
+		}
+		catch (const std::exception&)
+		{
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stopping = true;
+		}
+		m_queued.notify_all();
+		for (std::thread& worker : m_workers)
+			worker.join();
+
+		DestroyRing();
+	}
+
+	void IoQueue::RegisterBuffers(const std::vector<IoBuffer>& buffers)
+	{
+		if (m_inFlight != 0)
+			throw std::logic_error("IoQueue: buffers cannot be registered while requests are in flight");
+
+		m_buffers = buffers;
+
+#if defined(CHEMLIVE_IO_URING)
+		if (m_ring != nullptr)
+		{
+			if (m_ring->registered)
+				RingRegister(m_ring->fd, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+			m_ring->registered = false;
+
+			std::vector<iovec> vectors(buffers.size());
+			for (size_t iii = 0; iii < buffers.size(); ++iii)
+			{
+				vectors[iii].iov_base = buffers[iii].data;
+				vectors[iii].iov_len = buffers[iii].size;
+			}
+
+			// Registration pins the pages and counts against RLIMIT_MEMLOCK. If that is refused the
+			// requests still work, just without the fixed buffer fast path.
+			if (!vectors.empty())
+				m_ring->registered = RingRegister(m_ring->fd, IORING_REGISTER_BUFFERS, vectors.data(), static_cast<unsigned int>(vectors.size())) == 0;
+		}
+#endif
+	}
+
+	void IoQueue::Submit(const IoRequest* requests, size_t count)
+	{
+		for (size_t iii = 0; iii < count; ++iii)
+		{
+			const IoRequest& request = requests[iii];
+			if (request.buffer >= static_cast<int>(m_buffers.size()))
+				throw std::logic_error("IoQueue: request names a buffer that is not registered");
+
+			while (m_freeSlots.empty())
+				Reap(true);
+
+			unsigned int slot = m_freeSlots.back();
+			m_freeSlots.pop_back();
+			m_operations[slot].request = request;
+			m_operations[slot].done = 0;
+			++m_inFlight;
+
+			if (m_backend == IoBackend::IoUring)
+				PrepareRing(slot);
+			else
+			{
+				{
+					std::lock_guard<std::mutex> lock(m_mutex);
+					m_pending.push_back(slot);
+				}
+				m_queued.notify_one();
+			}
+		}
+
+		// The whole batch goes to the kernel with a single system call
+		if (m_backend == IoBackend::IoUring)
+			SubmitRing();
+	}
+
+	size_t IoQueue::Wait(IoCompletion* completions, size_t maxCount, size_t minCount)
+	{
+		minCount = std::min(minCount, maxCount);
+
+		Reap(false);
+		while (m_completions.size() < minCount && m_inFlight > 0)
+			Reap(true);
+
+		size_t count = std::min(maxCount, m_completions.size());
+		for (size_t iii = 0; iii < count; ++iii)
+		{
+			completions[iii] = m_completions.front();
+			m_completions.pop_front();
+		}
+		return count;
+	}
+
+	void IoQueue::Reap(bool wait)
+	{
+		if (m_backend == IoBackend::IoUring)
+			ReapRing(wait);
+		else
+			ReapPool(wait);
+	}
+
+	void IoQueue::WorkerThread()
+	{
+		while (true)
+		{
+			unsigned int slot;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_queued.wait(lock, [this] { return !m_pending.empty() || m_stopping; });
+				if (m_pending.empty())
+					return;
+
+				slot = m_pending.front();
+				m_pending.pop_front();
+			}
+
+			const IoRequest& request = m_operations[slot].request;
+			int64_t result;
+			try
+			{
+				if (request.operation == IoOperation::Read)
+					result = static_cast<int64_t>(request.file->ReadAt(request.offset, request.data, request.size));
+				else
+				{
+					request.file->WriteAt(request.offset, request.data, request.size);
+					result = request.size;
+				}
+			}
+			catch (const std::runtime_error&)
+			{
+				result = -1;
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_done.emplace_back(slot, result);
+			}
+			m_finished.notify_one();
+		}
+	}
+
+	void IoQueue::ReapPool(bool wait)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if (wait)
+			m_finished.wait(lock, [this] { return !m_done.empty(); });
+
+		for (const std::pair<unsigned int, int64_t>& done : m_done)
+		{
+			m_completions.push_back({ m_operations[done.first].request.tag, done.second });
+			m_freeSlots.push_back(done.first);
+			--m_inFlight;
+		}
+		m_done.clear();
+	}
+
+	// ==============================================================================================
+	// AsyncFileWriter
+
+	AsyncFileWriter::AsyncFileWriter(const std::wstring& filename, size_t bufferSize, unsigned int bufferCount, const IoQueueSettings& settings) :
+		m_file(filename, IoFile::Mode::Write),
+		m_bufferSize(std::max<size_t>(bufferSize, 4096)),
+		m_queue(settings),
+		m_used(0),
+		m_size(0),
+		m_failed(false)
+	{
+		// One buffer is always being filled, so at least two are needed for any overlap
+		bufferCount = std::max(2u, std::min(bufferCount, m_queue.QueueDepth() + 1));
+		m_storage.reset(new uint8_t[m_bufferSize * bufferCount]);
+		m_submitted.resize(bufferCount, 0);
+
+		std::vector<IoBuffer> buffers(bufferCount);
+		for (unsigned int iii = 0; iii < bufferCount; ++iii)
+		{
+			buffers[iii].data = m_storage.get() + iii * m_bufferSize;
+			buffers[iii].size = m_bufferSize;
+			m_freeBuffers.push_back(bufferCount - 1 - iii);
+		}
+		m_queue.RegisterBuffers(buffers);
+
+		m_current = m_freeBuffers.back();
+		m_freeBuffers.pop_back();
+	}
+
+	AsyncFileWriter::~AsyncFileWriter()
+	{
+		try
+		{
+			Flush();
+		}
+		catch (const std::exception&)
+		{
+		}
+	}
+
+	void AsyncFileWriter::Write(const void* data, size_t size)
+	{
+		if (m_failed)
+			throw std::runtime_error("AsyncFileWriter: an earlier write failed");
+
+		const uint8_t* bytes = static_cast<const uint8_t*>(data);
+		while (size > 0)
+		{
+			size_t count = std::min(size, m_bufferSize - m_used);
+			std::memcpy(m_storage.get() + m_current * m_bufferSize + m_used, bytes, count);
+			m_used += count;
+			m_size += count;
+			bytes += count;
+			size -= count;
+
+			if (m_used == m_bufferSize)
+				SubmitBuffer();
+		}
+	}
+
+	void AsyncFileWriter::WriteAt(uint64_t offset, const void* data, size_t size)
+	{
+		if (offset + size > m_size)
+			throw std::logic_error("AsyncFileWriter: WriteAt past the end of what was written");
+
+		Flush();
+		m_file.WriteAt(offset, data, size);
+	}
+
+	void AsyncFileWriter::SubmitBuffer()
+	{
+		if (m_used != 0)
+		{
+			IoRequest request;
+			request.operation = IoOperation::Write;
+			request.file = &m_file;
+			request.offset = m_size - m_used;
+			request.data = m_storage.get() + m_current * m_bufferSize;
+			request.size = static_cast<uint32_t>(m_used);
+			request.buffer = static_cast<int>(m_current);
+			request.tag = m_current;
+			m_submitted[m_current] = m_used;
+			m_queue.Submit(request);
+			m_used = 0;
+
+			if (m_freeBuffers.empty())
+				WaitForBuffer();
+			m_current = m_freeBuffers.back();
+			m_freeBuffers.pop_back();
+		}
+	}
+
+	void AsyncFileWriter::WaitForBuffer()
+	{
+		IoCompletion completions[16];
+		size_t count = m_queue.Wait(completions, 16, 1);
+		for (size_t iii = 0; iii < count; ++iii)
+		{
+			m_freeBuffers.push_back(static_cast<unsigned int>(completions[iii].tag));
+			if (completions[iii].result != static_cast<int64_t>(m_submitted[completions[iii].tag]))
+				m_failed = true;
+		}
+
+		if (m_failed)
+			throw std::runtime_error("AsyncFileWriter: write failed");
+	}
+
+	void AsyncFileWriter::Flush()
+	{
+		if (!m_file.IsOpen())
+			return;
+
+		SubmitBuffer();
+		while (m_queue.InFlight() > 0)
+			WaitForBuffer();
+
+		if (m_failed)
+			throw std::runtime_error("AsyncFileWriter: write failed");
+	}
+
+	void AsyncFileWriter::Sync()
+	{
+		Flush();
+		m_file.Sync();
+	}
+
+	void AsyncFileWriter::Close()
+	{
+		Flush();
+		m_file.Close();
+	}
+}
@@ -0,0 +1,236 @@
+#pragma once
+
+#include "pch.h"
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+*	Asynchronous file I/O shared by the scene, trajectory and checkpoint writers.
+*
+*	An IoQueue keeps many positional reads and writes in flight at once, which is what it takes
+*	to keep an NVMe drive busy while the simulation computes. On Linux it uses io_uring (one
+*	system call submits a whole batch, and registered buffers skip the per request page pinning);
+*	everywhere else, or when the kernel refuses io_uring, a small thread pool issues ordinary
+*	positional reads and writes instead. Callers see the same interface either way.
+*
+*	None of the classes here are thread safe - each is meant to be driven by a single thread
+*	(typically a background writer thread).
+*/
+
+namespace Simulation
+{
+	enum class IoBackend
+	{
+		Auto,			// io_uring if the kernel allows it, otherwise ThreadPool
+		IoUring,		// Linux only - the IoQueue constructor throws if it is unavailable
+		ThreadPool
+	};
+
+	enum class IoOperation
+	{
+		Read,
+		Write
+	};
+
+	struct IoQueueSettings
+	{
+		IoBackend		backend = IoBackend::Auto;
+		unsigned int	queueDepth = 64;		// Requests in flight at once - Submit waits for room beyond this
+		unsigned int	workerThreads = 4;		// ThreadPool backend only
+	};
+
+	/*
+	*	An open file for positional I/O. Nothing here moves a file pointer, so any number of
+	*	requests can target the same file at different offsets.
+	*/
+	class IoFile
+	{
+	public:
+		enum class Mode
+		{
+			Read,		// Existing file
+			Write		// Created, or truncated if it exists
+		};
+
+		IoFile();
+		IoFile(const std::wstring& filename, Mode mode);		// Throws std::runtime_error if the file cannot be opened
+		~IoFile();
+
+		IoFile(const IoFile&) = delete;
+		IoFile& operator=(const IoFile&) = delete;
+		IoFile(IoFile&& other) noexcept;
+		IoFile& operator=(IoFile&& other) noexcept;
+
+		void Close();
+
+		// Blocking positional I/O. Both loop until everything is transferred (or the end of the file
+		// is reached, for ReadAt) and throw std::runtime_error on failure.
+		size_t ReadAt(uint64_t offset, void* data, size_t size);
+		void WriteAt(uint64_t offset, const void* data, size_t size);
+
+		// Returns once everything written so far is on the disk
+		void Sync();
+
+		// GET
+		uint64_t Size();
+		bool IsOpen() const;
+
+#if defined(_WIN32)
+		HANDLE Handle() const { return m_file; }
+#else
+		int Descriptor() const { return m_file; }
+#endif
+
+	private:
+#if defined(_WIN32)
+		HANDLE			m_file;
+#else
+		int				m_file;
+#endif
+	};
+
+	struct IoRequest
+	{
+		IoOperation		operation;
+		IoFile*			file;
+		uint64_t		offset;
+		void*			data;
+		uint32_t		size;
+		int				buffer = -1;		// Index of the registered buffer 'data' lies in, or -1
+		uint64_t		tag;				// Handed back in the completion
+	};
+
+	struct IoCompletion
+	{
+		uint64_t		tag;
+		int64_t			result;				// Bytes transferred (short only for a read at the end of a file), or negative on failure
+	};
+
+	struct IoBuffer
+	{
+		void*			data;
+		size_t			size;
+	};
+
+	class IoQueue
+	{
+	public:
+		IoQueue(const IoQueueSettings& settings = IoQueueSettings());
+		~IoQueue();		// Waits for every request still in flight
+
+		IoQueue(const IoQueue&) = delete;
+		IoQueue& operator=(const IoQueue&) = delete;
+
+		// Register long lived buffers up front. Requests whose IoRequest::buffer names one of them
+		// avoid mapping the pages on every operation. Replaces any earlier registration; must be
+		// called while nothing is in flight.
+		void RegisterBuffers(const std::vector<IoBuffer>& buffers);
+
+		// Queue a batch of requests. Short transfers are continued internally, so a completion
+		// only arrives once a request is finished. Waits for room when queueDepth requests are
+		// already in flight (completions reaped meanwhile are kept for Wait).
+		void Submit(const IoRequest* requests, size_t count);
+		void Submit(const IoRequest& request) { Submit(&request, 1); }
+
+		// Collect between minCount and maxCount completions. Returns fewer than minCount only when
+		// nothing is left in flight.
+		size_t Wait(IoCompletion* completions, size_t maxCount, size_t minCount = 1);
+
+		// GET
+		IoBackend		Backend() const { return m_backend; }
+		unsigned int	InFlight() const { return m_inFlight; }
+		unsigned int	QueueDepth() const { return static_cast<unsigned int>(m_operations.size()); }
+
+	private:
+		struct Operation
+		{
+			IoRequest	request;
+			uint64_t	done;				// Bytes transferred so far
+		};
+
+		struct Ring;						// io_uring state (AsyncIO.cpp)
+
+		bool CreateRing();
+		void DestroyRing();
+		void PrepareRing(unsigned int slot);
+		void SubmitRing();
+		void ReapRing(bool wait);
+
+		void WorkerThread();
+		void ReapPool(bool wait);
+
+		void Reap(bool wait);
+
+		IoBackend								m_backend;
+		std::vector<Operation>					m_operations;		// One slot per request in flight
+		std::vector<unsigned int>				m_freeSlots;
+		unsigned int							m_inFlight;
+		std::deque<IoCompletion>				m_completions;		// Reaped but not yet handed to Wait
+
+		// io_uring
+		std::unique_ptr<Ring>					m_ring;
+		std::vector<IoBuffer>					m_buffers;
+
+		// Thread pool
+		std::mutex								m_mutex;
+		std::condition_variable					m_queued;
+		std::condition_variable					m_finished;
+		std::deque<unsigned int>				m_pending;
+		std::deque<std::pair<unsigned int, int64_t>> m_done;
+		bool									m_stopping;
+		std::vector<std::thread>				m_workers;
+	};
+
+	/*
+	*	Sequential file writer on top of an IoQueue. Write() copies into one of a few large
+	*	registered buffers; full buffers are written while the caller keeps producing, so the
+	*	writer only ever waits when every buffer is still on its way to the disk.
+	*/
+	class AsyncFileWriter
+	{
+	public:
+		// Throws std::runtime_error if the file cannot be created
+		AsyncFileWriter(const std::wstring& filename, size_t bufferSize = 1 << 20, unsigned int bufferCount = 8,
+			const IoQueueSettings& settings = IoQueueSettings());
+		~AsyncFileWriter();		// Finishes outstanding writes but reports nothing - call Close() to see errors
+
+		AsyncFileWriter(const AsyncFileWriter&) = delete;
+		AsyncFileWriter& operator=(const AsyncFileWriter&) = delete;
+
+		// Append to the file. Throws std::runtime_error if an earlier write failed.
+		void Write(const void* data, size_t size);
+
+		// Overwrite bytes that were already appended (e.g. patching a header). Flushes first.
+		void WriteAt(uint64_t offset, const void* data, size_t size);
+
+		void Flush();		// Every appended byte has been handed to the OS
+		void Sync();		// ... and is on the disk
+		void Close();		// Flush and close. Throws std::runtime_error if any write failed.
+
+		// GET
+		uint64_t	Size() const { return m_size; }		// Bytes appended so far
+		IoBackend	Backend() const { return m_queue.Backend(); }
+
+	private:
+		void SubmitBuffer();
+		void WaitForBuffer();
+
+		// Declared so that the queue is destroyed (waiting for its requests) before the buffers and the file
+		IoFile									m_file;
+		size_t									m_bufferSize;
+		std::unique_ptr<uint8_t[]>				m_storage;
+		IoQueue									m_queue;
+		std::vector<unsigned int>				m_freeBuffers;
+		std::vector<size_t>						m_submitted;		// Bytes each buffer's write must transfer
+		unsigned int							m_current;			// Buffer being filled
+		size_t									m_used;				// ... and how much of it
+		uint64_t								m_size;
+		bool									m_failed;
+	};
+}
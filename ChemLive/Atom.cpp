@@ -1,58 +1,65 @@
 #include "pch.h"
 #include "Atom.h"
+#include "Boundaries.h"
 
 namespace Simulation
 {
-	Atom::Atom(const std::shared_ptr<DX::DeviceResources>& deviceResources, Simulation::Element element, XMFLOAT3 position, XMFLOAT3 velocity) :
+	Atom::Atom(Simulation::Element element, XMFLOAT3 position, XMFLOAT3 velocity) :
 		m_element(element),
 		m_position(position),
 		m_velocity(velocity),
 		m_neutronCount(element),
+		m_electronCount(element),
 		m_radius(Constants::AtomicRadii[element])		
 	{
-		// Create the sphere mesh
-		m_sphereMesh = std::unique_ptr<SphereMesh>(new SphereMesh(deviceResources));
-
-		// Populate the electrons
-		for (int iii = 0; iii < element; ++iii)
-			m_electrons.push_back(std::shared_ptr<Electron>(new Electron()));
 	}
 
-	Atom::Atom(const std::shared_ptr<DX::DeviceResources>& deviceResources, Simulation::Element element, XMFLOAT3 position, XMFLOAT3 velocity, int neutronCount, int electronCount) :
+	Atom::Atom(Simulation::Element element, XMFLOAT3 position, XMFLOAT3 velocity, int neutronCount, int electronCount) :
 		m_element(element),
 		m_position(position),
 		m_velocity(velocity),
 		m_neutronCount(neutronCount),
+		m_electronCount(electronCount),
 		m_radius(Constants::AtomicRadii[element])
 	{
-		// Create the sphere mesh
-		m_sphereMesh = std::unique_ptr<SphereMesh>(new SphereMesh(deviceResources));
-
-		// Populate the electrons
-		for (int iii = 0; iii < electronCount; ++iii)
-			m_electrons.push_back(std::shared_ptr<Electron>(new Electron()));
 	}
 
-	Atom::Atom(const std::shared_ptr<DX::DeviceResources>& deviceResources, Simulation::Element element, XMFLOAT3 position, XMFLOAT3 velocity, int neutronCount, int electronCount, float radius) :
+	Atom::Atom(Simulation::Element element, XMFLOAT3 position, XMFLOAT3 velocity, int neutronCount, int electronCount, float radius) :
 		m_element(element),
 		m_position(position),
 		m_velocity(velocity),
 		m_neutronCount(neutronCount),
+		m_electronCount(electronCount),
 		m_radius(radius)
 	{
-		// Create the sphere mesh
-		m_sphereMesh = std::unique_ptr<SphereMesh>(new SphereMesh(deviceResources));
-
-		// Populate the electrons
-		for (int iii = 0; iii < electronCount; ++iii)
-			m_electrons.push_back(std::shared_ptr<Electron>(new Electron()));
 	}
 
-
-	void Atom::Render(XMMATRIX viewProjectionMatrix)
+	void Atom::Bound(XMFLOAT3 boxDimensions, unsigned int periodicAxes)
 	{
-		m_sphereMesh->Render(m_position, m_radius, viewProjectionMatrix);
-	}
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			float& position = (&m_position.x)[axis];
+			float& velocity = (&m_velocity.x)[axis];
+			float length = (&boxDimensions.x)[axis];
+
+			if (Boundaries::IsPeriodic(periodicAxes, axis))
+			{
+				position = Boundaries::Wrap(position, length);
+				continue;
+			}
 
+			// We can't just flip the velocity because when an atom is small enough and the velocity
+			// large enough, it is possible for the center of the atom to find itself outside the box
+			float delta = (position + m_radius) - (length / 2.0f);		// Positive wall
+			if (delta <= 0)
+			{
+				delta = (position - m_radius) + (length / 2.0f);		// Negative wall
+				if (delta >= 0)
+					continue;
+			}
 
-}
\ No newline at end of file
+			position -= delta;
+			velocity *= -1;
+		}
+	}
+}
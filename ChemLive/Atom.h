@@ -2,41 +2,41 @@
 
 #include "pch.h"
 #include "Constants.h"
-#include "Electron.h"
 #include "Enums.h"
-#include "SphereMesh.h"
 #include <vector>
 
 using DirectX::XMFLOAT3;
+using DirectX::XMMATRIX;
+using DirectX::XMMatrixTranslation;
 
 namespace Simulation
 {
+	/*
+	*	Atoms are constructed in place inside the simulation's AtomArena (see AtomGenerator),
+	*	so an Atom must not own any heap memory. Electrons are stored as a plain count and the
+	*	sphere mesh used for drawing is owned by the SimulationRenderer and shared by all atoms.
+	*/
 	class Atom
 	{
 	public:
 		// Constructors
-		Atom(const std::shared_ptr<DX::DeviceResources>& deviceResources,
-			Simulation::Element element,
+		Atom(Simulation::Element element,
 			XMFLOAT3 position, XMFLOAT3 velocity);
 
-		Atom(const std::shared_ptr<DX::DeviceResources>& deviceResources,
-			Simulation::Element element,
+		Atom(Simulation::Element element,
 			XMFLOAT3 position, XMFLOAT3 velocity,
 			int neutronCount, int electronCount);
 
 		// If you want to explicitly set the radius
-		Atom(const std::shared_ptr<DX::DeviceResources>& deviceResources,
-			Simulation::Element element,
+		Atom(Simulation::Element element,
 			XMFLOAT3 position, XMFLOAT3 velocity, 
 			int neutronCount, int electronCount,
 			float radius);
 
-		// Update
-		virtual void Update(double timeDelta, const std::vector<Atom*>& atoms, XMFLOAT3 boxDimensions) = 0;
+		// Update - 'periodicAxes' is a combination of PeriodicAxis flags
+		virtual void Update(double timeDelta, const std::vector<Atom*>& atoms, XMFLOAT3 boxDimensions, unsigned int periodicAxes) = 0;
 
 		// Render
-		void Render(XMMATRIX viewProjectionMatrix);
-		XMMATRIX ModelMatrix() { return m_sphereMesh->ModelMatrix(); }
 		XMMATRIX TranslationMatrix() { return XMMatrixTranslation(m_position.x, m_position.y, m_position.z); }
 
 		// Get
@@ -46,23 +46,30 @@ namespace Simulation
 		float Mass() { return static_cast<float>(m_element + m_neutronCount); }
 		int ProtonsCount() { return m_element; }
 		int NeutronsCount() { return m_neutronCount; }
-		int ElectronsCount() { return m_electrons.size(); }
+		int ElectronsCount() { return m_electronCount; }
 		float Radius() { return m_radius; }
-		int Charge() { return ProtonsCount() - ElectronsCount(); }
+		int Charge() { return m_element - m_electronCount; }
 
 		// Set
+		void Position(XMFLOAT3 position) { m_position = position; }
 		void Velocity(XMFLOAT3 velocity) { m_velocity = velocity; }
 
+		// Raw members - the C API hands out strided views over these (see ChemLiveAPI.h)
+		XMFLOAT3* PositionData() { return &m_position; }
+		XMFLOAT3* VelocityData() { return &m_velocity; }
+		const Simulation::Element* ElementData() { return &m_element; }
+
 	protected:
-		std::unique_ptr<SphereMesh> m_sphereMesh;
+		// Keep the atom inside the box - bounce it off the walls, or wrap it around the periodic axes
+		void Bound(XMFLOAT3 boxDimensions, unsigned int periodicAxes);
 
 		XMFLOAT3		m_position;
 		XMFLOAT3		m_velocity;
 
-		Simulation::Element	                   m_element;
-		std::vector<std::shared_ptr<Electron>> m_electrons;
+		Simulation::Element	m_element;
 
 		int				m_neutronCount;		
+		int				m_electronCount;
 
 		float			m_radius;
 	};
@@ -0,0 +1,196 @@
+#include "pch.h"
+#include "AtomArena.h"
+#include "Elements.h"
+#include <algorithm>
+#include <ppl.h>
+#include <type_traits>
+
+namespace Simulation
+{
+	// Clear() never runs destructors, so every element class must be safe to simply forget
+	static_assert(std::is_trivially_destructible<Hydrogen>::value, "Atoms must be trivially destructible");
+	static_assert(std::is_trivially_destructible<Helium>::value, "Atoms must be trivially destructible");
+	static_assert(std::is_trivially_destructible<Lithium>::value, "Atoms must be trivially destructible");
+	static_assert(std::is_trivially_destructible<Beryllium>::value, "Atoms must be trivially destructible");
+	static_assert(std::is_trivially_destructible<Boron>::value, "Atoms must be trivially destructible");
+	static_assert(std::is_trivially_destructible<Carbon>::value, "Atoms must be trivially destructible");
+	static_assert(std::is_trivially_destructible<Nitrogen>::value, "Atoms must be trivially destructible");
+	static_assert(std::is_trivially_destructible<Oxygen>::value, "Atoms must be trivially destructible");
+	static_assert(std::is_trivially_destructible<Flourine>::value, "Atoms must be trivially destructible");
+	static_assert(std::is_trivially_destructible<Neon>::value, "Atoms must be trivially destructible");
+
+	// Copy construct 'atom' into 'slot' as its most derived type
+	static void CopyAtom(Atom* atom, void* slot)
+	{
+		switch (atom->Element())
+		{
+		case Element::HYDROGEN:		new (slot) Hydrogen(*static_cast<Hydrogen*>(atom)); break;
+		case Element::HELIUM:		new (slot) Helium(*static_cast<Helium*>(atom)); break;
+		case Element::LITHIUM:		new (slot) Lithium(*static_cast<Lithium*>(atom)); break;
+		case Element::BERYLLIUM:	new (slot) Beryllium(*static_cast<Beryllium*>(atom)); break;
+		case Element::BORON:		new (slot) Boron(*static_cast<Boron*>(atom)); break;
+		case Element::CARBON:		new (slot) Carbon(*static_cast<Carbon*>(atom)); break;
+		case Element::NITROGEN:		new (slot) Nitrogen(*static_cast<Nitrogen*>(atom)); break;
+		case Element::OXYGEN:		new (slot) Oxygen(*static_cast<Oxygen*>(atom)); break;
+		case Element::FLOURINE:		new (slot) Flourine(*static_cast<Flourine*>(atom)); break;
+		case Element::NEON:			new (slot) Neon(*static_cast<Neon*>(atom)); break;
+		default:
+			break;
+		}
+	}
+
+	static size_t LargestElementSize()
+	{
+		return std::max({
+			sizeof(Hydrogen), sizeof(Helium), sizeof(Lithium), sizeof(Beryllium), sizeof(Boron),
+			sizeof(Carbon), sizeof(Nitrogen), sizeof(Oxygen), sizeof(Flourine), sizeof(Neon)
+		});
+	}
+
+	AtomArena::AtomArena() :
+		m_atomCount(0),
+		m_firstFreeChunk(0)
+	{
+		// Round the slot size up so that every slot is suitably aligned for an Atom
+		size_t alignment = alignof(Atom);
+		m_slotSize = (LargestElementSize() + alignment - 1) / alignment * alignment;
+	}
+
+	void* AtomArena::Allocate()
+	{
+		// Skip over full chunks - chunks are only ever filled front to back
+		while (m_firstFreeChunk < m_chunks.size() && m_chunks[m_firstFreeChunk]->count == ChunkCapacity)
+			++m_firstFreeChunk;
+
+		if (m_firstFreeChunk == m_chunks.size())
+			AddChunk();
+		else
+			MakeChunkWritable(m_firstFreeChunk);
+
+		Chunk& chunk = *m_chunks[m_firstFreeChunk];
+		void* slot = chunk.storage.get() + chunk.count * m_slotSize;
+		++chunk.count;
+		++m_atomCount;
+
+		return slot;
+	}
+
+	void AtomArena::Reserve(size_t atomCount)
+	{
+		size_t chunksNeeded = (atomCount + ChunkCapacity - 1) / ChunkCapacity;
+		m_chunks.reserve(chunksNeeded);
+		while (m_chunks.size() < chunksNeeded)
+			AddChunk();
+	}
+
+	size_t AtomArena::AllocateBulk(size_t count)
+	{
+		size_t first = m_atomCount;
+		Reserve(m_atomCount + count);
+
+		size_t remaining = count;
+		for (size_t chunk = first / ChunkCapacity; remaining > 0; ++chunk)
+		{
+			MakeChunkWritable(chunk);
+
+			unsigned int taken = static_cast<unsigned int>(std::min<size_t>(remaining, ChunkCapacity - m_chunks[chunk]->count));
+			m_chunks[chunk]->count += taken;
+			remaining -= taken;
+		}
+
+		m_atomCount += count;
+		return first;
+	}
+
+	void AtomArena::Numbers(const std::vector<Atom*>& atoms, std::vector<uint32_t>& numbers)
+	{
+		// Chunks by address - an atom belongs to the last one starting at or before it
+		std::vector<std::pair<const unsigned char*, size_t>> starts(m_chunks.size());
+		for (size_t chunk = 0; chunk < m_chunks.size(); ++chunk)
+			starts[chunk] = { m_chunks[chunk]->storage.get(), chunk };
+		std::sort(starts.begin(), starts.end());
+
+		numbers.resize(atoms.size());
+		concurrency::parallel_for(size_t(0), atoms.size(), [&](size_t iii)
+			{
+				const unsigned char* atom = reinterpret_cast<const unsigned char*>(atoms[iii]);
+				auto found = std::upper_bound(starts.begin(), starts.end(), std::make_pair(atom, ~size_t(0))) - 1;
+				numbers[iii] = static_cast<uint32_t>(found->second * ChunkCapacity + (atom - found->first) / m_slotSize);
+			});
+	}
+
+	void AtomArena::Clear()
+	{
+		m_chunks.clear();
+		m_atomCount = 0;
+		m_firstFreeChunk = 0;
+	}
+
+	void AtomArena::Swap(AtomArena& other)
+	{
+		std::swap(m_chunks, other.m_chunks);
+		std::swap(m_atomCount, other.m_atomCount);
+		std::swap(m_firstFreeChunk, other.m_firstFreeChunk);
+	}
+
+	AtomArena::Snapshot AtomArena::TakeSnapshot()
+	{
+		Snapshot snapshot;
+		snapshot.m_chunks = m_chunks;
+		snapshot.m_atomCount = m_atomCount;
+		snapshot.m_slotSize = m_slotSize;
+		return snapshot;
+	}
+
+	void AtomArena::Restore(const Snapshot& snapshot)
+	{
+		m_chunks = snapshot.m_chunks;
+		m_atomCount = snapshot.m_atomCount;
+		m_firstFreeChunk = 0;
+	}
+
+	size_t AtomArena::MakeWritable()
+	{
+		size_t copied = 0;
+		for (size_t iii = 0; iii < m_chunks.size(); ++iii)
+		{
+			if (MakeChunkWritable(iii))
+				++copied;
+		}
+		return copied;
+	}
+
+	bool AtomArena::MakeChunkWritable(size_t chunk)
+	{
+		std::shared_ptr<Chunk>& shared = m_chunks[chunk];
+		if (shared.use_count() == 1)
+			return false;
+
+		// Copy the atoms into fresh storage and hand that copy to the snapshot(s) that share
+		// this chunk. The live arena keeps the original storage so Atom* into it stay valid.
+		std::shared_ptr<Chunk> live = std::make_shared<Chunk>();
+		{
+			// A snapshot may be reading the chunk on another thread (see Snapshot::ReadChunk)
+			std::lock_guard<std::mutex> lock(shared->mutex);
+
+			std::unique_ptr<unsigned char[]> copy(new unsigned char[m_slotSize * ChunkCapacity]);
+			for (unsigned int slot = 0; slot < shared->count; ++slot)
+				CopyAtom(reinterpret_cast<Atom*>(shared->storage.get() + slot * m_slotSize), copy.get() + slot * m_slotSize);
+
+			live->storage = std::move(shared->storage);
+			live->count = shared->count;
+			shared->storage = std::move(copy);
+		}
+		shared = live;
+
+		return true;
+	}
+
+	void AtomArena::AddChunk()
+	{
+		std::shared_ptr<Chunk> chunk = std::make_shared<Chunk>();
+		chunk->storage = std::unique_ptr<unsigned char[]>(new unsigned char[m_slotSize * ChunkCapacity]);
+		chunk->count = 0;
+		m_chunks.push_back(chunk);
+	}
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include "pch.h"
+#include "Atom.h"
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace Simulation
+{
+	/*
+	*	Chunked storage for every atom in a simulation. Each chunk is a single allocation
+	*	holding ChunkCapacity fixed size slots, and an atom is constructed in place in the
+	*	next free slot (see AtomGenerator). Atoms never move once constructed, so the Atom*
+	*	handed out stays valid until the arena is cleared or restored from a snapshot.
+	*
+	*	Chunks are always filled front to back, so atom 'index' lives in chunk
+	*	index / ChunkCapacity at slot index % ChunkCapacity.
+	*
+	*	Atoms are trivially destructible, so Clear() just drops the chunks - there is no
+	*	per-atom work when tearing down a simulation.
+	*
+	*	Snapshots share chunks with the live arena (copy-on-write). Taking or restoring a
+	*	snapshot only copies chunk pointers; a chunk's atoms are copied the first time the
+	*	live arena writes to it while a snapshot still references it (see MakeWritable).
+	*/
+	class AtomArena
+	{
+	private:
+		struct Chunk
+		{
+			std::unique_ptr<unsigned char[]> storage;
+			unsigned int count;
+			std::mutex mutex;		// Held while a snapshot reads the chunk or MakeWritable swaps its storage
+		};
+
+	public:
+		static const unsigned int ChunkCapacity = 4096;
+
+		class Snapshot
+		{
+		public:
+			Snapshot() : m_atomCount(0), m_slotSize(0) {}
+
+			bool Empty() { return m_chunks.empty(); }
+			void Release() { m_chunks.clear(); m_atomCount = 0; }
+
+			size_t AtomCount() { return m_atomCount; }
+			size_t ChunkCount() { return m_chunks.size(); }
+
+			// Call function(Atom*) for every atom of 'chunk'. Safe to use from another thread while the
+			// simulation keeps running - the live arena waits for the read before splitting the chunk.
+			template <typename Function>
+			void ReadChunk(size_t chunk, Function function)
+			{
+				Chunk& shared = *m_chunks[chunk];
+				std::lock_guard<std::mutex> lock(shared.mutex);
+				for (unsigned int slot = 0; slot < shared.count; ++slot)
+					function(reinterpret_cast<Atom*>(shared.storage.get() + slot * m_slotSize));
+			}
+
+			// Drop the snapshot's reference to one chunk once it is no longer needed, so the live
+			// arena does not have to copy it on its next write
+			void ReleaseChunk(size_t chunk) { m_chunks[chunk] = nullptr; }
+
+		private:
+			friend class AtomArena;
+
+			std::vector<std::shared_ptr<Chunk>> m_chunks;
+			size_t								m_atomCount;
+			size_t								m_slotSize;
+		};
+
+		AtomArena();
+		AtomArena(const AtomArena&) = delete;
+		AtomArena& operator=(const AtomArena&) = delete;
+
+		// Returns uninitialized storage large enough for any element class
+		void* Allocate();
+
+		// Make sure there is room for a total of 'atomCount' atoms (used for bulk loading)
+		void Reserve(size_t atomCount);
+
+		// Claim 'count' consecutive slots at once and return the index of the first one. The
+		// slots (see SlotAt) must all be constructed before the arena is used for anything else.
+		// Construction can happen in parallel - this is how scenes are loaded in bulk.
+		size_t AllocateBulk(size_t count);
+		void* SlotAt(size_t index) { return m_chunks[index / ChunkCapacity]->storage.get() + (index % ChunkCapacity) * m_slotSize; }
+
+		// The index (as SlotAt takes it) of every one of 'atoms', which must all live in this arena
+		void Numbers(const std::vector<Atom*>& atoms, std::vector<uint32_t>& numbers);
+
+		// Release every atom at once
+		void Clear();
+
+		// Exchange contents with another arena (e.g. one a scene was loaded into)
+		void Swap(AtomArena& other);
+
+		// Snapshots - both are O(chunks). Restoring invalidates every Atom* handed out before.
+		Snapshot TakeSnapshot();
+		void Restore(const Snapshot& snapshot);
+
+		// Must be called before atoms are modified in place. Any chunk still shared with a
+		// snapshot is split so that the snapshot keeps an untouched copy. The live arena keeps
+		// the original storage, so existing Atom* stay valid. Returns the number of chunks copied.
+		size_t MakeWritable();
+
+		// GET
+		size_t AtomCount() { return m_atomCount; }
+		size_t ChunkCount() { return m_chunks.size(); }
+		size_t SlotSize() { return m_slotSize; }
+
+		unsigned int ChunkAtomCount(size_t chunk) { return m_chunks[chunk]->count; }
+		Atom* At(size_t chunk, unsigned int slot) { return reinterpret_cast<Atom*>(m_chunks[chunk]->storage.get() + slot * m_slotSize); }
+
+	private:
+		void AddChunk();
+		bool MakeChunkWritable(size_t chunk);
+
+		std::vector<std::shared_ptr<Chunk>>	m_chunks;
+		size_t								m_slotSize;			// sizeof the largest element class, rounded up to its alignment
+		size_t								m_atomCount;
+		size_t								m_firstFreeChunk;	// Chunks before this one are full
+	};
+}
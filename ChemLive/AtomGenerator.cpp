@@ -3,44 +3,56 @@
 
 namespace Simulation
 {
-	AtomGenerator::AtomGenerator(const std::shared_ptr<DX::DeviceResources>& deviceResources) :
-		m_deviceResources(deviceResources)
+	AtomGenerator::AtomGenerator(AtomArena* arena) :
+		m_arena(arena)
 	{
 	}
 
 	Atom* AtomGenerator::CreateAtom(Element element, XMFLOAT3 position, XMFLOAT3 velocity)
 	{
+		// Check before claiming a slot - the arena must never hold an unconstructed slot
+		if (!IsValidElement(element))
+			return nullptr;
+
 		switch (element)
 		{
-		case Element::HYDROGEN:		return new Hydrogen(m_deviceResources, position, velocity);
-		case Element::HELIUM:		return new Helium(m_deviceResources, position, velocity);
-		case Element::LITHIUM:		return new Lithium(m_deviceResources, position, velocity);
-		case Element::BERYLLIUM:	return new Beryllium(m_deviceResources, position, velocity); 
-		case Element::BORON:		return new Boron(m_deviceResources, position, velocity);
-		case Element::CARBON:		return new Carbon(m_deviceResources, position, velocity);
-		case Element::NITROGEN:		return new Nitrogen(m_deviceResources, position, velocity);
-		case Element::OXYGEN:		return new Oxygen(m_deviceResources, position, velocity);
-		case Element::FLOURINE:		return new Flourine(m_deviceResources, position, velocity);
-		case Element::NEON:			return new Neon(m_deviceResources, position, velocity);
+		case Element::HYDROGEN:		return new (m_arena->Allocate()) Hydrogen(position, velocity);
+		case Element::HELIUM:		return new (m_arena->Allocate()) Helium(position, velocity);
+		case Element::LITHIUM:		return new (m_arena->Allocate()) Lithium(position, velocity);
+		case Element::BERYLLIUM:	return new (m_arena->Allocate()) Beryllium(position, velocity); 
+		case Element::BORON:		return new (m_arena->Allocate()) Boron(position, velocity);
+		case Element::CARBON:		return new (m_arena->Allocate()) Carbon(position, velocity);
+		case Element::NITROGEN:		return new (m_arena->Allocate()) Nitrogen(position, velocity);
+		case Element::OXYGEN:		return new (m_arena->Allocate()) Oxygen(position, velocity);
+		case Element::FLOURINE:		return new (m_arena->Allocate()) Flourine(position, velocity);
+		case Element::NEON:			return new (m_arena->Allocate()) Neon(position, velocity);
 		default:
 			return nullptr;
 		}
 	}
 
 	Atom* AtomGenerator::CreateAtom(Element element, XMFLOAT3 position, XMFLOAT3 velocity, int neutronCount, int charge)
+	{
+		if (!IsValidElement(element))
+			return nullptr;
+
+		return CreateAtomAt(m_arena->Allocate(), element, position, velocity, neutronCount, charge);
+	}
+
+	Atom* AtomGenerator::CreateAtomAt(void* slot, Element element, XMFLOAT3 position, XMFLOAT3 velocity, int neutronCount, int charge)
 	{
 		switch (element)
 		{
-		case Element::HYDROGEN:		return new Hydrogen(m_deviceResources, position, velocity, neutronCount, charge);
-		case Element::HELIUM:		return new Helium(m_deviceResources, position, velocity, neutronCount, charge);
-		case Element::LITHIUM:		return new Lithium(m_deviceResources, position, velocity, neutronCount, charge);
-		case Element::BERYLLIUM:	return new Beryllium(m_deviceResources, position, velocity, neutronCount, charge);
-		case Element::BORON:		return new Boron(m_deviceResources, position, velocity, neutronCount, charge);
-		case Element::CARBON:		return new Carbon(m_deviceResources, position, velocity, neutronCount, charge);
-		case Element::NITROGEN:		return new Nitrogen(m_deviceResources, position, velocity, neutronCount, charge);
-		case Element::OXYGEN:		return new Oxygen(m_deviceResources, position, velocity, neutronCount, charge);
-		case Element::FLOURINE:		return new Flourine(m_deviceResources, position, velocity, neutronCount, charge);
-		case Element::NEON:			return new Neon(m_deviceResources, position, velocity, neutronCount, charge);
+		case Element::HYDROGEN:		return new (slot) Hydrogen(position, velocity, neutronCount, charge);
+		case Element::HELIUM:		return new (slot) Helium(position, velocity, neutronCount, charge);
+		case Element::LITHIUM:		return new (slot) Lithium(position, velocity, neutronCount, charge);
+		case Element::BERYLLIUM:	return new (slot) Beryllium(position, velocity, neutronCount, charge);
+		case Element::BORON:		return new (slot) Boron(position, velocity, neutronCount, charge);
+		case Element::CARBON:		return new (slot) Carbon(position, velocity, neutronCount, charge);
+		case Element::NITROGEN:		return new (slot) Nitrogen(position, velocity, neutronCount, charge);
+		case Element::OXYGEN:		return new (slot) Oxygen(position, velocity, neutronCount, charge);
+		case Element::FLOURINE:		return new (slot) Flourine(position, velocity, neutronCount, charge);
+		case Element::NEON:			return new (slot) Neon(position, velocity, neutronCount, charge);
 		default:
 			return nullptr;
 		}
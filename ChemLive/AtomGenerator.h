@@ -2,22 +2,32 @@
 
 #include "pch.h"
 
-#include "DeviceResources.h"
+#include "AtomArena.h"
 #include "Enums.h"
 #include "Elements.h"		// <-- includes header files for all elements
 
 namespace Simulation
 {
+	/*
+	*	Constructs atoms in place inside the AtomArena it was given. The arena owns
+	*	the atoms - callers must never delete the returned pointer.
+	*/
 	class AtomGenerator
 	{
 	private:
-		std::shared_ptr<DX::DeviceResources> m_deviceResources;
+		AtomArena* m_arena;
 
 
 	public:
-		AtomGenerator(const std::shared_ptr<DX::DeviceResources>& deviceResources);
+		AtomGenerator(AtomArena* arena);
 
 		Atom* CreateAtom(Element element, XMFLOAT3 position, XMFLOAT3 velocity);
 		Atom* CreateAtom(Element element, XMFLOAT3 position, XMFLOAT3 velocity, int neutronCount, int charge);
+
+		// Construct into a slot claimed with AtomArena::AllocateBulk. Safe to call from several threads
+		// for different slots. 'element' must be a valid element.
+		static Atom* CreateAtomAt(void* slot, Element element, XMFLOAT3 position, XMFLOAT3 velocity, int neutronCount, int charge);
+
+		static bool IsValidElement(int element) { return element >= Element::HYDROGEN && element <= Element::NEON; }
 	};
-}
\ No newline at end of file
+}
@@ -0,0 +1,430 @@
+#include "pch.h"
+#include "BarnesHut.h"
+#include "Constants.h"
+#include "Morton.h"
+#include <algorithm>
+#include <cmath>
+#include <ppl.h>
+#include <stdexcept>
+
+namespace Simulation
+{
+	// Atoms per task when sorting and walking, cells per task when building
+	static const size_t WalkBlock = 256;
+	static const size_t NodeBlock = 1024;
+
+	BarnesHut::BarnesHut(const BarnesHutSettings& settings) :
+		m_settings(settings),
+		m_origin(0.0f, 0.0f, 0.0f),
+		m_edge(0.0f),
+		m_statistics()
+	{
+		if (!(settings.openingAngle > 0.0f && settings.openingAngle <= 1.0f) || settings.leafSize == 0 || !(settings.innerRadius > 0.0f))
+			throw std::runtime_error("BarnesHut: the opening angle must be in (0, 1], with a positive leaf size and inner radius");
+
+		m_coupling = settings.form == LongRangeForm::Coulomb ? settings.strength * Constants::CoulombConstant : -settings.strength;
+	}
+
+	void BarnesHut::OpeningAngle(float angle)
+	{
+		// Beyond 1 an atom could see the cell it sits in as a multipole, itself included
+		if (!(angle > 0.0f && angle <= 1.0f))
+			throw std::runtime_error("BarnesHut: the opening angle must be in (0, 1]");
+		m_settings.openingAngle = angle;
+	}
+
+	double BarnesHut::AddForces(const AtomArrays& atoms, XMFLOAT3* forces)
+	{
+		Sort(atoms);
+		m_statistics.sources = m_codes.size();
+		m_statistics.pairInteractions = m_statistics.cellInteractions = 0;
+		if (m_codes.size() < 2)
+		{
+			m_statistics.nodes = 0;
+			m_statistics.depth = 0;
+			return 0.0;
+		}
+
+		Build();
+		ComputeMoments();
+		double energy = Walk();
+
+		const size_t count = m_codes.size();
+		concurrency::parallel_for(size_t(0), count, [&](size_t iii)
+			{
+				XMFLOAT3& force = forces[m_codes[iii].second];
+				force.x += m_forces[iii].x;
+				force.y += m_forces[iii].y;
+				force.z += m_forces[iii].z;
+			});
+
+		return energy;
+	}
+
+	void BarnesHut::Sort(const AtomArrays& atoms)
+	{
+		// Coulomb only sees the charged atoms, gravity every atom
+		const bool coulomb = m_settings.form == LongRangeForm::Coulomb;
+		m_codes.clear();
+		for (size_t iii = 0; iii < atoms.Count(); ++iii)
+			if (!coulomb || atoms.charges[iii] != 0.0f)
+				m_codes.push_back(std::make_pair(uint64_t(0), static_cast<uint32_t>(iii)));
+
+		// One cube around the whole box, so that every cell is a cube
+		const XMFLOAT3& box = atoms.boxDimensions;
+		m_edge = std::max(std::max(box.x, box.y), std::max(box.z, 1.0e-3f));
+		m_origin = XMFLOAT3(-m_edge / 2.0f, -m_edge / 2.0f, -m_edge / 2.0f);
+
+		const size_t count = m_codes.size();
+		const size_t blocks = (count + WalkBlock - 1) / WalkBlock;
+		concurrency::parallel_for(size_t(0), blocks, [&](size_t block)
+			{
+				const float scale = static_cast<float>(1u << Morton::Bits) / m_edge;
+				const float last = static_cast<float>((1u << Morton::Bits) - 1);
+				size_t end = std::min(count, (block + 1) * WalkBlock);
+				for (size_t iii = block * WalkBlock; iii < end; ++iii)
+				{
+					const XMFLOAT3& position = atoms.positions[m_codes[iii].second];
+					uint32_t x = static_cast<uint32_t>(std::min(last, std::max(0.0f, (position.x - m_origin.x) * scale)));
+					uint32_t y = static_cast<uint32_t>(std::min(last, std::max(0.0f, (position.y - m_origin.y) * scale)));
+					uint32_t z = static_cast<uint32_t>(std::min(last, std::max(0.0f, (position.z - m_origin.z) * scale)));
+					m_codes[iii].first = Morton::Code(x, y, z);
+				}
+			});
+
+		concurrency::parallel_sort(m_codes.begin(), m_codes.end());
+
+		m_positions.resize(count);
+		m_weights.resize(count);
+		m_forces.resize(count);
+		concurrency::parallel_for(size_t(0), blocks, [&](size_t block)
+			{
+				size_t end = std::min(count, (block + 1) * WalkBlock);
+				for (size_t iii = block * WalkBlock; iii < end; ++iii)
+				{
+					const uint32_t atom = m_codes[iii].second;
+					m_positions[iii] = atoms.positions[atom];
+					m_weights[iii] = coulomb ? atoms.charges[atom] : 1.0f / atoms.inverseMasses[atom];
+				}
+			});
+	}
+
+	void BarnesHut::Build()
+	{
+		Node root = {};
+		root.first = 0;
+		root.count = static_cast<uint32_t>(m_codes.size());
+		root.cellCentre = XMFLOAT3(0.0f, 0.0f, 0.0f);
+		root.edge = m_edge;
+
+		m_nodes.assign(1, root);
+		m_levelStart.assign(1, 0);
+		m_levelStart.push_back(1);
+
+		// A level at a time - the cells of a level find their octants' ranges by binary search in
+		// parallel, then the children are appended in the same order, so siblings stay contiguous
+		for (unsigned int level = 0; level < Morton::Bits; ++level)
+		{
+			const uint32_t begin = m_levelStart[level];
+			const uint32_t end = m_levelStart[level + 1];
+			if (begin == end)
+				break;
+
+			const unsigned int shift = 3 * (Morton::Bits - 1 - level);
+			const size_t cells = end - begin;
+			std::vector<uint32_t> bounds(cells * 9);
+			std::vector<uint32_t> childCounts(cells, 0);
+
+			const size_t blocks = (cells + NodeBlock - 1) / NodeBlock;
+			concurrency::parallel_for(size_t(0), blocks, [&](size_t block)
+				{
+					size_t last = std::min(cells, (block + 1) * NodeBlock);
+					for (size_t cell = block * NodeBlock; cell < last; ++cell)
+					{
+						const Node& node = m_nodes[begin + cell];
+						if (node.count <= m_settings.leafSize)
+							continue;
+
+						uint32_t* octants = bounds.data() + cell * 9;
+						octants[0] = node.first;
+						octants[8] = node.first + node.count;
+						for (uint32_t octant = 1; octant < 8; ++octant)
+						{
+							octants[octant] = static_cast<uint32_t>(std::lower_bound(m_codes.begin() + octants[octant - 1], m_codes.begin() + octants[8], octant,
+								[shift](const std::pair<uint64_t, uint32_t>& code, uint32_t value) { return ((code.first >> shift) & 7) < value; }) - m_codes.begin());
+						}
+						for (uint32_t octant = 0; octant < 8; ++octant)
+							if (octants[octant + 1] > octants[octant])
+								++childCounts[cell];
+					}
+				});
+
+			std::vector<uint32_t> childStart(cells + 1, end);
+			for (size_t cell = 0; cell < cells; ++cell)
+				childStart[cell + 1] = childStart[cell] + childCounts[cell];
+			if (childStart[cells] == end)
+				break;
+
+			m_nodes.resize(childStart[cells]);
+			concurrency::parallel_for(size_t(0), blocks, [&](size_t block)
+				{
+					size_t last = std::min(cells, (block + 1) * NodeBlock);
+					for (size_t cell = block * NodeBlock; cell < last; ++cell)
+					{
+						Node& node = m_nodes[begin + cell];
+						node.firstChild = childStart[cell];
+						node.childCount = childCounts[cell];
+						if (node.childCount == 0)
+							continue;
+
+						const uint32_t* octants = bounds.data() + cell * 9;
+						const float quarter = node.edge / 4.0f;
+						uint32_t next = childStart[cell];
+						for (uint32_t octant = 0; octant < 8; ++octant)
+						{
+							if (octants[octant + 1] == octants[octant])
+								continue;
+
+							Node child = {};
+							child.first = octants[octant];
+							child.count = octants[octant + 1] - octants[octant];
+							child.edge = node.edge / 2.0f;
+							child.cellCentre = XMFLOAT3(
+								node.cellCentre.x + ((octant & 1) ? quarter : -quarter),
+								node.cellCentre.y + ((octant & 2) ? quarter : -quarter),
+								node.cellCentre.z + ((octant & 4) ? quarter : -quarter));
+							m_nodes[next++] = child;
+						}
+					}
+				});
+
+			m_levelStart.push_back(childStart[cells]);
+		}
+
+		m_statistics.nodes = m_nodes.size();
+		m_statistics.depth = static_cast<unsigned int>(m_levelStart.size() - 2);
+	}
+
+	void BarnesHut::ComputeMoments()
+	{
+		// Deepest level first, so that every cell's children are done before it
+		for (size_t level = m_levelStart.size() - 1; level-- > 0; )
+		{
+			const uint32_t begin = m_levelStart[level];
+			const size_t cells = m_levelStart[level + 1] - begin;
+			const size_t blocks = (cells + NodeBlock - 1) / NodeBlock;
+
+			concurrency::parallel_for(size_t(0), blocks, [&](size_t block)
+				{
+					size_t last = std::min(cells, (block + 1) * NodeBlock);
+					for (size_t cell = block * NodeBlock; cell < last; ++cell)
+					{
+						Node& node = m_nodes[begin + cell];
+
+						// Expansion centre - where the sources are, whatever their signs
+						double magnitude = 0.0, cx = 0.0, cy = 0.0, cz = 0.0;
+						if (node.childCount == 0)
+						{
+							for (uint32_t iii = node.first; iii < node.first + node.count; ++iii)
+							{
+								double size = std::fabs(m_weights[iii]);
+								magnitude += size;
+								cx += size * m_positions[iii].x;
+								cy += size * m_positions[iii].y;
+								cz += size * m_positions[iii].z;
+							}
+						}
+						else
+						{
+							for (uint32_t child = node.firstChild; child < node.firstChild + node.childCount; ++child)
+							{
+								const Node& part = m_nodes[child];
+								magnitude += part.magnitude;
+								cx += static_cast<double>(part.magnitude) * part.centre.x;
+								cy += static_cast<double>(part.magnitude) * part.centre.y;
+								cz += static_cast<double>(part.magnitude) * part.centre.z;
+							}
+						}
+						if (magnitude > 0.0)
+						{
+							cx /= magnitude;
+							cy /= magnitude;
+							cz /= magnitude;
+						}
+						else
+						{
+							cx = node.cellCentre.x;
+							cy = node.cellCentre.y;
+							cz = node.cellCentre.z;
+						}
+
+						// Moments about the centre - Q = sum w (3 d d - d^2 I)
+						double weight = 0.0, dipole[3] = { 0.0, 0.0, 0.0 }, quadrupole[6] = { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0 };
+						auto add = [&](double w, const double d[3], const double childDipole[3], const float* childQuadrupole)
+							{
+								// A child's moments shifted by d, or a single atom at d when childDipole is null
+								const double square = d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+								weight += w;
+								for (int axis = 0; axis < 3; ++axis)
+									dipole[axis] += w * d[axis] + (childDipole ? childDipole[axis] : 0.0);
+
+								quadrupole[0] += w * (3.0 * d[0] * d[0] - square);
+								quadrupole[1] += w * (3.0 * d[1] * d[1] - square);
+								quadrupole[2] += w * (3.0 * d[2] * d[2] - square);
+								quadrupole[3] += w * 3.0 * d[0] * d[1];
+								quadrupole[4] += w * 3.0 * d[0] * d[2];
+								quadrupole[5] += w * 3.0 * d[1] * d[2];
+								if (childDipole != nullptr)
+								{
+									const double dot = 2.0 * (childDipole[0] * d[0] + childDipole[1] * d[1] + childDipole[2] * d[2]);
+									quadrupole[0] += 6.0 * childDipole[0] * d[0] - dot;
+									quadrupole[1] += 6.0 * childDipole[1] * d[1] - dot;
+									quadrupole[2] += 6.0 * childDipole[2] * d[2] - dot;
+									quadrupole[3] += 3.0 * (childDipole[0] * d[1] + d[0] * childDipole[1]);
+									quadrupole[4] += 3.0 * (childDipole[0] * d[2] + d[0] * childDipole[2]);
+									quadrupole[5] += 3.0 * (childDipole[1] * d[2] + d[1] * childDipole[2]);
+									for (int component = 0; component < 6; ++component)
+										quadrupole[component] += childQuadrupole[component];
+								}
+							};
+
+						if (node.childCount == 0)
+						{
+							for (uint32_t iii = node.first; iii < node.first + node.count; ++iii)
+							{
+								const double d[3] = { m_positions[iii].x - cx, m_positions[iii].y - cy, m_positions[iii].z - cz };
+								add(m_weights[iii], d, nullptr, nullptr);
+							}
+						}
+						else
+						{
+							for (uint32_t child = node.firstChild; child < node.firstChild + node.childCount; ++child)
+							{
+								const Node& part = m_nodes[child];
+								const double d[3] = { part.centre.x - cx, part.centre.y - cy, part.centre.z - cz };
+								const double childDipole[3] = { part.dipole.x, part.dipole.y, part.dipole.z };
+								add(part.weight, d, childDipole, part.quadrupole);
+							}
+						}
+
+						node.magnitude = static_cast<float>(magnitude);
+						node.centre = XMFLOAT3(static_cast<float>(cx), static_cast<float>(cy), static_cast<float>(cz));
+						node.weight = static_cast<float>(weight);
+						node.dipole = XMFLOAT3(static_cast<float>(dipole[0]), static_cast<float>(dipole[1]), static_cast<float>(dipole[2]));
+						for (int component = 0; component < 6; ++component)
+							node.quadrupole[component] = static_cast<float>(quadrupole[component]);
+
+						// Open unless further than edge / angle from the expansion centre, plus how far
+						// that centre is off the cube's (Barnes 1994)
+						const double ox = cx - node.cellCentre.x, oy = cy - node.cellCentre.y, oz = cz - node.cellCentre.z;
+						const double reach = node.edge / m_settings.openingAngle + std::sqrt(ox * ox + oy * oy + oz * oz);
+						node.openSquared = static_cast<float>(reach * reach);
+					}
+				});
+		}
+	}
+
+	double BarnesHut::Walk()
+	{
+		const size_t count = m_codes.size();
+		const size_t blocks = (count + WalkBlock - 1) / WalkBlock;
+		std::vector<double> energies(blocks, 0.0);
+		std::vector<unsigned long long> pairs(blocks, 0), cells(blocks, 0);
+		const float innerSquared = m_settings.innerRadius * m_settings.innerRadius;
+		const float coupling = static_cast<float>(m_coupling);
+
+		// Neighbouring atoms in Morton order take nearly the same path through the tree
+		concurrency::parallel_for(size_t(0), blocks, [&](size_t block)
+			{
+				std::vector<uint32_t> stack;
+				stack.reserve(8 * Morton::Bits);
+				double energy = 0.0;
+				unsigned long long pairCount = 0, cellCount = 0;
+
+				size_t end = std::min(count, (block + 1) * WalkBlock);
+				for (size_t iii = block * WalkBlock; iii < end; ++iii)
+				{
+					const XMFLOAT3 position = m_positions[iii];
+					float potential = 0.0f, ex = 0.0f, ey = 0.0f, ez = 0.0f;
+
+					stack.clear();
+					stack.push_back(0);
+					while (!stack.empty())
+					{
+						const Node& node = m_nodes[stack.back()];
+						stack.pop_back();
+
+						const float rx = position.x - node.centre.x;
+						const float ry = position.y - node.centre.y;
+						const float rz = position.z - node.centre.z;
+						const float r2 = rx * rx + ry * ry + rz * rz;
+
+						if (r2 > node.openSquared)
+						{
+							// Multipoles - phi = M/r + D.r/r^3 + r.Q.r/2r^5 and E = -grad phi
+							const float inverse = 1.0f / std::sqrt(r2);
+							const float inverse2 = inverse * inverse;
+							const float inverse3 = inverse * inverse2;
+							const float inverse5 = inverse3 * inverse2;
+							const float* q = node.quadrupole;
+							const float qx = q[0] * rx + q[3] * ry + q[4] * rz;
+							const float qy = q[3] * rx + q[1] * ry + q[5] * rz;
+							const float qz = q[4] * rx + q[5] * ry + q[2] * rz;
+							const float rqr = rx * qx + ry * qy + rz * qz;
+							const float dr = node.dipole.x * rx + node.dipole.y * ry + node.dipole.z * rz;
+
+							potential += node.weight * inverse + dr * inverse3 + 0.5f * rqr * inverse5;
+							const float radial = node.weight * inverse3 + 3.0f * dr * inverse5 + 2.5f * rqr * inverse5 * inverse2;
+							ex += radial * rx - node.dipole.x * inverse3 - qx * inverse5;
+							ey += radial * ry - node.dipole.y * inverse3 - qy * inverse5;
+							ez += radial * rz - node.dipole.z * inverse3 - qz * inverse5;
+							++cellCount;
+						}
+						else if (node.childCount == 0)
+						{
+							for (uint32_t jjj = node.first; jjj < node.first + node.count; ++jjj)
+							{
+								const float dx = position.x - m_positions[jjj].x;
+								const float dy = position.y - m_positions[jjj].y;
+								const float dz = position.z - m_positions[jjj].z;
+								const float square = dx * dx + dy * dy + dz * dz;
+								if (jjj == iii || square == 0.0f)
+									continue;
+
+								const float distance = std::sqrt(square);
+								const float clamped = std::max(square, innerSquared);
+								potential += m_weights[jjj] / std::max(distance, m_settings.innerRadius);
+								const float scale = m_weights[jjj] / (clamped * distance);
+								ex += scale * dx;
+								ey += scale * dy;
+								ez += scale * dz;
+							}
+							pairCount += node.count - (iii >= node.first && iii < node.first + node.count ? 1 : 0);
+						}
+						else
+						{
+							for (uint32_t child = node.firstChild; child < node.firstChild + node.childCount; ++child)
+								stack.push_back(child);
+						}
+					}
+
+					const float weight = m_weights[iii];
+					m_forces[iii] = XMFLOAT3(coupling * weight * ex, coupling * weight * ey, coupling * weight * ez);
+					energy += 0.5 * coupling * weight * potential;
+				}
+
+				energies[block] = energy;
+				pairs[block] = pairCount;
+				cells[block] = cellCount;
+			});
+
+		double energy = 0.0;
+		for (size_t block = 0; block < blocks; ++block)
+		{
+			energy += energies[block];
+			m_statistics.pairInteractions += pairs[block];
+			m_statistics.cellInteractions += cells[block];
+		}
+		return energy;
+	}
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include "pch.h"
+#include "ForceProvider.h"
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+using DirectX::XMFLOAT3;
+
+namespace Simulation
+{
+	enum class LongRangeForm
+	{
+		Coulomb,	// k q_i q_j / r between charged atoms
+		Gravity		// -G m_i m_j / r between every pair of atoms
+	};
+
+	struct BarnesHutSettings
+	{
+		LongRangeForm	form = LongRangeForm::Coulomb;
+		float			openingAngle = 0.5f;	// Cell size / distance below which a cell counts as one source, at most 1
+		unsigned int	leafSize = 16;			// Atoms a cell may hold before it is split
+		float			innerRadius = 0.05f;	// nm - closer pairs get the force at this distance
+		double			strength = 1.0;			// Scales Coulomb's constant, or G in kJ/mol nm / amu^2
+	};
+
+	struct BarnesHutStatistics
+	{
+		size_t				sources;			// Atoms in the tree
+		size_t				nodes;
+		unsigned int		depth;
+		unsigned long long	pairInteractions;		// Of the last AddForces
+		unsigned long long	cellInteractions;
+	};
+
+	/*
+	*	Barnes-Hut tree code for 1/r forces in an open box - O(N log N) instead of O(N^2), without
+	*	the periodic images particle-mesh Ewald brings.
+	*
+	*	Every step rebuilds a linear octree:
+	*
+	*		63 bit Morton codes of the positions, sorted in parallel - every cell is then a range of
+	*		the sorted atoms
+	*		cells split level by level, all cells of a level in parallel, until they hold leafSize
+	*		atoms or fewer
+	*		monopole, dipole and quadrupole moments bottom up, again a level at a time, each cell
+	*		shifting its children's moments to its own centre
+	*
+	*	Each atom then walks the tree on its own - a cell whose size over distance is below the
+	*	opening angle acts through its multipoles, leaves close by are summed directly - so the
+	*	walks run in parallel without sharing any writes. Smaller angles are more accurate and
+	*	slower; 0.5 with quadrupoles keeps forces within a few tenths of a percent.
+	*/
+	class BarnesHut : public ForceProvider
+	{
+	public:
+		BarnesHut(const BarnesHutSettings& settings = BarnesHutSettings());
+
+		double AddForces(const AtomArrays& atoms, XMFLOAT3* forces) override;
+
+		// GET
+		BarnesHutStatistics			Statistics() const { return m_statistics; }
+		const BarnesHutSettings&	Settings() const { return m_settings; }
+
+		// SET
+		void OpeningAngle(float angle);
+
+	private:
+		struct Node
+		{
+			uint32_t	first;			// Range of sorted atoms
+			uint32_t	count;
+			uint32_t	firstChild;		// Children are contiguous - none for a leaf
+			uint32_t	childCount;
+			XMFLOAT3	cellCentre;		// Of the cube
+			float		edge;
+			XMFLOAT3	centre;			// Of the expansion - the |weight| weighted mean position
+			float		weight;			// Monopole
+			float		magnitude;		// Sum of |weight|
+			XMFLOAT3	dipole;
+			float		openSquared;	// Closer than this, the cell must be opened
+			float		quadrupole[6];	// xx yy zz xy xz yz, traceless
+		};
+
+		void Sort(const AtomArrays& atoms);
+		void Build();
+		void ComputeMoments();
+		double Walk();
+
+		BarnesHutSettings						m_settings;
+		double									m_coupling;		// kJ/mol nm per weight^2
+
+		// Atoms with a weight, in Morton order
+		std::vector<std::pair<uint64_t, uint32_t>>	m_codes;	// Code and atom index
+		std::vector<XMFLOAT3>					m_positions;
+		std::vector<float>						m_weights;		// Charge or mass
+		std::vector<XMFLOAT3>					m_forces;
+
+		XMFLOAT3								m_origin;		// Lowest corner of the root cube
+		float									m_edge;			// Of the root cube
+
+		std::vector<Node>						m_nodes;
+		std::vector<uint32_t>					m_levelStart;	// First node of every level, and the end
+
+		BarnesHutStatistics						m_statistics;
+	};
+}
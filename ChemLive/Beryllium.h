@@ -14,9 +14,9 @@ namespace Simulation
 		// Constructors
 		// Most common isotope = Beryllium-9
 		// Most common charge  = +2
-		Beryllium(const std::shared_ptr<DX::DeviceResources>& deviceResources, XMFLOAT3 position, XMFLOAT3 velocity, int neutronCount = 5, int charge = 2);
+		Beryllium(XMFLOAT3 position, XMFLOAT3 velocity, int neutronCount = 5, int charge = 2);
 
 		// Update
-		void Update(double timeDelta, const std::vector<Atom*>& atoms, XMFLOAT3 boxDimensions);
+		void Update(double timeDelta, const std::vector<Atom*>& atoms, XMFLOAT3 boxDimensions, unsigned int periodicAxes);
 	};
 }
\ No newline at end of file
@@ -0,0 +1,313 @@
+#include "pch.h"
+#include "BondConstraints.h"
+#include "Boundaries.h"
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <ppl.h>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace Simulation
+{
+	// Molecules per task - most are a handful of bonds
+	static const size_t MoleculeBlock = 256;
+
+	// SHAKE divides by the dot product of the bond before and after the drift, which vanishes for
+	// a bond turned by 90 degrees in one step - far beyond any step worth taking, but kept finite
+	static const float MinimumAlignment = 1.0e-3f;
+
+	BondConstraints::BondConstraints(AtomArena& arena, const ConstraintSettings& settings) :
+		m_arena(arena),
+		m_settings(settings),
+		m_changed(false),
+		m_statistics()
+	{
+		if (!(settings.tolerance > 0.0f) || settings.maxIterations == 0)
+			throw std::runtime_error("BondConstraints: the tolerance and the iteration limit must be positive");
+	}
+
+	void BondConstraints::Add(size_t first, size_t second, float length)
+	{
+		if (first == second || first >= m_arena.AtomCount() || second >= m_arena.AtomCount())
+			throw std::runtime_error("BondConstraints: a bond needs two different atoms of the arena");
+		if (length < 0.0f)
+			throw std::runtime_error("BondConstraints: a bond length cannot be negative");
+
+		if (length == 0.0f)
+		{
+			const XMFLOAT3 a = static_cast<Atom*>(m_arena.SlotAt(first))->Position();
+			const XMFLOAT3 b = static_cast<Atom*>(m_arena.SlotAt(second))->Position();
+			length = std::sqrt((a.x - b.x) * (a.x - b.x) + (a.y - b.y) * (a.y - b.y) + (a.z - b.z) * (a.z - b.z));
+			if (!(length > 0.0f))
+				throw std::runtime_error("BondConstraints: the atoms of a bond cannot sit on top of each other");
+		}
+
+		m_bonds.push_back({ first, second, length });
+		m_changed = true;
+	}
+
+	void BondConstraints::Remove(size_t first, size_t second)
+	{
+		m_bonds.erase(std::remove_if(m_bonds.begin(), m_bonds.end(), [&](const Bond& bond)
+			{
+				return (bond.first == first && bond.second == second) || (bond.first == second && bond.second == first);
+			}), m_bonds.end());
+		m_changed = true;
+	}
+
+	void BondConstraints::Clear()
+	{
+		m_bonds.clear();
+		m_changed = true;
+	}
+
+	void BondConstraints::Tolerance(float tolerance)
+	{
+		if (!(tolerance > 0.0f))
+			throw std::runtime_error("BondConstraints: the tolerance must be positive");
+		m_settings.tolerance = tolerance;
+	}
+
+	void BondConstraints::Bind(const std::vector<Atom*>& atoms)
+	{
+		m_changed = false;
+		m_constraints.clear();
+		m_moleculeStart.assign(1, 0);
+
+		std::unordered_map<Atom*, uint32_t> indices;
+		indices.reserve(atoms.size());
+		for (size_t iii = 0; iii < atoms.size(); ++iii)
+			indices.emplace(atoms[iii], static_cast<uint32_t>(iii));
+
+		// Union-find over the bonded atoms - each root ends up naming a molecule
+		std::unordered_map<uint32_t, uint32_t> parents;
+		auto find = [&](uint32_t node)
+			{
+				uint32_t root = node;
+				while (parents[root] != root)
+					root = parents[root];
+				while (parents[node] != root)
+				{
+					uint32_t next = parents[node];
+					parents[node] = root;
+					node = next;
+				}
+				return root;
+			};
+
+		for (const Bond& bond : m_bonds)
+		{
+			// Atoms cleared from the arena, or not in the list, take their bonds with them
+			if (bond.first >= m_arena.AtomCount() || bond.second >= m_arena.AtomCount())
+				continue;
+			auto first = indices.find(static_cast<Atom*>(m_arena.SlotAt(bond.first)));
+			auto second = indices.find(static_cast<Atom*>(m_arena.SlotAt(bond.second)));
+			if (first == indices.end() || second == indices.end())
+				continue;
+
+			m_constraints.push_back({ first->second, second->second, bond.length * bond.length });
+			parents.emplace(first->second, first->second);
+			parents.emplace(second->second, second->second);
+			uint32_t a = find(first->second), b = find(second->second);
+			if (a != b)
+				parents[std::max(a, b)] = std::min(a, b);
+		}
+
+		// Bonds of a molecule back to back
+		std::vector<uint32_t> roots(m_constraints.size());
+		for (size_t iii = 0; iii < m_constraints.size(); ++iii)
+			roots[iii] = find(m_constraints[iii].first);
+
+		std::vector<uint32_t> order(m_constraints.size());
+		std::iota(order.begin(), order.end(), 0u);
+		std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return roots[a] < roots[b]; });
+
+		std::vector<Constraint> sorted(m_constraints.size());
+		for (size_t iii = 0; iii < order.size(); ++iii)
+		{
+			sorted[iii] = m_constraints[order[iii]];
+			if (iii > 0 && roots[order[iii]] != roots[order[iii - 1]])
+				m_moleculeStart.push_back(static_cast<uint32_t>(iii));
+		}
+		if (!sorted.empty())
+			m_moleculeStart.push_back(static_cast<uint32_t>(sorted.size()));
+		m_constraints.swap(sorted);
+
+		m_statistics.molecules = m_moleculeStart.size() - 1;
+		m_statistics.constraints = m_constraints.size();
+	}
+
+	void BondConstraints::Exclusions(size_t count, std::vector<uint32_t>& start, std::vector<uint32_t>& excluded) const
+	{
+		start.assign(count + 1, 0);
+		for (const Constraint& constraint : m_constraints)
+			++start[std::min(constraint.first, constraint.second) + 1];
+		for (size_t iii = 0; iii < count; ++iii)
+			start[iii + 1] += start[iii];
+
+		excluded.resize(start[count]);
+		std::vector<uint32_t> next(start.begin(), start.end() - 1);
+		for (const Constraint& constraint : m_constraints)
+			excluded[next[std::min(constraint.first, constraint.second)]++] = std::max(constraint.first, constraint.second);
+		for (size_t iii = 0; iii < count; ++iii)
+			std::sort(excluded.begin() + start[iii], excluded.begin() + start[iii + 1]);
+	}
+
+	void BondConstraints::Shake(AtomArrays& atoms, const std::vector<XMFLOAT3>& reference, float timeDelta)
+	{
+		const size_t molecules = m_moleculeStart.size() - 1;
+		if (molecules == 0)
+			return;
+
+		const XMFLOAT3 periods = Boundaries::Periods(atoms.boxDimensions, atoms.periodicAxes);
+		const XMFLOAT3 inverses = Boundaries::InversePeriods(atoms.boxDimensions, atoms.periodicAxes);
+		const float period[3] = { periods.x, periods.y, periods.z };
+		const float inverse[3] = { inverses.x, inverses.y, inverses.z };
+		const float inverseStep = 1.0f / timeDelta;
+
+		const size_t blocks = (molecules + MoleculeBlock - 1) / MoleculeBlock;
+		std::vector<unsigned int> most(blocks, 0);
+		std::vector<unsigned long long> total(blocks, 0), unconverged(blocks, 0);
+		concurrency::parallel_for(size_t(0), blocks, [&](size_t block)
+			{
+				size_t end = std::min(molecules, (block + 1) * MoleculeBlock);
+				for (size_t molecule = block * MoleculeBlock; molecule < end; ++molecule)
+				{
+					const uint32_t first = m_moleculeStart[molecule], last = m_moleculeStart[molecule + 1];
+
+					unsigned int iterations = 0;
+					bool converged = false;
+					while (!converged && iterations < m_settings.maxIterations)
+					{
+						++iterations;
+						converged = true;
+						for (uint32_t constraint = first; constraint < last; ++constraint)
+						{
+							const Constraint& bond = m_constraints[constraint];
+							float* a = &atoms.positions[bond.first].x;
+							float* b = &atoms.positions[bond.second].x;
+
+							float s[3], r[3];
+							for (int axis = 0; axis < 3; ++axis)
+							{
+								s[axis] = Boundaries::MinimumImage(a[axis] - b[axis], period[axis], inverse[axis]);
+								r[axis] = Boundaries::MinimumImage((&reference[bond.first].x)[axis] - (&reference[bond.second].x)[axis], period[axis], inverse[axis]);
+							}
+
+							// |s|^2 - d^2 = 2 d (|s| - d) to first order
+							const float difference = bond.lengthSquared - (s[0] * s[0] + s[1] * s[1] + s[2] * s[2]);
+							if (std::abs(difference) <= 2.0f * m_settings.tolerance * bond.lengthSquared)
+								continue;
+							converged = false;
+
+							const float firstWeight = atoms.inverseMasses[bond.first];
+							const float secondWeight = atoms.inverseMasses[bond.second];
+							const float alignment = std::max(s[0] * r[0] + s[1] * r[1] + s[2] * r[2], MinimumAlignment * bond.lengthSquared);
+							const float g = difference / (2.0f * alignment * (firstWeight + secondWeight));
+
+							float* u = &atoms.velocities[bond.first].x;
+							float* v = &atoms.velocities[bond.second].x;
+							for (int axis = 0; axis < 3; ++axis)
+							{
+								a[axis] += g * firstWeight * r[axis];
+								b[axis] -= g * secondWeight * r[axis];
+								u[axis] += g * firstWeight * r[axis] * inverseStep;
+								v[axis] -= g * secondWeight * r[axis] * inverseStep;
+							}
+						}
+					}
+
+					// Back into the box on periodic axes, where the corrections may have pushed an atom out
+					for (uint32_t constraint = first; constraint < last; ++constraint)
+					{
+						for (uint32_t atom : { m_constraints[constraint].first, m_constraints[constraint].second })
+						{
+							float* position = &atoms.positions[atom].x;
+							for (int axis = 0; axis < 3; ++axis)
+								position[axis] = Boundaries::MinimumImage(position[axis], period[axis], inverse[axis]);
+						}
+					}
+
+					most[block] = std::max(most[block], iterations);
+					total[block] += iterations;
+					unconverged[block] += converged ? 0 : 1;
+				}
+			});
+
+		m_statistics.shakeIterations = *std::max_element(most.begin(), most.end());
+		m_statistics.totalShakeIterations += std::accumulate(total.begin(), total.end(), 0ull);
+		m_statistics.unconverged += std::accumulate(unconverged.begin(), unconverged.end(), 0ull);
+	}
+
+	void BondConstraints::Rattle(AtomArrays& atoms, float timeDelta)
+	{
+		const size_t molecules = m_moleculeStart.size() - 1;
+		if (molecules == 0)
+			return;
+
+		const XMFLOAT3 periods = Boundaries::Periods(atoms.boxDimensions, atoms.periodicAxes);
+		const XMFLOAT3 inverses = Boundaries::InversePeriods(atoms.boxDimensions, atoms.periodicAxes);
+		const float period[3] = { periods.x, periods.y, periods.z };
+		const float inverse[3] = { inverses.x, inverses.y, inverses.z };
+
+		// A rate of change that would move the bond by 'tolerance' of its length within a step
+		const float limit = m_settings.tolerance / timeDelta;
+
+		const size_t blocks = (molecules + MoleculeBlock - 1) / MoleculeBlock;
+		std::vector<unsigned int> most(blocks, 0);
+		std::vector<unsigned long long> total(blocks, 0), unconverged(blocks, 0);
+		concurrency::parallel_for(size_t(0), blocks, [&](size_t block)
+			{
+				size_t end = std::min(molecules, (block + 1) * MoleculeBlock);
+				for (size_t molecule = block * MoleculeBlock; molecule < end; ++molecule)
+				{
+					const uint32_t first = m_moleculeStart[molecule], last = m_moleculeStart[molecule + 1];
+
+					unsigned int iterations = 0;
+					bool converged = false;
+					while (!converged && iterations < m_settings.maxIterations)
+					{
+						++iterations;
+						converged = true;
+						for (uint32_t constraint = first; constraint < last; ++constraint)
+						{
+							const Constraint& bond = m_constraints[constraint];
+							float* u = &atoms.velocities[bond.first].x;
+							float* v = &atoms.velocities[bond.second].x;
+
+							float r[3], w[3];
+							for (int axis = 0; axis < 3; ++axis)
+							{
+								r[axis] = Boundaries::MinimumImage((&atoms.positions[bond.first].x)[axis] - (&atoms.positions[bond.second].x)[axis], period[axis], inverse[axis]);
+								w[axis] = u[axis] - v[axis];
+							}
+
+							// d|r|/dt = r.w / |r|, against the limit times the length
+							const float rate = r[0] * w[0] + r[1] * w[1] + r[2] * w[2];
+							if (std::abs(rate) <= limit * bond.lengthSquared)
+								continue;
+							converged = false;
+
+							const float firstWeight = atoms.inverseMasses[bond.first];
+							const float secondWeight = atoms.inverseMasses[bond.second];
+							const float k = rate / (bond.lengthSquared * (firstWeight + secondWeight));
+							for (int axis = 0; axis < 3; ++axis)
+							{
+								u[axis] -= k * firstWeight * r[axis];
+								v[axis] += k * secondWeight * r[axis];
+							}
+						}
+					}
+
+					most[block] = std::max(most[block], iterations);
+					total[block] += iterations;
+					unconverged[block] += converged ? 0 : 1;
+				}
+			});
+
+		m_statistics.rattleIterations = *std::max_element(most.begin(), most.end());
+		m_statistics.totalRattleIterations += std::accumulate(total.begin(), total.end(), 0ull);
+		m_statistics.unconverged += std::accumulate(unconverged.begin(), unconverged.end(), 0ull);
+	}
+}
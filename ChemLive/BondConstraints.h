@@ -0,0 +1,109 @@
+#pragma once
+
+#include "pch.h"
+#include "Atom.h"
+#include "AtomArena.h"
+#include "ForceProvider.h"
+#include <cstdint>
+#include <vector>
+
+using DirectX::XMFLOAT3;
+
+namespace Simulation
+{
+	struct ConstraintSettings
+	{
+		float			tolerance = 1.0e-4f;	// Relative error of a bond length (and, per step, of its rate of change) left at most
+		unsigned int	maxIterations = 200;	// Per molecule and step - a molecule still off after that counts as unconverged
+	};
+
+	struct ConstraintStatistics
+	{
+		size_t				molecules;			// Connected groups of constrained atoms, as last bound
+		size_t				constraints;		// Bound - bonds to atoms no longer in the simulation are dropped
+		unsigned int		shakeIterations;	// Most any molecule needed in the last step
+		unsigned int		rattleIterations;
+		unsigned long long	totalShakeIterations;	// Summed over the molecules and steps
+		unsigned long long	totalRattleIterations;
+		unsigned long long	unconverged;		// Molecules that ran out of iterations
+	};
+
+	/*
+	*	Fixed bond lengths - holonomic constraints |r_i - r_j| = d - solved with SHAKE (Ryckaert,
+	*	Ciccotti and Berendsen 1977) for the positions and RATTLE (Andersen 1983) for the velocities.
+	*	Freezing the fastest vibrations, those of bonds to hydrogen, lets the integrator take steps
+	*	several times longer.
+	*
+	*	After the integrator's drift, SHAKE moves the atoms of every bond that is off along the bond
+	*	as it was at the start of the step, weighted by inverse mass, and the velocities with them;
+	*	bond after bond until every one is within 'tolerance'. After the last kick, RATTLE takes out
+	*	the velocity along every bond the same way.
+	*
+	*	Bonds are kept as pairs of atom numbers in the arena (the order the atoms were added, as in
+	*	ChemLiveAPI.h) - unlike atom pointers and list positions, those survive copy-on-write, resets
+	*	and re-sorting. Bind resolves them against the integrator's atom list and splits them into
+	*	molecules - connected groups of bonds - which share no atom and are solved in parallel. The
+	*	integrator binds on every reload and remap, and when bonds were added or removed since.
+	*
+	*	The short range pair forces leave the bound pairs out (see Exclusions) - their repulsion at
+	*	bond length would otherwise be far stronger than anything else in the step. Charges are not
+	*	excluded: the real and reciprocal Ewald sums still see the partners of a bond.
+	*/
+	class BondConstraints
+	{
+	public:
+		struct Bond
+		{
+			size_t		first;			// Atom numbers in the arena
+			size_t		second;
+			float		length;			// nm
+		};
+
+		BondConstraints(AtomArena& arena, const ConstraintSettings& settings = ConstraintSettings());
+
+		// Between atom numbers 'first' and 'second' of the arena - a length of 0 keeps the current distance
+		void Add(size_t first, size_t second, float length = 0.0f);
+		void Remove(size_t first, size_t second);
+		void Clear();
+
+		// Resolve the bonds against 'atoms' (the integrator's list) and find the molecules
+		void Bind(const std::vector<Atom*>& atoms);
+		bool NeedsBind() const { return m_changed; }
+
+		// The bound pairs as a list per atom of 'count' - the partners of i with a larger index are
+		// excluded[start[i]] .. excluded[start[i + 1] - 1], ascending
+		void Exclusions(size_t count, std::vector<uint32_t>& start, std::vector<uint32_t>& excluded) const;
+
+		// 'reference' holds the positions before the drift of 'timeDelta' that left atoms.positions
+		void Shake(AtomArrays& atoms, const std::vector<XMFLOAT3>& reference, float timeDelta);
+		void Rattle(AtomArrays& atoms, float timeDelta);
+
+		// GET
+		size_t						Count() const { return m_bonds.size(); }
+		const std::vector<Bond>&	Bonds() const { return m_bonds; }		// As added - for saving
+		ConstraintStatistics		Statistics() const { return m_statistics; }
+		const ConstraintSettings&	Settings() const { return m_settings; }
+
+		// SET
+		void Tolerance(float tolerance);
+
+	private:
+		struct Constraint
+		{
+			uint32_t	first;
+			uint32_t	second;
+			float		lengthSquared;
+		};
+
+		AtomArena&					m_arena;
+		ConstraintSettings			m_settings;
+		std::vector<Bond>			m_bonds;
+		bool						m_changed;
+
+		// As bound - constraints grouped by molecule
+		std::vector<Constraint>		m_constraints;
+		std::vector<uint32_t>		m_moleculeStart;	// One past the last molecule too
+
+		ConstraintStatistics		m_statistics;
+	};
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "pch.h"
+#include "Enums.h"
+#include <cmath>
+
+using DirectX::XMFLOAT3;
+using DirectX::XMVECTOR;
+
+namespace Simulation
+{
+	/*
+	*	Periodic boundaries, axis by axis (see PeriodicAxis in Enums.h). The box is centred on the
+	*	origin, so a periodic axis of length L keeps positions in [-L/2, L/2) and the displacement
+	*	between two atoms is the one to the nearest image - the minimum image convention. That only
+	*	finds every neighbour inside a cutoff if L is at least twice the cutoff.
+	*
+	*	Axes that are not periodic keep their walls; their period is 0 here, which turns both the
+	*	wrap and the minimum image into no-ops without a branch.
+	*/
+	namespace Boundaries
+	{
+		inline bool IsPeriodic(unsigned int periodicAxes, int axis) { return ((periodicAxes >> axis) & 1) != 0; }
+
+		// Back into [-L/2, L/2)
+		inline float Wrap(float position, float length) { return position - length * std::floor(position / length + 0.5f); }
+
+		// To the nearest image, in [-L/2, L/2] - a period of 0 (with its inverse 0) leaves it alone
+		inline float MinimumImage(float displacement, float period, float inversePeriod) { return displacement - period * std::nearbyint(displacement * inversePeriod); }
+
+		// Box lengths on the periodic axes, 0 on the others
+		inline XMFLOAT3 Periods(XMFLOAT3 boxDimensions, unsigned int periodicAxes)
+		{
+			return XMFLOAT3(
+				IsPeriodic(periodicAxes, 0) ? boxDimensions.x : 0.0f,
+				IsPeriodic(periodicAxes, 1) ? boxDimensions.y : 0.0f,
+				IsPeriodic(periodicAxes, 2) ? boxDimensions.z : 0.0f);
+		}
+
+		// 1 / the box length on the periodic axes, 0 on the others
+		inline XMFLOAT3 InversePeriods(XMFLOAT3 boxDimensions, unsigned int periodicAxes)
+		{
+			XMFLOAT3 periods = Periods(boxDimensions, periodicAxes);
+			return XMFLOAT3(
+				periods.x > 0.0f ? 1.0f / periods.x : 0.0f,
+				periods.y > 0.0f ? 1.0f / periods.y : 0.0f,
+				periods.z > 0.0f ? 1.0f / periods.z : 0.0f);
+		}
+
+		// The SIMD form - 'period' and 'inversePeriod' hold one axis (four displacements along it,
+		// as the pair kernels have them) or all three (one displacement). Either way it costs a
+		// multiply, a round and a multiply-subtract, and wraps a position into the box just the same.
+		inline XMVECTOR MinimumImage(XMVECTOR displacement, XMVECTOR period, XMVECTOR inversePeriod)
+		{
+			XMVECTOR images = DirectX::XMVectorRound(DirectX::XMVectorMultiply(displacement, inversePeriod));
+			return DirectX::XMVectorNegativeMultiplySubtract(images, period, displacement);
+		}
+	}
+}
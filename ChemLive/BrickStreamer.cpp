@@ -0,0 +1,212 @@
+#include "pch.h"
+#include "BrickStreamer.h"
+#include <algorithm>
+
+namespace Simulation
+{
+	BrickStreamer::BrickStreamer(const std::wstring& filename, const BrickStreamerSettings& settings) :
+		m_reader(filename),
+		m_settings(settings),
+		m_viewVersion(0),
+		m_cachedAtoms(0),
+		m_stopping(false)
+	{
+		m_settings.publishInterval = std::max(1u, m_settings.publishInterval);
+		m_settings.cachedAtomBudget = std::max(m_settings.cachedAtomBudget, m_settings.visibleAtomBudget);
+
+		m_loader = std::thread(&BrickStreamer::LoaderThread, this);
+	}
+
+	BrickStreamer::~BrickStreamer()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stopping = true;
+		}
+		m_viewChanged.notify_one();
+
+		if (m_loader.joinable())
+			m_loader.join();
+	}
+
+	void BrickStreamer::UpdateView(const XMFLOAT4X4& viewProjection, XMFLOAT3 eye)
+	{
+		// Culling only reads the directory, so it is cheap enough to do on every camera move
+		std::vector<uint32_t> visible = m_reader.QueryFrustum(BrickedSceneFile::ViewFrustum::FromViewProjection(viewProjection));
+
+		std::vector<std::pair<float, uint32_t>> byDistance(visible.size());
+		for (size_t iii = 0; iii < visible.size(); ++iii)
+		{
+			const BrickedSceneFile::BrickEntry& entry = m_reader.Brick(visible[iii]);
+			float dx = 0.5f * (entry.boundsMin[0] + entry.boundsMax[0]) - eye.x;
+			float dy = 0.5f * (entry.boundsMin[1] + entry.boundsMax[1]) - eye.y;
+			float dz = 0.5f * (entry.boundsMin[2] + entry.boundsMax[2]) - eye.z;
+			byDistance[iii] = { dx * dx + dy * dy + dz * dz, visible[iii] };
+		}
+		std::sort(byDistance.begin(), byDistance.end());
+
+		std::vector<uint32_t> wanted;
+		size_t atoms = 0;
+		for (const std::pair<float, uint32_t>& brick : byDistance)
+		{
+			size_t count = m_reader.Brick(brick.second).atomCount;
+			if (atoms + count > m_settings.visibleAtomBudget && !wanted.empty())
+				break;
+			wanted.push_back(brick.second);
+			atoms += count;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (wanted == m_wanted)
+				return;
+
+			// Wanted bricks are the last to be evicted, nearest last of all
+			for (auto brick = wanted.rbegin(); brick != wanted.rend(); ++brick)
+			{
+				auto cached = m_cache.find(*brick);
+				if (cached != m_cache.end())
+					m_lru.splice(m_lru.begin(), m_lru, cached->second.lru);
+			}
+
+			m_wanted.swap(wanted);
+			++m_viewVersion;
+		}
+		m_viewChanged.notify_one();
+	}
+
+	std::shared_ptr<const TrajectoryFrame> BrickStreamer::CurrentFrame()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_frame;
+	}
+
+	size_t BrickStreamer::WantedBricks()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_wanted.size();
+	}
+
+	size_t BrickStreamer::CachedBricks()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_cache.size();
+	}
+
+	void BrickStreamer::LoaderThread()
+	{
+		unsigned long long version = 0;
+		while (true)
+		{
+			std::vector<uint32_t> missing;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_viewChanged.wait(lock, [&] { return m_viewVersion != version || m_stopping; });
+				if (m_stopping)
+					return;
+
+				version = m_viewVersion;
+				for (uint32_t brick : m_wanted)
+				{
+					if (m_cache.count(brick) == 0 && m_failed.count(brick) == 0)
+						missing.push_back(brick);
+				}
+			}
+
+			// Show whatever is cached for the new view straight away
+			Publish();
+
+			// Decode outside the lock - this is where the file is actually read
+			unsigned int sincePublish = 0;
+			for (uint32_t brick : missing)
+			{
+				std::shared_ptr<BrickAtoms> loaded = std::make_shared<BrickAtoms>();
+				const bool decoded = m_reader.DecodeBrick(brick, loaded->positions, loaded->elements);
+
+				bool moved;
+				{
+					std::lock_guard<std::mutex> lock(m_mutex);
+					if (decoded)
+					{
+						m_cachedAtoms += loaded->positions.size();
+						m_lru.push_front(brick);
+						m_cache.emplace(brick, CachedBrick{ std::move(loaded), m_lru.begin() });
+					}
+					else
+						m_failed.insert(brick);		// Corrupt brick - leave a hole rather than stop streaming
+
+					moved = m_viewVersion != version || m_stopping;
+				}
+
+				if (decoded && ++sincePublish == m_settings.publishInterval)
+				{
+					sincePublish = 0;
+					Publish();
+				}
+
+				// The camera moved on - start over with the new view
+				if (moved)
+					break;
+			}
+
+			Publish();
+			std::lock_guard<std::mutex> lock(m_mutex);
+			Evict();
+		}
+	}
+
+	void BrickStreamer::Publish()
+	{
+		// Only hold the lock to pick the bricks and to swap the frame in - UpdateView takes it on
+		// the UI thread. Holding the bricks keeps them alive if they are evicted meanwhile.
+		std::vector<std::shared_ptr<const BrickAtoms>> bricks;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			bricks.reserve(m_wanted.size());
+			for (uint32_t brick : m_wanted)
+			{
+				auto cached = m_cache.find(brick);
+				if (cached != m_cache.end())
+					bricks.push_back(cached->second.atoms);
+			}
+		}
+
+		// A new frame each time - the renderer may still be drawing the previous one
+		std::shared_ptr<TrajectoryFrame> frame = std::make_shared<TrajectoryFrame>();
+		frame->step = m_reader.State().stepCount;
+		frame->time = 0.0;
+
+		size_t atoms = 0;
+		for (const std::shared_ptr<const BrickAtoms>& brick : bricks)
+			atoms += brick->positions.size();
+		frame->positions.reserve(atoms);
+		frame->elements.reserve(atoms);
+
+		for (const std::shared_ptr<const BrickAtoms>& brick : bricks)
+		{
+			frame->positions.insert(frame->positions.end(), brick->positions.begin(), brick->positions.end());
+			frame->elements.insert(frame->elements.end(), brick->elements.begin(), brick->elements.end());
+		}
+
+		// The old frame is let go after the lock
+		std::shared_ptr<const TrajectoryFrame> previous = std::move(frame);
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_frame.swap(previous);
+	}
+
+	void BrickStreamer::Evict()
+	{
+		std::unordered_set<uint32_t> wanted(m_wanted.begin(), m_wanted.end());
+		while (m_cachedAtoms > m_settings.cachedAtomBudget && !m_lru.empty())
+		{
+			uint32_t brick = m_lru.back();
+			if (wanted.count(brick) != 0)
+				break;		// Everything left is on screen
+
+			auto cached = m_cache.find(brick);
+			m_cachedAtoms -= cached->second.atoms->positions.size();
+			m_cache.erase(cached);
+			m_lru.pop_back();
+		}
+	}
+}
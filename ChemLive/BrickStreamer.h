@@ -0,0 +1,79 @@
+#pragma once
+
+#include "pch.h"
+#include "BrickedSceneFile.h"
+#include "TrajectoryReader.h"
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace Simulation
+{
+	struct BrickStreamerSettings
+	{
+		size_t		visibleAtomBudget = 2000000;		// Most atoms drawn at once - the nearest visible bricks win
+		size_t		cachedAtomBudget = 8000000;			// Decoded atoms kept around (visible or not) before the oldest are dropped
+		unsigned int publishInterval = 16;				// Bricks loaded between updates of the displayed frame
+	};
+
+	/*
+	*	Shows a bricked scene that is too large to load, for the SimulationRenderer. Every time the
+	*	view changes the bricks inside the frustum are picked (nearest first, up to the visible atom
+	*	budget), and a loader thread decodes the ones that are not cached yet. The displayed frame
+	*	is rebuilt as bricks arrive, so the scene fills in while the camera moves.
+	*/
+	class BrickStreamer
+	{
+	public:
+		BrickStreamer(const std::wstring& filename, const BrickStreamerSettings& settings = BrickStreamerSettings());
+		~BrickStreamer();
+
+		// Called when the camera moves - 'eye' orders the visible bricks by distance
+		void UpdateView(const XMFLOAT4X4& viewProjection, XMFLOAT3 eye);
+
+		// Everything loaded so far of the current view. Returns nullptr before anything is loaded.
+		std::shared_ptr<const TrajectoryFrame> CurrentFrame();
+
+		// GET
+		XMFLOAT3	BoxDimensions() { return m_reader.State().boxDimensions; }
+		size_t		WantedBricks();
+		size_t		CachedBricks();
+		const BrickedSceneFile::Reader& Reader() { return m_reader; }
+
+	private:
+		struct BrickAtoms
+		{
+			std::vector<XMFLOAT3>			positions;
+			std::vector<uint8_t>			elements;
+		};
+
+		struct CachedBrick
+		{
+			std::shared_ptr<const BrickAtoms>	atoms;		// Shared with a Publish copying it
+			std::list<uint32_t>::iterator		lru;		// Position in m_lru
+		};
+
+		void LoaderThread();
+		void Publish();									// Takes m_mutex - but copies without it
+		void Evict();									// m_mutex must be held
+
+		BrickedSceneFile::Reader					m_reader;
+		BrickStreamerSettings						m_settings;
+
+		std::mutex									m_mutex;
+		std::condition_variable						m_viewChanged;
+		std::vector<uint32_t>						m_wanted;			// Bricks of the current view, nearest first
+		unsigned long long							m_viewVersion;
+		std::unordered_map<uint32_t, CachedBrick>	m_cache;
+		std::list<uint32_t>							m_lru;				// Cached bricks, most recently wanted first
+		size_t										m_cachedAtoms;
+		std::unordered_set<uint32_t>				m_failed;			// Bricks that did not decode - the file is mapped once, so they never will
+		std::shared_ptr<const TrajectoryFrame>		m_frame;
+		bool										m_stopping;
+		std::thread									m_loader;
+	};
+}
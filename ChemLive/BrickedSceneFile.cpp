@@ -0,0 +1,393 @@
+#include "pch.h"
+#include "BrickedSceneFile.h"
+#include "AsyncIO.h"
+#include "AtomGenerator.h"
+#include "Morton.h"
+#include <atomic>
+#include <ppl.h>
+#include <stdexcept>
+
+namespace Simulation
+{
+	namespace BrickedSceneFile
+	{
+		// Bricks gathered in parallel before they are handed to the writer
+		static const size_t BrickBatch = 64;
+
+		static uint64_t AlignUp(uint64_t value) { return (value + BrickAlignment - 1) / BrickAlignment * BrickAlignment; }
+
+		// Grid cell along one axis - atoms outside the box go into the outermost cells
+		static uint32_t CellIndex(float position, float boxDimension, uint32_t cells)
+		{
+			float scaled = (position / boxDimension + 0.5f) * static_cast<float>(cells);
+			if (!(scaled > 0.0f))
+				return 0;
+			return std::min(static_cast<uint32_t>(scaled), cells - 1);
+		}
+
+		void Save(const std::wstring& filename, AtomArena& arena, const SceneFile::SceneState& state, const SaveSettings& settings)
+		{
+			const size_t atomCount = arena.AtomCount();
+			const unsigned int targetAtoms = std::max(1u, settings.targetAtomsPerBrick);
+			const unsigned int maxAtoms = std::max(targetAtoms, settings.maxAtomsPerBrick);
+
+			// Each level splits every cell in eight - stop once the average cell holds the target
+			uint32_t gridLevel = 0;
+			while (gridLevel < MaxGridLevel && (static_cast<uint64_t>(atomCount) >> (3 * gridLevel)) > targetAtoms)
+				++gridLevel;
+			const uint32_t cells = 1u << gridLevel;
+
+			std::vector<Atom*> atoms;
+			atoms.reserve(atomCount);
+			for (size_t chunk = 0; chunk < arena.ChunkCount(); ++chunk)
+			{
+				for (unsigned int slot = 0; slot < arena.ChunkAtomCount(chunk); ++slot)
+					atoms.push_back(arena.At(chunk, slot));
+			}
+
+			// Sort by (cell, element). The cell's Morton code is the high part of the key.
+			std::vector<std::pair<uint64_t, uint64_t>> order(atoms.size());
+			concurrency::parallel_for(size_t(0), atoms.size(), [&](size_t iii)
+				{
+					XMFLOAT3 position = atoms[iii]->Position();
+					uint64_t morton = Morton::Code(
+						CellIndex(position.x, state.boxDimensions.x, cells),
+						CellIndex(position.y, state.boxDimensions.y, cells),
+						CellIndex(position.z, state.boxDimensions.z, cells));
+					order[iii] = { (morton << 8) | static_cast<uint8_t>(atoms[iii]->Element()), iii };
+				});
+			concurrency::parallel_sort(order.begin(), order.end());
+
+			// Cut the sorted atoms into bricks
+			std::vector<BrickEntry> bricks;
+			std::vector<size_t> firstAtom;
+			for (size_t iii = 0; iii < order.size(); ++iii)
+			{
+				uint64_t morton = order[iii].first >> 8;
+				if (bricks.empty() || bricks.back().morton != morton || bricks.back().atomCount == maxAtoms)
+				{
+					BrickEntry entry = {};
+					entry.morton = morton;
+					bricks.push_back(entry);
+					firstAtom.push_back(iii);
+				}
+				++bricks.back().atomCount;
+			}
+
+			BrickHeader header = {};
+			std::memcpy(header.magic, Magic, sizeof(header.magic));
+			header.version = Version;
+			header.headerSize = sizeof(BrickHeader);
+			header.atomCount = atomCount;
+			header.brickCount = bricks.size();
+			header.stepCount = state.stepCount;
+			header.boxDimensions[0] = state.boxDimensions.x;
+			header.boxDimensions[1] = state.boxDimensions.y;
+			header.boxDimensions[2] = state.boxDimensions.z;
+			header.boxVisible = state.boxVisible ? 1 : 0;
+			header.gridLevel = gridLevel;
+
+			uint64_t offset = AlignUp(sizeof(BrickHeader) + bricks.size() * sizeof(BrickEntry));
+			header.fileSize = sizeof(BrickHeader) + bricks.size() * sizeof(BrickEntry);
+			for (BrickEntry& entry : bricks)
+			{
+				entry.offset = offset;
+				header.fileSize = offset + entry.atomCount * BytesPerAtom;
+				offset = AlignUp(header.fileSize);
+			}
+
+			concurrency::parallel_for(size_t(0), bricks.size(), [&](size_t brick)
+				{
+					BrickEntry& entry = bricks[brick];
+					XMFLOAT3 position = atoms[order[firstAtom[brick]].second]->Position();
+					float boundsMin[3] = { position.x, position.y, position.z };
+					float boundsMax[3] = { position.x, position.y, position.z };
+					for (uint32_t iii = 1; iii < entry.atomCount; ++iii)
+					{
+						position = atoms[order[firstAtom[brick] + iii].second]->Position();
+						const float values[3] = { position.x, position.y, position.z };
+						for (int axis = 0; axis < 3; ++axis)
+						{
+							boundsMin[axis] = std::min(boundsMin[axis], values[axis]);
+							boundsMax[axis] = std::max(boundsMax[axis], values[axis]);
+						}
+					}
+					std::memcpy(entry.boundsMin, boundsMin, sizeof(boundsMin));
+					std::memcpy(entry.boundsMax, boundsMax, sizeof(boundsMax));
+				});
+
+			std::unique_ptr<AsyncFileWriter> file;
+			try
+			{
+				file.reset(new AsyncFileWriter(filename));
+			}
+			catch (const std::runtime_error&)
+			{
+				throw std::runtime_error("BrickedSceneFile: unable to open the scene file for writing");
+			}
+
+			file->Write(&header, sizeof(header));
+			if (!bricks.empty())
+			{
+				static const uint8_t zeros[BrickAlignment] = {};
+				file->Write(bricks.data(), bricks.size() * sizeof(BrickEntry));
+				file->Write(zeros, static_cast<size_t>(bricks[0].offset - file->Size()));
+			}
+
+			// Gather a batch of bricks in parallel (each padded up to where the next one starts),
+			// then append them in order
+			std::vector<std::vector<uint8_t>> staging(std::min(BrickBatch, bricks.size()));
+			std::atomic<bool> valid(true);
+			for (size_t batch = 0; batch < bricks.size(); batch += BrickBatch)
+			{
+				size_t batchSize = std::min(BrickBatch, bricks.size() - batch);
+				concurrency::parallel_for(size_t(0), batchSize, [&](size_t index)
+					{
+						size_t brick = batch + index;
+						const BrickEntry& entry = bricks[brick];
+						uint64_t end = brick + 1 < bricks.size() ? bricks[brick + 1].offset : header.fileSize;
+
+						std::vector<uint8_t>& out = staging[index];
+						out.assign(static_cast<size_t>(end - entry.offset), 0);
+
+						const size_t n = entry.atomCount;
+						uint8_t* positions = out.data();
+						uint8_t* velocities = positions + n * sizeof(XMFLOAT3);
+						uint8_t* elements = velocities + n * sizeof(XMFLOAT3);
+						uint8_t* neutrons = elements + n;
+						uint8_t* electrons = neutrons + n;
+						for (size_t iii = 0; iii < n; ++iii)
+						{
+							Atom* atom = atoms[order[firstAtom[brick] + iii].second];
+							XMFLOAT3 position = atom->Position();
+							XMFLOAT3 velocity = atom->Velocity();
+							std::memcpy(positions + iii * sizeof(XMFLOAT3), &position, sizeof(XMFLOAT3));
+							std::memcpy(velocities + iii * sizeof(XMFLOAT3), &velocity, sizeof(XMFLOAT3));
+							elements[iii] = static_cast<uint8_t>(atom->Element());
+
+							if (atom->NeutronsCount() < 0 || atom->NeutronsCount() > 255 || atom->ElectronsCount() < 0 || atom->ElectronsCount() > 255)
+								valid = false;
+							neutrons[iii] = static_cast<uint8_t>(atom->NeutronsCount());
+							electrons[iii] = static_cast<uint8_t>(atom->ElectronsCount());
+						}
+					});
+
+				if (!valid)
+					throw std::runtime_error("BrickedSceneFile: particle count does not fit the scene format");
+
+				for (size_t index = 0; index < batchSize; ++index)
+					file->Write(staging[index].data(), staging[index].size());
+			}
+
+			try
+			{
+				file->Close();
+			}
+			catch (const std::runtime_error&)
+			{
+				throw std::runtime_error("BrickedSceneFile: failed writing the scene file");
+			}
+			if (file->Size() != header.fileSize)
+				throw std::runtime_error("BrickedSceneFile: failed writing the scene file");
+		}
+
+		ViewFrustum ViewFrustum::FromViewProjection(const XMFLOAT4X4& m)
+		{
+			// Row vectors are multiplied on the left (v * M), so clip space coordinates are the dot
+			// products of v with the columns of M. Each plane keeps one clip space inequality:
+			// -w <= x <= w, -w <= y <= w, 0 <= z <= w.
+			ViewFrustum frustum;
+			auto column = [&](int index) { return XMFLOAT4(m.m[0][index], m.m[1][index], m.m[2][index], m.m[3][index]); };
+			auto add = [](XMFLOAT4 a, XMFLOAT4 b, float sign) { return XMFLOAT4(a.x + sign * b.x, a.y + sign * b.y, a.z + sign * b.z, a.w + sign * b.w); };
+
+			XMFLOAT4 x = column(0), y = column(1), z = column(2), w = column(3);
+			frustum.planes[0] = add(w, x, 1.0f);		// Left
+			frustum.planes[1] = add(w, x, -1.0f);		// Right
+			frustum.planes[2] = add(w, y, 1.0f);		// Bottom
+			frustum.planes[3] = add(w, y, -1.0f);		// Top
+			frustum.planes[4] = z;						// Near
+			frustum.planes[5] = add(w, z, -1.0f);		// Far
+			return frustum;
+		}
+
+		bool ViewFrustum::Intersects(const float boundsMin[3], const float boundsMax[3]) const
+		{
+			// The box is outside if its corner furthest along a plane's normal is still behind it
+			for (const XMFLOAT4& plane : planes)
+			{
+				float x = plane.x >= 0.0f ? boundsMax[0] : boundsMin[0];
+				float y = plane.y >= 0.0f ? boundsMax[1] : boundsMin[1];
+				float z = plane.z >= 0.0f ? boundsMax[2] : boundsMin[2];
+				if (plane.x * x + plane.y * y + plane.z * z + plane.w < 0.0f)
+					return false;
+			}
+			return true;
+		}
+
+		Reader::Reader(const std::wstring& filename) :
+			m_file(filename)
+		{
+			const uint8_t* data = m_file.Data();
+			if (m_file.Size() < sizeof(BrickHeader))
+				throw std::runtime_error("BrickedSceneFile: file is too small to be a bricked scene");
+			std::memcpy(&m_header, data, sizeof(m_header));
+
+			if (std::memcmp(m_header.magic, Magic, sizeof(m_header.magic)) != 0)
+				throw std::runtime_error("BrickedSceneFile: not a bricked scene file");
+			if (m_header.version != Version || m_header.headerSize != sizeof(BrickHeader))
+				throw std::runtime_error("BrickedSceneFile: unsupported bricked scene version");
+			if (m_header.fileSize != m_file.Size() || m_header.brickCount > (m_file.Size() - sizeof(BrickHeader)) / sizeof(BrickEntry) ||
+				m_header.gridLevel > MaxGridLevel)
+				throw std::runtime_error("BrickedSceneFile: bricked scene file is truncated or corrupt");
+
+			m_bricks.resize(static_cast<size_t>(m_header.brickCount));
+			if (!m_bricks.empty())
+				std::memcpy(m_bricks.data(), data + sizeof(BrickHeader), m_bricks.size() * sizeof(BrickEntry));
+
+			// Check the directory up front so that decoding never has to
+			const uint64_t directoryEnd = sizeof(BrickHeader) + m_bricks.size() * sizeof(BrickEntry);
+			uint64_t atomCount = 0;
+			for (const BrickEntry& entry : m_bricks)
+			{
+				if (entry.offset < directoryEnd || entry.offset % BrickAlignment != 0 ||
+					entry.offset + entry.atomCount * BytesPerAtom > m_file.Size())
+					throw std::runtime_error("BrickedSceneFile: bricked scene directory is corrupt");
+				atomCount += entry.atomCount;
+			}
+			if (atomCount != m_header.atomCount)
+				throw std::runtime_error("BrickedSceneFile: bricked scene directory is corrupt");
+		}
+
+		SceneFile::SceneState Reader::State() const
+		{
+			SceneFile::SceneState state;
+			state.boxDimensions = XMFLOAT3(m_header.boxDimensions[0], m_header.boxDimensions[1], m_header.boxDimensions[2]);
+			state.boxVisible = m_header.boxVisible != 0;
+			state.stepCount = m_header.stepCount;
+			state.time = 0.0;		// A region starts a run of its own
+			state.periodicAxes = 0;	// ... cut out of the box, so nothing wraps around
+			return state;
+		}
+
+		std::vector<uint32_t> Reader::QueryBox(XMFLOAT3 regionMin, XMFLOAT3 regionMax) const
+		{
+			std::vector<uint32_t> result;
+			for (size_t brick = 0; brick < m_bricks.size(); ++brick)
+			{
+				const BrickEntry& entry = m_bricks[brick];
+				if (entry.boundsMax[0] >= regionMin.x && entry.boundsMin[0] <= regionMax.x &&
+					entry.boundsMax[1] >= regionMin.y && entry.boundsMin[1] <= regionMax.y &&
+					entry.boundsMax[2] >= regionMin.z && entry.boundsMin[2] <= regionMax.z)
+					result.push_back(static_cast<uint32_t>(brick));
+			}
+			return result;
+		}
+
+		std::vector<uint32_t> Reader::QueryFrustum(const ViewFrustum& frustum) const
+		{
+			std::vector<uint32_t> result;
+			for (size_t brick = 0; brick < m_bricks.size(); ++brick)
+			{
+				if (frustum.Intersects(m_bricks[brick].boundsMin, m_bricks[brick].boundsMax))
+					result.push_back(static_cast<uint32_t>(brick));
+			}
+			return result;
+		}
+
+		bool Reader::DecodeBrick(uint32_t brick, std::vector<XMFLOAT3>& positions, std::vector<uint8_t>& elements) const
+		{
+			const BrickEntry& entry = m_bricks[brick];
+			const size_t n = entry.atomCount;
+			const uint8_t* data = m_file.Data() + entry.offset;
+			const uint8_t* brickElements = data + 2 * n * sizeof(XMFLOAT3);
+
+			for (size_t iii = 0; iii < n; ++iii)
+			{
+				if (!AtomGenerator::IsValidElement(brickElements[iii]))
+					return false;
+			}
+
+			size_t first = positions.size();
+			positions.resize(first + n);
+			if (n != 0)
+				std::memcpy(&positions[first], data, n * sizeof(XMFLOAT3));
+			elements.insert(elements.end(), brickElements, brickElements + n);
+			return true;
+		}
+
+		size_t Reader::LoadBricks(const std::vector<uint32_t>& bricks, AtomArena& arena, const XMFLOAT3* clipMin, const XMFLOAT3* clipMax) const
+		{
+			auto inside = [&](const XMFLOAT3& position)
+			{
+				if (clipMin == nullptr || clipMax == nullptr)
+					return true;
+				return position.x >= clipMin->x && position.x <= clipMax->x &&
+					position.y >= clipMin->y && position.y <= clipMax->y &&
+					position.z >= clipMin->z && position.z <= clipMax->z;
+			};
+
+			for (uint32_t brick : bricks)
+			{
+				if (brick >= m_bricks.size())
+					throw std::runtime_error("BrickedSceneFile: brick index is out of range");
+			}
+
+			// Validate and count in parallel before anything is added to the arena
+			std::vector<size_t> counts(bricks.size() + 1, 0);
+			std::atomic<bool> valid(true);
+			concurrency::parallel_for(size_t(0), bricks.size(), [&](size_t index)
+				{
+					const BrickEntry& entry = m_bricks[bricks[index]];
+					const size_t n = entry.atomCount;
+					const uint8_t* data = m_file.Data() + entry.offset;
+					const uint8_t* elements = data + 2 * n * sizeof(XMFLOAT3);
+
+					size_t count = 0;
+					for (size_t iii = 0; iii < n; ++iii)
+					{
+						if (!AtomGenerator::IsValidElement(elements[iii]))
+							valid = false;
+
+						XMFLOAT3 position;
+						std::memcpy(&position, data + iii * sizeof(XMFLOAT3), sizeof(position));
+						if (inside(position))
+							++count;
+					}
+					counts[index + 1] = count;
+				});
+
+			if (!valid)
+				throw std::runtime_error("BrickedSceneFile: bricked scene contains an unknown element");
+
+			for (size_t index = 0; index < bricks.size(); ++index)
+				counts[index + 1] += counts[index];
+
+			size_t first = arena.AllocateBulk(counts.back());
+			concurrency::parallel_for(size_t(0), bricks.size(), [&](size_t index)
+				{
+					const BrickEntry& entry = m_bricks[bricks[index]];
+					const size_t n = entry.atomCount;
+					const uint8_t* positions = m_file.Data() + entry.offset;
+					const uint8_t* velocities = positions + n * sizeof(XMFLOAT3);
+					const uint8_t* elements = velocities + n * sizeof(XMFLOAT3);
+					const uint8_t* neutrons = elements + n;
+					const uint8_t* electrons = neutrons + n;
+
+					size_t slot = first + counts[index];
+					for (size_t iii = 0; iii < n; ++iii)
+					{
+						XMFLOAT3 position, velocity;
+						std::memcpy(&position, positions + iii * sizeof(XMFLOAT3), sizeof(position));
+						if (!inside(position))
+							continue;
+						std::memcpy(&velocity, velocities + iii * sizeof(XMFLOAT3), sizeof(velocity));
+
+						Element element = static_cast<Element>(elements[iii]);
+						AtomGenerator::CreateAtomAt(arena.SlotAt(slot++), element, position, velocity, neutrons[iii], element - electrons[iii]);
+					}
+				});
+
+			return counts.back();
+		}
+	}
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include "pch.h"
+#include "AtomArena.h"
+#include "MappedFile.h"
+#include "SceneFile.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using DirectX::XMFLOAT3;
+using DirectX::XMFLOAT4;
+using DirectX::XMFLOAT4X4;
+
+/*
+*	Spatially bricked scene file (*.clbricks) for scenes too large to load in one go.
+*
+*	The box is cut into a regular grid of 2^gridLevel cells per axis. The atoms of each cell form
+*	a brick (cells with more than maxAtomsPerBrick atoms are split into several), bricks are
+*	stored in Morton (Z-order) order of their cell so that bricks close in space are close in the
+*	file, and a directory with the bounding box of every brick lets a reader pick the bricks it
+*	needs without touching the rest of the file.
+*
+*	[BrickHeader]
+*	[BrickEntry] * brickCount
+*	brick 0: positions float[3] * n, velocities float[3] * n, elements / neutrons / electrons uint8 * n
+*	brick 1: ...													(each brick starts on a 64 byte boundary)
+*
+*	Within a brick the atoms are sorted by element, which keeps material changes down when a
+*	brick is rendered.
+*/
+
+namespace Simulation
+{
+	namespace BrickedSceneFile
+	{
+		const char Magic[8] = { 'C', 'L', 'B', 'R', 'I', 'C', 'K', '\0' };
+		const uint32_t Version = 1;
+		const uint64_t BrickAlignment = 64;
+		const uint32_t MaxGridLevel = 10;			// 1024^3 cells - Morton codes fit in 30 bits
+
+		struct BrickHeader
+		{
+			char		magic[8];
+			uint32_t	version;
+			uint32_t	headerSize;
+			uint64_t	fileSize;
+			uint64_t	atomCount;
+			uint64_t	brickCount;
+			uint64_t	stepCount;
+			float		boxDimensions[3];
+			uint32_t	boxVisible;
+			uint32_t	gridLevel;
+			uint32_t	reserved;
+		};
+
+		struct BrickEntry
+		{
+			uint64_t	morton;				// Z-order code of the grid cell
+			uint64_t	offset;				// Of the brick's positions column
+			uint32_t	atomCount;
+			uint32_t	reserved;
+			float		boundsMin[3];		// Tight bounds of the brick's atoms
+			float		boundsMax[3];
+		};
+
+		static_assert(sizeof(BrickHeader) == 72, "BrickHeader layout changed");
+		static_assert(sizeof(BrickEntry) == 48, "BrickEntry layout changed");
+
+		// Bytes of brick data per atom (two float3 columns and three uint8 columns)
+		const uint64_t BytesPerAtom = 2 * sizeof(XMFLOAT3) + 3;
+
+		struct SaveSettings
+		{
+			unsigned int	targetAtomsPerBrick = 32768;	// Picks the grid resolution
+			unsigned int	maxAtomsPerBrick = 262144;		// Denser cells are split into several bricks
+		};
+
+		// Write every atom in 'arena' plus 'state'. Throws std::runtime_error on failure.
+		void Save(const std::wstring& filename, AtomArena& arena, const SceneFile::SceneState& state,
+			const SaveSettings& settings = SaveSettings());
+
+		/*
+		*	Six planes (a, b, c, d with a*x + b*y + c*z + d >= 0 inside) of a view frustum, taken
+		*	from a row-major view * projection matrix as used by the SimulationRenderer.
+		*/
+		struct ViewFrustum
+		{
+			XMFLOAT4	planes[6];
+
+			static ViewFrustum FromViewProjection(const XMFLOAT4X4& viewProjection);
+
+			// Conservative - may report a box just outside a corner of the frustum as visible
+			bool Intersects(const float boundsMin[3], const float boundsMax[3]) const;
+		};
+
+		/*
+		*	Memory maps a bricked scene and loads bricks on demand. Only the header and directory
+		*	are read when the file is opened; brick data is paged in as bricks are decoded.
+		*	All const members may be called from several threads at once.
+		*/
+		class Reader
+		{
+		public:
+			Reader(const std::wstring& filename);		// Throws std::runtime_error if the file is invalid
+
+			// Bricks whose bounds intersect the region, in file (Morton) order
+			std::vector<uint32_t> QueryBox(XMFLOAT3 regionMin, XMFLOAT3 regionMax) const;
+			std::vector<uint32_t> QueryFrustum(const ViewFrustum& frustum) const;
+
+			// Append a brick's positions and elements (for display). Returns false if the brick
+			// contains an unknown element.
+			bool DecodeBrick(uint32_t brick, std::vector<XMFLOAT3>& positions, std::vector<uint8_t>& elements) const;
+
+			// Append the atoms of 'bricks' to 'arena', optionally only those inside [clipMin, clipMax].
+			// Throws std::runtime_error if a brick is corrupt, leaving the arena untouched.
+			size_t LoadBricks(const std::vector<uint32_t>& bricks, AtomArena& arena,
+				const XMFLOAT3* clipMin = nullptr, const XMFLOAT3* clipMax = nullptr) const;
+
+			// GET
+			size_t				BrickCount() const { return m_bricks.size(); }
+			const BrickEntry&	Brick(size_t brick) const { return m_bricks[brick]; }
+			uint64_t			AtomCount() const { return m_header.atomCount; }
+			SceneFile::SceneState State() const;
+
+		private:
+			MappedFile					m_file;
+			BrickHeader					m_header;
+			std::vector<BrickEntry>		m_bricks;
+		};
+	}
+}
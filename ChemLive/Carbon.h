@@ -14,9 +14,9 @@ namespace Simulation
 		// Constructors
 		// Most common isotope = Carbon-12
 		// Most common charge  = 0
-		Carbon(const std::shared_ptr<DX::DeviceResources>& deviceResources, XMFLOAT3 position, XMFLOAT3 velocity, int neutronCount = 6, int charge = 0);
+		Carbon(XMFLOAT3 position, XMFLOAT3 velocity, int neutronCount = 6, int charge = 0);
 
 		// Update
-		void Update(double timeDelta, const std::vector<Atom*>& atoms, XMFLOAT3 boxDimensions);
+		void Update(double timeDelta, const std::vector<Atom*>& atoms, XMFLOAT3 boxDimensions, unsigned int periodicAxes);
 	};
 }
\ No newline at end of file
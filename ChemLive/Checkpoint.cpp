@@ -0,0 +1,565 @@
+#include "pch.h"
+#include "Checkpoint.h"
+#include "AsyncIO.h"
+#include "AtomGenerator.h"
+#include "MappedFile.h"
+#include <filesystem>
+#include <limits>
+#include <map>
+#include <ppl.h>
+#include <set>
+#include <stdexcept>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace Simulation
+{
+	using namespace CheckpointFormat;
+
+	namespace
+	{
+		const wchar_t ManifestName[] = L"checkpoint.clckpt";
+		const wchar_t ManifestTemporaryName[] = L"checkpoint.clckpt.tmp";
+		const wchar_t SegmentPrefix[] = L"segment-";
+		const wchar_t SegmentExtension[] = L".clseg";
+
+		// Chunks serialized in parallel before their records are appended to the segment
+		const size_t ChunkBatch = 64;
+
+		std::filesystem::path SegmentPath(const std::wstring& directory, uint64_t sequence)
+		{
+			std::wstring number = std::to_wstring(sequence);
+			if (number.size() < 8)
+				number.insert(0, 8 - number.size(), L'0');
+			return std::filesystem::path(directory) / (SegmentPrefix + number + SegmentExtension);
+		}
+
+		// 64 bit hash of a block of bytes, eight bytes at a time. Only used to spot changed chunks
+		// and damaged files, so it does not need to be cryptographic.
+		uint64_t HashBytes(const void* data, size_t size)
+		{
+			const uint8_t* bytes = static_cast<const uint8_t*>(data);
+			uint64_t hash = 0x9E3779B97F4A7C15ull ^ size;
+
+			size_t iii = 0;
+			for (; iii + 8 <= size; iii += 8)
+			{
+				uint64_t word;
+				std::memcpy(&word, bytes + iii, 8);
+				hash = (hash ^ word) * 0x9FB21C651E98DF25ull;
+				hash ^= hash >> 29;
+			}
+			for (; iii < size; ++iii)
+				hash = (hash ^ bytes[iii]) * 0x100000001B3ull;
+
+			hash ^= hash >> 32;
+			hash *= 0xD6E8FEB86659FD93ull;
+			hash ^= hash >> 32;
+			return hash;
+		}
+
+		// Make a rename in 'directory' durable. NTFS journals the rename itself; POSIX needs the
+		// directory flushed.
+		void SyncDirectory(const std::wstring& directory)
+		{
+#if !defined(_WIN32)
+			int file = open(std::filesystem::path(directory).c_str(), O_RDONLY);
+			if (file >= 0)
+			{
+				fsync(file);
+				close(file);
+			}
+#else
+			(void)directory;
+#endif
+		}
+
+		// Read and validate the manifest. Throws std::runtime_error if it is missing or damaged.
+		void ReadManifest(const std::wstring& directory, ManifestHeader& header, std::vector<ManifestChunk>& chunks,
+			std::vector<uint32_t>* order = nullptr, std::vector<BondRecord>* bonds = nullptr)
+		{
+			MappedFile file((std::filesystem::path(directory) / ManifestName).wstring());
+			if (file.Size() < MinimumHeaderSize)
+				throw std::runtime_error("Checkpointer: checkpoint manifest is truncated");
+
+			// Older manifests have a shorter header - whatever it does not reach stays zero
+			header = {};
+			std::memcpy(&header, file.Data(), MinimumHeaderSize);
+			if (std::memcmp(header.magic, Magic, sizeof(header.magic)) != 0 || header.version == 0 || header.version > Version)
+				throw std::runtime_error("Checkpointer: not a checkpoint manifest");
+			if (header.headerSize < MinimumHeaderSize || header.headerSize > file.Size())
+				throw std::runtime_error("Checkpointer: checkpoint manifest is truncated or corrupt");
+			std::memcpy(&header, file.Data(), std::min<size_t>(header.headerSize, sizeof(header)));
+
+			if (header.chunkCount > file.Size() / sizeof(ManifestChunk) || header.orderCount > file.Size() / sizeof(uint32_t) ||
+				header.bondCount > file.Size() / sizeof(BondRecord) || (header.orderCount != 0 && header.orderCount != header.atomCount) ||
+				file.Size() != header.headerSize + header.chunkCount * sizeof(ManifestChunk) + header.orderCount * sizeof(uint32_t) +
+					header.bondCount * sizeof(BondRecord))
+				throw std::runtime_error("Checkpointer: checkpoint manifest is truncated or corrupt");
+
+			const uint8_t* entries = file.Data() + header.headerSize;
+			size_t entriesSize = static_cast<size_t>(header.chunkCount * sizeof(ManifestChunk));
+			size_t orderSize = static_cast<size_t>(header.orderCount * sizeof(uint32_t));
+			size_t bondsSize = static_cast<size_t>(header.bondCount * sizeof(BondRecord));
+			if (HashBytes(entries, entriesSize + orderSize + bondsSize) != header.entriesHash)
+				throw std::runtime_error("Checkpointer: checkpoint manifest is corrupt");
+
+			chunks.resize(static_cast<size_t>(header.chunkCount));
+			if (entriesSize != 0)
+				std::memcpy(chunks.data(), entries, entriesSize);
+
+			if (order != nullptr)
+			{
+				order->resize(static_cast<size_t>(header.orderCount));
+				if (orderSize != 0)
+					std::memcpy(order->data(), entries + entriesSize, orderSize);
+			}
+			if (bonds != nullptr)
+			{
+				bonds->resize(static_cast<size_t>(header.bondCount));
+				if (bondsSize != 0)
+					std::memcpy(bonds->data(), entries + entriesSize + orderSize, bondsSize);
+			}
+		}
+	}
+
+	Checkpointer::Checkpointer(const std::wstring& directory, const CheckpointSettings& settings) :
+		m_directory(directory),
+		m_settings(settings),
+		m_sequence(0),
+		m_started(false),
+		m_lastStep(0),
+		m_pending(false),
+		m_busy(false),
+		m_stopping(false),
+		m_state(),
+		m_checkpointsWritten(0),
+		m_lastChunksWritten(0),
+		m_lastChunksReused(0),
+		m_lastBytesWritten(0),
+		m_failed(false)
+	{
+		std::error_code error;
+		std::filesystem::create_directories(std::filesystem::path(m_directory), error);
+		if (!std::filesystem::is_directory(std::filesystem::path(m_directory)))
+			throw std::runtime_error("Checkpointer: unable to create the checkpoint directory");
+
+		// Continue from an existing checkpoint so unchanged chunks are not written again
+		try
+		{
+			ManifestHeader header;
+			ReadManifest(m_directory, header, m_chunks);
+			m_sequence = header.sequence;
+		}
+		catch (const std::runtime_error&)
+		{
+			m_chunks.clear();
+			m_sequence = 0;
+		}
+
+		// Clear out whatever a crash in the middle of a checkpoint left behind
+		RemoveUnreferencedFiles();
+
+		m_writer = std::thread(&Checkpointer::WriterThread, this);
+	}
+
+	Checkpointer::~Checkpointer()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stopping = true;
+		}
+		m_submitted.notify_one();
+
+		// The writer finishes a checkpoint that was already submitted before it stops
+		if (m_writer.joinable())
+			m_writer.join();
+	}
+
+	bool Checkpointer::Due(unsigned long long step)
+	{
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if (!m_started)
+		{
+			m_started = true;
+			m_lastStep = step;
+			m_lastTime = now;
+			return false;
+		}
+
+		if (m_settings.stepInterval != 0 && step >= m_lastStep + m_settings.stepInterval)
+			return true;
+
+		return m_settings.secondsInterval > 0.0 &&
+			std::chrono::duration<double>(now - m_lastTime).count() >= m_settings.secondsInterval;
+	}
+
+	bool Checkpointer::Submit(AtomArena::Snapshot snapshot, const CheckpointState& state)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_busy)
+				return false;
+
+			m_snapshot = std::move(snapshot);
+			m_state = state;
+			m_pending = true;
+			m_busy = true;
+		}
+		m_submitted.notify_one();
+
+		m_started = true;
+		m_lastStep = state.stepCount;
+		m_lastTime = std::chrono::steady_clock::now();
+		return true;
+	}
+
+	void Checkpointer::Wait()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_finished.wait(lock, [this] { return !m_busy; });
+	}
+
+	void Checkpointer::WriterThread()
+	{
+		while (true)
+		{
+			AtomArena::Snapshot snapshot;
+			CheckpointState state;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_submitted.wait(lock, [this] { return m_pending || m_stopping; });
+				if (!m_pending)
+					return;
+
+				snapshot = std::move(m_snapshot);
+				state = m_state;
+				m_pending = false;
+			}
+
+			// A failed checkpoint leaves the previous one in place - the next one simply tries again
+			try
+			{
+				WriteCheckpoint(snapshot, state);
+				m_failed = false;
+			}
+			catch (const std::exception&)
+			{
+				m_failed = true;
+			}
+			snapshot.Release();
+
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_busy = false;
+			}
+			m_finished.notify_all();
+		}
+	}
+
+	void Checkpointer::WriteCheckpoint(AtomArena::Snapshot& snapshot, const CheckpointState& state)
+	{
+		const uint64_t sequence = m_sequence + 1;
+		const size_t chunkCount = snapshot.ChunkCount();
+
+		// Segments that have become mostly garbage get their surviving chunks written again, after
+		// which nothing refers to them and they are deleted
+		std::map<uint64_t, uint64_t> liveBytes;
+		for (const ManifestChunk& chunk : m_chunks)
+			liveBytes[chunk.segment] += chunk.atomCount * sizeof(AtomRecord);
+
+		std::set<uint64_t> compact;
+		for (const auto& segment : liveBytes)
+		{
+			std::error_code error;
+			uint64_t size = std::filesystem::file_size(SegmentPath(m_directory, segment.first), error);
+			if (error || static_cast<double>(segment.second) < m_settings.compactionThreshold * static_cast<double>(size - sizeof(SegmentHeader)))
+				compact.insert(segment.first);
+		}
+
+		std::filesystem::path segmentPath = SegmentPath(m_directory, sequence);
+		AsyncFileWriter segment(segmentPath.wstring());
+
+		SegmentHeader segmentHeader = {};
+		std::memcpy(segmentHeader.magic, SegmentMagic, sizeof(segmentHeader.magic));
+		segmentHeader.sequence = sequence;
+		segment.Write(&segmentHeader, sizeof(segmentHeader));
+
+		std::vector<ManifestChunk> chunks(chunkCount);
+		std::vector<std::vector<AtomRecord>> records(std::min(ChunkBatch, chunkCount));
+		std::vector<uint64_t> hashes(records.size());
+		unsigned long long chunksWritten = 0;
+		unsigned long long atomCount = 0;
+
+		for (size_t batch = 0; batch < chunkCount; batch += ChunkBatch)
+		{
+			size_t batchSize = std::min(ChunkBatch, chunkCount - batch);
+
+			// Serialize and hash in parallel. Each chunk is released straight away, so the simulation
+			// does not copy it on its next write.
+			concurrency::parallel_for(size_t(0), batchSize, [&](size_t index)
+				{
+					std::vector<AtomRecord>& out = records[index];
+					out.clear();
+					snapshot.ReadChunk(batch + index, [&](Atom* atom)
+						{
+							AtomRecord record = {};
+							XMFLOAT3 position = atom->Position();
+							XMFLOAT3 velocity = atom->Velocity();
+							std::memcpy(record.position, &position, sizeof(record.position));
+							std::memcpy(record.velocity, &velocity, sizeof(record.velocity));
+							record.element = static_cast<uint8_t>(atom->Element());
+							record.neutronCount = static_cast<uint8_t>(atom->NeutronsCount());
+							record.electronCount = static_cast<uint8_t>(atom->ElectronsCount());
+							out.push_back(record);
+						});
+					snapshot.ReleaseChunk(batch + index);
+
+					hashes[index] = HashBytes(out.data(), out.size() * sizeof(AtomRecord));
+				});
+
+			// Only chunks that changed (or live in a segment being compacted) are written
+			for (size_t index = 0; index < batchSize; ++index)
+			{
+				size_t chunk = batch + index;
+				uint32_t count = static_cast<uint32_t>(records[index].size());
+				atomCount += count;
+
+				if (chunk < m_chunks.size() && m_chunks[chunk].hash == hashes[index] &&
+					m_chunks[chunk].atomCount == count && compact.count(m_chunks[chunk].segment) == 0)
+				{
+					chunks[chunk] = m_chunks[chunk];
+					continue;
+				}
+
+				chunks[chunk].hash = hashes[index];
+				chunks[chunk].offset = segment.Size();
+				chunks[chunk].segment = sequence;
+				chunks[chunk].atomCount = count;
+				segment.Write(records[index].data(), count * sizeof(AtomRecord));
+				++chunksWritten;
+			}
+		}
+
+		// The segment has to be on the disk before a manifest that refers to it
+		segment.Sync();
+		uint64_t bytesWritten = segment.Size();
+		segment.Close();
+		if (chunksWritten == 0)
+		{
+			std::error_code error;
+			std::filesystem::remove(segmentPath, error);
+			bytesWritten = 0;
+		}
+
+		ManifestHeader header = {};
+		std::memcpy(header.magic, Magic, sizeof(header.magic));
+		header.version = Version;
+		header.headerSize = sizeof(ManifestHeader);
+		header.sequence = sequence;
+		header.stepCount = state.stepCount;
+		header.fixedTimeStep = state.fixedTimeStep;
+		header.boxDimensions[0] = state.boxDimensions.x;
+		header.boxDimensions[1] = state.boxDimensions.y;
+		header.boxDimensions[2] = state.boxDimensions.z;
+		header.boxVisible = state.boxVisible ? 1 : 0;
+		header.time = state.time;
+		header.periodicAxes = state.periodicAxes;
+		header.sortInterval = state.sortState.interval;
+		header.sortStepsToCheck = state.sortState.stepsToCheck;
+		header.sortForce = state.sortState.force ? 1 : 0;
+		header.atomCount = atomCount;
+		header.chunkCount = chunkCount;
+		header.orderCount = state.order.size() == atomCount ? atomCount : 0;
+
+		std::vector<BondRecord> bonds;
+		for (const BondConstraints::Bond& bond : state.bonds)
+		{
+			if (bond.first < atomCount && bond.second < atomCount)
+				bonds.push_back({ bond.first, bond.second, bond.length, 0 });
+		}
+		header.bondCount = bonds.size();
+
+		// The order and the bonds straight after the chunks, so one hash covers them all
+		const size_t entriesSize = chunks.size() * sizeof(ManifestChunk);
+		const size_t orderSize = static_cast<size_t>(header.orderCount * sizeof(uint32_t));
+		const size_t bondsSize = bonds.size() * sizeof(BondRecord);
+		std::vector<uint8_t> entries(entriesSize + orderSize + bondsSize);
+		if (entriesSize != 0)
+			std::memcpy(entries.data(), chunks.data(), entriesSize);
+		if (orderSize != 0)
+			std::memcpy(entries.data() + entriesSize, state.order.data(), orderSize);
+		if (bondsSize != 0)
+			std::memcpy(entries.data() + entriesSize + orderSize, bonds.data(), bondsSize);
+		header.entriesHash = HashBytes(entries.data(), entries.size());
+
+		// Write the new manifest next to the old one and swap it in with a single rename
+		std::filesystem::path manifestPath = std::filesystem::path(m_directory) / ManifestName;
+		std::filesystem::path temporaryPath = std::filesystem::path(m_directory) / ManifestTemporaryName;
+		{
+			AsyncFileWriter manifest(temporaryPath.wstring());
+			manifest.Write(&header, sizeof(header));
+			manifest.Write(entries.data(), entries.size());
+			manifest.Sync();
+			manifest.Close();
+			bytesWritten += manifest.Size();
+		}
+
+		std::error_code error;
+		std::filesystem::rename(temporaryPath, manifestPath, error);
+		if (error)
+			throw std::runtime_error("Checkpointer: unable to replace the checkpoint manifest");
+		SyncDirectory(m_directory);
+
+		m_sequence = sequence;
+		m_chunks.swap(chunks);
+		RemoveUnreferencedFiles();
+
+		m_lastChunksWritten = chunksWritten;
+		m_lastChunksReused = chunkCount - chunksWritten;
+		m_lastBytesWritten = bytesWritten;
+		++m_checkpointsWritten;
+	}
+
+	void Checkpointer::RemoveUnreferencedFiles()
+	{
+		std::set<uint64_t> referenced;
+		for (const ManifestChunk& chunk : m_chunks)
+			referenced.insert(chunk.segment);
+
+		std::error_code error;
+		for (const std::filesystem::directory_entry& entry : std::filesystem::directory_iterator(std::filesystem::path(m_directory), error))
+		{
+			std::wstring name = entry.path().filename().wstring();
+			bool remove = name == ManifestTemporaryName;
+
+			if (name.compare(0, std::wcslen(SegmentPrefix), SegmentPrefix) == 0 && entry.path().extension() == SegmentExtension)
+			{
+				std::wstring number = entry.path().stem().wstring().substr(std::wcslen(SegmentPrefix));
+				wchar_t* end = nullptr;
+				uint64_t sequence = std::wcstoull(number.c_str(), &end, 10);
+				remove = end != nullptr && *end == L'\0' && referenced.count(sequence) == 0;
+			}
+
+			if (remove)
+			{
+				std::error_code removeError;
+				std::filesystem::remove(entry.path(), removeError);
+			}
+		}
+	}
+
+	CheckpointState Checkpointer::Restore(const std::wstring& directory, AtomArena& arena)
+	{
+		if (arena.AtomCount() != 0)
+			throw std::runtime_error("Checkpointer: checkpoints must be restored into an empty arena");
+
+		ManifestHeader header;
+		std::vector<ManifestChunk> chunks;
+		std::vector<uint32_t> order;
+		std::vector<BondRecord> bonds;
+		ReadManifest(directory, header, chunks, &order, &bonds);
+
+		// The order has to be a permutation of the arena numbers
+		std::vector<bool> listed(order.size(), false);
+		for (uint32_t number : order)
+		{
+			if (number >= order.size() || listed[number])
+				throw std::runtime_error("Checkpointer: checkpoint atom order is corrupt");
+			listed[number] = true;
+		}
+		for (const BondRecord& bond : bonds)
+		{
+			if (bond.first >= header.atomCount || bond.second >= header.atomCount || bond.first == bond.second ||
+				!(bond.length > 0.0f && bond.length < std::numeric_limits<float>::infinity()))
+				throw std::runtime_error("Checkpointer: checkpoint bonds are corrupt");
+		}
+
+		// Map every segment the manifest refers to and check that each chunk lies inside it
+		std::map<uint64_t, MappedFile> segments;
+		std::vector<size_t> firstAtom(chunks.size());
+		uint64_t atomCount = 0;
+		for (size_t chunk = 0; chunk < chunks.size(); ++chunk)
+		{
+			const ManifestChunk& entry = chunks[chunk];
+			auto found = segments.find(entry.segment);
+			if (found == segments.end())
+			{
+				MappedFile file(SegmentPath(directory, entry.segment).wstring());
+				SegmentHeader segmentHeader;
+				if (file.Size() < sizeof(SegmentHeader))
+					throw std::runtime_error("Checkpointer: checkpoint segment is truncated");
+				std::memcpy(&segmentHeader, file.Data(), sizeof(segmentHeader));
+				if (std::memcmp(segmentHeader.magic, SegmentMagic, sizeof(segmentHeader.magic)) != 0 || segmentHeader.sequence != entry.segment)
+					throw std::runtime_error("Checkpointer: not a checkpoint segment");
+
+				found = segments.emplace(entry.segment, std::move(file)).first;
+			}
+
+			if (entry.atomCount > AtomArena::ChunkCapacity || entry.offset < sizeof(SegmentHeader) ||
+				entry.offset + entry.atomCount * sizeof(AtomRecord) > found->second.Size())
+				throw std::runtime_error("Checkpointer: checkpoint segment is truncated or corrupt");
+
+			firstAtom[chunk] = static_cast<size_t>(atomCount);
+			atomCount += entry.atomCount;
+		}
+
+		if (atomCount != header.atomCount)
+			throw std::runtime_error("Checkpointer: checkpoint manifest is corrupt");
+
+		// Chunks are independent - check and construct them in parallel
+		size_t first = arena.AllocateBulk(static_cast<size_t>(atomCount));
+		std::atomic<bool> valid(true);
+		concurrency::parallel_for(size_t(0), chunks.size(), [&](size_t chunk)
+			{
+				const ManifestChunk& entry = chunks[chunk];
+				const uint8_t* data = segments.find(entry.segment)->second.Data() + entry.offset;
+				if (HashBytes(data, entry.atomCount * sizeof(AtomRecord)) != entry.hash)
+				{
+					valid = false;
+					return;
+				}
+
+				for (uint32_t iii = 0; iii < entry.atomCount; ++iii)
+				{
+					AtomRecord record;
+					std::memcpy(&record, data + iii * sizeof(AtomRecord), sizeof(record));
+					if (!AtomGenerator::IsValidElement(record.element))
+					{
+						valid = false;
+						return;
+					}
+
+					XMFLOAT3 position(record.position[0], record.position[1], record.position[2]);
+					XMFLOAT3 velocity(record.velocity[0], record.velocity[1], record.velocity[2]);
+					AtomGenerator::CreateAtomAt(arena.SlotAt(first + firstAtom[chunk] + iii), static_cast<Element>(record.element),
+						position, velocity, record.neutronCount, record.element - record.electronCount);
+				}
+			});
+
+		if (!valid)
+		{
+			// Some slots were never constructed, so the arena cannot be used
+			arena.Clear();
+			throw std::runtime_error("Checkpointer: checkpoint data is corrupt");
+		}
+
+		CheckpointState state;
+		state.boxDimensions = XMFLOAT3(header.boxDimensions[0], header.boxDimensions[1], header.boxDimensions[2]);
+		state.boxVisible = header.boxVisible != 0;
+		state.stepCount = header.stepCount;
+		state.fixedTimeStep = header.fixedTimeStep;
+		state.time = header.time;
+		state.periodicAxes = header.periodicAxes;
+		state.order.swap(order);
+		state.sortState.interval = header.sortInterval;
+		state.sortState.stepsToCheck = header.sortStepsToCheck;
+		state.sortState.force = header.sortForce != 0;
+		for (const BondRecord& bond : bonds)
+			state.bonds.push_back({ static_cast<size_t>(bond.first), static_cast<size_t>(bond.second), bond.length });
+		return state;
+	}
+}
@@ -0,0 +1,202 @@
+#pragma once
+
+#include "pch.h"
+#include "AtomArena.h"
+#include "BondConstraints.h"
+#include "SpatialSort.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using DirectX::XMFLOAT3;
+
+/*
+*	Incremental checkpoints (a directory of files)
+*
+*	checkpoint.clckpt		Manifest - simulation state plus, for every arena chunk, where its
+*							atoms are stored and a hash of them, then the simulation order of the
+*							atoms and the bond constraints. Always replaced by an atomic rename, so
+*							it describes either the previous or the new checkpoint, never a mix.
+*	segment-NNNNNNNN.clseg	Atom records of the chunks that changed in checkpoint N. Written once,
+*							never modified; deleted when no manifest refers to it any more.
+*
+*	A chunk whose hash matches the previous checkpoint is not written again - the new manifest
+*	points at the segment that already holds it. Segments that are mostly unreferenced have
+*	their remaining chunks rewritten so the directory does not grow without bound.
+*/
+
+namespace Simulation
+{
+	namespace CheckpointFormat
+	{
+		const char Magic[8] = { 'C', 'L', 'C', 'K', 'P', 'T', '\0', '\0' };
+		const char SegmentMagic[8] = { 'C', 'L', 'S', 'E', 'G', '\0', '\0', '\0' };
+		const uint32_t Version = 2;
+		const uint32_t MinimumHeaderSize = 80;		// Version 1 - fields a manifest's header does not reach read as zero
+
+		struct ManifestHeader
+		{
+			char		magic[8];
+			uint32_t	version;
+			uint32_t	headerSize;
+			uint64_t	sequence;			// Checkpoint number - also the segment it wrote
+			uint64_t	stepCount;
+			double		fixedTimeStep;
+			float		boxDimensions[3];
+			uint32_t	boxVisible;
+			uint64_t	atomCount;
+			uint64_t	chunkCount;
+			uint64_t	entriesHash;		// Hash of everything after the header
+			double		time;				// Simulated time - version 2
+			uint32_t	periodicAxes;		// PeriodicAxis flags - version 2
+			uint32_t	sortInterval;		// SpatialSortState - version 2
+			uint32_t	sortStepsToCheck;
+			uint32_t	sortForce;
+			uint64_t	orderCount;			// Arena numbers of the atoms in simulation order after the
+											// ManifestChunk array - 0 or atomCount, version 2
+			uint64_t	bondCount;			// BondRecords after the order - version 2
+		};
+
+		struct ManifestChunk
+		{
+			uint64_t	hash;				// Of the chunk's atom records
+			uint64_t	offset;				// In the segment file
+			uint64_t	segment;
+			uint32_t	atomCount;
+			uint32_t	reserved;
+		};
+
+		struct SegmentHeader
+		{
+			char		magic[8];
+			uint64_t	sequence;
+		};
+
+		// Everything needed to bring an atom back bit for bit
+		struct AtomRecord
+		{
+			float		position[3];
+			float		velocity[3];
+			uint8_t		element;
+			uint8_t		neutronCount;
+			uint8_t		electronCount;
+			uint8_t		reserved;
+		};
+
+		// A bond constraint between two atoms, by arena number
+		struct BondRecord
+		{
+			uint64_t	first;
+			uint64_t	second;
+			float		length;
+			uint32_t	reserved;
+		};
+
+		static_assert(sizeof(ManifestHeader) == 120, "ManifestHeader layout changed");
+		static_assert(sizeof(ManifestChunk) == 32, "ManifestChunk layout changed");
+		static_assert(sizeof(SegmentHeader) == 16, "SegmentHeader layout changed");
+		static_assert(sizeof(AtomRecord) == 28, "AtomRecord layout changed");
+		static_assert(sizeof(BondRecord) == 24, "BondRecord layout changed");
+	}
+
+	// Simulation-wide state stored in every checkpoint
+	struct CheckpointState
+	{
+		XMFLOAT3			boxDimensions;
+		bool				boxVisible;
+		unsigned long long	stepCount;
+		double				fixedTimeStep;
+		double				time;
+		unsigned int		periodicAxes;		// PeriodicAxis flags
+
+		// The simulation's atom list, as arena numbers (see AtomArena::Numbers), and where its
+		// re-sorting stands - empty if the list is in the order RebuildAtomList gives
+		std::vector<uint32_t>	order;
+		SpatialSortState		sortState;
+
+		std::vector<BondConstraints::Bond>	bonds;		// Those to atoms past the end are left out
+	};
+
+	struct CheckpointSettings
+	{
+		unsigned long long	stepInterval = 0;			// Checkpoint every N steps (0 = off)
+		double				secondsInterval = 600.0;	// ... and/or every T seconds of wall clock time (0 = off)
+		double				compactionThreshold = 0.5;	// Rewrite a segment's chunks once less than this fraction of it is still referenced
+	};
+
+	/*
+	*	Writes checkpoints on a background thread from an AtomArena::Snapshot, so the simulation only
+	*	pays for taking the snapshot (copying chunk pointers). Chunks are released as soon as they have
+	*	been read, which limits the copy-on-write work the next simulation step has to do.
+	*/
+	class Checkpointer
+	{
+	public:
+		// Picks up the existing checkpoint in 'directory' (if any) so incremental checkpoints continue
+		// across restarts. Throws std::runtime_error if the directory cannot be created.
+		Checkpointer(const std::wstring& directory, const CheckpointSettings& settings);
+		~Checkpointer();
+
+		// True when the step or time interval has passed since the last checkpoint was started
+		bool Due(unsigned long long step);
+
+		// Start writing a checkpoint. Returns false (and keeps the checkpoint due) if the previous one
+		// is still being written.
+		bool Submit(AtomArena::Snapshot snapshot, const CheckpointState& state);
+
+		// Block until the checkpoint being written (if any) is on disk
+		void Wait();
+
+		// GET
+		unsigned long long	CheckpointsWritten() { return m_checkpointsWritten; }
+		unsigned long long	LastChunksWritten() { return m_lastChunksWritten; }		// Chunks that changed
+		unsigned long long	LastChunksReused() { return m_lastChunksReused; }		// Chunks referenced from older segments
+		unsigned long long	LastBytesWritten() { return m_lastBytesWritten; }
+		bool				Failed() { return m_failed; }
+
+		// Load the checkpoint in 'directory' into 'arena', which must be empty. Every chunk is checked
+		// against its hash. Throws std::runtime_error if the checkpoint is missing or damaged, in which
+		// case the arena is left empty.
+		static CheckpointState Restore(const std::wstring& directory, AtomArena& arena);
+
+	private:
+		void WriterThread();
+		void WriteCheckpoint(AtomArena::Snapshot& snapshot, const CheckpointState& state);
+		void RemoveUnreferencedFiles();
+
+		std::wstring							m_directory;
+		CheckpointSettings						m_settings;
+
+		// Previous checkpoint - what the next one is compared against
+		uint64_t								m_sequence;
+		std::vector<CheckpointFormat::ManifestChunk> m_chunks;
+
+		// Scheduling (simulation thread)
+		bool									m_started;			// m_lastStep / m_lastTime are set
+		unsigned long long						m_lastStep;
+		std::chrono::steady_clock::time_point	m_lastTime;
+
+		// Hand-off to the writer thread
+		std::mutex								m_mutex;
+		std::condition_variable					m_submitted;
+		std::condition_variable					m_finished;
+		bool									m_pending;			// m_snapshot is waiting for the writer
+		bool									m_busy;				// ... or being written
+		bool									m_stopping;
+		AtomArena::Snapshot						m_snapshot;
+		CheckpointState							m_state;
+		std::thread								m_writer;
+
+		// Statistics
+		std::atomic<unsigned long long>			m_checkpointsWritten;
+		std::atomic<unsigned long long>			m_lastChunksWritten;
+		std::atomic<unsigned long long>			m_lastChunksReused;
+		std::atomic<unsigned long long>			m_lastBytesWritten;
+		std::atomic<bool>						m_failed;
+	};
+}
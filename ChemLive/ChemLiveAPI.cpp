@@ -0,0 +1,224 @@
+#include "pch.h"
+#include "ChemLiveAPI.h"
+#include "Simulation.h"
+#include <stdexcept>
+#include <string>
+
+struct chemlive_simulation
+{
+	Simulation::Simulation simulation;
+};
+
+// The element view hands out the enum as int32
+static_assert(sizeof(Simulation::Element) == sizeof(int32_t), "Element must be 32 bits for chemlive_segment::elements");
+
+static thread_local std::string s_lastError;
+
+static int Fail(const char* message)
+{
+	s_lastError = message;
+	return -1;
+}
+
+extern "C"
+{
+	int chemlive_api_version(void)
+	{
+		return CHEMLIVE_API_VERSION;
+	}
+
+	const char* chemlive_last_error(void)
+	{
+		return s_lastError.c_str();
+	}
+
+	chemlive_simulation* chemlive_create(void)
+	{
+		try
+		{
+			chemlive_simulation* handle = new chemlive_simulation();
+
+			// Start from nothing rather than the demo scene the app opens with
+			handle->simulation.ClearSimulation();
+			handle->simulation.BoxDimensions(XMFLOAT3(2.0f, 2.0f, 2.0f));
+			handle->simulation.FixedTimeStep(0.001);
+			return handle;
+		}
+		catch (const std::exception& exception)
+		{
+			Fail(exception.what());
+			return nullptr;
+		}
+	}
+
+	void chemlive_destroy(chemlive_simulation* simulation)
+	{
+		delete simulation;
+	}
+
+	int chemlive_set_box(chemlive_simulation* simulation, float x, float y, float z)
+	{
+		if (simulation == nullptr)
+			return Fail("chemlive_set_box: null simulation");
+		if (!(x > 0.0f && y > 0.0f && z > 0.0f))
+			return Fail("chemlive_set_box: box dimensions must be positive");
+
+		try
+		{
+			simulation->simulation.BoxDimensions(XMFLOAT3(x, y, z));
+		}
+		catch (const std::exception& exception)
+		{
+			return Fail(exception.what());
+		}
+		return 0;
+	}
+
+	int chemlive_get_box(chemlive_simulation* simulation, float* dimensions)
+	{
+		if (simulation == nullptr || dimensions == nullptr)
+			return Fail("chemlive_get_box: null argument");
+
+		XMFLOAT3 box = simulation->simulation.BoxDimensions();
+		dimensions[0] = box.x;
+		dimensions[1] = box.y;
+		dimensions[2] = box.z;
+		return 0;
+	}
+
+	int chemlive_set_time_step(chemlive_simulation* simulation, double timeStep)
+	{
+		if (simulation == nullptr)
+			return Fail("chemlive_set_time_step: null simulation");
+		if (!(timeStep > 0.0))
+			return Fail("chemlive_set_time_step: time step must be positive");
+
+		simulation->simulation.FixedTimeStep(timeStep);
+		return 0;
+	}
+
+	int chemlive_set_adaptive_time_step(chemlive_simulation* simulation, double minimum, double maximum)
+	{
+		if (simulation == nullptr)
+			return Fail("chemlive_set_adaptive_time_step: null simulation");
+
+		try
+		{
+			if (maximum == 0.0)
+			{
+				simulation->simulation.AdaptiveTimeStepping(false);
+				return 0;
+			}
+
+			Simulation::AdaptiveTimeStepSettings settings;
+			settings.minimum = minimum;
+			settings.maximum = maximum;
+			simulation->simulation.AdaptiveTimeStepping(true, settings);
+			return 0;
+		}
+		catch (const std::exception& exception)
+		{
+			return Fail(exception.what());
+		}
+	}
+
+	int chemlive_get_time_step(chemlive_simulation* simulation, double* timeStep, uint64_t* rejectedSteps)
+	{
+		if (simulation == nullptr)
+			return Fail("chemlive_get_time_step: null simulation");
+
+		// Before the first adaptive step there is nothing observed yet - report the fixed step
+		Simulation::AdaptiveTimeStep* control = simulation->simulation.TimeStepControl();
+		const bool observed = control != nullptr && control->Statistics().accepted > 0;
+		if (timeStep != nullptr)
+			*timeStep = observed ? control->Statistics().timeStep : simulation->simulation.FixedTimeStep();
+		if (rejectedSteps != nullptr)
+			*rejectedSteps = control != nullptr ? control->Statistics().rejected : 0;
+		return 0;
+	}
+
+	int chemlive_step(chemlive_simulation* simulation, uint64_t steps)
+	{
+		if (simulation == nullptr)
+			return Fail("chemlive_step: null simulation");
+
+		try
+		{
+			const double timeStep = simulation->simulation.FixedTimeStep();
+			for (uint64_t step = 0; step < steps; ++step)
+				simulation->simulation.Step(timeStep);
+			return 0;
+		}
+		catch (const std::exception& exception)
+		{
+			return Fail(exception.what());
+		}
+	}
+
+	uint64_t chemlive_step_count(chemlive_simulation* simulation)
+	{
+		return simulation == nullptr ? 0 : simulation->simulation.StepCount();
+	}
+
+	double chemlive_time(chemlive_simulation* simulation)
+	{
+		return simulation == nullptr ? 0.0 : simulation->simulation.SimulatedTime();
+	}
+
+	int64_t chemlive_add_atoms(chemlive_simulation* simulation, size_t count, const int32_t* elements, const float* positions, const float* velocities)
+	{
+		if (simulation == nullptr)
+			return Fail("chemlive_add_atoms: null simulation");
+		if (count == 0)
+			return static_cast<int64_t>(simulation->simulation.Arena().AtomCount());
+		if (elements == nullptr || positions == nullptr)
+			return Fail("chemlive_add_atoms: elements and positions are required");
+
+		try
+		{
+			return static_cast<int64_t>(simulation->simulation.AddAtoms(count, elements, positions, velocities));
+		}
+		catch (const std::exception& exception)
+		{
+			return Fail(exception.what());
+		}
+	}
+
+	size_t chemlive_atom_count(chemlive_simulation* simulation)
+	{
+		return simulation == nullptr ? 0 : simulation->simulation.Arena().AtomCount();
+	}
+
+	size_t chemlive_get_segments(chemlive_simulation* simulation, chemlive_segment* segments, size_t capacity)
+	{
+		if (simulation == nullptr)
+			return 0;
+
+		Simulation::AtomArena& arena = simulation->simulation.Arena();
+
+		// The caller may write through the views - split off anything a snapshot still shares
+		// (the live arena keeps its storage, so views handed out earlier stay valid)
+		if (capacity != 0)
+			arena.MakeWritable();
+
+		size_t count = 0;
+		for (size_t chunk = 0; chunk < arena.ChunkCount(); ++chunk)
+		{
+			const unsigned int atoms = arena.ChunkAtomCount(chunk);
+			if (atoms == 0)
+				continue;		// Reserved but not filled yet - chunks fill front to back
+
+			if (count < capacity)
+			{
+				Simulation::Atom* atom = arena.At(chunk, 0);
+				chemlive_segment& segment = segments[count];
+				segment.first = chunk * Simulation::AtomArena::ChunkCapacity;
+				segment.positions = { atom->PositionData(), arena.SlotSize(), atoms };
+				segment.velocities = { atom->VelocityData(), arena.SlotSize(), atoms };
+				segment.elements = { const_cast<Simulation::Element*>(atom->ElementData()), arena.SlotSize(), atoms };
+			}
+			++count;
+		}
+		return count;
+	}
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+/*
+*	C interface for driving a simulation from other languages (Python/NumPy, Julia, ...).
+*	Plain C types only, so it can be bound with ctypes / cffi / ccall without a C++ compiler.
+*
+*	Atom state is never copied out. chemlive_get_segments returns pointer / stride / length views
+*	straight into the simulation's atom storage, which is split into segments of up to 4096 atoms
+*	(one per AtomArena chunk). Within a segment, atom i's position is the three floats at
+*	data + i * stride, so each segment wraps as a (length, 3) float32 array with strides (stride, 4).
+*
+*	Atoms are numbered in the order they were added, across segments: segment k starts at atom
+*	'first' of that segment. This order never changes while atoms are only added.
+*
+*	Views stay valid between steps. Adding atoms, or anything that replaces the scene, invalidates
+*	them. Positions and velocities may be written through the views, but only after calling
+*	chemlive_get_segments since the last step - that call is what lets the simulation keep its
+*	reset state and in-flight checkpoints intact (it is cheap when there is nothing to protect).
+*
+*	Functions returning int return 0 on success and -1 on failure; chemlive_last_error then
+*	describes the failure. Nothing here is thread safe for a single simulation.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32) && defined(CHEMLIVE_EXPORTS)
+#define CHEMLIVE_API __declspec(dllexport)
+#elif defined(_WIN32) && defined(CHEMLIVE_IMPORTS)
+#define CHEMLIVE_API __declspec(dllimport)
+#else
+#define CHEMLIVE_API
+#endif
+
+#define CHEMLIVE_API_VERSION 2
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct chemlive_simulation chemlive_simulation;
+
+typedef struct chemlive_view
+{
+	void*		data;			/* First atom's value */
+	size_t		stride;			/* Bytes from one atom's value to the next */
+	size_t		length;			/* Atoms in the view */
+} chemlive_view;
+
+typedef struct chemlive_segment
+{
+	size_t			first;			/* Number of the segment's first atom */
+	chemlive_view	positions;		/* float[3] per atom, nm */
+	chemlive_view	velocities;		/* float[3] per atom */
+	chemlive_view	elements;		/* int32 per atom (atomic number) - read only */
+} chemlive_segment;
+
+CHEMLIVE_API int							chemlive_api_version(void);
+CHEMLIVE_API const char*					chemlive_last_error(void);		/* Of the calling thread */
+
+/* An empty simulation in a 2 nm box with a fixed time step of 0.001 */
+CHEMLIVE_API chemlive_simulation*			chemlive_create(void);
+CHEMLIVE_API void							chemlive_destroy(chemlive_simulation* simulation);
+
+CHEMLIVE_API int							chemlive_set_box(chemlive_simulation* simulation, float x, float y, float z);
+CHEMLIVE_API int							chemlive_get_box(chemlive_simulation* simulation, float* dimensions);		/* 3 floats */
+CHEMLIVE_API int							chemlive_set_time_step(chemlive_simulation* simulation, double timeStep);
+
+/*
+*	Let every step choose its own time step between 'minimum' and 'maximum' from how fast the
+*	atoms move and how soon they meet (the fixed time step is ignored meanwhile), or go back to the
+*	fixed one with 'maximum' 0. Since version 2.
+*/
+CHEMLIVE_API int							chemlive_set_adaptive_time_step(chemlive_simulation* simulation, double minimum, double maximum);
+
+/* The time step of the last step, and how many adaptive steps were rejected and taken again with half the step so far */
+CHEMLIVE_API int							chemlive_get_time_step(chemlive_simulation* simulation, double* timeStep, uint64_t* rejectedSteps);
+
+/* Advance 'steps' steps of the fixed (or adaptive) time step */
+CHEMLIVE_API int							chemlive_step(chemlive_simulation* simulation, uint64_t steps);
+CHEMLIVE_API uint64_t						chemlive_step_count(chemlive_simulation* simulation);
+CHEMLIVE_API double							chemlive_time(chemlive_simulation* simulation);
+
+/*
+*	Add 'count' atoms: 'elements' holds atomic numbers, 'positions' and 'velocities' 3 floats per
+*	atom ('velocities' may be NULL). Returns the number of the first new atom, or -1 if any element
+*	is invalid - in which case nothing is added.
+*/
+CHEMLIVE_API int64_t						chemlive_add_atoms(chemlive_simulation* simulation, size_t count,
+													const int32_t* elements, const float* positions, const float* velocities);
+CHEMLIVE_API size_t							chemlive_atom_count(chemlive_simulation* simulation);
+
+/* Fill up to 'capacity' segments and return how many there are (call with capacity 0 to size the array) */
+CHEMLIVE_API size_t							chemlive_get_segments(chemlive_simulation* simulation, chemlive_segment* segments, size_t capacity);
+
+#ifdef __cplusplus
+}
+#endif
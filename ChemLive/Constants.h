@@ -20,5 +20,38 @@ namespace Simulation
 			0.050f, // Flourine
 			0.160f  // Neon
 		};
+
+		// Chemical symbol for every element, indexed the same way as AtomicRadii
+		const char* const ElementSymbols[11] = {
+			"",		// Invalid value to take up the 0 index spot
+			"H",	// Hydrogen
+			"He",	// Helium
+			"Li",	// Lithium
+			"Be",	// Beryllium
+			"B",	// Boron
+			"C",	// Carbon
+			"N",	// Nitrogen
+			"O",	// Oxygen
+			"F",	// Flourine
+			"Ne"	// Neon
+		};
+
+		// Neutron count of the most common isotope - matches the defaults of the element classes
+		const int DefaultNeutronCounts[11] = {
+			0,		// Invalid value to take up the 0 index spot
+			0,		// Hydrogen
+			2,		// Helium
+			4,		// Lithium
+			5,		// Beryllium
+			6,		// Boron
+			6,		// Carbon
+			7,		// Nitrogen
+			8,		// Oxygen
+			10,		// Flourine
+			10		// Neon
+		};
+
+		// Coulomb's constant 1 / (4 pi epsilon0) in the simulation's units - kJ/mol nm / e^2
+		const double CoulombConstant = 138.935458;
 	}
 }
\ No newline at end of file
@@ -0,0 +1,213 @@
+#include "pch.h"
+#include "EntropyCoder.h"
+
+namespace Simulation
+{
+	namespace EntropyCoder
+	{
+		// See "Interleaved entropy coders" (F. Giesen) for the byte-wise rANS formulation used here
+		static const uint32_t ScaleBits = 12;
+		static const uint32_t TotalFrequency = 1u << ScaleBits;
+		static const uint32_t StateLowerBound = 1u << 23;
+
+		static const uint8_t BlockStored = 0;
+		static const uint8_t BlockRANS = 1;
+
+		static void WriteVarint(uint32_t value, std::vector<uint8_t>& out)
+		{
+			while (value >= 0x80)
+			{
+				out.push_back(static_cast<uint8_t>(value | 0x80));
+				value >>= 7;
+			}
+			out.push_back(static_cast<uint8_t>(value));
+		}
+
+		static bool ReadVarint(const uint8_t*& data, const uint8_t* end, uint32_t& value)
+		{
+			value = 0;
+			for (unsigned int shift = 0; shift < 32; shift += 7)
+			{
+				if (data == end)
+					return false;
+
+				uint8_t byte = *data++;
+				value |= static_cast<uint32_t>(byte & 0x7F) << shift;
+				if ((byte & 0x80) == 0)
+					return true;
+			}
+			return false;
+		}
+
+		// Scale the symbol counts so they sum to TotalFrequency, keeping every used symbol >= 1
+		static void NormalizeFrequencies(const uint64_t counts[256], uint64_t total, uint32_t frequencies[256])
+		{
+			uint32_t sum = 0;
+			unsigned int largest = 0;
+			for (unsigned int symbol = 0; symbol < 256; ++symbol)
+			{
+				frequencies[symbol] = 0;
+				if (counts[symbol] == 0)
+					continue;
+
+				frequencies[symbol] = std::max<uint32_t>(1, static_cast<uint32_t>(counts[symbol] * TotalFrequency / total));
+				sum += frequencies[symbol];
+
+				if (frequencies[symbol] > frequencies[largest])
+					largest = symbol;
+			}
+
+			// Give any rounding slack to the most common symbol, or take the excess from the
+			// most common symbols that can afford it
+			if (sum < TotalFrequency)
+			{
+				frequencies[largest] += TotalFrequency - sum;
+			}
+			else
+			{
+				while (sum > TotalFrequency)
+				{
+					unsigned int victim = 0;
+					for (unsigned int symbol = 0; symbol < 256; ++symbol)
+					{
+						if (frequencies[symbol] > frequencies[victim])
+							victim = symbol;
+					}
+
+					uint32_t take = std::min(sum - TotalFrequency, frequencies[victim] / 2);
+					frequencies[victim] -= take;
+					sum -= take;
+				}
+			}
+		}
+
+		static void StoreRaw(const uint8_t* data, size_t size, std::vector<uint8_t>& out, size_t blockStart)
+		{
+			out.resize(blockStart);
+			out.push_back(BlockStored);
+			out.insert(out.end(), data, data + size);
+		}
+
+		void Compress(const uint8_t* data, size_t size, std::vector<uint8_t>& out)
+		{
+			size_t blockStart = out.size();
+			if (size == 0)
+			{
+				out.push_back(BlockStored);
+				return;
+			}
+
+			uint64_t counts[256] = { 0 };
+			for (size_t iii = 0; iii < size; ++iii)
+				++counts[data[iii]];
+
+			uint32_t frequencies[256];
+			uint32_t cumulative[257];
+			NormalizeFrequencies(counts, size, frequencies);
+
+			cumulative[0] = 0;
+			for (unsigned int symbol = 0; symbol < 256; ++symbol)
+				cumulative[symbol + 1] = cumulative[symbol] + frequencies[symbol];
+
+			out.push_back(BlockRANS);
+			for (unsigned int symbol = 0; symbol < 256; ++symbol)
+				WriteVarint(frequencies[symbol], out);
+
+			// rANS emits bytes back to front, so encode into a scratch buffer from the end.
+			// Each symbol emits at most two bytes with a 12 bit scale.
+			std::vector<uint8_t> scratch(2 * size + 4);
+			uint8_t* end = scratch.data() + scratch.size();
+			uint8_t* ptr = end;
+			uint32_t state = StateLowerBound;
+
+			for (size_t iii = size; iii-- > 0;)
+			{
+				uint32_t frequency = frequencies[data[iii]];
+				uint32_t stateMax = ((StateLowerBound >> ScaleBits) << 8) * frequency;
+				while (state >= stateMax)
+				{
+					*--ptr = static_cast<uint8_t>(state & 0xFF);
+					state >>= 8;
+				}
+				state = ((state / frequency) << ScaleBits) + (state % frequency) + cumulative[data[iii]];
+			}
+
+			ptr -= 4;
+			ptr[0] = static_cast<uint8_t>(state >> 0);
+			ptr[1] = static_cast<uint8_t>(state >> 8);
+			ptr[2] = static_cast<uint8_t>(state >> 16);
+			ptr[3] = static_cast<uint8_t>(state >> 24);
+
+			out.insert(out.end(), ptr, end);
+
+			// Incompressible data (e.g. a block of random low bits) is cheaper to store as is
+			if (out.size() - blockStart > size + 1)
+				StoreRaw(data, size, out, blockStart);
+		}
+
+		bool Decompress(const uint8_t* data, size_t size, uint8_t* out, size_t rawSize)
+		{
+			const uint8_t* end = data + size;
+			if (size == 0)
+				return false;
+
+			uint8_t mode = *data++;
+			if (mode == BlockStored)
+			{
+				if (static_cast<size_t>(end - data) != rawSize)
+					return false;
+
+				std::memcpy(out, data, rawSize);
+				return true;
+			}
+			if (mode != BlockRANS)
+				return false;
+
+			uint32_t frequencies[256];
+			uint32_t cumulative[257];
+			cumulative[0] = 0;
+			for (unsigned int symbol = 0; symbol < 256; ++symbol)
+			{
+				// Bounded before adding, so a corrupt table cannot wrap the sum back to the total
+				// and send the slot fill below past the end of symbolOfSlot
+				if (!ReadVarint(data, end, frequencies[symbol]) || frequencies[symbol] > TotalFrequency - cumulative[symbol])
+					return false;
+				cumulative[symbol + 1] = cumulative[symbol] + frequencies[symbol];
+			}
+			if (cumulative[256] != TotalFrequency)
+				return false;
+
+			// Slot -> symbol lookup
+			uint8_t symbolOfSlot[TotalFrequency];
+			for (unsigned int symbol = 0; symbol < 256; ++symbol)
+			{
+				for (uint32_t slot = cumulative[symbol]; slot < cumulative[symbol + 1]; ++slot)
+					symbolOfSlot[slot] = static_cast<uint8_t>(symbol);
+			}
+
+			if (end - data < 4)
+				return false;
+
+			uint32_t state = static_cast<uint32_t>(data[0]) | (static_cast<uint32_t>(data[1]) << 8) |
+				(static_cast<uint32_t>(data[2]) << 16) | (static_cast<uint32_t>(data[3]) << 24);
+			data += 4;
+
+			const uint32_t mask = TotalFrequency - 1;
+			for (size_t iii = 0; iii < rawSize; ++iii)
+			{
+				uint8_t symbol = symbolOfSlot[state & mask];
+				out[iii] = symbol;
+
+				state = frequencies[symbol] * (state >> ScaleBits) + (state & mask) - cumulative[symbol];
+				while (state < StateLowerBound)
+				{
+					if (data == end)
+						return iii + 1 == rawSize;
+					state = (state << 8) | *data++;
+				}
+			}
+
+			return true;
+		}
+	}
+}
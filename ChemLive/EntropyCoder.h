@@ -0,0 +1,23 @@
+#pragma once
+
+#include "pch.h"
+#include <cstdint>
+#include <vector>
+
+namespace Simulation
+{
+	/*
+	*	Order-0 byte-wise rANS coder used to compress independent blocks of trajectory and
+	*	scene data. Every block carries its own frequency table so blocks can be decoded in
+	*	any order and on any thread. Blocks that would not shrink are stored raw.
+	*/
+	namespace EntropyCoder
+	{
+		// Appends the compressed form of [data, data + size) to 'out'
+		void Compress(const uint8_t* data, size_t size, std::vector<uint8_t>& out);
+
+		// Decompresses a block produced by Compress. 'rawSize' must be the size that was
+		// passed to Compress. Returns false if the block is malformed.
+		bool Decompress(const uint8_t* data, size_t size, uint8_t* out, size_t rawSize);
+	}
+}
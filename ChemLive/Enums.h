@@ -16,4 +16,14 @@ namespace Simulation
 		FLOURINE  = 9,
 		NEON      = 10
 	};
+
+	// Axes whose faces wrap around instead of reflecting - combine with |
+	enum PeriodicAxis
+	{
+		PERIODIC_NONE = 0,
+		PERIODIC_X    = 1,
+		PERIODIC_Y    = 2,
+		PERIODIC_Z    = 4,
+		PERIODIC_ALL  = 7
+	};
 }
\ No newline at end of file
@@ -14,9 +14,9 @@ namespace Simulation
 		// Constructors
 		// Most common isotope = Flourine-19
 		// Most common charge  = -1
-		Flourine(const std::shared_ptr<DX::DeviceResources>& deviceResources, XMFLOAT3 position, XMFLOAT3 velocity, int neutronCount = 10, int charge = -1);
+		Flourine(XMFLOAT3 position, XMFLOAT3 velocity, int neutronCount = 10, int charge = -1);
 
 		// Update
-		void Update(double timeDelta, const std::vector<Atom*>& atoms, XMFLOAT3 boxDimensions);
+		void Update(double timeDelta, const std::vector<Atom*>& atoms, XMFLOAT3 boxDimensions, unsigned int periodicAxes);
 	};
 }
\ No newline at end of file
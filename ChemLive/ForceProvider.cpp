@@ -0,0 +1,65 @@
+#include "pch.h"
+#include "ForceProvider.h"
+#include <algorithm>
+#include <ppl.h>
+
+namespace Simulation
+{
+	// Atoms per task
+	static const size_t FieldBlock = 16384;
+
+	PairForceProvider::PairForceProvider(const PairForceSettings& settings, float skin) :
+		m_forces(settings),
+		m_list(settings.cutoff, skin)
+	{
+	}
+
+	double PairForceProvider::AddForces(const AtomArrays& atoms, XMFLOAT3* forces)
+	{
+		m_list.Update(atoms.positions.data(), atoms.Count(), atoms.boxDimensions, atoms.periodicAxes,
+			atoms.exclusionStart.empty() ? nullptr : atoms.exclusionStart.data(), atoms.exclusions.data());
+		return m_forces.Compute(m_list, atoms.positions.data(), atoms.elements.data(), forces);
+	}
+
+	ExternalFieldProvider::ExternalFieldProvider(XMFLOAT3 acceleration, XMFLOAT3 electricField) :
+		m_acceleration(acceleration),
+		m_electricField(electricField)
+	{
+	}
+
+	double ExternalFieldProvider::AddForces(const AtomArrays& atoms, XMFLOAT3* forces)
+	{
+		const size_t count = atoms.Count();
+		const size_t blocks = (count + FieldBlock - 1) / FieldBlock;
+		std::vector<double> energies(blocks, 0.0);
+
+		concurrency::parallel_for(size_t(0), blocks, [&](size_t block)
+			{
+				double energy = 0.0;
+				size_t end = std::min(count, (block + 1) * FieldBlock);
+				for (size_t iii = block * FieldBlock; iii < end; ++iii)
+				{
+					// F = m g + q E, with the potential measured from the origin
+					const float mass = 1.0f / atoms.inverseMasses[iii];
+					const float charge = atoms.charges[iii];
+					const XMFLOAT3 force(
+						mass * m_acceleration.x + charge * m_electricField.x,
+						mass * m_acceleration.y + charge * m_electricField.y,
+						mass * m_acceleration.z + charge * m_electricField.z);
+
+					forces[iii].x += force.x;
+					forces[iii].y += force.y;
+					forces[iii].z += force.z;
+
+					const XMFLOAT3& position = atoms.positions[iii];
+					energy -= force.x * position.x + force.y * position.y + force.z * position.z;
+				}
+				energies[block] = energy;
+			});
+
+		double energy = 0.0;
+		for (double part : energies)
+			energy += part;
+		return energy;
+	}
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "pch.h"
+#include "NeighbourList.h"
+#include "PairForces.h"
+#include <cstdint>
+#include <vector>
+
+using DirectX::XMFLOAT3;
+
+namespace Simulation
+{
+	/*
+	*	The atoms as the integrator steps them - plain arrays, indexed like the simulation's atom
+	*	list, so force kernels never touch Atom objects.
+	*/
+	struct AtomArrays
+	{
+		std::vector<XMFLOAT3>	positions;			// nm
+		std::vector<XMFLOAT3>	velocities;			// nm/ps
+		std::vector<XMFLOAT3>	forces;				// kJ/(mol nm) - the sum over every provider (the fast ones under multiple time stepping)
+		std::vector<float>		inverseMasses;		// 1/amu
+		std::vector<float>		radii;				// nm - for the walls
+		std::vector<float>		charges;			// e
+		std::vector<uint8_t>	elements;			// Element values
+		std::vector<uint32_t>	exclusionStart;		// Pairs the short range forces leave out - empty if none,
+		std::vector<uint32_t>	exclusions;			// else as BondConstraints::Exclusions
+		XMFLOAT3				boxDimensions;
+		unsigned int			periodicAxes = PERIODIC_NONE;		// PeriodicAxis flags - walls on the other axes
+
+		size_t Count() const { return positions.size(); }
+	};
+
+	/*
+	*	One source of force - pair, bonded, long range, external. The integrator sums every provider
+	*	it has into AtomArrays::forces at the positions of the current step.
+	*/
+	class ForceProvider
+	{
+	public:
+		virtual ~ForceProvider() {}
+
+		// Add the force on every atom to 'forces' and return the potential energy (kJ/mol)
+		virtual double AddForces(const AtomArrays& atoms, XMFLOAT3* forces) = 0;
+
+		// The atoms were replaced or edited from outside - drop anything cached about them
+		virtual void Reset() {}
+
+		// Shortest periodic box length the forces are right for - 0 if any will do
+		virtual float MinimumPeriod() const { return 0.0f; }
+	};
+
+	// Short range pair forces (see PairForces.h) with their own neighbour list
+	class PairForceProvider : public ForceProvider
+	{
+	public:
+		PairForceProvider(const PairForceSettings& settings = PairForceSettings(), float skin = 0.1f);
+
+		double AddForces(const AtomArrays& atoms, XMFLOAT3* forces) override;
+		void Reset() override { m_list.Invalidate(); }
+		float MinimumPeriod() const override { return m_list.MinimumPeriod(); }
+
+		// GET
+		PairForces&		Forces() { return m_forces; }
+		NeighbourList&	List() { return m_list; }
+
+	private:
+		PairForces		m_forces;
+		NeighbourList	m_list;
+	};
+
+	// Uniform fields - a constant acceleration on every atom (gravity-like) and an electric field
+	// acting on the charged ones
+	class ExternalFieldProvider : public ForceProvider
+	{
+	public:
+		ExternalFieldProvider(XMFLOAT3 acceleration, XMFLOAT3 electricField = XMFLOAT3(0.0f, 0.0f, 0.0f));
+
+		double AddForces(const AtomArrays& atoms, XMFLOAT3* forces) override;
+
+		// GET
+		XMFLOAT3 Acceleration() { return m_acceleration; }		// nm/ps^2
+		XMFLOAT3 ElectricField() { return m_electricField; }	// kJ/(mol nm e)
+
+		// SET
+		void Acceleration(XMFLOAT3 acceleration) { m_acceleration = acceleration; }
+		void ElectricField(XMFLOAT3 field) { m_electricField = field; }
+
+	private:
+		XMFLOAT3	m_acceleration;
+		XMFLOAT3	m_electricField;
+	};
+}
@@ -0,0 +1,311 @@
+#include "pch.h"
+#include "FourierTransform.h"
+#include <algorithm>
+#include <cmath>
+#include <ppl.h>
+#include <stdexcept>
+
+namespace Simulation
+{
+	// Lines per task in the x pass, and neighbouring lines transformed together in the y and z
+	// passes - they share cache lines
+	static const size_t LineBlock = 32;
+	static const size_t LineTile = 8;
+
+	// Plain complex product - std::complex's operator* checks for infinities and NaNs on some compilers
+	static inline FourierTransform::Complex Multiply(FourierTransform::Complex a, FourierTransform::Complex b)
+	{
+		return FourierTransform::Complex(a.real() * b.real() - a.imag() * b.imag(), a.real() * b.imag() + a.imag() * b.real());
+	}
+
+	static inline FourierTransform::Complex RotateQuarter(FourierTransform::Complex value, bool inverse)
+	{
+		// Multiply by -i (forward) or +i (inverse)
+		return inverse ? FourierTransform::Complex(-value.imag(), value.real()) : FourierTransform::Complex(value.imag(), -value.real());
+	}
+
+	FourierTransform::FourierTransform(size_t size) :
+		m_size(size)
+	{
+		if (size == 0)
+			throw std::runtime_error("FourierTransform: the length must be positive");
+
+		size_t rest = size;
+		while (rest % 4 == 0) { m_factors.push_back(4); rest /= 4; }
+		while (rest % 2 == 0) { m_factors.push_back(2); rest /= 2; }
+		while (rest % 3 == 0) { m_factors.push_back(3); rest /= 3; }
+		while (rest % 5 == 0) { m_factors.push_back(5); rest /= 5; }
+		if (rest != 1)
+			throw std::runtime_error("FourierTransform: the length must only have the prime factors 2, 3 and 5");
+		if (m_factors.empty())
+			m_factors.push_back(1);
+
+		m_forward.resize(size);
+		m_inverse.resize(size);
+		const double pi = std::acos(-1.0);
+		for (size_t k = 0; k < size; ++k)
+		{
+			double angle = 2.0 * pi * static_cast<double>(k) / static_cast<double>(size);
+			m_forward[k] = Complex(static_cast<float>(std::cos(angle)), static_cast<float>(-std::sin(angle)));
+			m_inverse[k] = std::conj(m_forward[k]);
+		}
+	}
+
+	size_t FourierTransform::GoodSize(size_t size)
+	{
+		for (size_t candidate = std::max<size_t>(size, 1); ; ++candidate)
+		{
+			size_t rest = candidate;
+			for (size_t factor : { 2, 3, 5 })
+				while (rest % factor == 0)
+					rest /= factor;
+			if (rest == 1)
+				return candidate;
+		}
+	}
+
+	void FourierTransform::Transform(Complex* data, size_t stride, bool inverse, Complex* scratch) const
+	{
+		Recurse(data, stride, scratch, m_size, 0, inverse ? m_inverse.data() : m_forward.data());
+		for (size_t k = 0; k < m_size; ++k)
+			data[k * stride] = scratch[k];
+	}
+
+	void FourierTransform::Recurse(const Complex* in, size_t inStride, Complex* out, size_t length, size_t level, const Complex* twiddles) const
+	{
+		// Split into 'radix' interleaved sub-sequences, transform each into its own part of 'out',
+		// then combine them with butterflies
+		const size_t radix = m_factors[level];
+		const size_t part = length / radix;
+		const size_t step = m_size / length;		// twiddles[k * step] = exp(-+2 pi i k / length)
+
+		if (part == 1)
+		{
+			for (size_t q = 0; q < radix; ++q)
+				out[q] = in[q * inStride];
+		}
+		else
+		{
+			for (size_t q = 0; q < radix; ++q)
+				Recurse(in + q * inStride, inStride * radix, out + q * part, part, level + 1, twiddles);
+		}
+
+		const bool inverse = twiddles == m_inverse.data();
+		switch (radix)
+		{
+		case 1:
+			break;
+
+		case 2:
+			for (size_t k = 0; k < part; ++k)
+			{
+				Complex a = out[k];
+				Complex b = Multiply(out[k + part], twiddles[k * step]);
+				out[k] = a + b;
+				out[k + part] = a - b;
+			}
+			break;
+
+		case 4:
+			for (size_t k = 0; k < part; ++k)
+			{
+				Complex a0 = out[k];
+				Complex a1 = Multiply(out[k + part], twiddles[k * step]);
+				Complex a2 = Multiply(out[k + 2 * part], twiddles[2 * k * step]);
+				Complex a3 = Multiply(out[k + 3 * part], twiddles[3 * k * step]);
+				Complex t0 = a0 + a2;
+				Complex t1 = a0 - a2;
+				Complex t2 = a1 + a3;
+				Complex t3 = RotateQuarter(a1 - a3, inverse);
+				out[k] = t0 + t2;
+				out[k + part] = t1 + t3;
+				out[k + 2 * part] = t0 - t2;
+				out[k + 3 * part] = t1 - t3;
+			}
+			break;
+
+		case 3:
+			{
+				// X1, X2 = a0 - (a1 + a2) / 2 +- i sin(-+120) (a1 - a2)
+				const float sine = inverse ? 0.866025404f : -0.866025404f;
+				for (size_t k = 0; k < part; ++k)
+				{
+					Complex a0 = out[k];
+					Complex a1 = Multiply(out[k + part], twiddles[k * step]);
+					Complex a2 = Multiply(out[k + 2 * part], twiddles[2 * k * step]);
+					Complex sum = a1 + a2;
+					Complex middle = a0 - 0.5f * sum;
+					Complex difference = a1 - a2;
+					Complex turn(-sine * difference.imag(), sine * difference.real());
+					out[k] = a0 + sum;
+					out[k + part] = middle + turn;
+					out[k + 2 * part] = middle - turn;
+				}
+			}
+			break;
+
+		case 5:
+			{
+				// The symmetric and antisymmetric pairs (a1, a4) and (a2, a3) share their products
+				const float cos72 = 0.309016994f, cos144 = -0.809016994f;
+				const float sin72 = inverse ? 0.951056516f : -0.951056516f;
+				const float sin144 = inverse ? 0.587785252f : -0.587785252f;
+				for (size_t k = 0; k < part; ++k)
+				{
+					Complex a0 = out[k];
+					Complex a1 = Multiply(out[k + part], twiddles[k * step]);
+					Complex a2 = Multiply(out[k + 2 * part], twiddles[2 * k * step]);
+					Complex a3 = Multiply(out[k + 3 * part], twiddles[3 * k * step]);
+					Complex a4 = Multiply(out[k + 4 * part], twiddles[4 * k * step]);
+					Complex t1 = a1 + a4, t2 = a2 + a3, t3 = a1 - a4, t4 = a2 - a3;
+
+					Complex real1 = a0 + cos72 * t1 + cos144 * t2;
+					Complex real2 = a0 + cos144 * t1 + cos72 * t2;
+					Complex odd1 = sin72 * t3 + sin144 * t4;
+					Complex odd2 = sin144 * t3 - sin72 * t4;
+					Complex turn1(-odd1.imag(), odd1.real());
+					Complex turn2(-odd2.imag(), odd2.real());
+
+					out[k] = a0 + t1 + t2;
+					out[k + part] = real1 + turn1;
+					out[k + 4 * part] = real1 - turn1;
+					out[k + 2 * part] = real2 + turn2;
+					out[k + 3 * part] = real2 - turn2;
+				}
+			}
+			break;
+		}
+	}
+
+	RealFourierTransform3D::RealFourierTransform3D(size_t k1, size_t k2, size_t k3) :
+		m_x(k1),
+		m_y(k2),
+		m_z(k3)
+	{
+		m_sizes[0] = k1;
+		m_sizes[1] = k2;
+		m_sizes[2] = k3;
+	}
+
+	void RealFourierTransform3D::Forward(const float* grid, Complex* spectrum) const
+	{
+		const size_t k1 = m_sizes[0];
+		const size_t width = SpectrumWidth();
+		const size_t lines = m_sizes[1] * m_sizes[2];
+		const size_t pairs = (lines + 1) / 2;
+
+		// x: lines a and b go in as a + i b, and the two real spectra come apart again through
+		// A(k) = (Z(k) + Z*(K - k)) / 2 and B(k) = (Z(k) - Z*(K - k)) / 2i
+		const size_t blocks = (pairs + LineBlock - 1) / LineBlock;
+		concurrency::parallel_for(size_t(0), blocks, [&](size_t block)
+			{
+				std::vector<Complex> line(k1), scratch(k1);
+				const size_t end = std::min(pairs, (block + 1) * LineBlock);
+				for (size_t pair = block * LineBlock; pair < end; ++pair)
+				{
+					const size_t a = 2 * pair;
+					const size_t b = a + 1;
+					const float* realA = grid + a * k1;
+					const float* realB = grid + b * k1;
+					for (size_t x = 0; x < k1; ++x)
+						line[x] = Complex(realA[x], b < lines ? realB[x] : 0.0f);
+
+					m_x.Transform(line.data(), 1, false, scratch.data());
+
+					Complex* outA = spectrum + a * width;
+					Complex* outB = spectrum + b * width;
+					for (size_t k = 0; k < width; ++k)
+					{
+						Complex z = line[k];
+						Complex mirror = std::conj(line[(k1 - k) % k1]);
+						outA[k] = 0.5f * (z + mirror);
+						if (b < lines)
+							outB[k] = RotateQuarter(0.5f * (z - mirror), false);
+					}
+				}
+			});
+
+		TransformAxis(spectrum, 1, false);
+		TransformAxis(spectrum, 2, false);
+	}
+
+	void RealFourierTransform3D::Inverse(Complex* spectrum, float* grid) const
+	{
+		TransformAxis(spectrum, 2, true);
+		TransformAxis(spectrum, 1, true);
+
+		const size_t k1 = m_sizes[0];
+		const size_t width = SpectrumWidth();
+		const size_t lines = m_sizes[1] * m_sizes[2];
+		const size_t pairs = (lines + 1) / 2;
+
+		// x: rebuild both full spectra from their halves, go back as A + i B, and the real and
+		// imaginary parts are the two lines
+		const size_t blocks = (pairs + LineBlock - 1) / LineBlock;
+		concurrency::parallel_for(size_t(0), blocks, [&](size_t block)
+			{
+				std::vector<Complex> line(k1), scratch(k1);
+				const size_t end = std::min(pairs, (block + 1) * LineBlock);
+				for (size_t pair = block * LineBlock; pair < end; ++pair)
+				{
+					const size_t a = 2 * pair;
+					const size_t b = a + 1;
+					const Complex* inA = spectrum + a * width;
+					const Complex* inB = spectrum + b * width;
+					for (size_t k = 0; k < k1; ++k)
+					{
+						const bool stored = k < width;
+						Complex valueA = stored ? inA[k] : std::conj(inA[k1 - k]);
+						Complex valueB = b >= lines ? Complex(0.0f, 0.0f) : stored ? inB[k] : std::conj(inB[k1 - k]);
+						line[k] = valueA + RotateQuarter(valueB, true);
+					}
+
+					m_x.Transform(line.data(), 1, true, scratch.data());
+
+					float* realA = grid + a * k1;
+					float* realB = grid + b * k1;
+					for (size_t x = 0; x < k1; ++x)
+					{
+						realA[x] = line[x].real();
+						if (b < lines)
+							realB[x] = line[x].imag();
+					}
+				}
+			});
+	}
+
+	void RealFourierTransform3D::TransformAxis(Complex* spectrum, int axis, bool inverse) const
+	{
+		const size_t width = SpectrumWidth();
+		const FourierTransform& transform = axis == 1 ? m_y : m_z;
+		const size_t length = transform.Size();
+		const size_t stride = axis == 1 ? width : width * m_sizes[1];		// Between the values of a line
+		const size_t outer = axis == 1 ? m_sizes[2] : m_sizes[1];			// Lines of each kx
+		const size_t outerStride = axis == 1 ? width * m_sizes[1] : width;
+		const size_t tiles = (width + LineTile - 1) / LineTile;
+
+		// Gather a few neighbouring kx lines, transform them contiguously and scatter them back
+		concurrency::parallel_for(size_t(0), outer * tiles, [&](size_t task)
+			{
+				Complex* base = spectrum + (task / tiles) * outerStride;
+				const size_t firstLine = (task % tiles) * LineTile;
+				const size_t count = std::min(LineTile, width - firstLine);
+
+				std::vector<Complex> lines(LineTile * length), scratch(length);
+				for (size_t k = 0; k < length; ++k)
+				{
+					const Complex* source = base + k * stride + firstLine;
+					for (size_t line = 0; line < count; ++line)
+						lines[line * length + k] = source[line];
+				}
+				for (size_t line = 0; line < count; ++line)
+					transform.Transform(lines.data() + line * length, 1, inverse, scratch.data());
+				for (size_t k = 0; k < length; ++k)
+				{
+					Complex* target = base + k * stride + firstLine;
+					for (size_t line = 0; line < count; ++line)
+						target[line] = lines[line * length + k];
+				}
+			});
+	}
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "pch.h"
+#include <complex>
+#include <vector>
+
+namespace Simulation
+{
+	/*
+	*	Complex FFT of one length whose only prime factors are 2, 3 and 5 - mixed radix, recursive
+	*	decimation in time, out of place. Neither direction is normalised: Inverse(Forward(x)) is
+	*	Size() * x.
+	*/
+	class FourierTransform
+	{
+	public:
+		typedef std::complex<float> Complex;
+
+		FourierTransform(size_t size);
+
+		// Transform Size() values 'stride' apart in place. 'scratch' holds Size() values.
+		void Transform(Complex* data, size_t stride, bool inverse, Complex* scratch) const;
+
+		// The smallest length >= 'size' that the transform accepts
+		static size_t GoodSize(size_t size);
+
+		// GET
+		size_t Size() const { return m_size; }
+
+	private:
+		void Recurse(const Complex* in, size_t inStride, Complex* out, size_t length, size_t level, const Complex* twiddles) const;
+
+		size_t					m_size;
+		std::vector<size_t>		m_factors;		// Radix of each level, outermost first
+		std::vector<Complex>	m_forward;		// exp(-2 pi i k / Size())
+		std::vector<Complex>	m_inverse;		// exp(+2 pi i k / Size())
+	};
+
+	/*
+	*	Real to complex 3D FFT of a K1 x K2 x K3 grid stored x fastest. The spectrum keeps only the
+	*	K1 / 2 + 1 non-negative x frequencies - the rest follow from the symmetry of a real signal -
+	*	stored [z][y][kx]. The x pass transforms two real lines at once as one complex line, and each
+	*	pass runs its lines in parallel.
+	*/
+	class RealFourierTransform3D
+	{
+	public:
+		typedef std::complex<float> Complex;
+
+		RealFourierTransform3D(size_t k1, size_t k2, size_t k3);
+
+		void Forward(const float* grid, Complex* spectrum) const;
+		void Inverse(Complex* spectrum, float* grid) const;		// Overwrites 'spectrum'
+
+		// GET
+		size_t Size(int axis) const { return m_sizes[axis]; }
+		size_t SpectrumWidth() const { return m_sizes[0] / 2 + 1; }
+		size_t SpectrumCount() const { return SpectrumWidth() * m_sizes[1] * m_sizes[2]; }
+
+	private:
+		// The y and z passes - every line of one axis of the spectrum
+		void TransformAxis(Complex* spectrum, int axis, bool inverse) const;
+
+		size_t				m_sizes[3];
+		FourierTransform	m_x;
+		FourierTransform	m_y;
+		FourierTransform	m_z;
+	};
+}
@@ -0,0 +1,783 @@
+#include "pch.h"
+#include "FrameServer.h"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstring>
+#include <ppl.h>
+#include <stdexcept>
+#include <string>
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "Ws2_32.lib")
+#else
+#include <arpa/inet.h>
+#include <cerrno>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+namespace Simulation
+{
+	using namespace FrameStreamFormat;
+
+#if defined(_WIN32)
+	using SocketHandle = SOCKET;
+	static const SocketHandle InvalidSocket = INVALID_SOCKET;
+	static const int SendFlags = 0;
+
+	static void CloseSocket(SocketHandle socket) { closesocket(socket); }
+	static bool WouldBlock() { return WSAGetLastError() == WSAEWOULDBLOCK; }
+	static int PollSockets(pollfd* sockets, size_t count, int timeout) { return WSAPoll(sockets, static_cast<ULONG>(count), timeout); }
+
+	static bool SetNonBlocking(SocketHandle socket)
+	{
+		u_long enable = 1;
+		return ioctlsocket(socket, FIONBIO, &enable) == 0;
+	}
+#else
+	using SocketHandle = int;
+	static const SocketHandle InvalidSocket = -1;
+	static const int SendFlags = MSG_NOSIGNAL;		// A client that hung up must not kill the process
+
+	static void CloseSocket(SocketHandle socket) { close(socket); }
+	static bool WouldBlock() { return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR; }
+	static int PollSockets(pollfd* sockets, size_t count, int timeout) { return poll(sockets, static_cast<nfds_t>(count), timeout); }
+
+	static bool SetNonBlocking(SocketHandle socket)
+	{
+		int flags = fcntl(socket, F_GETFL, 0);
+		return flags >= 0 && fcntl(socket, F_SETFL, flags | O_NONBLOCK) == 0;
+	}
+#endif
+
+	// How long the server thread sleeps in poll - also the most a new frame waits before it is sent
+	static const int PollInterval = 2;
+
+	// Atoms gathered per task when a client's selection is copied out of the frame
+	static const size_t GatherBlock = 16384;
+
+	// Largest WebSocket handshake request accepted
+	static const size_t MaxHandshake = 8192;
+
+	enum class Transport
+	{
+		Unknown,		// Nothing received yet
+		Raw,			// Length prefixed messages
+		WebSocket
+	};
+
+	struct FrameServer::Client
+	{
+		SocketHandle							socket = InvalidSocket;
+		Transport								transport = Transport::Unknown;
+		std::vector<uint8_t>					inbound;
+		std::vector<uint8_t>					outbound;
+		size_t									outboundSent = 0;
+		bool									closing = false;		// Disconnect once outbound is sent
+		bool									subscribed = false;
+		Subscription							subscription;
+		bool									selectionChanged = false;
+
+		// What the client has - delta frames are coded against this
+		bool									hasBaseline = false;
+		std::vector<uint32_t>					indices;
+		std::vector<uint32_t>					previous;
+		std::vector<uint32_t>					quantized;
+		std::vector<uint8_t>					elements;
+		XMFLOAT3								boxDimensions = XMFLOAT3(0.0f, 0.0f, 0.0f);
+		size_t									simulationAtoms = 0;
+		unsigned int							framesSinceKeyframe = 0;
+		bool									sentAny = false;
+		uint64_t								lastFrame = 0;
+		std::chrono::steady_clock::time_point	lastSent;
+	};
+
+	// SHA-1 of the WebSocket handshake - not used for anything else
+	static void Sha1(const uint8_t* data, size_t size, uint8_t digest[20])
+	{
+		uint32_t state[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+
+		std::vector<uint8_t> message(data, data + size);
+		message.push_back(0x80);
+		while (message.size() % 64 != 56)
+			message.push_back(0);
+		const uint64_t bits = static_cast<uint64_t>(size) * 8;
+		for (int shift = 56; shift >= 0; shift -= 8)
+			message.push_back(static_cast<uint8_t>(bits >> shift));
+
+		auto rotate = [](uint32_t value, int count) { return (value << count) | (value >> (32 - count)); };
+		for (size_t block = 0; block < message.size(); block += 64)
+		{
+			uint32_t w[80];
+			for (int iii = 0; iii < 16; ++iii)
+			{
+				const uint8_t* word = &message[block + 4 * iii];
+				w[iii] = (uint32_t(word[0]) << 24) | (uint32_t(word[1]) << 16) | (uint32_t(word[2]) << 8) | word[3];
+			}
+			for (int iii = 16; iii < 80; ++iii)
+				w[iii] = rotate(w[iii - 3] ^ w[iii - 8] ^ w[iii - 14] ^ w[iii - 16], 1);
+
+			uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+			for (int iii = 0; iii < 80; ++iii)
+			{
+				uint32_t f, k;
+				if (iii < 20)		{ f = (b & c) | (~b & d);			k = 0x5A827999; }
+				else if (iii < 40)	{ f = b ^ c ^ d;					k = 0x6ED9EBA1; }
+				else if (iii < 60)	{ f = (b & c) | (b & d) | (c & d);	k = 0x8F1BBCDC; }
+				else				{ f = b ^ c ^ d;					k = 0xCA62C1D6; }
+
+				uint32_t temp = rotate(a, 5) + f + e + k + w[iii];
+				e = d;
+				d = c;
+				c = rotate(b, 30);
+				b = a;
+				a = temp;
+			}
+			state[0] += a;
+			state[1] += b;
+			state[2] += c;
+			state[3] += d;
+			state[4] += e;
+		}
+
+		for (int iii = 0; iii < 5; ++iii)
+		{
+			digest[4 * iii + 0] = static_cast<uint8_t>(state[iii] >> 24);
+			digest[4 * iii + 1] = static_cast<uint8_t>(state[iii] >> 16);
+			digest[4 * iii + 2] = static_cast<uint8_t>(state[iii] >> 8);
+			digest[4 * iii + 3] = static_cast<uint8_t>(state[iii]);
+		}
+	}
+
+	static std::string Base64(const uint8_t* data, size_t size)
+	{
+		static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+		std::string out;
+		for (size_t iii = 0; iii < size; iii += 3)
+		{
+			uint32_t value = uint32_t(data[iii]) << 16;
+			if (iii + 1 < size) value |= uint32_t(data[iii + 1]) << 8;
+			if (iii + 2 < size) value |= data[iii + 2];
+
+			out.push_back(alphabet[(value >> 18) & 63]);
+			out.push_back(alphabet[(value >> 12) & 63]);
+			out.push_back(iii + 1 < size ? alphabet[(value >> 6) & 63] : '=');
+			out.push_back(iii + 2 < size ? alphabet[value & 63] : '=');
+		}
+		return out;
+	}
+
+	FrameServer::FrameServer(const FrameServerSettings& settings) :
+		m_settings(settings),
+		m_listener(static_cast<intptr_t>(InvalidSocket)),
+		m_port(0),
+		m_stepsSinceFrame(0),
+		m_spare(new Frame()),
+		m_latest(new Frame()),
+		m_current(new Frame()),
+		m_hasLatest(false),
+		m_framesSubmitted(0),
+		m_quantizedFrame(UINT64_MAX),
+		m_stopping(false),
+		m_clientCount(0),
+		m_framesSent(0),
+		m_framesSkipped(0),
+		m_bytesSent(0)
+	{
+		m_settings.maxClients = std::max(1u, m_settings.maxClients);
+		m_settings.frameInterval = std::max(1u, m_settings.frameInterval);
+		m_settings.keyframeInterval = std::max(1u, m_settings.keyframeInterval);
+		m_settings.atomsPerChunk = std::max(1u, m_settings.atomsPerChunk);
+		m_settings.positionBits = std::min(std::max(m_settings.positionBits, TrajectoryFormat::MinPositionBits), TrajectoryFormat::MaxPositionBits);
+
+#if defined(_WIN32)
+		WSADATA data;
+		if (WSAStartup(MAKEWORD(2, 2), &data) != 0)
+			throw std::runtime_error("FrameServer: unable to initialize Winsock");
+#endif
+
+		SocketHandle listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (listener == InvalidSocket)
+		{
+#if defined(_WIN32)
+			WSACleanup();
+#endif
+			throw std::runtime_error("FrameServer: unable to create the server socket");
+		}
+
+#if !defined(_WIN32)
+		// Restarting the server must not have to wait for the old connections to time out
+		int reuse = 1;
+		setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+#endif
+
+		sockaddr_in address = {};
+		address.sin_family = AF_INET;
+		address.sin_port = htons(m_settings.port);
+		address.sin_addr.s_addr = htonl(m_settings.loopbackOnly ? INADDR_LOOPBACK : INADDR_ANY);
+
+		socklen_t addressSize = sizeof(address);
+		if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, SOMAXCONN) != 0 ||
+			getsockname(listener, reinterpret_cast<sockaddr*>(&address), &addressSize) != 0 || !SetNonBlocking(listener))
+		{
+			CloseSocket(listener);
+#if defined(_WIN32)
+			WSACleanup();
+#endif
+			throw std::runtime_error("FrameServer: unable to listen on the port");
+		}
+
+		m_listener = static_cast<intptr_t>(listener);
+		m_port = ntohs(address.sin_port);
+
+		m_server = std::thread(&FrameServer::ServerThread, this);
+	}
+
+	FrameServer::~FrameServer()
+	{
+		m_stopping = true;
+		if (m_server.joinable())
+			m_server.join();
+
+		for (std::unique_ptr<Client>& client : m_clients)
+			CloseSocket(client->socket);
+		CloseSocket(static_cast<SocketHandle>(m_listener));
+
+#if defined(_WIN32)
+		WSACleanup();
+#endif
+	}
+
+	void FrameServer::SubmitFrame(unsigned long long step, double time, XMFLOAT3 boxDimensions, const std::vector<Atom*>& atoms)
+	{
+		if (m_stepsSinceFrame++ % m_settings.frameInterval != 0 || m_clientCount == 0)
+			return;
+
+		// m_spare belongs to the simulation thread until it is swapped in below
+		Frame& frame = *m_spare;
+		frame.step = step;
+		frame.time = time;
+		frame.boxDimensions = boxDimensions;
+		frame.positions.resize(atoms.size());
+		frame.elements.resize(atoms.size());
+
+		const size_t blocks = (atoms.size() + GatherBlock - 1) / GatherBlock;
+		concurrency::parallel_for(size_t(0), blocks, [&](size_t block)
+			{
+				size_t end = std::min(atoms.size(), (block + 1) * GatherBlock);
+				for (size_t iii = block * GatherBlock; iii < end; ++iii)
+				{
+					frame.positions[iii] = atoms[iii]->Position();
+					frame.elements[iii] = static_cast<uint8_t>(atoms[iii]->Element());
+				}
+			});
+
+		// An unsent older frame is simply replaced - clients only ever want the newest one
+		std::lock_guard<std::mutex> lock(m_mutex);
+		frame.frame = m_framesSubmitted++;
+		m_spare.swap(m_latest);
+		m_hasLatest = true;
+	}
+
+	FrameServerStatistics FrameServer::Statistics()
+	{
+		FrameServerStatistics statistics;
+		statistics.clients = m_clientCount;
+		statistics.framesSent = m_framesSent;
+		statistics.framesSkipped = m_framesSkipped;
+		statistics.bytesSent = m_bytesSent;
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		statistics.framesSubmitted = m_framesSubmitted;
+		return statistics;
+	}
+
+	void FrameServer::ServerThread()
+	{
+		bool hasFrame = false;
+		std::vector<pollfd> sockets;
+		while (!m_stopping)
+		{
+			sockets.resize(1 + m_clients.size());
+			sockets[0].fd = static_cast<SocketHandle>(m_listener);
+			sockets[0].events = POLLIN;
+			sockets[0].revents = 0;
+			for (size_t iii = 0; iii < m_clients.size(); ++iii)
+			{
+				const Client& client = *m_clients[iii];
+				sockets[1 + iii].fd = client.socket;
+				sockets[1 + iii].events = static_cast<short>(POLLIN | (client.outbound.empty() ? 0 : POLLOUT));
+				sockets[1 + iii].revents = 0;
+			}
+
+			PollSockets(sockets.data(), sockets.size(), PollInterval);
+
+			std::vector<bool> dropped(m_clients.size(), false);
+			for (size_t iii = 0; iii < m_clients.size(); ++iii)
+			{
+				if ((sockets[1 + iii].revents & (POLLIN | POLLHUP | POLLERR)) != 0 && !Receive(*m_clients[iii]))
+					dropped[iii] = true;
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				if (m_hasLatest)
+				{
+					m_current.swap(m_latest);
+					m_hasLatest = false;
+					hasFrame = true;
+				}
+			}
+
+			// Only clients whose previous frame has left the socket get the new one - that is the
+			// whole of the rate adaptation
+			const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+			for (size_t iii = 0; iii < m_clients.size(); ++iii)
+			{
+				Client& client = *m_clients[iii];
+				if (dropped[iii] || !hasFrame || !client.subscribed || client.closing || !client.outbound.empty())
+					continue;
+				if (client.sentAny && client.lastFrame == m_current->frame)
+					continue;
+				if (client.sentAny && client.subscription.maxFrameRate > 0.0f &&
+					std::chrono::duration<float>(now - client.lastSent).count() < 1.0f / client.subscription.maxFrameRate)
+					continue;
+
+				SendFrame(client, *m_current);
+			}
+
+			for (size_t iii = 0; iii < m_clients.size(); ++iii)
+			{
+				Client& client = *m_clients[iii];
+				if (!dropped[iii] && !Flush(client))
+					dropped[iii] = true;
+				if (client.closing && client.outbound.empty())
+					dropped[iii] = true;
+			}
+
+			size_t kept = 0;
+			for (size_t iii = 0; iii < m_clients.size(); ++iii)
+			{
+				if (dropped[iii])
+					CloseSocket(m_clients[iii]->socket);
+				else
+					m_clients[kept++] = std::move(m_clients[iii]);
+			}
+			m_clients.resize(kept);
+
+			if ((sockets[0].revents & POLLIN) != 0)
+				Accept();
+
+			m_clientCount = static_cast<unsigned int>(m_clients.size());
+		}
+	}
+
+	void FrameServer::Accept()
+	{
+		while (true)
+		{
+			SocketHandle socket = accept(static_cast<SocketHandle>(m_listener), nullptr, nullptr);
+			if (socket == InvalidSocket)
+				return;
+
+			if (m_clients.size() >= m_settings.maxClients || !SetNonBlocking(socket))
+			{
+				CloseSocket(socket);
+				continue;
+			}
+
+			// Frames are sent whole - do not hold back their tails
+			int noDelay = 1;
+			setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&noDelay), sizeof(noDelay));
+
+			std::unique_ptr<Client> client(new Client());
+			client->socket = socket;
+			m_clients.push_back(std::move(client));
+		}
+	}
+
+	bool FrameServer::Receive(Client& client)
+	{
+		uint8_t buffer[4096];
+		while (true)
+		{
+			int received = recv(client.socket, reinterpret_cast<char*>(buffer), sizeof(buffer), 0);
+			if (received == 0)
+				return false;		// Disconnected
+			if (received < 0)
+			{
+				if (WouldBlock())
+					break;
+				return false;
+			}
+
+			client.inbound.insert(client.inbound.end(), buffer, buffer + received);
+			if (client.inbound.size() > MaxClientMessage + MaxHandshake)
+				return false;
+		}
+
+		if (client.transport == Transport::Unknown)
+		{
+			if (client.inbound.size() < 4)
+				return true;
+
+			// A WebSocket starts with an HTTP request, anything else is the raw protocol
+			if (std::memcmp(client.inbound.data(), "GET ", 4) != 0)
+				client.transport = Transport::Raw;
+			else if (!Handshake(client))
+				return false;
+			else if (client.transport == Transport::Unknown)
+				return true;		// Rest of the request still to come
+		}
+
+		size_t offset = 0;
+		const uint8_t* data = client.inbound.data();
+		const size_t size = client.inbound.size();
+		if (client.transport == Transport::Raw)
+		{
+			while (size - offset >= sizeof(uint32_t))
+			{
+				uint32_t length;
+				std::memcpy(&length, data + offset, sizeof(length));
+				if (length > MaxClientMessage)
+					return false;
+				if (size - offset - sizeof(length) < length)
+					break;
+
+				if (!HandleMessage(client, data + offset + sizeof(length), length))
+					return false;
+				offset += sizeof(length) + length;
+			}
+		}
+		else
+		{
+			while (size - offset >= 2 && !client.closing)
+			{
+				const bool final = (data[offset] & 0x80) != 0;
+				const uint8_t opcode = data[offset] & 0x0F;
+				const bool masked = (data[offset + 1] & 0x80) != 0;
+				uint64_t length = data[offset + 1] & 0x7F;
+
+				size_t header = 2;
+				if (length == 126)
+				{
+					if (size - offset < 4)
+						break;
+					length = (uint64_t(data[offset + 2]) << 8) | data[offset + 3];
+					header = 4;
+				}
+				else if (length == 127)
+				{
+					if (size - offset < 10)
+						break;
+					length = 0;
+					for (int iii = 0; iii < 8; ++iii)
+						length = (length << 8) | data[offset + 2 + iii];
+					header = 10;
+				}
+
+				// Clients must mask what they send; fragmented messages are not needed for subscribing
+				if (!masked || length > MaxClientMessage || (!final && opcode < 0x8) || opcode == 0x0)
+					return false;
+				if (size - offset < header + 4 + length)
+					break;
+
+				uint8_t* payload = client.inbound.data() + offset + header + 4;
+				const uint8_t* mask = data + offset + header;
+				for (size_t iii = 0; iii < length; ++iii)
+					payload[iii] ^= mask[iii % 4];
+
+				if (opcode == 0x1 || opcode == 0x2)
+				{
+					if (!HandleMessage(client, payload, static_cast<size_t>(length)))
+						return false;
+				}
+				else if (opcode == 0x8)
+				{
+					QueueWebSocketFrame(client, 0x8, nullptr, 0);
+					client.closing = true;
+				}
+				else if (opcode == 0x9)
+				{
+					QueueWebSocketFrame(client, 0xA, payload, static_cast<size_t>(length));
+				}
+				offset += header + 4 + static_cast<size_t>(length);
+			}
+		}
+
+		client.inbound.erase(client.inbound.begin(), client.inbound.begin() + offset);
+		return true;
+	}
+
+	bool FrameServer::Handshake(Client& client)
+	{
+		static const char terminator[] = "\r\n\r\n";
+		auto end = std::search(client.inbound.begin(), client.inbound.end(), terminator, terminator + 4);
+		if (end == client.inbound.end())
+			return client.inbound.size() <= MaxHandshake;
+
+		std::string request(client.inbound.begin(), end + 2);
+		std::string lower(request);
+		std::transform(lower.begin(), lower.end(), lower.begin(), [](char c) { return static_cast<char>(std::tolower(static_cast<unsigned char>(c))); });
+
+		static const std::string field = "\r\nsec-websocket-key:";
+		size_t start = lower.find(field);
+		if (start == std::string::npos)
+			return false;
+		start += field.size();
+		size_t stop = request.find("\r\n", start);
+
+		std::string key = request.substr(start, stop - start);
+		key.erase(0, key.find_first_not_of(" \t"));
+		key.erase(key.find_last_not_of(" \t") + 1);
+		if (key.empty())
+			return false;
+
+		// RFC 6455 - the accept value proves the server understood the upgrade
+		std::string accept = key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+		uint8_t digest[20];
+		Sha1(reinterpret_cast<const uint8_t*>(accept.data()), accept.size(), digest);
+
+		std::string response =
+			"HTTP/1.1 101 Switching Protocols\r\n"
+			"Upgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Accept: " + Base64(digest, sizeof(digest)) + "\r\n\r\n";
+		client.outbound.insert(client.outbound.end(), response.begin(), response.end());
+
+		client.inbound.erase(client.inbound.begin(), end + 4);
+		client.transport = Transport::WebSocket;
+		return true;
+	}
+
+	bool FrameServer::HandleMessage(Client& client, const uint8_t* message, size_t size)
+	{
+		// Unknown messages are ignored, so newer clients can talk to this server
+		if (size == 0 || message[0] != SubscribeType)
+			return true;
+
+		Subscription subscription;
+		if (!DecodeSubscription(message, size, subscription))
+			return false;
+
+		if (!client.subscribed)
+		{
+			HelloMessage hello = {};
+			hello.type = HelloType;
+			hello.positionBits = static_cast<uint8_t>(m_settings.positionBits);
+			hello.version = Version;
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				hello.atomCount = static_cast<uint32_t>((m_hasLatest ? m_latest : m_current)->positions.size());
+			}
+			QueueMessage(client, reinterpret_cast<const uint8_t*>(&hello), sizeof(hello));
+			client.subscribed = true;
+		}
+
+		client.subscription = std::move(subscription);
+		client.selectionChanged = true;
+		return true;
+	}
+
+	void FrameServer::SendFrame(Client& client, const Frame& frame)
+	{
+		const size_t atomCount = frame.positions.size();
+
+		// Quantized once per frame, however many clients there are
+		if (m_quantizedFrame != frame.frame)
+		{
+			m_quantized.resize(3 * atomCount);
+			TrajectoryFormat::Quantize(frame.positions.data(), atomCount, frame.boxDimensions, m_settings.positionBits, m_quantized.data());
+			m_quantizedFrame = frame.frame;
+		}
+
+		const bool keyframe = !client.hasBaseline || client.selectionChanged || client.framesSinceKeyframe >= m_settings.keyframeInterval ||
+			client.simulationAtoms != atomCount || std::memcmp(&client.boxDimensions, &frame.boxDimensions, sizeof(XMFLOAT3)) != 0;
+
+		// The selection is only picked on keyframes - a region keeps the atoms it had until the next one
+		std::vector<std::pair<uint32_t, uint32_t>> ranges;
+		if (keyframe)
+		{
+			const Subscription& subscription = client.subscription;
+			client.indices.clear();
+			if (subscription.selection == Selection::All)
+			{
+				client.indices.resize(atomCount);
+				for (size_t iii = 0; iii < atomCount; ++iii)
+					client.indices[iii] = static_cast<uint32_t>(iii);
+			}
+			else if (subscription.selection == Selection::Ranges)
+			{
+				for (const std::pair<uint32_t, uint32_t>& range : subscription.ranges)
+				{
+					size_t end = std::min<size_t>(atomCount, static_cast<size_t>(range.first) + range.second);
+					for (size_t iii = range.first; iii < end; ++iii)
+						client.indices.push_back(static_cast<uint32_t>(iii));
+				}
+			}
+			else
+			{
+				const XMFLOAT3 low = subscription.regionMin;
+				const XMFLOAT3 high = subscription.regionMax;
+				for (size_t iii = 0; iii < atomCount; ++iii)
+				{
+					const XMFLOAT3& p = frame.positions[iii];
+					if (p.x >= low.x && p.x <= high.x && p.y >= low.y && p.y <= high.y && p.z >= low.z && p.z <= high.z)
+						client.indices.push_back(static_cast<uint32_t>(iii));
+				}
+			}
+
+			for (uint32_t index : client.indices)
+			{
+				if (!ranges.empty() && ranges.back().first + ranges.back().second == index)
+					++ranges.back().second;
+				else
+					ranges.push_back({ index, 1 });
+			}
+		}
+
+		const uint32_t count = static_cast<uint32_t>(client.indices.size());
+		client.quantized.resize(3 * static_cast<size_t>(count));
+		if (keyframe)
+			client.elements.resize(count);
+
+		const size_t blocks = (count + GatherBlock - 1) / GatherBlock;
+		concurrency::parallel_for(size_t(0), blocks, [&](size_t block)
+			{
+				size_t end = std::min<size_t>(count, (block + 1) * GatherBlock);
+				for (size_t iii = block * GatherBlock; iii < end; ++iii)
+				{
+					const uint32_t* source = &m_quantized[3 * static_cast<size_t>(client.indices[iii])];
+					client.quantized[3 * iii + 0] = source[0];
+					client.quantized[3 * iii + 1] = source[1];
+					client.quantized[3 * iii + 2] = source[2];
+					if (keyframe)
+						client.elements[iii] = frame.elements[client.indices[iii]];
+				}
+			});
+
+		// Same chunk coding as the trajectory recorder, chunks encoded in parallel
+		const uint32_t chunkCount = (count + m_settings.atomsPerChunk - 1) / m_settings.atomsPerChunk;
+		m_chunks.resize(chunkCount);
+		concurrency::parallel_for(0u, chunkCount, [&](uint32_t chunk)
+			{
+				uint32_t firstAtom = chunk * m_settings.atomsPerChunk;
+				uint32_t chunkAtoms = std::min(m_settings.atomsPerChunk, count - firstAtom);
+
+				m_chunks[chunk].clear();
+				TrajectoryFormat::EncodeChunk(client.quantized.data(), keyframe ? nullptr : client.previous.data(),
+					client.elements.data(), firstAtom, chunkAtoms, m_chunks[chunk]);
+			});
+
+		FrameMessage header = {};
+		header.type = FrameType;
+		header.flags = keyframe ? FrameKeyframe : 0;
+		header.atomCount = count;
+		header.frame = frame.frame;
+		header.step = frame.step;
+		header.time = frame.time;
+		header.boxDimensions[0] = frame.boxDimensions.x;
+		header.boxDimensions[1] = frame.boxDimensions.y;
+		header.boxDimensions[2] = frame.boxDimensions.z;
+		header.rangeCount = static_cast<uint32_t>(ranges.size());
+
+		size_t size = sizeof(header) + ranges.size() * 2 * sizeof(uint32_t);
+		for (const std::vector<uint8_t>& chunk : m_chunks)
+			size += chunk.size();
+
+		std::vector<uint8_t> message;
+		message.reserve(size);
+		message.insert(message.end(), reinterpret_cast<const uint8_t*>(&header), reinterpret_cast<const uint8_t*>(&header) + sizeof(header));
+		for (const std::pair<uint32_t, uint32_t>& range : ranges)
+		{
+			message.insert(message.end(), reinterpret_cast<const uint8_t*>(&range.first), reinterpret_cast<const uint8_t*>(&range.first) + sizeof(uint32_t));
+			message.insert(message.end(), reinterpret_cast<const uint8_t*>(&range.second), reinterpret_cast<const uint8_t*>(&range.second) + sizeof(uint32_t));
+		}
+		for (const std::vector<uint8_t>& chunk : m_chunks)
+			message.insert(message.end(), chunk.begin(), chunk.end());
+
+		QueueMessage(client, message.data(), message.size());
+
+		if (client.sentAny && frame.frame > client.lastFrame + 1)
+			m_framesSkipped += frame.frame - client.lastFrame - 1;
+
+		client.previous.swap(client.quantized);
+		client.hasBaseline = true;
+		client.selectionChanged = false;
+		client.framesSinceKeyframe = keyframe ? 1 : client.framesSinceKeyframe + 1;
+		client.simulationAtoms = atomCount;
+		client.boxDimensions = frame.boxDimensions;
+		client.sentAny = true;
+		client.lastFrame = frame.frame;
+		client.lastSent = std::chrono::steady_clock::now();
+		++m_framesSent;
+	}
+
+	void FrameServer::QueueMessage(Client& client, const uint8_t* data, size_t size)
+	{
+		if (client.transport == Transport::WebSocket)
+		{
+			QueueWebSocketFrame(client, 0x2, data, size);
+			return;
+		}
+
+		uint32_t length = static_cast<uint32_t>(size);
+		client.outbound.insert(client.outbound.end(), reinterpret_cast<const uint8_t*>(&length), reinterpret_cast<const uint8_t*>(&length) + sizeof(length));
+		client.outbound.insert(client.outbound.end(), data, data + size);
+	}
+
+	void FrameServer::QueueWebSocketFrame(Client& client, uint8_t opcode, const uint8_t* data, size_t size)
+	{
+		// Server frames are never masked
+		uint8_t header[10];
+		size_t headerSize = 2;
+		header[0] = static_cast<uint8_t>(0x80 | opcode);
+		if (size < 126)
+			header[1] = static_cast<uint8_t>(size);
+		else if (size <= 0xFFFF)
+		{
+			header[1] = 126;
+			header[2] = static_cast<uint8_t>(size >> 8);
+			header[3] = static_cast<uint8_t>(size);
+			headerSize = 4;
+		}
+		else
+		{
+			header[1] = 127;
+			for (int iii = 0; iii < 8; ++iii)
+				header[2 + iii] = static_cast<uint8_t>(static_cast<uint64_t>(size) >> (56 - 8 * iii));
+			headerSize = 10;
+		}
+
+		client.outbound.insert(client.outbound.end(), header, header + headerSize);
+		if (size != 0)
+			client.outbound.insert(client.outbound.end(), data, data + size);
+	}
+
+	bool FrameServer::Flush(Client& client)
+	{
+		while (client.outboundSent < client.outbound.size())
+		{
+			size_t remaining = client.outbound.size() - client.outboundSent;
+			int sent = send(client.socket, reinterpret_cast<const char*>(client.outbound.data() + client.outboundSent),
+				static_cast<int>(std::min<size_t>(remaining, INT32_MAX)), SendFlags);
+			if (sent < 0)
+				return WouldBlock();
+
+			client.outboundSent += sent;
+			m_bytesSent += sent;
+		}
+
+		client.outbound.clear();
+		client.outboundSent = 0;
+		return true;
+	}
+}
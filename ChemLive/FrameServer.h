@@ -0,0 +1,107 @@
+#pragma once
+
+#include "pch.h"
+#include "Atom.h"
+#include "FrameStream.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Simulation
+{
+	struct FrameServerSettings
+	{
+		uint16_t		port = 8765;				// 0 picks a free port - see FrameServer::Port
+		bool			loopbackOnly = true;		// Only accept connections from this machine
+		unsigned int	maxClients = 16;
+		unsigned int	frameInterval = 1;			// Offer every Nth simulation step to the clients
+		unsigned int	positionBits = 16;			// Quantization per axis, relative to the box
+		unsigned int	keyframeInterval = 60;		// Frames sent to a client between its keyframes
+		unsigned int	atomsPerChunk = 65536;		// Atoms per independently compressed chunk
+	};
+
+	struct FrameServerStatistics
+	{
+		unsigned int		clients;
+		unsigned long long	framesSubmitted;		// Frames offered by the simulation
+		unsigned long long	framesSent;				// Summed over all clients
+		unsigned long long	framesSkipped;			// Frames a client was still busy with the previous one for
+		unsigned long long	bytesSent;
+	};
+
+	/*
+	*	Streams live frames to remote viewers over TCP or WebSocket (see FrameStream.h for the
+	*	protocol). The simulation thread only copies positions into a spare buffer; a server thread
+	*	serves every client from the newest frame. A client is encoded a new frame only once the
+	*	previous one has left its socket, so a slow client is sent fewer frames - it never holds up
+	*	the simulation, the other clients, or its own view of the newest frame.
+	*/
+	class FrameServer
+	{
+	public:
+		// Throws std::runtime_error if the port cannot be opened
+		FrameServer(const FrameServerSettings& settings = FrameServerSettings());
+		~FrameServer();		// Disconnects every client
+
+		FrameServer(const FrameServer&) = delete;
+		FrameServer& operator=(const FrameServer&) = delete;
+
+		// Called from Simulation::Update after every step
+		void SubmitFrame(unsigned long long step, double time, XMFLOAT3 boxDimensions, const std::vector<Atom*>& atoms);
+
+		// GET
+		uint16_t				Port() { return m_port; }
+		FrameServerStatistics	Statistics();
+
+	private:
+		struct Frame
+		{
+			uint64_t				frame;
+			unsigned long long		step;
+			double					time;
+			XMFLOAT3				boxDimensions;
+			std::vector<XMFLOAT3>	positions;
+			std::vector<uint8_t>	elements;
+		};
+
+		struct Client;		// Connection state - see FrameServer.cpp
+
+		void ServerThread();
+		void Accept();
+		bool Receive(Client& client);
+		bool HandleMessage(Client& client, const uint8_t* message, size_t size);
+		bool Handshake(Client& client);
+		void SendFrame(Client& client, const Frame& frame);
+		void QueueMessage(Client& client, const uint8_t* data, size_t size);		// Adds the transport framing
+		void QueueWebSocketFrame(Client& client, uint8_t opcode, const uint8_t* data, size_t size);
+		bool Flush(Client& client);
+
+		FrameServerSettings						m_settings;
+		intptr_t								m_listener;			// SOCKET / file descriptor
+		uint16_t								m_port;
+		unsigned long long						m_stepsSinceFrame;
+
+		// Triple buffer between the simulation thread and the server thread
+		std::mutex								m_mutex;
+		std::unique_ptr<Frame>					m_spare;			// Filled by SubmitFrame
+		std::unique_ptr<Frame>					m_latest;			// Newest complete frame
+		std::unique_ptr<Frame>					m_current;			// Being sent by the server thread
+		bool									m_hasLatest;
+		uint64_t								m_framesSubmitted;
+
+		// Server thread only
+		std::vector<std::unique_ptr<Client>>	m_clients;
+		std::vector<uint32_t>					m_quantized;		// m_current, quantized once for every client
+		uint64_t								m_quantizedFrame;
+		std::vector<std::vector<uint8_t>>		m_chunks;
+
+		std::atomic<bool>						m_stopping;
+		std::atomic<unsigned int>				m_clientCount;
+		std::atomic<unsigned long long>			m_framesSent;
+		std::atomic<unsigned long long>			m_framesSkipped;
+		std::atomic<unsigned long long>			m_bytesSent;
+		std::thread								m_server;
+	};
+}
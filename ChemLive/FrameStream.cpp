@@ -0,0 +1,180 @@
+#include "pch.h"
+#include "FrameStream.h"
+#include <cstring>
+
+namespace Simulation
+{
+	namespace FrameStreamFormat
+	{
+		std::vector<uint8_t> EncodeSubscription(const Subscription& subscription)
+		{
+			SubscribeMessage message = {};
+			message.type = SubscribeType;
+			message.selection = static_cast<uint8_t>(subscription.selection);
+			message.maxFrameRate = subscription.maxFrameRate;
+			message.regionMin[0] = subscription.regionMin.x;
+			message.regionMin[1] = subscription.regionMin.y;
+			message.regionMin[2] = subscription.regionMin.z;
+			message.regionMax[0] = subscription.regionMax.x;
+			message.regionMax[1] = subscription.regionMax.y;
+			message.regionMax[2] = subscription.regionMax.z;
+			message.rangeCount = static_cast<uint32_t>(subscription.ranges.size());
+
+			std::vector<uint8_t> out(sizeof(message) + subscription.ranges.size() * 2 * sizeof(uint32_t));
+			std::memcpy(out.data(), &message, sizeof(message));
+
+			uint8_t* cursor = out.data() + sizeof(message);
+			for (const std::pair<uint32_t, uint32_t>& range : subscription.ranges)
+			{
+				std::memcpy(cursor, &range.first, sizeof(uint32_t));
+				std::memcpy(cursor + sizeof(uint32_t), &range.second, sizeof(uint32_t));
+				cursor += 2 * sizeof(uint32_t);
+			}
+			return out;
+		}
+
+		bool DecodeSubscription(const uint8_t* data, size_t size, Subscription& subscription)
+		{
+			SubscribeMessage message;
+			if (size < sizeof(message))
+				return false;
+			std::memcpy(&message, data, sizeof(message));
+
+			if (message.type != SubscribeType || message.selection > static_cast<uint8_t>(Selection::Region))
+				return false;
+			if (size != sizeof(message) + static_cast<uint64_t>(message.rangeCount) * 2 * sizeof(uint32_t))
+				return false;
+
+			subscription.selection = static_cast<Selection>(message.selection);
+			subscription.maxFrameRate = message.maxFrameRate > 0.0f ? message.maxFrameRate : 0.0f;
+			subscription.regionMin = XMFLOAT3(message.regionMin[0], message.regionMin[1], message.regionMin[2]);
+			subscription.regionMax = XMFLOAT3(message.regionMax[0], message.regionMax[1], message.regionMax[2]);
+			subscription.ranges.resize(message.rangeCount);
+
+			const uint8_t* cursor = data + sizeof(message);
+			for (std::pair<uint32_t, uint32_t>& range : subscription.ranges)
+			{
+				std::memcpy(&range.first, cursor, sizeof(uint32_t));
+				std::memcpy(&range.second, cursor + sizeof(uint32_t), sizeof(uint32_t));
+				cursor += 2 * sizeof(uint32_t);
+			}
+			return true;
+		}
+	}
+
+	using namespace FrameStreamFormat;
+
+	FrameStreamDecoder::FrameStreamDecoder() :
+		m_positionBits(0),
+		m_atomCount(0),
+		m_hasFrame(false),
+		m_framesDecoded(0),
+		m_framesSkipped(0)
+	{
+		m_frame.frame = 0;
+		m_frame.step = 0;
+		m_frame.time = 0.0;
+		m_frame.boxDimensions = XMFLOAT3(0.0f, 0.0f, 0.0f);
+	}
+
+	bool FrameStreamDecoder::Decode(const uint8_t* message, size_t size)
+	{
+		if (size == 0)
+			return false;
+
+		if (message[0] == HelloType)
+		{
+			HelloMessage hello;
+			if (size < sizeof(hello))
+				return false;
+			std::memcpy(&hello, message, sizeof(hello));
+			if (hello.version != Version || hello.positionBits < TrajectoryFormat::MinPositionBits || hello.positionBits > TrajectoryFormat::MaxPositionBits)
+				return false;
+
+			// Starts a new stream - the next frame is a keyframe
+			m_positionBits = hello.positionBits;
+			m_atomCount = hello.atomCount;
+			m_hasFrame = false;
+			return false;
+		}
+
+		FrameMessage header;
+		if (message[0] != FrameType || size < sizeof(header) || !Connected())
+			return false;
+		std::memcpy(&header, message, sizeof(header));
+
+		const bool keyframe = (header.flags & FrameKeyframe) != 0;
+		const uint8_t* cursor = message + sizeof(header);
+		const uint8_t* end = message + size;
+
+		std::vector<uint32_t> indices;
+		if (keyframe)
+		{
+			if (static_cast<uint64_t>(end - cursor) < static_cast<uint64_t>(header.rangeCount) * 2 * sizeof(uint32_t))
+				return false;
+
+			indices.reserve(header.atomCount);
+			for (uint32_t range = 0; range < header.rangeCount; ++range)
+			{
+				uint32_t first, count;
+				std::memcpy(&first, cursor, sizeof(uint32_t));
+				std::memcpy(&count, cursor + sizeof(uint32_t), sizeof(uint32_t));
+				cursor += 2 * sizeof(uint32_t);
+
+				if (count > header.atomCount - indices.size())
+					return false;
+				for (uint32_t iii = 0; iii < count; ++iii)
+					indices.push_back(first + iii);
+			}
+			if (indices.size() != header.atomCount)
+				return false;
+
+			m_elements.resize(header.atomCount);
+		}
+		else if (!m_hasFrame || m_frame.indices.size() != header.atomCount)
+			return false;
+
+		// Decode into a scratch buffer, so a bad frame leaves the previous one intact
+		m_decoded.resize(3 * static_cast<size_t>(header.atomCount));
+		uint64_t atomsDecoded = 0;
+		while (cursor < end)
+		{
+			TrajectoryFormat::ChunkHeader chunk;
+			if (static_cast<size_t>(end - cursor) < sizeof(chunk))
+				return false;
+			std::memcpy(&chunk, cursor, sizeof(chunk));
+			if (chunk.firstAtom != atomsDecoded)
+				return false;		// Chunks cover the atoms in order - a gap or overlap would leave stale atoms
+
+			size_t consumed = TrajectoryFormat::DecodeChunk(cursor, end - cursor, keyframe, header.atomCount,
+				keyframe ? nullptr : m_quantized.data(), m_decoded.data(), m_elements.data());
+			if (consumed == 0)
+				return false;
+
+			cursor += consumed;
+			atomsDecoded += chunk.atomCount;
+		}
+		if (atomsDecoded != header.atomCount)
+			return false;
+
+		if (m_hasFrame && header.frame > m_frame.frame + 1)
+			m_framesSkipped += header.frame - m_frame.frame - 1;
+
+		m_quantized.swap(m_decoded);
+		m_frame.frame = header.frame;
+		m_frame.step = header.step;
+		m_frame.time = header.time;
+		m_frame.boxDimensions = XMFLOAT3(header.boxDimensions[0], header.boxDimensions[1], header.boxDimensions[2]);
+		if (keyframe)
+		{
+			m_frame.indices.swap(indices);
+			m_frame.elements = m_elements;
+		}
+		m_frame.positions.resize(header.atomCount);
+		TrajectoryFormat::Dequantize(m_quantized.data(), header.atomCount, m_frame.boxDimensions, m_positionBits, m_frame.positions.data());
+
+		m_hasFrame = true;
+		++m_framesDecoded;
+		return true;
+	}
+}
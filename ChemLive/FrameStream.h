@@ -0,0 +1,145 @@
+#pragma once
+
+#include "pch.h"
+#include "TrajectoryFormat.h"
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+using DirectX::XMFLOAT3;
+
+/*
+*	Network protocol of the frame server (see FrameServer.h). Everything is little-endian.
+*
+*	A client connects over plain TCP, where every message is prefixed with its uint32 length,
+*	or as a WebSocket (any path), where every message is one binary WebSocket message. Nothing
+*	is sent until the client sends a Subscribe message; the server answers with Hello and then
+*	streams Frame messages. Subscribing again changes the selection at any time.
+*
+*	Frame:	[FrameMessage] [uint32 first, uint32 count] * rangeCount		(keyframes only)
+*			[TrajectoryFormat::ChunkHeader][elements][positions] ...	(same coding as recorded trajectories)
+*
+*	Positions are quantized relative to the box and delta coded against the previous frame this
+*	client received - a client that cannot keep up is simply sent fewer frames, never stale ones.
+*	Keyframes list the selected atoms (as index ranges into the simulation's atom list) and their
+*	elements; delta frames carry the same atoms in the same order.
+*/
+
+namespace Simulation
+{
+	namespace FrameStreamFormat
+	{
+		const uint32_t Version = 1;
+
+		// First byte of every message
+		const uint8_t SubscribeType = 1;		// client -> server
+		const uint8_t HelloType = 2;			// server -> client
+		const uint8_t FrameType = 3;			// server -> client
+
+		// FrameMessage::flags
+		const uint8_t FrameKeyframe = 0x1;
+
+		// Largest message the server accepts from a client
+		const uint32_t MaxClientMessage = 1 << 20;
+
+		enum class Selection : uint8_t
+		{
+			All = 0,
+			Ranges = 1,		// Atom index ranges
+			Region = 2		// Atoms inside a box - picked again at every keyframe
+		};
+
+		struct SubscribeMessage
+		{
+			uint8_t		type;
+			uint8_t		selection;
+			uint16_t	reserved;
+			float		maxFrameRate;		// Frames per second wanted by the client, 0 for as many as it can take
+			float		regionMin[3];
+			float		regionMax[3];
+			uint32_t	rangeCount;			// followed by [uint32 first, uint32 count] * rangeCount
+		};
+
+		struct HelloMessage
+		{
+			uint8_t		type;
+			uint8_t		positionBits;
+			uint16_t	reserved;
+			uint32_t	version;
+			uint32_t	atomCount;			// Atoms in the simulation when the client subscribed
+		};
+
+		struct FrameMessage
+		{
+			uint8_t		type;
+			uint8_t		flags;
+			uint16_t	reserved;
+			uint32_t	atomCount;			// Selected atoms in this frame
+			uint64_t	frame;				// Server frame number - gaps are frames this client was not sent
+			uint64_t	step;
+			double		time;
+			float		boxDimensions[3];
+			uint32_t	rangeCount;			// Keyframes only
+		};
+
+		static_assert(sizeof(SubscribeMessage) == 36, "SubscribeMessage layout changed");
+		static_assert(sizeof(HelloMessage) == 12, "HelloMessage layout changed");
+		static_assert(sizeof(FrameMessage) == 48, "FrameMessage layout changed");
+
+		struct Subscription
+		{
+			Selection									selection = Selection::All;
+			float										maxFrameRate = 0.0f;
+			XMFLOAT3									regionMin = XMFLOAT3(0.0f, 0.0f, 0.0f);
+			XMFLOAT3									regionMax = XMFLOAT3(0.0f, 0.0f, 0.0f);
+			std::vector<std::pair<uint32_t, uint32_t>>	ranges;			// first, count
+		};
+
+		std::vector<uint8_t> EncodeSubscription(const Subscription& subscription);
+		bool DecodeSubscription(const uint8_t* data, size_t size, Subscription& subscription);
+	}
+
+	struct StreamedFrame
+	{
+		uint64_t				frame;
+		unsigned long long		step;
+		double					time;
+		XMFLOAT3				boxDimensions;
+		std::vector<uint32_t>	indices;			// Index of each atom in the simulation's atom list
+		std::vector<XMFLOAT3>	positions;
+		std::vector<uint8_t>	elements;			// Simulation::Element of each atom
+	};
+
+	/*
+	*	Client side of the protocol - feed it the messages in the order they arrived (without the
+	*	transport framing) and it keeps the current frame. Consumers only need this header,
+	*	FrameStream.cpp and the TrajectoryFormat / EntropyCoder sources.
+	*/
+	class FrameStreamDecoder
+	{
+	public:
+		FrameStreamDecoder();
+
+		// Returns true if the message was a frame that is now in Frame(). Malformed messages, and
+		// delta frames that arrive before any keyframe, return false and leave the frame as it was.
+		bool Decode(const uint8_t* message, size_t size);
+
+		// GET
+		const StreamedFrame&	Frame() const { return m_frame; }
+		bool					Connected() const { return m_positionBits != 0; }		// Hello received
+		uint32_t				SimulationAtomCount() const { return m_atomCount; }
+		unsigned long long		FramesDecoded() const { return m_framesDecoded; }
+		unsigned long long		FramesSkipped() const { return m_framesSkipped; }		// Gaps in the frame numbers
+
+	private:
+		StreamedFrame			m_frame;
+		std::vector<uint32_t>	m_quantized;
+		std::vector<uint32_t>	m_decoded;
+		std::vector<uint8_t>	m_elements;
+		uint32_t				m_positionBits;
+		uint32_t				m_atomCount;
+		bool					m_hasFrame;
+		unsigned long long		m_framesDecoded;
+		unsigned long long		m_framesSkipped;
+	};
+}
@@ -0,0 +1,550 @@
+#include "pch.h"
+#include "HardSphereDynamics.h"
+#include "Boundaries.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <ppl.h>
+
+namespace Simulation
+{
+	// Particles per task when loading, predicting and writing back
+	static const size_t ParticleBlock = 4096;
+
+	// Cells per particle at most - a few huge atoms in a big box would otherwise ask for a huge grid
+	static const double MaxCellsPerParticle = 2.0;
+
+	// Stale events the queue may hold per particle before it is rebuilt from scratch
+	static const size_t MaxEventsPerParticle = 16;
+
+	HardSphereDynamics::HardSphereDynamics() :
+		m_cells{ 1, 1, 1 },
+		m_cellWidth{ 0.0, 0.0, 0.0 },
+		m_halfBox{ 0.0, 0.0, 0.0 },
+		m_period{ 0.0, 0.0, 0.0 },
+		m_inversePeriod{ 0.0, 0.0, 0.0 },
+		m_boxDimensions(0.0f, 0.0f, 0.0f),
+		m_periodicAxes(PERIODIC_NONE),
+		m_time(0.0),
+		m_statistics()
+	{
+	}
+
+	void HardSphereDynamics::Advance(double timeDelta, const std::vector<Atom*>& atoms, XMFLOAT3 boxDimensions, unsigned int periodicAxes)
+	{
+		if (NeedsReload(atoms, boxDimensions, periodicAxes))
+			Reload(atoms, boxDimensions, periodicAxes);
+
+		const double target = m_time + timeDelta;
+		while (!m_queue.empty() && m_queue.top().time <= target)
+		{
+			Event event = m_queue.top();
+			m_queue.pop();
+
+			if (event.countA != m_particles[event.a].count ||
+				(event.type == EventType::Collision && event.countB != m_particles[event.b].count))
+			{
+				++m_statistics.staleEvents;
+				continue;
+			}
+
+			m_time = event.time;
+			switch (event.type)
+			{
+			case EventType::Collision:		Collide(event); break;
+			case EventType::Wall:			Bounce(event); break;
+			case EventType::CellCrossing:	Cross(event); break;
+			}
+
+			if (m_queue.size() > MaxEventsPerParticle * m_particles.size() + 1024)
+				RebuildQueue();
+		}
+		m_time = target;
+
+		// Bring every atom up to the end of the step - this is also what NeedsReload compares against
+		concurrency::parallel_for(size_t(0), m_particles.size(), [&](size_t iii)
+			{
+				Move(static_cast<uint32_t>(iii), target);
+
+				const Particle& particle = m_particles[iii];
+				m_atoms[iii]->Position(XMFLOAT3(
+					static_cast<float>(particle.position[0]), static_cast<float>(particle.position[1]), static_cast<float>(particle.position[2])));
+				m_atoms[iii]->Velocity(XMFLOAT3(
+					static_cast<float>(particle.velocity[0]), static_cast<float>(particle.velocity[1]), static_cast<float>(particle.velocity[2])));
+			});
+	}
+
+	void HardSphereDynamics::Remap(const std::vector<Atom*>& atoms, const std::vector<uint32_t>& previous)
+	{
+		// Not loaded yet, or loaded from another list - the next Advance reloads anyway
+		const size_t count = m_particles.size();
+		if (count == 0 || atoms.size() != count || previous.size() != count)
+			return;
+
+		std::vector<Particle> old(m_particles);
+		concurrency::parallel_for(size_t(0), count, [&](size_t iii)
+			{
+				m_particles[iii] = old[previous[iii]];
+			});
+		m_atoms = atoms;
+
+		// The cell lists and every queued event refer to particles by index
+		std::fill(m_cellHeads.begin(), m_cellHeads.end(), NoParticle);
+		for (uint32_t iii = 0; iii < count; ++iii)
+			Link(iii);
+		RebuildQueue();
+	}
+
+	bool HardSphereDynamics::NeedsReload(const std::vector<Atom*>& atoms, XMFLOAT3 boxDimensions, unsigned int periodicAxes)
+	{
+		if (atoms.size() != m_atoms.size() || atoms.empty() || periodicAxes != m_periodicAxes ||
+			boxDimensions.x != m_boxDimensions.x || boxDimensions.y != m_boxDimensions.y || boxDimensions.z != m_boxDimensions.z)
+			return true;
+
+		// Anything written by someone else (a load, the C API, the UI) shows up as a difference from
+		// what the last Advance wrote back
+		std::atomic<bool> changed(false);
+		const size_t blocks = (atoms.size() + ParticleBlock - 1) / ParticleBlock;
+		concurrency::parallel_for(size_t(0), blocks, [&](size_t block)
+			{
+				size_t end = std::min(atoms.size(), (block + 1) * ParticleBlock);
+				for (size_t iii = block * ParticleBlock; iii < end && !changed.load(std::memory_order_relaxed); ++iii)
+				{
+					const Particle& particle = m_particles[iii];
+					XMFLOAT3 position = atoms[iii]->Position();
+					XMFLOAT3 velocity = atoms[iii]->Velocity();
+					if (atoms[iii] != m_atoms[iii] ||
+						position.x != static_cast<float>(particle.position[0]) ||
+						position.y != static_cast<float>(particle.position[1]) ||
+						position.z != static_cast<float>(particle.position[2]) ||
+						velocity.x != static_cast<float>(particle.velocity[0]) ||
+						velocity.y != static_cast<float>(particle.velocity[1]) ||
+						velocity.z != static_cast<float>(particle.velocity[2]))
+						changed = true;
+				}
+			});
+		return changed;
+	}
+
+	void HardSphereDynamics::Reload(const std::vector<Atom*>& atoms, XMFLOAT3 boxDimensions, unsigned int periodicAxes)
+	{
+		m_atoms = atoms;
+		m_boxDimensions = boxDimensions;
+		m_periodicAxes = periodicAxes;
+		m_halfBox[0] = boxDimensions.x / 2.0;
+		m_halfBox[1] = boxDimensions.y / 2.0;
+		m_halfBox[2] = boxDimensions.z / 2.0;
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			m_period[axis] = Boundaries::IsPeriodic(periodicAxes, axis) ? 2.0 * m_halfBox[axis] : 0.0;
+			m_inversePeriod[axis] = m_period[axis] > 0.0 ? 1.0 / m_period[axis] : 0.0;
+		}
+		m_time = 0.0;
+
+		m_particles.resize(atoms.size());
+		concurrency::parallel_for(size_t(0), atoms.size(), [&](size_t iii)
+			{
+				Particle& particle = m_particles[iii];
+				Atom* atom = atoms[iii];
+				XMFLOAT3 position = atom->Position();
+				XMFLOAT3 velocity = atom->Velocity();
+
+				particle.position[0] = position.x;
+				particle.position[1] = position.y;
+				particle.position[2] = position.z;
+				particle.velocity[0] = velocity.x;
+				particle.velocity[1] = velocity.y;
+				particle.velocity[2] = velocity.z;
+				particle.time = 0.0;
+				particle.radius = atom->Radius();
+				particle.mass = atom->Mass();
+				particle.count = 0;
+				particle.pinned = 0;
+
+				// Start inside the walls - the time stepped update can leave an atom slightly past one -
+				// and inside the box on the periodic axes
+				for (int axis = 0; axis < 3; ++axis)
+				{
+					double bound = m_halfBox[axis] - particle.radius;
+					if (m_period[axis] > 0.0)
+						particle.position[axis] -= m_period[axis] * std::floor(particle.position[axis] * m_inversePeriod[axis] + 0.5);
+					else if (bound <= 0.0)
+					{
+						particle.pinned |= 1 << axis;
+						particle.position[axis] = 0.0;
+						particle.velocity[axis] = 0.0;
+					}
+					else
+						particle.position[axis] = std::max(-bound, std::min(bound, particle.position[axis]));
+				}
+			});
+
+		// Cells at least as wide as the largest pair of atoms can reach, so atoms further than one
+		// cell apart cannot touch before one of them crosses into a new cell
+		double largestRadius = 0.0;
+		for (const Particle& particle : m_particles)
+			largestRadius = std::max(largestRadius, particle.radius);
+
+		double cellCount = 1.0;
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			m_cells[axis] = largestRadius > 0.0 ? static_cast<int32_t>(std::min(1.0e6, std::floor(2.0 * m_halfBox[axis] / (2.0 * largestRadius)))) : 1;
+			m_cells[axis] = std::max(1, m_cells[axis]);
+			cellCount *= m_cells[axis];
+		}
+
+		const double maxCells = MaxCellsPerParticle * m_particles.size() + 64.0;
+		if (cellCount > maxCells)
+		{
+			double scale = std::cbrt(maxCells / cellCount);
+			for (int axis = 0; axis < 3; ++axis)
+				m_cells[axis] = std::max(1, static_cast<int32_t>(m_cells[axis] * scale));
+		}
+
+		for (int axis = 0; axis < 3; ++axis)
+			m_cellWidth[axis] = 2.0 * m_halfBox[axis] / m_cells[axis];
+
+		m_cellHeads.assign(static_cast<size_t>(m_cells[0]) * m_cells[1] * m_cells[2], NoParticle);
+		for (uint32_t iii = 0; iii < m_particles.size(); ++iii)
+		{
+			Particle& particle = m_particles[iii];
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				int32_t cell = static_cast<int32_t>(std::floor((particle.position[axis] + m_halfBox[axis]) / m_cellWidth[axis]));
+				particle.cell[axis] = std::max(0, std::min(m_cells[axis] - 1, cell));
+			}
+			Link(iii);
+		}
+
+		RebuildQueue();
+	}
+
+	void HardSphereDynamics::RebuildQueue()
+	{
+		++m_statistics.rebuilds;
+
+		// Predict from a common time, each pair once
+		const size_t blocks = (m_particles.size() + ParticleBlock - 1) / ParticleBlock;
+		std::vector<std::vector<Event>> predicted(blocks);
+		concurrency::parallel_for(size_t(0), blocks, [&](size_t block)
+			{
+				size_t end = std::min(m_particles.size(), (block + 1) * ParticleBlock);
+				for (size_t iii = block * ParticleBlock; iii < end; ++iii)
+					Move(static_cast<uint32_t>(iii), m_time);
+			});
+		concurrency::parallel_for(size_t(0), blocks, [&](size_t block)
+			{
+				size_t end = std::min(m_particles.size(), (block + 1) * ParticleBlock);
+				for (size_t iii = block * ParticleBlock; iii < end; ++iii)
+					Predict(static_cast<uint32_t>(iii), true, predicted[block]);
+			});
+
+		std::vector<Event> events;
+		size_t total = 0;
+		for (const std::vector<Event>& block : predicted)
+			total += block.size();
+		events.reserve(total);
+		for (const std::vector<Event>& block : predicted)
+			events.insert(events.end(), block.begin(), block.end());
+
+		m_queue = std::priority_queue<Event, std::vector<Event>, std::greater<Event>>(std::greater<Event>(), std::move(events));
+	}
+
+	void HardSphereDynamics::Move(uint32_t iii, double time)
+	{
+		Particle& particle = m_particles[iii];
+		double dt = time - particle.time;
+		if (dt == 0.0)
+			return;
+
+		particle.position[0] += particle.velocity[0] * dt;
+		particle.position[1] += particle.velocity[1] * dt;
+		particle.position[2] += particle.velocity[2] * dt;
+		particle.time = time;
+	}
+
+	void HardSphereDynamics::Predict(uint32_t iii, bool laterOnly, std::vector<Event>& events)
+	{
+		PredictWall(iii, events);
+		PredictCrossing(iii, events);
+
+		const Particle& particle = m_particles[iii];
+		const int32_t low[3] = { particle.cell[0] - 1, particle.cell[1] - 1, particle.cell[2] - 1 };
+		const int32_t high[3] = { particle.cell[0] + 1, particle.cell[1] + 1, particle.cell[2] + 1 };
+		PredictCollisions(iii, low, high, laterOnly, events);
+	}
+
+	void HardSphereDynamics::PredictWall(uint32_t iii, std::vector<Event>& events)
+	{
+		const Particle& particle = m_particles[iii];
+
+		Event event = {};
+		event.time = std::numeric_limits<double>::infinity();
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			double velocity = particle.velocity[axis];
+			if (velocity == 0.0 || (particle.pinned & (1 << axis)) != 0 || m_period[axis] > 0.0)
+				continue;
+
+			double bound = velocity > 0.0 ? m_halfBox[axis] - particle.radius : particle.radius - m_halfBox[axis];
+			double time = particle.time + std::max(0.0, (bound - particle.position[axis]) / velocity);
+			if (time < event.time)
+			{
+				event.time = time;
+				event.axis = static_cast<uint8_t>(axis);
+				event.direction = velocity > 0.0 ? 1 : -1;
+			}
+		}
+
+		if (event.time == std::numeric_limits<double>::infinity())
+			return;
+
+		event.type = EventType::Wall;
+		event.a = iii;
+		event.countA = particle.count;
+		events.push_back(event);
+	}
+
+	void HardSphereDynamics::PredictCrossing(uint32_t iii, std::vector<Event>& events)
+	{
+		const Particle& particle = m_particles[iii];
+
+		Event event = {};
+		event.time = std::numeric_limits<double>::infinity();
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			double velocity = particle.velocity[axis];
+			int32_t cell = particle.cell[axis];
+
+			// The outer cells reach the wall, which always comes first - unless the axis is periodic
+			const bool periodic = m_period[axis] > 0.0;
+			double boundary;
+			if (velocity > 0.0 && (periodic || cell < m_cells[axis] - 1))
+				boundary = (cell + 1) * m_cellWidth[axis] - m_halfBox[axis];
+			else if (velocity < 0.0 && (periodic || cell > 0))
+				boundary = cell * m_cellWidth[axis] - m_halfBox[axis];
+			else
+				continue;
+
+			double time = particle.time + std::max(0.0, (boundary - particle.position[axis]) / velocity);
+			if (time < event.time)
+			{
+				event.time = time;
+				event.axis = static_cast<uint8_t>(axis);
+				event.direction = velocity > 0.0 ? 1 : -1;
+			}
+		}
+
+		if (event.time == std::numeric_limits<double>::infinity())
+			return;
+
+		event.type = EventType::CellCrossing;
+		event.a = iii;
+		event.countA = particle.count;
+		events.push_back(event);
+	}
+
+	void HardSphereDynamics::PredictCollisions(uint32_t iii, const int32_t low[3], const int32_t high[3], bool laterOnly, std::vector<Event>& events)
+	{
+		const Particle& particle = m_particles[iii];
+
+		// The cells of the range on every axis - clamped at walls, wrapped around periodic axes,
+		// where a grid of fewer than 3 cells would otherwise list one twice
+		int32_t cells[3][3];
+		int32_t cellCount[3];
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			cellCount[axis] = 0;
+			for (int32_t cell = low[axis]; cell <= high[axis]; ++cell)
+			{
+				int32_t wrapped = cell;
+				if (m_period[axis] > 0.0)
+					wrapped = (cell % m_cells[axis] + m_cells[axis]) % m_cells[axis];
+				else if (cell < 0 || cell >= m_cells[axis])
+					continue;
+
+				if (std::find(cells[axis], cells[axis] + cellCount[axis], wrapped) == cells[axis] + cellCount[axis])
+					cells[axis][cellCount[axis]++] = wrapped;
+			}
+		}
+
+		int32_t cell[3];
+		for (int32_t zzz = 0; zzz < cellCount[2]; ++zzz)
+		{
+			cell[2] = cells[2][zzz];
+			for (int32_t yyy = 0; yyy < cellCount[1]; ++yyy)
+			{
+				cell[1] = cells[1][yyy];
+				for (int32_t xxx = 0; xxx < cellCount[0]; ++xxx)
+				{
+					cell[0] = cells[0][xxx];
+					for (uint32_t jjj = m_cellHeads[CellIndex(cell)]; jjj != NoParticle; jjj = m_particles[jjj].next)
+					{
+						if (jjj == iii || (laterOnly && jjj < iii))
+							continue;
+
+						// Relative motion, with the partner brought up to this particle's time
+						const Particle& other = m_particles[jjj];
+						const double lag = particle.time - other.time;
+						double dr[3], dv[3];
+						for (int axis = 0; axis < 3; ++axis)
+						{
+							dr[axis] = particle.position[axis] - (other.position[axis] + other.velocity[axis] * lag);
+							dv[axis] = particle.velocity[axis] - other.velocity[axis];
+						}
+						MinimumImage(dr);
+
+						const double b = dr[0] * dv[0] + dr[1] * dv[1] + dr[2] * dv[2];
+						if (b >= 0.0)
+							continue;		// Moving apart
+
+						const double dvv = dv[0] * dv[0] + dv[1] * dv[1] + dv[2] * dv[2];
+						const double drr = dr[0] * dr[0] + dr[1] * dr[1] + dr[2] * dr[2];
+						const double sigma = particle.radius + other.radius;
+						const double gap = drr - sigma * sigma;
+						const double discriminant = b * b - dvv * gap;
+						if (discriminant < 0.0)
+							continue;		// Miss
+
+						// Smaller root of |dr + dv t| = sigma, in the form that does not cancel. Pairs that
+						// already overlap (from a load or the time stepped update) collide right away.
+						double time = gap > 0.0 ? gap / (std::sqrt(discriminant) - b) : 0.0;
+
+						Event event = {};
+						event.time = particle.time + time;
+						event.type = EventType::Collision;
+						event.a = iii;
+						event.b = jjj;
+						event.countA = particle.count;
+						event.countB = other.count;
+						events.push_back(event);
+					}
+				}
+			}
+		}
+	}
+
+	void HardSphereDynamics::Push(const std::vector<Event>& events)
+	{
+		for (const Event& event : events)
+			m_queue.push(event);
+	}
+
+	void HardSphereDynamics::Collide(const Event& event)
+	{
+		++m_statistics.collisions;
+
+		Move(event.a, event.time);
+		Move(event.b, event.time);
+		Particle& a = m_particles[event.a];
+		Particle& b = m_particles[event.b];
+
+		double dr[3], dv[3];
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			dr[axis] = a.position[axis] - b.position[axis];
+			dv[axis] = a.velocity[axis] - b.velocity[axis];
+		}
+		MinimumImage(dr);
+		const double drr = dr[0] * dr[0] + dr[1] * dr[1] + dr[2] * dr[2];
+		const double approach = dr[0] * dv[0] + dr[1] * dv[1] + dr[2] * dv[2];
+
+		// Elastic impulse along the line of centers
+		if (drr > 0.0 && approach < 0.0)
+		{
+			const double impulse = 2.0 * approach / (drr * (a.mass + b.mass));
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				if ((a.pinned & (1 << axis)) == 0)
+					a.velocity[axis] -= impulse * b.mass * dr[axis];
+				if ((b.pinned & (1 << axis)) == 0)
+					b.velocity[axis] += impulse * a.mass * dr[axis];
+			}
+		}
+		++a.count;
+		++b.count;
+
+		m_predicted.clear();
+		Predict(event.a, false, m_predicted);
+		Predict(event.b, false, m_predicted);
+		Push(m_predicted);
+	}
+
+	void HardSphereDynamics::Bounce(const Event& event)
+	{
+		++m_statistics.wallBounces;
+
+		Move(event.a, event.time);
+		Particle& particle = m_particles[event.a];
+
+		// Exactly on the wall, whatever the rounding on the way there
+		particle.position[event.axis] = event.direction * (m_halfBox[event.axis] - particle.radius);
+		if (particle.velocity[event.axis] * event.direction > 0.0)
+			particle.velocity[event.axis] = -particle.velocity[event.axis];
+		++particle.count;
+
+		m_predicted.clear();
+		Predict(event.a, false, m_predicted);
+		Push(m_predicted);
+	}
+
+	void HardSphereDynamics::Cross(const Event& event)
+	{
+		++m_statistics.cellCrossings;
+
+		Move(event.a, event.time);
+		Unlink(event.a);
+		Particle& particle = m_particles[event.a];
+		particle.cell[event.axis] += event.direction;
+
+		// Out through a periodic face and back in through the opposite one
+		if (particle.cell[event.axis] < 0 || particle.cell[event.axis] >= m_cells[event.axis])
+		{
+			particle.cell[event.axis] -= event.direction * m_cells[event.axis];
+			particle.position[event.axis] -= event.direction * m_period[event.axis];
+		}
+		Link(event.a);
+
+		// The course is unchanged, so every pending event stays valid - only the layer of cells
+		// that just came into reach has new partners
+		int32_t low[3] = { particle.cell[0] - 1, particle.cell[1] - 1, particle.cell[2] - 1 };
+		int32_t high[3] = { particle.cell[0] + 1, particle.cell[1] + 1, particle.cell[2] + 1 };
+		low[event.axis] = high[event.axis] = particle.cell[event.axis] + event.direction;
+
+		m_predicted.clear();
+		PredictCrossing(event.a, m_predicted);
+		PredictCollisions(event.a, low, high, false, m_predicted);
+		Push(m_predicted);
+	}
+
+	void HardSphereDynamics::MinimumImage(double dr[3])
+	{
+		for (int axis = 0; axis < 3; ++axis)
+			dr[axis] -= m_period[axis] * std::nearbyint(dr[axis] * m_inversePeriod[axis]);
+	}
+
+	void HardSphereDynamics::Unlink(uint32_t iii)
+	{
+		Particle& particle = m_particles[iii];
+		if (particle.previous != NoParticle)
+			m_particles[particle.previous].next = particle.next;
+		else
+			m_cellHeads[CellIndex(particle.cell)] = particle.next;
+
+		if (particle.next != NoParticle)
+			m_particles[particle.next].previous = particle.previous;
+	}
+
+	void HardSphereDynamics::Link(uint32_t iii)
+	{
+		Particle& particle = m_particles[iii];
+		uint32_t& head = m_cellHeads[CellIndex(particle.cell)];
+
+		particle.previous = NoParticle;
+		particle.next = head;
+		if (head != NoParticle)
+			m_particles[head].previous = iii;
+		head = iii;
+	}
+}
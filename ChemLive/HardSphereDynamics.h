@@ -0,0 +1,131 @@
+#pragma once
+
+#include "pch.h"
+#include "Atom.h"
+#include <cstdint>
+#include <functional>
+#include <queue>
+#include <vector>
+
+using DirectX::XMFLOAT3;
+
+namespace Simulation
+{
+	struct HardSphereStatistics
+	{
+		unsigned long long	collisions;
+		unsigned long long	wallBounces;
+		unsigned long long	cellCrossings;
+		unsigned long long	staleEvents;		// Popped after one of their atoms had already changed course
+		unsigned long long	rebuilds;			// Full reloads of the atoms plus queue compactions
+	};
+
+	/*
+	*	Event driven hard sphere dynamics - the same physics as the time stepped update (elastic
+	*	spheres in a closed or periodic box), but exact: atoms fly in straight lines from one event to the next,
+	*	so nothing ever overlaps, tunnels through another atom or is detected a step late.
+	*
+	*	Every atom's next collisions, wall bounce and cell crossing are solved in closed form and
+	*	kept in one priority queue. Atoms only look for partners in the 27 cells around their own,
+	*	so crossing into a new cell is an event too. When an atom changes course its counter goes
+	*	up, which silently invalidates every event predicted for its old course - stale events are
+	*	dropped when they are popped, and the queue is rebuilt if they pile up. Atoms are only moved
+	*	when they take part in an event, and all of them once at the end of Advance.
+	*
+	*	On periodic axes there are no walls: the cell grid wraps around, an atom crossing the last
+	*	cell comes back in the first one at the opposite face, and pairs collide through their
+	*	minimum image (see Boundaries.h).
+	*
+	*	The engine keeps its own double precision state between calls. It reloads from the atoms
+	*	whenever the atom list, the box or its periodic axes, or any atom's position or velocity was
+	*	changed by someone else since the last Advance.
+	*/
+	class HardSphereDynamics
+	{
+	public:
+		HardSphereDynamics();
+
+		// Advance every atom by exactly 'timeDelta', handling every event inside it in time order
+		void Advance(double timeDelta, const std::vector<Atom*>& atoms, XMFLOAT3 boxDimensions, unsigned int periodicAxes = PERIODIC_NONE);
+
+		// The same atoms in a new order (see SpatialSort.h) - atoms[iii] was at index previous[iii].
+		// The double precision state is carried over and the queue predicted afresh.
+		void Remap(const std::vector<Atom*>& atoms, const std::vector<uint32_t>& previous);
+
+		// GET
+		HardSphereStatistics Statistics() { return m_statistics; }
+
+	private:
+		enum class EventType : uint8_t { Collision, Wall, CellCrossing };
+
+		struct Event
+		{
+			double		time;
+			uint32_t	a;
+			uint32_t	b;				// Collisions only
+			uint32_t	countA;			// Counters of a and b when the event was predicted
+			uint32_t	countB;
+			EventType	type;
+			uint8_t		axis;			// Walls and cell crossings
+			int8_t		direction;		// -1 or +1
+
+			bool operator>(const Event& other) const { return time > other.time; }
+		};
+
+		struct Particle
+		{
+			double		position[3];	// At 'time'
+			double		velocity[3];
+			double		time;
+			double		radius;
+			double		mass;
+			uint32_t	count;			// Bumped whenever the velocity changes
+			uint8_t		pinned;			// Axes the atom is too big to move along in this box (bit per axis)
+			int32_t		cell[3];
+			uint32_t	next;			// Cell list links - NoParticle ends a list
+			uint32_t	previous;
+		};
+
+		static constexpr uint32_t NoParticle = 0xFFFFFFFF;
+
+		bool NeedsReload(const std::vector<Atom*>& atoms, XMFLOAT3 boxDimensions, unsigned int periodicAxes);
+		void Reload(const std::vector<Atom*>& atoms, XMFLOAT3 boxDimensions, unsigned int periodicAxes);
+		void RebuildQueue();
+
+		void Move(uint32_t iii, double time);
+
+		// Events of particle iii from its current time - 'laterOnly' skips partners with a lower
+		// index, so predicting every particle finds every pair once
+		void Predict(uint32_t iii, bool laterOnly, std::vector<Event>& events);
+		void PredictWall(uint32_t iii, std::vector<Event>& events);
+		void PredictCrossing(uint32_t iii, std::vector<Event>& events);
+		void PredictCollisions(uint32_t iii, const int32_t low[3], const int32_t high[3], bool laterOnly, std::vector<Event>& events);
+		void Push(const std::vector<Event>& events);
+
+		void Collide(const Event& event);
+		void Bounce(const Event& event);
+		void Cross(const Event& event);
+
+		uint32_t CellIndex(const int32_t cell[3]) { return static_cast<uint32_t>((cell[2] * m_cells[1] + cell[1]) * m_cells[0] + cell[0]); }
+		void MinimumImage(double dr[3]);
+		void Unlink(uint32_t iii);
+		void Link(uint32_t iii);
+
+		std::vector<Particle>	m_particles;
+		std::vector<Atom*>		m_atoms;			// The list the particles were loaded from
+		std::vector<uint32_t>	m_cellHeads;
+		int32_t					m_cells[3];
+		double					m_cellWidth[3];
+		double					m_halfBox[3];
+		double					m_period[3];		// Box length on the periodic axes, 0 on the walled ones
+		double					m_inversePeriod[3];
+		XMFLOAT3				m_boxDimensions;
+		unsigned int			m_periodicAxes;
+		double					m_time;
+
+		std::priority_queue<Event, std::vector<Event>, std::greater<Event>> m_queue;
+		std::vector<Event>		m_predicted;		// Scratch for Predict
+
+		HardSphereStatistics	m_statistics;
+	};
+}
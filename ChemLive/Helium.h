@@ -12,9 +12,9 @@ namespace Simulation
 	{
 	public:
 		// Constructors
-		Helium(const std::shared_ptr<DX::DeviceResources>& deviceResources, XMFLOAT3 position, XMFLOAT3 velocity, int neutronCount = 2, int charge = 0);
+		Helium(XMFLOAT3 position, XMFLOAT3 velocity, int neutronCount = 2, int charge = 0);
 
 		// Update
-		void Update(double timeDelta, const std::vector<Atom*>& atoms, XMFLOAT3 boxDimensions);
+		void Update(double timeDelta, const std::vector<Atom*>& atoms, XMFLOAT3 boxDimensions, unsigned int periodicAxes);
 	};
 }
\ No newline at end of file
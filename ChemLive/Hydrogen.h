@@ -12,9 +12,9 @@ namespace Simulation
 	{
 	public:
 		// Constructors
-		Hydrogen(const std::shared_ptr<DX::DeviceResources>& deviceResources, XMFLOAT3 position, XMFLOAT3 velocity, int neutronCount = 0, int charge = 1);
+		Hydrogen(XMFLOAT3 position, XMFLOAT3 velocity, int neutronCount = 0, int charge = 1);
 
 		// Update
-		void Update(double timeDelta, const std::vector<Atom*>& atoms, XMFLOAT3 boxDimensions);
+		void Update(double timeDelta, const std::vector<Atom*>& atoms, XMFLOAT3 boxDimensions, unsigned int periodicAxes);
 	};
 }
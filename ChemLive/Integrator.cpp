@@ -0,0 +1,459 @@
+#include "pch.h"
+#include "Integrator.h"
+#include "Boundaries.h"
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <ppl.h>
+#include <stdexcept>
+
+using namespace DirectX;
+
+namespace Simulation
+{
+	// Atoms per task
+	static const size_t StepBlock = 8192;
+
+	Integrator::Integrator(const IntegratorSettings& settings) :
+		m_settings(settings),
+		m_forcesValid(false),
+		m_slowForcesValid(false),
+		m_fastPotential(0.0),
+		m_slowPotential(0.0),
+		m_halfStepBehind(false),
+		m_lastTimeStep(0.0f),
+		m_statistics()
+	{
+		if (settings.innerSteps == 0)
+			throw std::runtime_error("Integrator: there must be at least one inner step");
+
+		m_arrays.boxDimensions = XMFLOAT3(0.0f, 0.0f, 0.0f);
+	}
+
+	void Integrator::AddForceProvider(std::shared_ptr<ForceProvider> provider, ForceSplit split)
+	{
+		m_providers.push_back(std::move(provider));
+		m_splits.push_back(split);
+		m_forcesValid = false;
+		m_slowForcesValid = false;
+	}
+
+	void Integrator::RemoveForceProvider(const std::shared_ptr<ForceProvider>& provider)
+	{
+		for (size_t iii = m_providers.size(); iii-- > 0;)
+		{
+			if (m_providers[iii] == provider)
+			{
+				m_providers.erase(m_providers.begin() + iii);
+				m_splits.erase(m_splits.begin() + iii);
+			}
+		}
+		m_forcesValid = false;
+		m_slowForcesValid = false;
+	}
+
+	float Integrator::MinimumPeriod() const
+	{
+		float minimum = 0.0f;
+		for (const std::shared_ptr<ForceProvider>& provider : m_providers)
+			minimum = std::max(minimum, provider->MinimumPeriod());
+		return minimum;
+	}
+
+	void Integrator::ClearForceProviders()
+	{
+		m_providers.clear();
+		m_splits.clear();
+		m_forcesValid = false;
+		m_slowForcesValid = false;
+	}
+
+	void Integrator::Split(const std::shared_ptr<ForceProvider>& provider, ForceSplit split)
+	{
+		for (size_t iii = 0; iii < m_providers.size(); ++iii)
+		{
+			if (m_providers[iii] == provider)
+				m_splits[iii] = split;
+		}
+		m_forcesValid = false;
+		m_slowForcesValid = false;
+	}
+
+	void Integrator::Constraints(std::shared_ptr<BondConstraints> constraints)
+	{
+		m_constraints = std::move(constraints);
+		BindConstraints();
+		for (const std::shared_ptr<ForceProvider>& provider : m_providers)
+			provider->Reset();
+		m_forcesValid = false;
+		m_slowForcesValid = false;
+	}
+
+	void Integrator::InnerSteps(unsigned int innerSteps)
+	{
+		if (innerSteps == 0)
+			throw std::runtime_error("Integrator: there must be at least one inner step");
+		if (innerSteps == m_settings.innerSteps)
+			return;
+
+		// Leapfrog velocities half a step behind are brought up to the positions first - the
+		// forces still belong to every provider
+		if (m_halfStepBehind && m_forcesValid && innerSteps > 1)
+		{
+			m_statistics.kineticEnergy = Kick(0.5f * m_lastTimeStep, m_arrays.forces);
+			WriteBack();
+			m_halfStepBehind = false;
+		}
+
+		// The forces array holds a different set of providers from now on
+		m_settings.innerSteps = innerSteps;
+		m_forcesValid = false;
+		m_slowForcesValid = false;
+	}
+
+	void Integrator::Step(double timeDelta, const std::vector<Atom*>& atoms, XMFLOAT3 boxDimensions, unsigned int periodicAxes)
+	{
+		if (NeedsReload(atoms, boxDimensions, periodicAxes))
+			Reload(atoms, boxDimensions, periodicAxes);
+		if (m_constraints != nullptr && m_constraints->NeedsBind())
+		{
+			// The pair lists and the forces change with the exclusions
+			BindConstraints();
+			for (const std::shared_ptr<ForceProvider>& provider : m_providers)
+				provider->Reset();
+			m_forcesValid = false;
+			m_slowForcesValid = false;
+		}
+		if (m_arrays.Count() == 0)
+			return;
+
+		// Velocity Verlet needs the forces at the start of the step - normally left by the last one
+		if (!m_forcesValid)
+			ComputeForces();
+
+		const float dt = static_cast<float>(timeDelta);
+		if (m_settings.innerSteps > 1)
+			StepMultiple(dt);
+		else if (m_settings.scheme == IntegrationScheme::VelocityVerlet)
+		{
+			KickDrift(0.5f * dt, dt);
+			ComputeForces();
+			m_statistics.kineticEnergy = Rattle(Kick(0.5f * dt, m_arrays.forces), dt);
+		}
+		else
+		{
+			// Velocities loaded from the atoms are at t - the first kick only brings them to t + dt/2.
+			// After that they are at t - dt'/2 for the last step dt', which an adaptive step makes
+			// different from dt.
+			m_statistics.kineticEnergy = KickDrift(m_halfStepBehind ? 0.5f * (m_lastTimeStep + dt) : 0.5f * dt, dt);
+			m_halfStepBehind = true;
+			m_lastTimeStep = dt;
+			ComputeForces();
+		}
+
+		++m_statistics.steps;
+		WriteBack();
+	}
+
+	void Integrator::Remap(const std::vector<Atom*>& atoms, const std::vector<uint32_t>& previous)
+	{
+		// Not loaded yet, or loaded from another list - the next Step reloads anyway
+		const size_t count = m_arrays.Count();
+		if (count == 0 || atoms.size() != count || previous.size() != count)
+			return;
+
+		auto permute = [&](auto& values)
+			{
+				auto old = values;
+				concurrency::parallel_for(size_t(0), count, [&](size_t iii)
+					{
+						values[iii] = old[previous[iii]];
+					});
+			};
+		permute(m_arrays.positions);
+		permute(m_arrays.velocities);
+		permute(m_arrays.forces);
+		if (m_slowForces.size() == count)
+			permute(m_slowForces);
+		permute(m_arrays.inverseMasses);
+		permute(m_arrays.radii);
+		permute(m_arrays.charges);
+		permute(m_arrays.elements);
+		m_atoms = atoms;
+
+		// Neighbour lists, compacted charges and bonds hold indices
+		for (const std::shared_ptr<ForceProvider>& provider : m_providers)
+			provider->Reset();
+		BindConstraints();
+	}
+
+	void Integrator::BindConstraints()
+	{
+		m_arrays.exclusionStart.clear();
+		m_arrays.exclusions.clear();
+		if (m_constraints == nullptr)
+			return;
+
+		m_constraints->Bind(m_atoms);
+		if (m_constraints->Statistics().constraints > 0)
+			m_constraints->Exclusions(m_atoms.size(), m_arrays.exclusionStart, m_arrays.exclusions);
+	}
+
+	bool Integrator::NeedsReload(const std::vector<Atom*>& atoms, XMFLOAT3 boxDimensions, unsigned int periodicAxes)
+	{
+		const XMFLOAT3& box = m_arrays.boxDimensions;
+		if (atoms.size() != m_atoms.size() || periodicAxes != m_arrays.periodicAxes ||
+			boxDimensions.x != box.x || boxDimensions.y != box.y || boxDimensions.z != box.z)
+			return true;
+
+		// Anything written by someone else shows up as a difference from what WriteBack wrote
+		std::atomic<bool> changed(false);
+		const size_t blocks = (atoms.size() + StepBlock - 1) / StepBlock;
+		concurrency::parallel_for(size_t(0), blocks, [&](size_t block)
+			{
+				size_t end = std::min(atoms.size(), (block + 1) * StepBlock);
+				for (size_t iii = block * StepBlock; iii < end && !changed.load(std::memory_order_relaxed); ++iii)
+				{
+					XMFLOAT3 position = atoms[iii]->Position();
+					XMFLOAT3 velocity = atoms[iii]->Velocity();
+					const XMFLOAT3& ours = m_arrays.positions[iii];
+					const XMFLOAT3& ourVelocity = m_arrays.velocities[iii];
+					if (atoms[iii] != m_atoms[iii] ||
+						position.x != ours.x || position.y != ours.y || position.z != ours.z ||
+						velocity.x != ourVelocity.x || velocity.y != ourVelocity.y || velocity.z != ourVelocity.z)
+						changed = true;
+				}
+			});
+		return changed;
+	}
+
+	void Integrator::Reload(const std::vector<Atom*>& atoms, XMFLOAT3 boxDimensions, unsigned int periodicAxes)
+	{
+		++m_statistics.reloads;
+
+		m_atoms = atoms;
+		const size_t count = atoms.size();
+		m_arrays.boxDimensions = boxDimensions;
+		m_arrays.periodicAxes = periodicAxes;
+		m_arrays.positions.resize(count);
+		m_arrays.velocities.resize(count);
+		m_arrays.forces.resize(count);
+		m_slowForces.resize(count);
+		m_arrays.inverseMasses.resize(count);
+		m_arrays.radii.resize(count);
+		m_arrays.charges.resize(count);
+		m_arrays.elements.resize(count);
+
+		concurrency::parallel_for(size_t(0), count, [&](size_t iii)
+			{
+				Atom* atom = atoms[iii];
+				m_arrays.positions[iii] = atom->Position();
+				m_arrays.velocities[iii] = atom->Velocity();
+				m_arrays.inverseMasses[iii] = 1.0f / atom->Mass();
+				m_arrays.radii[iii] = atom->Radius();
+				m_arrays.charges[iii] = static_cast<float>(atom->Charge());
+				m_arrays.elements[iii] = static_cast<uint8_t>(atom->Element());
+			});
+
+		for (const std::shared_ptr<ForceProvider>& provider : m_providers)
+			provider->Reset();
+		BindConstraints();
+
+		m_forcesValid = false;
+		m_slowForcesValid = false;
+		m_halfStepBehind = false;
+	}
+
+	void Integrator::ComputeForces()
+	{
+		XMFLOAT3* forces = m_arrays.forces.data();
+		std::fill(m_arrays.forces.begin(), m_arrays.forces.end(), XMFLOAT3(0.0f, 0.0f, 0.0f));
+
+		// Only the fast providers under multiple time stepping
+		const bool multiple = m_settings.innerSteps > 1;
+		double potential = 0.0;
+		for (size_t iii = 0; iii < m_providers.size(); ++iii)
+		{
+			if (!multiple || m_splits[iii] == ForceSplit::Fast)
+				potential += m_providers[iii]->AddForces(m_arrays, forces);
+		}
+
+		m_fastPotential = potential;
+		m_statistics.potentialEnergy = multiple ? m_fastPotential + m_slowPotential : m_fastPotential;
+		++m_statistics.forceEvaluations;
+		m_forcesValid = true;
+	}
+
+	void Integrator::ComputeSlowForces()
+	{
+		XMFLOAT3* forces = m_slowForces.data();
+		std::fill(m_slowForces.begin(), m_slowForces.end(), XMFLOAT3(0.0f, 0.0f, 0.0f));
+
+		double potential = 0.0;
+		for (size_t iii = 0; iii < m_providers.size(); ++iii)
+		{
+			if (m_splits[iii] == ForceSplit::Slow)
+				potential += m_providers[iii]->AddForces(m_arrays, forces);
+		}
+
+		m_slowPotential = potential;
+		m_statistics.potentialEnergy = m_fastPotential + m_slowPotential;
+		++m_statistics.slowEvaluations;
+		m_slowForcesValid = true;
+	}
+
+	void Integrator::StepMultiple(float dt)
+	{
+		// Like the fast forces, the slow ones at the start of the step are normally left by the last one
+		if (!m_slowForcesValid)
+			ComputeSlowForces();
+		Kick(0.5f * dt, m_slowForces);
+
+		const float inner = dt / static_cast<float>(m_settings.innerSteps);
+		for (unsigned int step = 0; step < m_settings.innerSteps; ++step)
+		{
+			KickDrift(0.5f * inner, inner);
+			ComputeForces();
+			Rattle(Kick(0.5f * inner, m_arrays.forces), inner);
+		}
+
+		ComputeSlowForces();
+		m_statistics.kineticEnergy = Rattle(Kick(0.5f * dt, m_slowForces), dt);
+	}
+
+	double Integrator::KickDrift(float kick, float drift)
+	{
+		const bool constrained = m_constraints != nullptr && m_constraints->Statistics().constraints > 0;
+		if (constrained)
+			m_reference = m_arrays.positions;
+
+		const size_t count = m_arrays.Count();
+		const size_t blocks = (count + StepBlock - 1) / StepBlock;
+		std::vector<double> energies(blocks, 0.0);
+
+		concurrency::parallel_for(size_t(0), blocks, [&](size_t block)
+			{
+				const XMVECTOR halfBox = XMVectorSet(m_arrays.boxDimensions.x / 2.0f, m_arrays.boxDimensions.y / 2.0f, m_arrays.boxDimensions.z / 2.0f, 0.0f);
+				const XMVECTOR step = XMVectorReplicate(drift);
+				const XMVECTOR zero = XMVectorZero();
+				const XMVECTOR two = XMVectorReplicate(2.0f);
+
+				// Periodic axes have no walls - their bound is out of reach - and wrap instead
+				const XMFLOAT3 period = Boundaries::Periods(m_arrays.boxDimensions, m_arrays.periodicAxes);
+				const XMFLOAT3 inverse = Boundaries::InversePeriods(m_arrays.boxDimensions, m_arrays.periodicAxes);
+				const XMVECTOR periods = XMVectorSet(period.x, period.y, period.z, 0.0f);
+				const XMVECTOR inversePeriods = XMVectorSet(inverse.x, inverse.y, inverse.z, 0.0f);
+				const XMVECTOR periodic = XMVectorGreater(periods, zero);
+				const XMVECTOR unbounded = XMVectorReplicate(FLT_MAX);
+
+				double energy = 0.0;
+				size_t end = std::min(count, (block + 1) * StepBlock);
+				for (size_t iii = block * StepBlock; iii < end; ++iii)
+				{
+					const float inverseMass = m_arrays.inverseMasses[iii];
+					XMVECTOR velocity = XMVectorMultiplyAdd(XMLoadFloat3(&m_arrays.forces[iii]), XMVectorReplicate(kick * inverseMass), XMLoadFloat3(&m_arrays.velocities[iii]));
+					XMVECTOR position = XMVectorMultiplyAdd(velocity, step, XMLoadFloat3(&m_arrays.positions[iii]));
+
+					// Mirror anything past a wall back inside and send it the other way - an atom too
+					// big for the box sits in the middle of it
+					const XMVECTOR bound = XMVectorSelect(XMVectorMax(zero, XMVectorSubtract(halfBox, XMVectorReplicate(m_arrays.radii[iii]))), unbounded, periodic);
+					const XMVECTOR over = XMVectorGreater(position, bound);
+					const XMVECTOR under = XMVectorLess(position, XMVectorNegate(bound));
+					position = XMVectorSelect(position, XMVectorNegate(XMVectorMultiplyAdd(two, bound, position)), under);
+					position = XMVectorSelect(position, XMVectorSubtract(XMVectorMultiply(two, bound), position), over);
+					position = XMVectorClamp(position, XMVectorNegate(bound), bound);
+					velocity = XMVectorSelect(velocity, XMVectorAbs(velocity), under);
+					velocity = XMVectorSelect(velocity, XMVectorNegate(XMVectorAbs(velocity)), over);
+					position = Boundaries::MinimumImage(position, periods, inversePeriods);
+
+					XMStoreFloat3(&m_arrays.velocities[iii], velocity);
+					XMStoreFloat3(&m_arrays.positions[iii], position);
+					energy += 0.5f * XMVectorGetX(XMVector3Dot(velocity, velocity)) / inverseMass;
+				}
+				energies[block] = energy;
+			});
+
+		m_forcesValid = false;
+		m_slowForcesValid = false;
+
+		// SHAKE moves the velocities too
+		if (constrained)
+		{
+			m_constraints->Shake(m_arrays, m_reference, drift);
+			return KineticEnergy();
+		}
+
+		double energy = 0.0;
+		for (double part : energies)
+			energy += part;
+		return energy;
+	}
+
+	double Integrator::Kick(float kick, const std::vector<XMFLOAT3>& forces)
+	{
+		const size_t count = m_arrays.Count();
+		const size_t blocks = (count + StepBlock - 1) / StepBlock;
+		std::vector<double> energies(blocks, 0.0);
+
+		concurrency::parallel_for(size_t(0), blocks, [&](size_t block)
+			{
+				double energy = 0.0;
+				size_t end = std::min(count, (block + 1) * StepBlock);
+				for (size_t iii = block * StepBlock; iii < end; ++iii)
+				{
+					const float inverseMass = m_arrays.inverseMasses[iii];
+					XMVECTOR velocity = XMVectorMultiplyAdd(XMLoadFloat3(&forces[iii]), XMVectorReplicate(kick * inverseMass), XMLoadFloat3(&m_arrays.velocities[iii]));
+					XMStoreFloat3(&m_arrays.velocities[iii], velocity);
+					energy += 0.5f * XMVectorGetX(XMVector3Dot(velocity, velocity)) / inverseMass;
+				}
+				energies[block] = energy;
+			});
+
+		double energy = 0.0;
+		for (double part : energies)
+			energy += part;
+		return energy;
+	}
+
+	double Integrator::Rattle(double kineticEnergy, float timeDelta)
+	{
+		if (m_constraints == nullptr || m_constraints->Statistics().constraints == 0)
+			return kineticEnergy;
+
+		m_constraints->Rattle(m_arrays, timeDelta);
+		return KineticEnergy();
+	}
+
+	double Integrator::KineticEnergy()
+	{
+		const size_t count = m_arrays.Count();
+		const size_t blocks = (count + StepBlock - 1) / StepBlock;
+		std::vector<double> energies(blocks, 0.0);
+
+		concurrency::parallel_for(size_t(0), blocks, [&](size_t block)
+			{
+				double energy = 0.0;
+				size_t end = std::min(count, (block + 1) * StepBlock);
+				for (size_t iii = block * StepBlock; iii < end; ++iii)
+				{
+					const XMFLOAT3& velocity = m_arrays.velocities[iii];
+					energy += 0.5 * (velocity.x * velocity.x + velocity.y * velocity.y + velocity.z * velocity.z) / m_arrays.inverseMasses[iii];
+				}
+				energies[block] = energy;
+			});
+
+		double energy = 0.0;
+		for (double part : energies)
+			energy += part;
+		return energy;
+	}
+
+	void Integrator::WriteBack()
+	{
+		concurrency::parallel_for(size_t(0), m_arrays.Count(), [&](size_t iii)
+			{
+				m_atoms[iii]->Position(m_arrays.positions[iii]);
+				m_atoms[iii]->Velocity(m_arrays.velocities[iii]);
+			});
+	}
+}
@@ -0,0 +1,143 @@
+#pragma once
+
+#include "pch.h"
+#include "Atom.h"
+#include "BondConstraints.h"
+#include "ForceProvider.h"
+#include <memory>
+#include <vector>
+
+namespace Simulation
+{
+	enum class IntegrationScheme
+	{
+		VelocityVerlet,		// Positions and velocities at the same time
+		Leapfrog			// Velocities half a step behind the positions - one pass less per step
+	};
+
+	// Which time scale a force provider belongs to under multiple time stepping
+	enum class ForceSplit
+	{
+		Fast,		// Short range, quickly varying - every inner step
+		Slow		// Long range or far neighbours, smooth - once per Step
+	};
+
+	struct IntegratorSettings
+	{
+		IntegrationScheme	scheme = IntegrationScheme::VelocityVerlet;
+		unsigned int		innerSteps = 1;		// r-RESPA inner steps per Step - 1 evaluates every provider every step
+	};
+
+	struct IntegratorStatistics
+	{
+		unsigned long long	steps;
+		unsigned long long	forceEvaluations;	// Of the fast providers - of all of them without multiple time stepping
+		unsigned long long	slowEvaluations;
+		unsigned long long	reloads;
+		double				kineticEnergy;		// kJ/mol, at the end of the last step
+		double				potentialEnergy;	// kJ/mol, summed over the providers
+	};
+
+	/*
+	*	Symplectic integration of the atoms under the sum of any number of force providers, between
+	*	the simulation box's reflecting walls or across its periodic faces. Velocity Verlet runs a
+	*	step as
+	*
+	*		kick a half step and drift a full step	(one pass: v += a dt/2, x += v dt, walls and wrapping)
+	*		every provider adds its forces
+	*		kick a half step						(one pass: v += a dt/2, kinetic energy)
+	*
+	*	and leapfrog as a single kick-and-drift pass and the forces. Every pass is one parallel
+	*	sweep in DirectXMath vectors over the arrays. Being time reversible and symplectic, both keep
+	*	the energy bounded at several times the time step explicit Euler can manage.
+	*
+	*	With more than one inner step, Step runs r-RESPA (Tuckerman, Berne and Martyna 1992) instead:
+	*	the providers are split into fast and slow ones (see ForceSplit), and a step of dt becomes
+	*
+	*		kick a half step with the slow forces
+	*		'innerSteps' velocity Verlet steps of dt / innerSteps under the fast forces alone
+	*		the slow providers add their forces, kick a half step with them
+	*
+	*	so the expensive long range forces are evaluated once per step while the short range ones
+	*	still resolve the fast motion - hydrogen next to neon, say. Being a Trotter split it stays
+	*	time reversible and symplectic; the slow forces must really be slow though, as an outer step
+	*	near a period of the motion they drive resonates. Leapfrog only applies to single steps.
+	*
+	*	Bond constraints (see BondConstraints.h), when given, are applied after every drift (SHAKE)
+	*	and, under velocity Verlet, after every closing kick (RATTLE).
+	*
+	*	Like HardSphereDynamics the integrator keeps its own arrays between steps, writes the atoms
+	*	back after every step and reloads if anyone else changed them.
+	*
+	*	Atoms are wrapped back into the box here and nowhere else, so every provider sees positions
+	*	inside [-L/2, L/2) on the periodic axes and only has to take minimum images.
+	*/
+	class Integrator
+	{
+	public:
+		Integrator(const IntegratorSettings& settings = IntegratorSettings());
+
+		void AddForceProvider(std::shared_ptr<ForceProvider> provider, ForceSplit split = ForceSplit::Fast);
+		void RemoveForceProvider(const std::shared_ptr<ForceProvider>& provider);
+		void ClearForceProviders();
+		void Split(const std::shared_ptr<ForceProvider>& provider, ForceSplit split);
+
+		// Fixed bond lengths - null for none
+		void Constraints(std::shared_ptr<BondConstraints> constraints);
+		BondConstraints* Constraints() { return m_constraints.get(); }
+		const std::vector<std::shared_ptr<ForceProvider>>& ForceProviders() { return m_providers; }
+		float MinimumPeriod() const;		// Shortest periodic box length every provider is right for
+
+		void Step(double timeDelta, const std::vector<Atom*>& atoms, XMFLOAT3 boxDimensions, unsigned int periodicAxes = PERIODIC_NONE);
+
+		// The same atoms in a new order (see SpatialSort.h) - atoms[iii] was at index previous[iii].
+		// The arrays are permuted rather than reloaded, so the forces and leapfrog's half step
+		// survive; the providers start over as after a reload.
+		void Remap(const std::vector<Atom*>& atoms, const std::vector<uint32_t>& previous);
+
+		// GET
+		IntegratorStatistics	Statistics() { return m_statistics; }
+		const AtomArrays&		Arrays() { return m_arrays; }
+		IntegrationScheme		Scheme() { return m_settings.scheme; }
+		unsigned int			InnerSteps() { return m_settings.innerSteps; }
+
+		// SET
+		void InnerSteps(unsigned int innerSteps);
+
+	private:
+		bool NeedsReload(const std::vector<Atom*>& atoms, XMFLOAT3 boxDimensions, unsigned int periodicAxes);
+		void Reload(const std::vector<Atom*>& atoms, XMFLOAT3 boxDimensions, unsigned int periodicAxes);
+		void BindConstraints();		// And the pair exclusions that go with them
+		void ComputeForces();
+		void ComputeSlowForces();
+		void StepMultiple(float dt);
+
+		// v += kick F/m, then x += drift v, reflect off the walls and wrap around the periodic axes.
+		// Returns the kinetic energy of the new velocities.
+		double KickDrift(float kick, float drift);
+		double Kick(float kick, const std::vector<XMFLOAT3>& forces);
+
+		// RATTLE after a closing kick - returns the kinetic energy, 'kineticEnergy' if nothing is constrained
+		double Rattle(double kineticEnergy, float timeDelta);
+		double KineticEnergy();
+		void WriteBack();
+
+		IntegratorSettings							m_settings;
+		std::vector<std::shared_ptr<ForceProvider>>	m_providers;
+		std::vector<ForceSplit>						m_splits;			// One per provider
+		std::shared_ptr<BondConstraints>			m_constraints;
+		std::vector<XMFLOAT3>						m_reference;		// Positions before the drift, for SHAKE
+
+		AtomArrays									m_arrays;
+		std::vector<Atom*>							m_atoms;			// The list the arrays were loaded from
+		bool										m_forcesValid;		// Forces belong to the current positions
+		std::vector<XMFLOAT3>						m_slowForces;		// Under multiple time stepping - m_arrays.forces holds the fast ones
+		bool										m_slowForcesValid;
+		double										m_fastPotential;
+		double										m_slowPotential;
+		bool										m_halfStepBehind;	// Leapfrog velocities are at t - dt/2
+		float										m_lastTimeStep;		// The dt of that half step - the step may change
+
+		IntegratorStatistics						m_statistics;
+	};
+}
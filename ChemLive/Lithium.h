@@ -14,9 +14,9 @@ namespace Simulation
 		// Constructors
 		// Most common isotope = Lithium-7
 		// Most common charge  = +1
-		Lithium(const std::shared_ptr<DX::DeviceResources>& deviceResources, XMFLOAT3 position, XMFLOAT3 velocity, int neutronCount = 4, int charge = 1);
+		Lithium(XMFLOAT3 position, XMFLOAT3 velocity, int neutronCount = 4, int charge = 1);
 
 		// Update
-		void Update(double timeDelta, const std::vector<Atom*>& atoms, XMFLOAT3 boxDimensions);
+		void Update(double timeDelta, const std::vector<Atom*>& atoms, XMFLOAT3 boxDimensions, unsigned int periodicAxes);
 	};
 }
\ No newline at end of file
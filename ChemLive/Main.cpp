@@ -25,7 +25,8 @@ namespace ChemLive
 	Main::Main(const std::shared_ptr<DX::DeviceResources>& deviceResources) :
 		m_deviceResources(deviceResources),
 		m_windowClosed(false),
-		m_windowVisible(true)
+		m_windowVisible(true),
+		m_trajectoryPlaying(false)
 	{
 		// Register to be notified if the Device is lost or recreated
 		m_deviceResources->RegisterDeviceNotify(this);
@@ -53,7 +54,7 @@ namespace ChemLive
 
 		// Simulation
 		m_simulation = std::unique_ptr<Simulation::Simulation>(
-			new Simulation::Simulation(m_deviceResources)
+			new Simulation::Simulation()
 		);
 
 		m_moveLookController = std::shared_ptr<MoveLookController>(
@@ -136,8 +137,16 @@ namespace ChemLive
 				// Sphere
 				//m_sphereRenderer->Update(m_timer);
 
-				// Simulation
-				m_simulation->Update(m_timer);
+				// Simulation - the live simulation does not advance while a recording is played back
+				if (m_trajectoryPlayer != nullptr)
+				{
+					if (m_trajectoryPlaying)
+						m_trajectoryPlayer->Advance();
+				}
+				else if (m_brickStreamer == nullptr)
+				{
+					m_simulation->Update(m_timer);
+				}
 				m_moveLookController->Update(m_timer, m_layout->RenderPaneRectFDIPS());
 			});
 	}
@@ -167,8 +176,14 @@ namespace ChemLive
 		//  - If so, then have it compute a new view matrix and pass it
 		//    to the SimulationRenderer
 		if (m_moveLookController->IsMoving())
+		{
 			m_simulationRenderer->SetViewMatrix(m_moveLookController->ViewMatrix());
 
+			// A bricked scene only loads what is in view, so it follows the camera
+			if (m_brickStreamer != nullptr)
+				UpdateBrickedSceneView();
+		}
+
 	}
 
 	// Renders the current frame according to the current application state.
@@ -206,7 +221,22 @@ namespace ChemLive
 		//m_sphereRenderer->Render();
 
 		// Simulation
-		m_simulationRenderer->Render(m_simulation->Atoms());
+		if (m_trajectoryPlayer != nullptr)
+		{
+			std::shared_ptr<const Simulation::TrajectoryFrame> frame = m_trajectoryPlayer->CurrentFrame();
+			if (frame != nullptr)
+				m_simulationRenderer->Render(*frame);
+		}
+		else if (m_brickStreamer != nullptr)
+		{
+			std::shared_ptr<const Simulation::TrajectoryFrame> frame = m_brickStreamer->CurrentFrame();
+			if (frame != nullptr)
+				m_simulationRenderer->Render(*frame);
+		}
+		else
+		{
+			m_simulationRenderer->Render(m_simulation->AtomsByElement());
+		}
 
 		// Render the menu at the end (although it shouldn't really matter)
 		m_titleBar->Render();
@@ -385,8 +415,8 @@ namespace ChemLive
 
 				// If the simulation is paused, then we want to determine which atom
 				// the pointer is over and update its color accordingly
-				if (m_simulation->IsPaused())
-					m_simulationRenderer->PointerMoved(p, m_layout->RenderPaneRectFDIPS(), m_simulation->Atoms());
+				if (m_simulation->IsPaused() && m_trajectoryPlayer == nullptr)
+					m_simulationRenderer->PointerMoved(p, m_layout->RenderPaneRectFDIPS(), m_simulation->AtomsByElement());
 
 				m_menu->PointerNotOver();
 				m_menuBar->PointerNotOver();
@@ -802,12 +832,78 @@ namespace ChemLive
 	// Button Event Handlers =============================================================
 	void Main::SimulationPlayButtonClick(const winrt::Windows::Foundation::IInspectable i, int args)
 	{
-		m_simulation->PlaySimulation();
+		// Play/Pause drive the trajectory instead of the simulation while one is open
+		if (m_trajectoryPlayer != nullptr)
+			m_trajectoryPlaying = true;
+		else
+			m_simulation->PlaySimulation();
 	}
 
 	void Main::SimulationPauseButtonClick(const winrt::Windows::Foundation::IInspectable i, int args)
 	{
+		if (m_trajectoryPlayer != nullptr)
+			m_trajectoryPlaying = false;
+		else
+			m_simulation->PauseSimulation();
+	}
+
+	// Trajectory Playback ===============================================================
+	void Main::OpenTrajectory(const std::wstring& filename)
+	{
+		// Pause the live simulation so that it resumes from the same state once playback closes
 		m_simulation->PauseSimulation();
+
+		m_trajectoryPlayer = std::unique_ptr<Simulation::TrajectoryPlayer>(new Simulation::TrajectoryPlayer(filename));
+		m_trajectoryPlaying = false;
+
+		m_simulationRenderer->BoxDimensions(m_trajectoryPlayer->BoxDimensions());
+		m_simulationRenderer->CreateDeviceDependentResourcesAsync();
+	}
+
+	void Main::CloseTrajectory()
+	{
+		m_trajectoryPlayer = nullptr;
+		m_trajectoryPlaying = false;
+
+		m_simulationRenderer->BoxDimensions(m_simulation->BoxDimensions());
+		m_simulationRenderer->CreateDeviceDependentResourcesAsync();
+	}
+
+	void Main::SeekTrajectory(size_t frame)
+	{
+		if (m_trajectoryPlayer != nullptr)
+			m_trajectoryPlayer->Seek(frame);
+	}
+
+	// Bricked Scene Viewing ============================================================
+	void Main::OpenBrickedScene(const std::wstring& filename)
+	{
+		m_simulation->PauseSimulation();
+
+		m_brickStreamer = std::unique_ptr<Simulation::BrickStreamer>(new Simulation::BrickStreamer(filename));
+
+		m_simulationRenderer->BoxDimensions(m_brickStreamer->BoxDimensions());
+		m_simulationRenderer->CreateDeviceDependentResourcesAsync();
+		UpdateBrickedSceneView();
+	}
+
+	void Main::CloseBrickedScene()
+	{
+		m_brickStreamer = nullptr;
+
+		m_simulationRenderer->BoxDimensions(m_simulation->BoxDimensions());
+		m_simulationRenderer->CreateDeviceDependentResourcesAsync();
+	}
+
+	void Main::UpdateBrickedSceneView()
+	{
+		XMFLOAT4X4 viewProjection;
+		DirectX::XMStoreFloat4x4(&viewProjection, m_simulationRenderer->ViewProjectionMatrix());
+
+		XMFLOAT3 eye;
+		DirectX::XMStoreFloat3(&eye, m_moveLookController->EyeVector());
+
+		m_brickStreamer->UpdateView(viewProjection, eye);
 	}
 
 	// Slider Event Handlers ===========================================================
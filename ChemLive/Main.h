@@ -10,6 +10,8 @@
 #include "MoveLookController.h"
 #include "SphereRenderer.h"
 #include "Simulation.h"
+#include "TrajectoryPlayer.h"
+#include "BrickStreamer.h"
 
 using DirectX::Sample3DSceneRenderer;
 using DirectX::SampleFpsTextRenderer;
@@ -31,6 +33,15 @@ namespace ChemLive
 		void Update();
 		bool Render();
 
+		// Trajectory playback - while a trajectory is open it is rendered in place of the live simulation
+		void OpenTrajectory(const std::wstring& filename);
+		void CloseTrajectory();
+		void SeekTrajectory(size_t frame);
+
+		// Bricked scene viewing - streams in the part of a very large scene that is in view
+		void OpenBrickedScene(const std::wstring& filename);
+		void CloseBrickedScene();
+
 		// Add controls to the UI
 		void AddMenuControls();
 		void AddMenuBarControls();
@@ -109,6 +120,14 @@ namespace ChemLive
 		std::unique_ptr<Simulation::Simulation> m_simulation;
 		std::unique_ptr<Simulation::SimulationRenderer> m_simulationRenderer;
 
+		// Trajectory Playback - null when showing the live simulation
+		std::unique_ptr<Simulation::TrajectoryPlayer> m_trajectoryPlayer;
+		bool m_trajectoryPlaying;
+
+		// Bricked Scene Viewing - null when showing the live simulation
+		std::unique_ptr<Simulation::BrickStreamer> m_brickStreamer;
+		void UpdateBrickedSceneView();
+
 		// Rendering loop timer.
 		DX::StepTimer m_timer;
 
@@ -0,0 +1,136 @@
+#include "pch.h"
+#include "MappedFile.h"
+#include <filesystem>
+#include <stdexcept>
+#include <utility>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Simulation
+{
+	MappedFile::MappedFile() :
+		m_data(nullptr),
+		m_size(0),
+#if defined(_WIN32)
+		m_file(INVALID_HANDLE_VALUE),
+		m_mapping(nullptr)
+#else
+		m_file(-1)
+#endif
+	{
+	}
+
+	MappedFile::MappedFile(const std::wstring& filename) :
+		MappedFile()
+	{
+#if defined(_WIN32)
+		m_file = CreateFile2(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING, nullptr);
+		if (m_file == INVALID_HANDLE_VALUE)
+			throw std::runtime_error("MappedFile: unable to open file");
+
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(m_file, &size))
+		{
+			Close();
+			throw std::runtime_error("MappedFile: unable to query file size");
+		}
+		m_size = static_cast<uint64_t>(size.QuadPart);
+
+		// An empty file cannot be mapped - leave it open with a null view
+		if (m_size == 0)
+			return;
+
+		m_mapping = CreateFileMappingFromApp(m_file, nullptr, PAGE_READONLY, 0, nullptr);
+		if (m_mapping == nullptr)
+		{
+			Close();
+			throw std::runtime_error("MappedFile: unable to create file mapping");
+		}
+
+		m_data = static_cast<const uint8_t*>(MapViewOfFileFromApp(m_mapping, FILE_MAP_READ, 0, 0));
+		if (m_data == nullptr)
+		{
+			Close();
+			throw std::runtime_error("MappedFile: unable to map view of file");
+		}
+#else
+		m_file = open(std::filesystem::path(filename).c_str(), O_RDONLY);
+		if (m_file < 0)
+			throw std::runtime_error("MappedFile: unable to open file");
+
+		struct stat status;
+		if (fstat(m_file, &status) != 0)
+		{
+			Close();
+			throw std::runtime_error("MappedFile: unable to query file size");
+		}
+		m_size = static_cast<uint64_t>(status.st_size);
+
+		if (m_size == 0)
+			return;
+
+		void* view = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, m_file, 0);
+		if (view == MAP_FAILED)
+		{
+			Close();
+			throw std::runtime_error("MappedFile: unable to map file");
+		}
+		m_data = static_cast<const uint8_t*>(view);
+#endif
+	}
+
+	MappedFile::~MappedFile()
+	{
+		Close();
+	}
+
+	MappedFile::MappedFile(MappedFile&& other) noexcept :
+		MappedFile()
+	{
+		*this = std::move(other);
+	}
+
+	MappedFile& MappedFile::operator=(MappedFile&& other) noexcept
+	{
+		if (this != &other)
+		{
+			Close();
+			std::swap(m_data, other.m_data);
+			std::swap(m_size, other.m_size);
+			std::swap(m_file, other.m_file);
+#if defined(_WIN32)
+			std::swap(m_mapping, other.m_mapping);
+#endif
+		}
+		return *this;
+	}
+
+	void MappedFile::Close()
+	{
+#if defined(_WIN32)
+		if (m_data != nullptr)
+			UnmapViewOfFile(m_data);
+		if (m_mapping != nullptr)
+			CloseHandle(m_mapping);
+		if (m_file != INVALID_HANDLE_VALUE)
+			CloseHandle(m_file);
+
+		m_mapping = nullptr;
+		m_file = INVALID_HANDLE_VALUE;
+#else
+		if (m_data != nullptr)
+			munmap(const_cast<uint8_t*>(m_data), m_size);
+		if (m_file >= 0)
+			close(m_file);
+
+		m_file = -1;
+#endif
+		m_data = nullptr;
+		m_size = 0;
+	}
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "pch.h"
+#include <cstdint>
+#include <string>
+
+namespace Simulation
+{
+	/*
+	*	Read-only memory mapping of an entire file. Pages are only read from disk when they
+	*	are touched, so opening even a very large file is cheap and random access into it
+	*	costs one page fault per page rather than a read of everything before it.
+	*/
+	class MappedFile
+	{
+	public:
+		MappedFile();
+		MappedFile(const std::wstring& filename);		// Throws std::runtime_error if the file cannot be mapped
+		~MappedFile();
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+		MappedFile(MappedFile&& other) noexcept;
+		MappedFile& operator=(MappedFile&& other) noexcept;
+
+		void Close();
+
+		// GET
+		const uint8_t*	Data() const { return m_data; }
+		uint64_t		Size() const { return m_size; }
+		bool			IsOpen() const { return m_data != nullptr; }
+
+	private:
+		const uint8_t*	m_data;
+		uint64_t		m_size;
+
+#if defined(_WIN32)
+		HANDLE			m_file;
+		HANDLE			m_mapping;
+#else
+		int				m_file;
+#endif
+	};
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "pch.h"
+#include <cstdint>
+
+namespace Simulation
+{
+	/*
+	*	Morton (Z-order) codes: the bits of three cell coordinates interleaved, x lowest, so that
+	*	sorting by code walks the cells along a curve that keeps nearby cells close together. Up
+	*	to 21 bits a coordinate, 63 in all.
+	*/
+	namespace Morton
+	{
+		// Bits of every coordinate in a code at most
+		const unsigned int Bits = 21;
+
+		// The low 21 bits of 'value' moved to every third bit
+		inline uint64_t SpreadBits(uint64_t value)
+		{
+			value &= 0x1fffff;
+			value = (value | value << 32) & 0x1f00000000ffffull;
+			value = (value | value << 16) & 0x1f0000ff0000ffull;
+			value = (value | value << 8) & 0x100f00f00f00f00full;
+			value = (value | value << 4) & 0x10c30c30c30c30c3ull;
+			value = (value | value << 2) & 0x1249249249249249ull;
+			return value;
+		}
+
+		inline uint64_t Code(uint32_t x, uint32_t y, uint32_t z)
+		{
+			return SpreadBits(x) | SpreadBits(y) << 1 | SpreadBits(z) << 2;
+		}
+	}
+}
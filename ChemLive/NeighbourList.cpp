@@ -0,0 +1,268 @@
+#include "pch.h"
+#include "NeighbourList.h"
+#include "Boundaries.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <ppl.h>
+#include <stdexcept>
+
+namespace Simulation
+{
+	// Atoms per task
+	static const size_t ListBlock = 4096;
+
+	// Cells per atom at most - a sparse gas in a big box would otherwise ask for a huge grid
+	static const double MaxCellsPerAtom = 2.0;
+
+	NeighbourList::NeighbourList(float cutoff, float skin) :
+		m_cutoff(cutoff),
+		m_skin(skin),
+		m_valid(false),
+		m_builds(0),
+		m_builtBox(0.0f, 0.0f, 0.0f),
+		m_periodicAxes(PERIODIC_NONE),
+		m_cells{ 1, 1, 1 }
+	{
+		if (!(cutoff > 0.0f) || !(skin >= 0.0f))
+			throw std::runtime_error("NeighbourList: the cutoff must be positive and the skin must not be negative");
+	}
+
+	bool NeighbourList::Update(const XMFLOAT3* positions, size_t count, XMFLOAT3 boxDimensions, unsigned int periodicAxes,
+		const uint32_t* exclusionStart, const uint32_t* excluded)
+	{
+		if (!NeedsBuild(positions, count, boxDimensions, periodicAxes))
+			return false;
+
+		Build(positions, count, boxDimensions, periodicAxes, exclusionStart, excluded);
+		return true;
+	}
+
+	bool NeighbourList::NeedsBuild(const XMFLOAT3* positions, size_t count, XMFLOAT3 boxDimensions, unsigned int periodicAxes)
+	{
+		if (!m_valid || count != AtomCount() || periodicAxes != m_periodicAxes ||
+			boxDimensions.x != m_builtBox.x || boxDimensions.y != m_builtBox.y || boxDimensions.z != m_builtBox.z)
+			return true;
+
+		// An atom wrapped to the far side of a periodic box has hardly moved
+		const XMFLOAT3 period = Boundaries::Periods(boxDimensions, periodicAxes);
+		const XMFLOAT3 inverse = Boundaries::InversePeriods(boxDimensions, periodicAxes);
+
+		// Two atoms that each moved half the skin may have closed the whole skin between them
+		const float limit = 0.25f * m_skin * m_skin;
+		std::atomic<bool> moved(false);
+		const size_t blocks = (count + ListBlock - 1) / ListBlock;
+		concurrency::parallel_for(size_t(0), blocks, [&](size_t block)
+			{
+				size_t end = std::min(count, (block + 1) * ListBlock);
+				for (size_t iii = block * ListBlock; iii < end && !moved.load(std::memory_order_relaxed); ++iii)
+				{
+					float dx = Boundaries::MinimumImage(positions[iii].x - m_builtPositions[iii].x, period.x, inverse.x);
+					float dy = Boundaries::MinimumImage(positions[iii].y - m_builtPositions[iii].y, period.y, inverse.y);
+					float dz = Boundaries::MinimumImage(positions[iii].z - m_builtPositions[iii].z, period.z, inverse.z);
+					if (dx * dx + dy * dy + dz * dz > limit)
+						moved = true;
+				}
+			});
+		return moved;
+	}
+
+	void NeighbourList::Build(const XMFLOAT3* positions, size_t count, XMFLOAT3 boxDimensions, unsigned int periodicAxes,
+		const uint32_t* exclusionStart, const uint32_t* excluded)
+	{
+		if (count >= 0xFFFFFFFF)
+			throw std::runtime_error("NeighbourList: too many atoms");
+
+		const float lengths[3] = { boxDimensions.x, boxDimensions.y, boxDimensions.z };
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			if (Boundaries::IsPeriodic(periodicAxes, axis) && lengths[axis] < MinimumPeriod())
+				throw std::runtime_error("NeighbourList: a periodic box length is shorter than twice the cutoff plus skin");
+		}
+
+		++m_builds;
+		m_valid = true;
+		m_builtBox = boxDimensions;
+		m_periodicAxes = periodicAxes;
+		m_builtPositions.assign(positions, positions + count);
+
+		const float reach = m_cutoff + m_skin;
+		const float reachSquared = reach * reach;
+		const float box[3] = { boxDimensions.x, boxDimensions.y, boxDimensions.z };
+		const XMFLOAT3 period = Boundaries::Periods(boxDimensions, periodicAxes);
+		const XMFLOAT3 inverse = Boundaries::InversePeriods(boxDimensions, periodicAxes);
+
+		// Cells at least 'reach' wide, so every neighbour is in one of the 27 cells around an atom
+		double cellCount = 1.0;
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			m_cells[axis] = std::max(1, static_cast<int32_t>(std::min(1.0e6, std::floor(static_cast<double>(box[axis]) / reach))));
+			cellCount *= m_cells[axis];
+		}
+		const double maxCells = MaxCellsPerAtom * count + 64.0;
+		if (cellCount > maxCells)
+		{
+			double scale = std::cbrt(maxCells / cellCount);
+			for (int axis = 0; axis < 3; ++axis)
+				m_cells[axis] = std::max(1, static_cast<int32_t>(m_cells[axis] * scale));
+		}
+
+		const float scale[3] = { m_cells[0] / box[0], m_cells[1] / box[1], m_cells[2] / box[2] };
+		auto cellCoordinate = [&](float position, int axis)
+			{
+				// Atoms a little outside the box (before the walls catch them) go in the outer cells,
+				// ones not yet wrapped around a periodic axis in the cell of their image
+				int32_t cell = static_cast<int32_t>(std::floor((position + box[axis] / 2.0f) * scale[axis]));
+				if (Boundaries::IsPeriodic(periodicAxes, axis))
+					return (cell % m_cells[axis] + m_cells[axis]) % m_cells[axis];
+				return std::max(0, std::min(m_cells[axis] - 1, cell));
+			};
+
+		// The cells next to 'cell' on an axis, itself included - clamped at walls, wrapped around
+		// periodic axes, where a grid of fewer than 3 cells would otherwise list one twice
+		auto adjacentCells = [&](int32_t cell, int axis, int32_t* adjacent)
+			{
+				const int32_t cells = m_cells[axis];
+				if (!Boundaries::IsPeriodic(periodicAxes, axis))
+				{
+					int32_t found = 0;
+					for (int32_t other = std::max(0, cell - 1); other <= std::min(cells - 1, cell + 1); ++other)
+						adjacent[found++] = other;
+					return found;
+				}
+
+				if (cells < 3)
+				{
+					for (int32_t other = 0; other < cells; ++other)
+						adjacent[other] = other;
+					return cells;
+				}
+
+				adjacent[0] = (cell + cells - 1) % cells;
+				adjacent[1] = cell;
+				adjacent[2] = (cell + 1) % cells;
+				return 3;
+			};
+
+		// Sort the atoms into cells - a counting sort keeps every cell in ascending index order
+		m_cellOf.resize(count);
+		concurrency::parallel_for(size_t(0), count, [&](size_t iii)
+			{
+				m_cellOf[iii] = static_cast<uint32_t>(
+					(cellCoordinate(positions[iii].z, 2) * m_cells[1] + cellCoordinate(positions[iii].y, 1)) * m_cells[0] + cellCoordinate(positions[iii].x, 0));
+			});
+
+		const size_t cells = static_cast<size_t>(m_cells[0]) * m_cells[1] * m_cells[2];
+		m_cellStart.assign(cells + 1, 0);
+		for (size_t iii = 0; iii < count; ++iii)
+			++m_cellStart[m_cellOf[iii] + 1];
+		for (size_t cell = 0; cell < cells; ++cell)
+			m_cellStart[cell + 1] += m_cellStart[cell];
+
+		m_cellAtoms.resize(count);
+		{
+			std::vector<uint32_t> fill(m_cellStart.begin(), m_cellStart.end() - 1);
+			for (size_t iii = 0; iii < count; ++iii)
+				m_cellAtoms[fill[m_cellOf[iii]]++] = static_cast<uint32_t>(iii);
+		}
+
+		// Positions in cell order, so scanning a cell reads memory in sequence
+		m_cellPositions.resize(count);
+		concurrency::parallel_for(size_t(0), count, [&](size_t kkk)
+			{
+				m_cellPositions[kkk] = positions[m_cellAtoms[kkk]];
+			});
+
+		// Neighbours of every block of atoms into its own list, then concatenated. Blocks run in cell
+		// order, so consecutive atoms search the same cells and find them in cache.
+		const size_t blocks = (count + ListBlock - 1) / ListBlock;
+		std::vector<std::vector<uint32_t>> found(blocks);
+		m_offsets.assign(count + 1, 0);
+		m_furthest.resize(count);
+		concurrency::parallel_for(size_t(0), blocks, [&](size_t block)
+			{
+				std::vector<uint32_t>& list = found[block];
+				size_t end = std::min(count, (block + 1) * ListBlock);
+				for (size_t kkk = block * ListBlock; kkk < end; ++kkk)
+				{
+					const uint32_t iii = m_cellAtoms[kkk];
+					const XMFLOAT3 position = m_cellPositions[kkk];
+					const uint32_t cell = m_cellOf[iii];
+					const int32_t cx = static_cast<int32_t>(cell % m_cells[0]);
+					const int32_t cy = static_cast<int32_t>((cell / m_cells[0]) % m_cells[1]);
+					const int32_t cz = static_cast<int32_t>(cell / (static_cast<uint32_t>(m_cells[0]) * m_cells[1]));
+					const size_t before = list.size();
+					uint32_t furthest = iii;
+
+					int32_t xs[3], ys[3], zs[3];
+					const int32_t xCount = adjacentCells(cx, 0, xs);
+					const int32_t yCount = adjacentCells(cy, 1, ys);
+					const int32_t zCount = adjacentCells(cz, 2, zs);
+					for (int32_t z = 0; z < zCount; ++z)
+					{
+						for (int32_t y = 0; y < yCount; ++y)
+						{
+							for (int32_t x = 0; x < xCount; ++x)
+							{
+								const size_t other = (static_cast<size_t>(zs[z]) * m_cells[1] + ys[y]) * m_cells[0] + xs[x];
+								const uint32_t* first = m_cellAtoms.data() + m_cellStart[other];
+								const uint32_t* last = m_cellAtoms.data() + m_cellStart[other + 1];
+
+								// Half list - only the larger indices, which start past i in every cell
+								const uint32_t* start = std::upper_bound(first, last, iii);
+								const XMFLOAT3* partner = m_cellPositions.data() + (start - m_cellAtoms.data());
+								if (start != last)
+									furthest = std::max(furthest, last[-1]);
+
+								// Every candidate is written and only the ones in reach are kept, so
+								// the loop has no unpredictable branch - the minimum image is a no-op
+								// on walled axes
+								const size_t kept = list.size();
+								list.resize(kept + (last - start));
+								uint32_t* out = list.data() + kept;
+								size_t inReach = 0;
+								for (const uint32_t* jjj = start; jjj != last; ++jjj, ++partner)
+								{
+									float dx = Boundaries::MinimumImage(position.x - partner->x, period.x, inverse.x);
+									float dy = Boundaries::MinimumImage(position.y - partner->y, period.y, inverse.y);
+									float dz = Boundaries::MinimumImage(position.z - partner->z, period.z, inverse.z);
+									out[inReach] = *jjj;
+									inReach += dx * dx + dy * dy + dz * dz < reachSquared ? 1 : 0;
+								}
+								list.resize(kept + inReach);
+							}
+						}
+					}
+
+					// Bonded partners - only a handful per atom, if any
+					if (exclusionStart != nullptr && exclusionStart[iii] != exclusionStart[iii + 1])
+					{
+						const uint32_t* firstExcluded = excluded + exclusionStart[iii];
+						const uint32_t* lastExcluded = excluded + exclusionStart[iii + 1];
+						list.erase(std::remove_if(list.begin() + before, list.end(),
+							[&](uint32_t jjj) { return std::binary_search(firstExcluded, lastExcluded, jjj); }), list.end());
+					}
+
+					m_offsets[iii + 1] = list.size() - before;
+					m_furthest[iii] = furthest;
+				}
+			});
+
+		for (size_t iii = 0; iii < count; ++iii)
+			m_offsets[iii + 1] += m_offsets[iii];
+
+		m_neighbours.resize(m_offsets[count]);
+		concurrency::parallel_for(size_t(0), blocks, [&](size_t block)
+			{
+				const uint32_t* list = found[block].data();
+				size_t end = std::min(count, (block + 1) * ListBlock);
+				for (size_t kkk = block * ListBlock; kkk < end; ++kkk)
+				{
+					const uint32_t iii = m_cellAtoms[kkk];
+					const size_t length = m_offsets[iii + 1] - m_offsets[iii];
+					std::copy(list, list + length, m_neighbours.begin() + m_offsets[iii]);
+					list += length;
+				}
+			});
+	}
+}
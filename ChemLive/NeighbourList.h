@@ -0,0 +1,82 @@
+#pragma once
+
+#include "pch.h"
+#include "Enums.h"
+#include <cstdint>
+#include <vector>
+
+using DirectX::XMFLOAT3;
+
+namespace Simulation
+{
+	/*
+	*	Verlet neighbour list - every pair closer than cutoff + skin, stored once (the "half" list:
+	*	the neighbours of i all have a larger index), so a pair kernel can apply Newton's third law
+	*	and do each pair's work only once.
+	*
+	*	Built from a cell grid in parallel, and only rebuilt once some atom has moved more than half
+	*	the skin since the last build - until then no pair that matters can be missing.
+	*
+	*	On periodic axes (see Boundaries.h) the grid wraps around and pairs are found through the
+	*	minimum image, so atoms by opposite faces are neighbours - the pair kernels then take the
+	*	minimum image of their displacements too. Only the nearest image of a partner counts, which
+	*	is all of them while the periodic box lengths are at least twice cutoff + skin - Update
+	*	throws on a shorter one.
+	*
+	*	Pairs held together otherwise - constrained bonds - can be left out of the list altogether.
+	*/
+	class NeighbourList
+	{
+	public:
+		NeighbourList(float cutoff, float skin = 0.1f);
+
+		// Rebuild if needed. Returns true if the list was rebuilt. The partners of i in
+		// excluded[exclusionStart[i]] .. excluded[exclusionStart[i + 1] - 1] are left out of a rebuild.
+		bool Update(const XMFLOAT3* positions, size_t count, XMFLOAT3 boxDimensions, unsigned int periodicAxes = PERIODIC_NONE,
+			const uint32_t* exclusionStart = nullptr, const uint32_t* excluded = nullptr);
+		void Invalidate() { m_valid = false; }		// Rebuild on the next Update - after the exclusions change too
+
+		// Neighbours of i are Neighbours()[Offsets()[i]] .. Neighbours()[Offsets()[i + 1] - 1]
+		const std::vector<size_t>&		Offsets() const { return m_offsets; }
+		const std::vector<uint32_t>&	Neighbours() const { return m_neighbours; }
+
+		// Upper bound on the partner indices of i (i itself if it has none) - how far a pair kernel
+		// that starts at i can write
+		uint32_t						Furthest(size_t iii) const { return m_furthest[iii]; }
+
+		// GET
+		size_t				AtomCount() const { return m_offsets.empty() ? 0 : m_offsets.size() - 1; }
+		size_t				PairCount() const { return m_neighbours.size(); }
+		float				Cutoff() const { return m_cutoff; }
+		float				Skin() const { return m_skin; }
+		float				MinimumPeriod() const { return 2.0f * (m_cutoff + m_skin); }		// Shortest periodic box length
+		unsigned long long	Builds() const { return m_builds; }
+		XMFLOAT3			BoxDimensions() const { return m_builtBox; }		// Of the last build
+		unsigned int		PeriodicAxes() const { return m_periodicAxes; }
+
+	private:
+		bool NeedsBuild(const XMFLOAT3* positions, size_t count, XMFLOAT3 boxDimensions, unsigned int periodicAxes);
+		void Build(const XMFLOAT3* positions, size_t count, XMFLOAT3 boxDimensions, unsigned int periodicAxes,
+			const uint32_t* exclusionStart, const uint32_t* excluded);
+
+		float					m_cutoff;
+		float					m_skin;
+		bool					m_valid;
+		unsigned long long		m_builds;
+
+		std::vector<size_t>		m_offsets;
+		std::vector<uint32_t>	m_neighbours;
+		std::vector<uint32_t>	m_furthest;
+
+		std::vector<XMFLOAT3>	m_builtPositions;		// Where the atoms were at the last build
+		XMFLOAT3				m_builtBox;
+		unsigned int			m_periodicAxes;
+
+		// Cell grid of the last build - atoms sorted by cell, ascending index within a cell
+		int32_t					m_cells[3];
+		std::vector<uint32_t>	m_cellOf;
+		std::vector<uint32_t>	m_cellStart;
+		std::vector<uint32_t>	m_cellAtoms;
+		std::vector<XMFLOAT3>	m_cellPositions;		// Same order as m_cellAtoms
+	};
+}
@@ -14,9 +14,9 @@ namespace Simulation
 		// Constructors
 		// Most common isotope = Neon-20
 		// Most common charge  = 0
-		Neon(const std::shared_ptr<DX::DeviceResources>& deviceResources, XMFLOAT3 position, XMFLOAT3 velocity, int neutronCount = 10, int charge = 0);
+		Neon(XMFLOAT3 position, XMFLOAT3 velocity, int neutronCount = 10, int charge = 0);
 
 		// Update
-		void Update(double timeDelta, const std::vector<Atom*>& atoms, XMFLOAT3 boxDimensions);
+		void Update(double timeDelta, const std::vector<Atom*>& atoms, XMFLOAT3 boxDimensions, unsigned int periodicAxes);
 	};
 }
\ No newline at end of file
@@ -14,9 +14,9 @@ namespace Simulation
 		// Constructors
 		// Most common isotope = Nitrogen-14
 		// Most common charge  = 0
-		Nitrogen(const std::shared_ptr<DX::DeviceResources>& deviceResources, XMFLOAT3 position, XMFLOAT3 velocity, int neutronCount = 7, int charge = 0);
+		Nitrogen(XMFLOAT3 position, XMFLOAT3 velocity, int neutronCount = 7, int charge = 0);
 
 		// Update
-		void Update(double timeDelta, const std::vector<Atom*>& atoms, XMFLOAT3 boxDimensions);
+		void Update(double timeDelta, const std::vector<Atom*>& atoms, XMFLOAT3 boxDimensions, unsigned int periodicAxes);
 	};
 }
\ No newline at end of file
@@ -0,0 +1,309 @@
+#include "pch.h"
+#include "PairForces.h"
+#include "Boundaries.h"
+#include <algorithm>
+#include <cmath>
+#include <ppl.h>
+#include <stdexcept>
+#include <thread>
+
+using namespace DirectX;
+
+namespace Simulation
+{
+	// Atoms per task when summing the windows
+	static const size_t ReduceBlock = 16384;
+
+	PairForces::PairForces(const PairForceSettings& settings) :
+		m_settings(settings)
+	{
+		if (!(settings.cutoff > settings.innerRadius) || !(settings.innerRadius > 0.0f) || settings.tablePoints < 16)
+			throw std::runtime_error("PairForces: the cutoff must be beyond a positive inner radius, with at least 16 table points");
+
+		m_cutoffSquared = settings.cutoff * settings.cutoff;
+		m_innerSquared = settings.innerRadius * settings.innerRadius;
+		m_intervalsPerSquare = settings.tablePoints / (m_cutoffSquared - m_innerSquared);
+		m_lastInterval = std::nextafter(static_cast<float>(settings.tablePoints), 0.0f);
+
+		// Table 0 stays zero, then one table per unordered pair of real elements
+		const size_t intervals = settings.tablePoints;
+		m_tables.assign(intervals * (1 + 10 * 11 / 2), XMFLOAT4A(0.0f, 0.0f, 0.0f, 0.0f));
+		std::fill(std::begin(m_tableOf), std::end(m_tableOf), 0u);
+
+		uint32_t next = 1;
+		for (int a = Element::HYDROGEN; a <= Element::NEON; ++a)
+		{
+			for (int b = a; b <= Element::NEON; ++b)
+			{
+				m_tableOf[a * 11 + b] = m_tableOf[b * 11 + a] = static_cast<uint32_t>(next++ * intervals);
+
+				const PairPotential::PairParameters& pair = PairPotential::Pair(static_cast<Element>(a), static_cast<Element>(b));
+				double (*form)(const PairPotential::PairParameters&, double, double&) =
+					settings.form == PairForm::Morse ? PairPotential::Morse : PairPotential::LennardJones;
+
+				BuildTable(static_cast<Element>(a), static_cast<Element>(b),
+					[&](double r) { double derivative; return form(pair, r, derivative); },
+					[&](double r) { double derivative; form(pair, r, derivative); return derivative; });
+			}
+		}
+	}
+
+	void PairForces::SetPotential(Element a, Element b, std::function<double(double)> energy, std::function<double(double)> derivative)
+	{
+		if (a < Element::HYDROGEN || a > Element::NEON || b < Element::HYDROGEN || b > Element::NEON || !energy)
+			throw std::runtime_error("PairForces: invalid element pair or potential");
+
+		if (!derivative)
+		{
+			derivative = [energy](double r)
+				{
+					double h = 1.0e-5 * r;
+					return (energy(r + h) - energy(r - h)) / (2.0 * h);
+				};
+		}
+		BuildTable(a, b, energy, derivative);
+	}
+
+	void PairForces::BuildTable(Element a, Element b, const std::function<double(double)>& energy, const std::function<double(double)>& derivative)
+	{
+		// Cubic Hermite spline in s = r^2 through the exact energy and slope at every knot
+		const size_t intervals = m_settings.tablePoints;
+		const double inner = static_cast<double>(m_settings.innerRadius) * m_settings.innerRadius;
+		const double width = (static_cast<double>(m_settings.cutoff) * m_settings.cutoff - inner) / intervals;
+		const double shift = m_settings.shift ? energy(m_settings.cutoff) : 0.0;
+
+		auto knot = [&](size_t k, double& value, double& slope)
+			{
+				double r = std::sqrt(inner + k * width);
+				value = energy(r) - shift;
+				slope = width * derivative(r) / (2.0 * r);		// dV/dt, with t the position inside an interval
+			};
+
+		XMFLOAT4A* table = m_tables.data() + m_tableOf[a * 11 + b];
+		double v0, m0;
+		knot(0, v0, m0);
+		for (size_t k = 0; k < intervals; ++k)
+		{
+			double v1, m1;
+			knot(k + 1, v1, m1);
+			table[k] = XMFLOAT4A(
+				static_cast<float>(v0),
+				static_cast<float>(m0),
+				static_cast<float>(3.0 * (v1 - v0) - 2.0 * m0 - m1),
+				static_cast<float>(2.0 * (v0 - v1) + m0 + m1));
+			v0 = v1;
+			m0 = m1;
+		}
+	}
+
+	void PairForces::Evaluate(Element a, Element b, float r, float& energy, float& forceOverDistance) const
+	{
+		const float s = r * r;
+		if (s >= m_cutoffSquared)
+		{
+			energy = forceOverDistance = 0.0f;
+			return;
+		}
+
+		float position = std::min(m_lastInterval, std::max(0.0f, (s - m_innerSquared) * m_intervalsPerSquare));
+		float interval = std::floor(position);
+		float t = position - interval;
+		const XMFLOAT4A& c = m_tables[m_tableOf[a * 11 + b] + static_cast<uint32_t>(interval)];
+
+		energy = c.x + t * (c.y + t * (c.z + t * c.w));
+		forceOverDistance = -2.0f * m_intervalsPerSquare * (c.y + t * (2.0f * c.z + t * 3.0f * c.w));
+	}
+
+	double PairForces::Compute(const NeighbourList& list, const XMFLOAT3* positions, const uint8_t* elements, XMFLOAT3* forces)
+	{
+		if (list.Cutoff() + list.Skin() < m_settings.cutoff)
+			throw std::runtime_error("PairForces: the neighbour list is shorter than the cutoff");
+
+		PairTable table;
+		table.coefficients = m_tables.data();
+		table.cutoffSquared = m_cutoffSquared;
+		table.innerSquared = m_innerSquared;
+		table.intervalsPerSquare = m_intervalsPerSquare;
+		table.lastInterval = m_lastInterval;
+		table.tableOf = m_tableOf;
+		table.elements = elements;
+		return SumPairForces(list, positions, table, m_windows, forces);
+	}
+
+	// SumPairForces for one kind of table - per element pair or shared, with or without charges -
+	// so that the choice costs nothing in the inner loop
+	template <bool ByElement, bool Charged>
+	static double SumPairs(const NeighbourList& list, const XMFLOAT3* positions, const PairTable& table,
+		std::vector<std::vector<XMFLOAT3>>& windows, XMFLOAT3* forces)
+	{
+		const size_t count = list.AtomCount();
+		if (count == 0)
+			return 0.0;
+
+		const std::vector<size_t>& offsets = list.Offsets();
+		const uint32_t* neighbours = list.Neighbours().data();
+		const XMFLOAT3 period = Boundaries::Periods(list.BoxDimensions(), list.PeriodicAxes());
+		const XMFLOAT3 inverse = Boundaries::InversePeriods(list.BoxDimensions(), list.PeriodicAxes());
+		const XMFLOAT4A* coefficientTable = table.coefficients;
+		const uint8_t* elements = table.elements;
+		const float* charges = table.charges;
+
+		// One task per core, each with about the same number of pairs
+		const size_t tasks = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), count));
+		std::vector<size_t> taskStart(tasks + 1, count);
+		for (size_t task = 0; task < tasks; ++task)
+		{
+			size_t pairs = offsets[count] / tasks * task;
+			taskStart[task] = task == 0 ? 0 : std::lower_bound(offsets.begin(), offsets.end() - 1, pairs) - offsets.begin();
+		}
+
+		windows.resize(tasks);
+		std::vector<size_t> windowEnd(tasks);
+		std::vector<double> energies(tasks, 0.0);
+
+		concurrency::parallel_for(size_t(0), tasks, [&](size_t task)
+			{
+				const size_t first = taskStart[task];
+				const size_t last = taskStart[task + 1];
+
+				size_t end = last;
+				for (size_t iii = first; iii < last; ++iii)
+					end = std::max(end, static_cast<size_t>(list.Furthest(iii)) + 1);
+				windowEnd[task] = end;
+
+				std::vector<XMFLOAT3>& window = windows[task];
+				window.assign(end - first, XMFLOAT3(0.0f, 0.0f, 0.0f));
+				XMFLOAT3* local = window.data() - first;		// Indexed by atom
+
+				const XMVECTOR cutoffSquared = XMVectorReplicate(table.cutoffSquared);
+				const XMVECTOR innerSquared = XMVectorReplicate(table.innerSquared);
+				const XMVECTOR intervalsPerSquare = XMVectorReplicate(table.intervalsPerSquare);
+				const XMVECTOR lastInterval = XMVectorReplicate(table.lastInterval);
+				const XMVECTOR forceScale = XMVectorReplicate(-2.0f * table.intervalsPerSquare);
+				const XMVECTOR two = XMVectorReplicate(2.0f);
+				const XMVECTOR three = XMVectorReplicate(3.0f);
+				const XMVECTOR zero = XMVectorZero();
+
+				// Minimum image on the periodic axes, a no-op on the walled ones
+				const XMVECTOR periodX = XMVectorReplicate(period.x), inverseX = XMVectorReplicate(inverse.x);
+				const XMVECTOR periodY = XMVectorReplicate(period.y), inverseY = XMVectorReplicate(inverse.y);
+				const XMVECTOR periodZ = XMVectorReplicate(period.z), inverseZ = XMVectorReplicate(inverse.z);
+
+				double energy = 0.0;
+				for (size_t iii = first; iii < last; ++iii)
+				{
+					const XMFLOAT3 position = positions[iii];
+					const XMVECTOR xi = XMVectorReplicate(position.x);
+					const XMVECTOR yi = XMVectorReplicate(position.y);
+					const XMVECTOR zi = XMVectorReplicate(position.z);
+					const uint32_t* tableOf = ByElement ? table.tableOf + elements[iii] * 11 : nullptr;
+					const XMVECTOR qi = XMVectorReplicate(Charged ? charges[iii] : 1.0f);
+
+					XMVECTOR fx = zero, fy = zero, fz = zero, pairEnergy = zero;
+					for (size_t kkk = offsets[iii]; kkk < offsets[iii + 1]; kkk += 4)
+					{
+						// Four partners per pass - missing lanes pair the atom with itself, which the
+						// r^2 > 0 test below masks out
+						const size_t lanes = std::min<size_t>(4, offsets[iii + 1] - kkk);
+						uint32_t j[4] = { static_cast<uint32_t>(iii), static_cast<uint32_t>(iii), static_cast<uint32_t>(iii), static_cast<uint32_t>(iii) };
+						for (size_t lane = 0; lane < lanes; ++lane)
+							j[lane] = neighbours[kkk + lane];
+
+						const XMVECTOR dx = Boundaries::MinimumImage(XMVectorSubtract(xi, XMVectorSet(positions[j[0]].x, positions[j[1]].x, positions[j[2]].x, positions[j[3]].x)), periodX, inverseX);
+						const XMVECTOR dy = Boundaries::MinimumImage(XMVectorSubtract(yi, XMVectorSet(positions[j[0]].y, positions[j[1]].y, positions[j[2]].y, positions[j[3]].y)), periodY, inverseY);
+						const XMVECTOR dz = Boundaries::MinimumImage(XMVectorSubtract(zi, XMVectorSet(positions[j[0]].z, positions[j[1]].z, positions[j[2]].z, positions[j[3]].z)), periodZ, inverseZ);
+						const XMVECTOR r2 = XMVectorMultiplyAdd(dz, dz, XMVectorMultiplyAdd(dy, dy, XMVectorMultiply(dx, dx)));
+						const XMVECTOR inRange = XMVectorAndInt(XMVectorLess(r2, cutoffSquared), XMVectorGreater(r2, zero));
+
+						// Table coordinate, clamped so that pairs inside the inner radius use the first knot
+						const XMVECTOR scaled = XMVectorClamp(XMVectorMultiply(XMVectorSubtract(r2, innerSquared), intervalsPerSquare), zero, lastInterval);
+						const XMVECTOR interval = XMVectorTruncate(scaled);
+						const XMVECTOR t = XMVectorSubtract(scaled, interval);
+
+						XMFLOAT4A index;
+						XMStoreFloat4A(&index, interval);
+						const XMMATRIX coefficients = XMMatrixTranspose(XMMATRIX(
+							XMLoadFloat4A(&coefficientTable[(ByElement ? tableOf[elements[j[0]]] : 0) + static_cast<uint32_t>(index.x)]),
+							XMLoadFloat4A(&coefficientTable[(ByElement ? tableOf[elements[j[1]]] : 0) + static_cast<uint32_t>(index.y)]),
+							XMLoadFloat4A(&coefficientTable[(ByElement ? tableOf[elements[j[2]]] : 0) + static_cast<uint32_t>(index.z)]),
+							XMLoadFloat4A(&coefficientTable[(ByElement ? tableOf[elements[j[3]]] : 0) + static_cast<uint32_t>(index.w)])));
+
+						// a + t (b + t (c + t d)) and its slope b + t (2c + 3 t d), times q_i q_j if charged
+						XMVECTOR e = XMVectorMultiplyAdd(t, XMVectorMultiplyAdd(t, XMVectorMultiplyAdd(t, coefficients.r[3], coefficients.r[2]), coefficients.r[1]), coefficients.r[0]);
+						XMVECTOR slope = XMVectorMultiplyAdd(t, XMVectorMultiplyAdd(XMVectorMultiply(three, t), coefficients.r[3], XMVectorMultiply(two, coefficients.r[2])), coefficients.r[1]);
+						slope = XMVectorMultiply(slope, forceScale);
+						if (Charged)
+						{
+							const XMVECTOR qq = XMVectorMultiply(qi, XMVectorSet(charges[j[0]], charges[j[1]], charges[j[2]], charges[j[3]]));
+							e = XMVectorMultiply(e, qq);
+							slope = XMVectorMultiply(slope, qq);
+						}
+						const XMVECTOR scale = XMVectorSelect(zero, slope, inRange);
+
+						pairEnergy = XMVectorAdd(pairEnergy, XMVectorSelect(zero, e, inRange));
+						const XMVECTOR px = XMVectorMultiply(scale, dx);
+						const XMVECTOR py = XMVectorMultiply(scale, dy);
+						const XMVECTOR pz = XMVectorMultiply(scale, dz);
+						fx = XMVectorAdd(fx, px);
+						fy = XMVectorAdd(fy, py);
+						fz = XMVectorAdd(fz, pz);
+
+						// Equal and opposite on the partners
+						XMFLOAT4A ox, oy, oz;
+						XMStoreFloat4A(&ox, px);
+						XMStoreFloat4A(&oy, py);
+						XMStoreFloat4A(&oz, pz);
+						const float* lx = &ox.x;
+						const float* ly = &oy.x;
+						const float* lz = &oz.x;
+						for (size_t lane = 0; lane < lanes; ++lane)
+						{
+							XMFLOAT3& partner = local[j[lane]];
+							partner.x -= lx[lane];
+							partner.y -= ly[lane];
+							partner.z -= lz[lane];
+						}
+					}
+
+					local[iii].x += XMVectorGetX(XMVectorSum(fx));
+					local[iii].y += XMVectorGetX(XMVectorSum(fy));
+					local[iii].z += XMVectorGetX(XMVectorSum(fz));
+					energy += XMVectorGetX(XMVectorSum(pairEnergy));
+				}
+				energies[task] = energy;
+			});
+
+		// Sum the windows - every block of atoms adds the windows that reach it
+		const size_t blocks = (count + ReduceBlock - 1) / ReduceBlock;
+		concurrency::parallel_for(size_t(0), blocks, [&](size_t block)
+			{
+				const size_t first = block * ReduceBlock;
+				const size_t last = std::min(count, first + ReduceBlock);
+				for (size_t task = 0; task < tasks; ++task)
+				{
+					const size_t from = std::max(first, taskStart[task]);
+					const size_t to = std::min(last, windowEnd[task]);
+					const XMFLOAT3* window = windows[task].data() - taskStart[task];
+					for (size_t iii = from; iii < to; ++iii)
+					{
+						forces[iii].x += window[iii].x;
+						forces[iii].y += window[iii].y;
+						forces[iii].z += window[iii].z;
+					}
+				}
+			});
+
+		double energy = 0.0;
+		for (double part : energies)
+			energy += part;
+		return energy;
+	}
+
+	double SumPairForces(const NeighbourList& list, const XMFLOAT3* positions, const PairTable& table,
+		std::vector<std::vector<XMFLOAT3>>& windows, XMFLOAT3* forces)
+	{
+		if (table.elements != nullptr)
+			return table.charges != nullptr ? SumPairs<true, true>(list, positions, table, windows, forces) : SumPairs<true, false>(list, positions, table, windows, forces);
+		return table.charges != nullptr ? SumPairs<false, true>(list, positions, table, windows, forces) : SumPairs<false, false>(list, positions, table, windows, forces);
+	}
+}
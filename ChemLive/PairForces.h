@@ -0,0 +1,105 @@
+#pragma once
+
+#include "pch.h"
+#include "Enums.h"
+#include "NeighbourList.h"
+#include "PairPotential.h"
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+using DirectX::XMFLOAT3;
+using DirectX::XMFLOAT4A;
+
+namespace Simulation
+{
+	enum class PairForm
+	{
+		LennardJones,
+		Morse
+	};
+
+	struct PairForceSettings
+	{
+		PairForm		form = PairForm::LennardJones;
+		float			cutoff = 1.0f;			// nm - pairs further apart do not interact
+		bool			shift = true;			// Shift the energy to 0 at the cutoff
+		float			innerRadius = 0.05f;	// nm - closer pairs get the force at this distance
+		unsigned int	tablePoints = 2048;		// Spline intervals per element pair
+	};
+
+	// A spline table uniform in r^2 as SumPairForces reads it
+	struct PairTable
+	{
+		const XMFLOAT4A*	coefficients = nullptr;		// (a, b, c, d) of a + b t + c t^2 + d t^3 for every interval
+		float				cutoffSquared = 0.0f;
+		float				innerSquared = 0.0f;
+		float				intervalsPerSquare = 0.0f;	// Table intervals per nm^2
+		float				lastInterval = 0.0f;		// Largest table coordinate in range
+
+		// With 'elements', every element pair reads its own table from interval tableOf[a * 11 + b].
+		// Without, all pairs read the one table.
+		const uint32_t*		tableOf = nullptr;
+		const uint8_t*		elements = nullptr;
+
+		// With 'charges', the energy and force of a pair are scaled by the product of its charges
+		const float*		charges = nullptr;
+	};
+
+	// The kernel of PairForces, which ParticleMeshEwald also runs for its real space part. Add the
+	// force of every pair of 'list' within the table's cutoff to 'forces' and return their energy.
+	// 'windows' hold each task's forces and are kept between calls.
+	double SumPairForces(const NeighbourList& list, const XMFLOAT3* positions, const PairTable& table,
+		std::vector<std::vector<XMFLOAT3>>& windows, XMFLOAT3* forces);
+
+	/*
+	*	Short range pair forces over a half neighbour list.
+	*
+	*	Every element pair's potential - Lennard-Jones or Morse from PairPotential.h, or anything
+	*	set with SetPotential - is sampled into a cubic spline table that is uniform in r^2, so the
+	*	kernel never takes a square root or an exponent. One table entry gives both the energy and
+	*	the force, which therefore stay consistent.
+	*
+	*	The kernel runs four neighbours at a time in SIMD lanes. Each pair is visited once and the
+	*	force is added to both atoms (Newton's third law). Every task writes its partners' forces
+	*	into a private window covering the indices its pairs reach, and the windows are summed
+	*	afterwards, so no two threads ever write the same force. The windows are small when nearby
+	*	atoms have nearby indices.
+	*/
+	class PairForces
+	{
+	public:
+		PairForces(const PairForceSettings& settings = PairForceSettings());
+
+		// Replace the potential between two elements (both orders). 'energy' is V(r) in kJ/mol;
+		// 'derivative' is dV/dr, or empty to differentiate numerically. Shifted like the built in forms.
+		void SetPotential(Element a, Element b, std::function<double(double)> energy, std::function<double(double)> derivative = nullptr);
+
+		// Add the force on every atom to 'forces' and return the potential energy. 'list' must be up
+		// to date for 'positions' and built with at least Cutoff(). 'elements' are Element values.
+		double Compute(const NeighbourList& list, const XMFLOAT3* positions, const uint8_t* elements, XMFLOAT3* forces);
+
+		// Tabulated energy and force / r at distance r - the force on a is forceOverDistance * (a - b)
+		void Evaluate(Element a, Element b, float r, float& energy, float& forceOverDistance) const;
+
+		// GET
+		float Cutoff() const { return m_settings.cutoff; }
+		const PairForceSettings& Settings() const { return m_settings; }
+
+	private:
+		void BuildTable(Element a, Element b, const std::function<double(double)>& energy, const std::function<double(double)>& derivative);
+
+		PairForceSettings						m_settings;
+		float									m_cutoffSquared;
+		float									m_innerSquared;
+		float									m_intervalsPerSquare;	// Table intervals per nm^2
+		float									m_lastInterval;			// Largest table coordinate in range
+
+		// (a, b, c, d) of a + b t + c t^2 + d t^3 for every interval of every table. Table 0 is all
+		// zeros - for the invalid element.
+		std::vector<XMFLOAT4A>					m_tables;
+		uint32_t								m_tableOf[11 * 11];		// First interval of each element pair's table
+
+		std::vector<std::vector<XMFLOAT3>>		m_windows;				// Per task, kept between calls
+	};
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include "Enums.h"
+#include <array>
+#include <cmath>
+
+/*
+*	Pair potential parameters for every element pair, and the analytic forms they feed. Units are
+*	the simulation's: nm, ps and amu, which makes the energy unit amu nm^2 / ps^2 = 1 kJ/mol.
+*
+*	The per element values are the UFF van der Waals parameters (Rappe et al., 1992). Unlike pairs
+*	are mixed with the Lorentz-Berthelot rules - arithmetic mean of the sizes, geometric mean of the
+*	well depths - when the table is compiled, so a pair's parameters are a constant lookup.
+*/
+
+namespace Simulation
+{
+	namespace PairPotential
+	{
+		struct ElementParameters
+		{
+			double	sigma;			// nm - where the Lennard-Jones energy crosses zero
+			double	epsilon;		// kJ/mol - well depth
+		};
+
+		// Indexed by element, like Constants::AtomicRadii
+		constexpr ElementParameters ElementTable[11] = {
+			{ 0.0,    0.0    },		// Invalid value to take up the 0 index spot
+			{ 0.2571, 0.1841 },		// Hydrogen
+			{ 0.2104, 0.2343 },		// Helium
+			{ 0.2184, 0.1046 },		// Lithium
+			{ 0.2446, 0.3556 },		// Beryllium
+			{ 0.3638, 0.7531 },		// Boron
+			{ 0.3431, 0.4393 },		// Carbon
+			{ 0.3261, 0.2887 },		// Nitrogen
+			{ 0.3118, 0.2510 },		// Oxygen
+			{ 0.2997, 0.2092 },		// Flourine
+			{ 0.2889, 0.1757 }		// Neon
+		};
+
+		struct PairParameters
+		{
+			// Lennard-Jones: 4 epsilon ((sigma / r)^12 - (sigma / r)^6)
+			double	sigma;
+			double	epsilon;
+
+			// Morse: depth ((1 - exp(-width (r - distance)))^2 - 1). The defaults put the minimum
+			// where Lennard-Jones has it, with the same depth and curvature.
+			double	morseDepth;
+			double	morseWidth;		// 1/nm
+			double	morseDistance;	// nm
+		};
+
+		constexpr double ConstexprSqrt(double value)
+		{
+			double root = value > 1.0 ? value : 1.0;
+			for (int iii = 0; iii < 64; ++iii)
+				root = 0.5 * (root + value / root);
+			return value > 0.0 ? root : 0.0;
+		}
+
+		// 2^(1/6) - distance of the Lennard-Jones minimum in units of sigma
+		constexpr double MinimumRatio = 1.1224620483093730;
+
+		constexpr PairParameters Mix(int a, int b)
+		{
+			const double sigma = 0.5 * (ElementTable[a].sigma + ElementTable[b].sigma);
+			const double epsilon = ConstexprSqrt(ElementTable[a].epsilon * ElementTable[b].epsilon);
+			const double distance = MinimumRatio * sigma;
+			return { sigma, epsilon, epsilon, distance > 0.0 ? 6.0 / distance : 0.0, distance };
+		}
+
+		constexpr std::array<PairParameters, 11 * 11> MixTable()
+		{
+			std::array<PairParameters, 11 * 11> table = {};
+			for (int a = 0; a < 11; ++a)
+			{
+				for (int b = 0; b < 11; ++b)
+					table[a * 11 + b] = Mix(a, b);
+			}
+			return table;
+		}
+
+		constexpr std::array<PairParameters, 11 * 11> PairTable = MixTable();
+
+		constexpr const PairParameters& Pair(Element a, Element b) { return PairTable[a * 11 + b]; }
+
+		// Energy at distance r, and its derivative dV/dr in 'derivative'
+		inline double LennardJones(const PairParameters& pair, double r, double& derivative)
+		{
+			double s6 = std::pow(pair.sigma / r, 6.0);
+			derivative = 24.0 * pair.epsilon * (s6 - 2.0 * s6 * s6) / r;
+			return 4.0 * pair.epsilon * (s6 * s6 - s6);
+		}
+
+		inline double Morse(const PairParameters& pair, double r, double& derivative)
+		{
+			double e = std::exp(-pair.morseWidth * (r - pair.morseDistance));
+			derivative = 2.0 * pair.morseDepth * pair.morseWidth * e * (1.0 - e);
+			return pair.morseDepth * ((1.0 - e) * (1.0 - e) - 1.0);
+		}
+	}
+}
@@ -0,0 +1,587 @@
+#include "pch.h"
+#include "ParticleMeshEwald.h"
+#include "Boundaries.h"
+#include "Constants.h"
+#include "PairForces.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <ppl.h>
+#include <stdexcept>
+#include <thread>
+
+using namespace DirectX;
+
+namespace Simulation
+{
+	// Largest B-spline order
+	static const unsigned int MaxOrder = 8;
+
+	// Intervals of the real space table
+	static const size_t RealTablePoints = 4096;
+
+	// Atoms per task when gathering, interpolating and summing
+	static const size_t EwaldBlock = 4096;
+
+	// M_n(w + j) and its slope for j = 0 .. n-1, w in [0, 1) - the weights of the grid points
+	// floor(u), floor(u) - 1, ... of a charge at grid coordinate u = floor(u) + w
+	static void BSpline(float w, unsigned int order, float* weights, float* slopes)
+	{
+		weights[0] = w;
+		weights[1] = 1.0f - w;
+		for (unsigned int k = 3; k <= order; ++k)
+		{
+			// M_k(x) = (x M_k-1(x) + (k - x) M_k-1(x - 1)) / (k - 1), and the slope of M_n is
+			// M_n-1(x) - M_n-1(x - 1)
+			if (k == order)
+			{
+				slopes[0] = weights[0];
+				for (unsigned int j = 1; j < k - 1; ++j)
+					slopes[j] = weights[j] - weights[j - 1];
+				slopes[k - 1] = -weights[k - 2];
+			}
+
+			const float divisor = 1.0f / (k - 1);
+			weights[k - 1] = divisor * (k - w - (k - 1)) * weights[k - 2];
+			for (unsigned int j = k - 2; j > 0; --j)
+				weights[j] = divisor * ((w + j) * weights[j] + (k - w - j) * weights[j - 1]);
+			weights[0] = divisor * w * weights[0];
+		}
+	}
+
+	ParticleMeshEwald::ParticleMeshEwald(const EwaldSettings& settings, float skin) :
+		m_settings(settings),
+		m_gathered(false),
+		m_atomCount(0),
+		m_selfEnergy(0.0),
+		m_list(settings.cutoff, skin),
+		m_box(0.0f, 0.0f, 0.0f),
+		m_periodicAxes(PERIODIC_NONE),
+		m_cell(0.0f, 0.0f, 0.0f),
+		m_components()
+	{
+		if (!(settings.cutoff > settings.innerRadius) || !(settings.innerRadius > 0.0f))
+			throw std::runtime_error("ParticleMeshEwald: the cutoff must be beyond a positive inner radius");
+		if (!(settings.tolerance > 0.0 && settings.tolerance < 1.0))
+			throw std::runtime_error("ParticleMeshEwald: the tolerance must be between 0 and 1");
+		if (settings.order < 3 || settings.order > MaxOrder || !(settings.gridSpacing >= 0.0f) || !(settings.padding >= 0.0f))
+			throw std::runtime_error("ParticleMeshEwald: the spline order must be 3 to 8, with a grid spacing and padding of 0 or more");
+
+		// erfc(beta cutoff) = tolerance, by bisection - erfc falls monotonically
+		double low = 0.0, high = 1.0;
+		while (std::erfc(high * settings.cutoff) > settings.tolerance)
+			high *= 2.0;
+		for (int iteration = 0; iteration < 64; ++iteration)
+		{
+			double middle = 0.5 * (low + high);
+			(std::erfc(middle * settings.cutoff) > settings.tolerance ? low : high) = middle;
+		}
+		m_beta = static_cast<float>(high);
+
+		// About 1.2 A for the common 1 nm / 1e-5 - finer or coarser with beta
+		if (m_settings.gridSpacing == 0.0f)
+			m_settings.gridSpacing = 0.375f / m_beta;
+		m_settings.padding = std::max(m_settings.padding, m_settings.cutoff);
+
+		m_gridSize[0] = m_gridSize[1] = m_gridSize[2] = 0;
+		BuildTable();
+	}
+
+	void ParticleMeshEwald::Reset()
+	{
+		m_gathered = false;
+		m_list.Invalidate();
+	}
+
+	double ParticleMeshEwald::AddForces(const AtomArrays& atoms, XMFLOAT3* forces)
+	{
+		Gather(atoms);
+		if (m_indices.empty())
+		{
+			m_components = EwaldComponents();
+			return 0.0;
+		}
+
+		std::fill(m_forces.begin(), m_forces.end(), XMFLOAT3(0.0f, 0.0f, 0.0f));
+		m_components = EwaldComponents();
+
+		if (m_settings.terms != EwaldTerms::Reciprocal)
+		{
+			m_list.Update(m_positions.data(), m_positions.size(), atoms.boxDimensions, atoms.periodicAxes);
+			m_components.real = RealSpace();
+		}
+
+		if (m_settings.terms != EwaldTerms::RealSpace)
+		{
+			Setup(atoms.boxDimensions, atoms.periodicAxes);
+			m_components.reciprocal = Reciprocal() + SurfaceTerm();
+
+			// A net charge is neutralised by a uniform background, which only shifts the energy
+			double total = 0.0;
+			for (float charge : m_charges)
+				total += charge;
+			const double pi = std::acos(-1.0);
+			const double volume = static_cast<double>(m_cell.x) * m_cell.y * m_cell.z;
+			m_components.self = m_selfEnergy - Constants::CoulombConstant * pi * total * total / (2.0 * volume * m_beta * m_beta);
+		}
+
+		const size_t count = m_indices.size();
+		concurrency::parallel_for(size_t(0), count, [&](size_t iii)
+			{
+				XMFLOAT3& force = forces[m_indices[iii]];
+				force.x += m_forces[iii].x;
+				force.y += m_forces[iii].y;
+				force.z += m_forces[iii].z;
+			});
+
+		return m_components.real + m_components.reciprocal + m_components.self;
+	}
+
+	void ParticleMeshEwald::Gather(const AtomArrays& atoms)
+	{
+		if (!m_gathered || atoms.Count() != m_atomCount)
+		{
+			m_indices.clear();
+			m_charges.clear();
+			double squares = 0.0;
+			for (size_t iii = 0; iii < atoms.Count(); ++iii)
+			{
+				if (atoms.charges[iii] != 0.0f)
+				{
+					m_indices.push_back(static_cast<uint32_t>(iii));
+					m_charges.push_back(atoms.charges[iii]);
+					squares += static_cast<double>(atoms.charges[iii]) * atoms.charges[iii];
+				}
+			}
+
+			// Every charge's interaction with its own screening charge, which the grid includes
+			m_selfEnergy = -Constants::CoulombConstant * m_beta / std::sqrt(std::acos(-1.0)) * squares;
+
+			m_positions.resize(m_indices.size());
+			m_forces.resize(m_indices.size());
+			m_atomCount = atoms.Count();
+			m_gathered = true;
+			m_list.Invalidate();
+		}
+
+		const size_t blocks = (m_indices.size() + EwaldBlock - 1) / EwaldBlock;
+		concurrency::parallel_for(size_t(0), blocks, [&](size_t block)
+			{
+				size_t end = std::min(m_indices.size(), (block + 1) * EwaldBlock);
+				for (size_t iii = block * EwaldBlock; iii < end; ++iii)
+					m_positions[iii] = atoms.positions[m_indices[iii]];
+			});
+	}
+
+	void ParticleMeshEwald::Setup(XMFLOAT3 boxDimensions, unsigned int periodicAxes)
+	{
+		if (m_transform != nullptr && periodicAxes == m_periodicAxes &&
+			boxDimensions.x == m_box.x && boxDimensions.y == m_box.y && boxDimensions.z == m_box.z)
+			return;
+
+		// Periodic axes repeat the box itself. Walled ones keep their images 'padding' away, and at
+		// least a box length - no image comes closer than the far side of the box does
+		m_box = boxDimensions;
+		m_periodicAxes = periodicAxes;
+		auto cellLength = [&](int axis, float length)
+		{
+			return Boundaries::IsPeriodic(periodicAxes, axis) ? length : length + std::max(m_settings.padding, length);
+		};
+		m_cell = XMFLOAT3(cellLength(0, boxDimensions.x), cellLength(1, boxDimensions.y), cellLength(2, boxDimensions.z));
+		const float cell[3] = { m_cell.x, m_cell.y, m_cell.z };
+		const unsigned int order = m_settings.order;
+
+		for (int axis = 0; axis < 3; ++axis)
+			m_gridSize[axis] = FourierTransform::GoodSize(std::max<size_t>(order, static_cast<size_t>(std::ceil(cell[axis] / m_settings.gridSpacing))));
+
+		m_transform = std::unique_ptr<RealFourierTransform3D>(new RealFourierTransform3D(m_gridSize[0], m_gridSize[1], m_gridSize[2]));
+		m_grid.assign(m_gridSize[0] * m_gridSize[1] * m_gridSize[2], 0.0f);
+		m_spectrum.resize(m_transform->SpectrumCount());
+
+		// |b(m)|^2 on every axis - what the splines take out of each frequency, divided back out
+		const double pi = std::acos(-1.0);
+		float integerWeights[MaxOrder], unused[MaxOrder];
+		BSpline(0.0f, order, integerWeights, unused);		// M_n(j)
+
+		std::vector<double> moduli[3];
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			const size_t size = m_gridSize[axis];
+			moduli[axis].resize(size);
+			for (size_t k = 0; k < size; ++k)
+			{
+				double real = 0.0, imaginary = 0.0;
+				for (unsigned int j = 0; j + 1 < order; ++j)
+				{
+					double angle = 2.0 * pi * static_cast<double>(k * j) / size;
+					real += integerWeights[j + 1] * std::cos(angle);
+					imaginary += integerWeights[j + 1] * std::sin(angle);
+				}
+				double square = real * real + imaginary * imaginary;
+				moduli[axis][k] = square > 1.0e-7 ? 1.0 / square : 0.0;
+			}
+
+			// Odd orders vanish at the Nyquist frequency - use the neighbours instead
+			for (size_t k = 0; k < size; ++k)
+			{
+				if (moduli[axis][k] == 0.0)
+					moduli[axis][k] = 0.5 * (moduli[axis][(k + size - 1) % size] + moduli[axis][(k + 1) % size]);
+			}
+		}
+
+		// exp(-pi^2 m^2 / beta^2) / (pi V m^2) |b(m)|^2 in Coulomb units, for every stored frequency
+		const size_t width = m_transform->SpectrumWidth();
+		const size_t k2 = m_gridSize[1], k3 = m_gridSize[2];
+		const double volume = static_cast<double>(m_cell.x) * m_cell.y * m_cell.z;
+		const double factor = Constants::CoulombConstant / (pi * volume);
+		const double exponent = -pi * pi / (static_cast<double>(m_beta) * m_beta);
+		m_influence.resize(m_spectrum.size());
+		concurrency::parallel_for(size_t(0), k3, [&](size_t kz)
+			{
+				double mz = (kz <= k3 / 2 ? static_cast<double>(kz) : static_cast<double>(kz) - k3) / m_cell.z;
+				for (size_t ky = 0; ky < k2; ++ky)
+				{
+					double my = (ky <= k2 / 2 ? static_cast<double>(ky) : static_cast<double>(ky) - k2) / m_cell.y;
+					float* row = m_influence.data() + (kz * k2 + ky) * width;
+					for (size_t kx = 0; kx < width; ++kx)
+					{
+						double mx = static_cast<double>(kx) / m_cell.x;
+						double square = mx * mx + my * my + mz * mz;
+						row[kx] = square == 0.0 ? 0.0f : static_cast<float>(
+							factor * std::exp(exponent * square) / square * moduli[0][kx] * moduli[1][ky] * moduli[2][kz]);
+					}
+				}
+			});
+	}
+
+	void ParticleMeshEwald::BuildTable()
+	{
+		// k erfc(beta r)/r as a cubic Hermite spline in s = r^2, like the PairForces tables
+		const double inner = static_cast<double>(m_settings.innerRadius) * m_settings.innerRadius;
+		const double width = (static_cast<double>(m_settings.cutoff) * m_settings.cutoff - inner) / RealTablePoints;
+		const double beta = m_beta;
+		const double slopeFactor = 2.0 * beta / std::sqrt(std::acos(-1.0));
+
+		auto knot = [&](size_t k, double& value, double& slope)
+			{
+				double r = std::sqrt(inner + k * width);
+				double screened = std::erfc(beta * r) / r;
+				double derivative = -(screened + slopeFactor * std::exp(-beta * beta * r * r)) / r;
+				value = Constants::CoulombConstant * screened;
+				slope = width * Constants::CoulombConstant * derivative / (2.0 * r);
+			};
+
+		m_table.resize(RealTablePoints);
+		double v0, m0;
+		knot(0, v0, m0);
+		for (size_t k = 0; k < RealTablePoints; ++k)
+		{
+			double v1, m1;
+			knot(k + 1, v1, m1);
+			m_table[k] = XMFLOAT4A(
+				static_cast<float>(v0),
+				static_cast<float>(m0),
+				static_cast<float>(3.0 * (v1 - v0) - 2.0 * m0 - m1),
+				static_cast<float>(2.0 * (v0 - v1) + m0 + m1));
+			v0 = v1;
+			m0 = m1;
+		}
+
+		m_cutoffSquared = m_settings.cutoff * m_settings.cutoff;
+		m_innerSquared = m_settings.innerRadius * m_settings.innerRadius;
+		m_intervalsPerSquare = RealTablePoints / (m_cutoffSquared - m_innerSquared);
+		m_lastInterval = std::nextafter(static_cast<float>(RealTablePoints), 0.0f);
+	}
+
+	double ParticleMeshEwald::RealSpace()
+	{
+		// The PairForces kernel with one table scaled by the two charges
+		PairTable table;
+		table.coefficients = m_table.data();
+		table.cutoffSquared = m_cutoffSquared;
+		table.innerSquared = m_innerSquared;
+		table.intervalsPerSquare = m_intervalsPerSquare;
+		table.lastInterval = m_lastInterval;
+		table.charges = m_charges.data();
+		return SumPairForces(m_list, m_positions.data(), table, m_windows, m_forces.data());
+	}
+
+	double ParticleMeshEwald::SurfaceTerm()
+	{
+		// The grid sums the images as if surrounded by a conductor. Summed in vacuum in the shape
+		// the walled axes leave - a sphere, a needle or a slab - the images add 2 pi k / V D M^2 for
+		// the dipole M of the cell, with the depolarisation D = 1 / (walled axes) along each walled
+		// axis (Yeh and Berkowitz 1999 for the slab). Adding it takes the images' dipole part out.
+		const bool walled[3] = { !Boundaries::IsPeriodic(m_periodicAxes, 0), !Boundaries::IsPeriodic(m_periodicAxes, 1), !Boundaries::IsPeriodic(m_periodicAxes, 2) };
+		const int walls = static_cast<int>(walled[0]) + walled[1] + walled[2];
+		if (walls == 0)
+			return 0.0;
+
+		double dipole[3] = { 0.0, 0.0, 0.0 };
+		for (size_t iii = 0; iii < m_positions.size(); ++iii)
+		{
+			dipole[0] += static_cast<double>(m_charges[iii]) * m_positions[iii].x;
+			dipole[1] += static_cast<double>(m_charges[iii]) * m_positions[iii].y;
+			dipole[2] += static_cast<double>(m_charges[iii]) * m_positions[iii].z;
+		}
+
+		const double pi = std::acos(-1.0);
+		const double volume = static_cast<double>(m_cell.x) * m_cell.y * m_cell.z;
+		const double factor = 2.0 * pi * Constants::CoulombConstant / (volume * walls);
+		float field[3];
+		double energy = 0.0;
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			energy += walled[axis] ? factor * dipole[axis] * dipole[axis] : 0.0;
+			field[axis] = walled[axis] ? static_cast<float>(-2.0 * factor * dipole[axis]) : 0.0f;
+		}
+
+		concurrency::parallel_for(size_t(0), m_positions.size(), [&](size_t iii)
+			{
+				m_forces[iii].x += m_charges[iii] * field[0];
+				m_forces[iii].y += m_charges[iii] * field[1];
+				m_forces[iii].z += m_charges[iii] * field[2];
+			});
+		return energy;
+	}
+
+	double ParticleMeshEwald::Reciprocal()
+	{
+		const size_t count = m_positions.size();
+		const unsigned int order = m_settings.order;
+		const size_t k1 = m_gridSize[0], k2 = m_gridSize[1], k3 = m_gridSize[2];
+		const float cell[3] = { m_cell.x, m_cell.y, m_cell.z };
+		const size_t stride = 6 * order;
+
+		// Spline weights of every atom on every axis, and its atoms sorted by highest z plane
+		m_splines.resize(count * stride);
+		m_base.resize(count * 3);
+		m_planeStart.assign(k3 + 1, 0);
+		m_planeAtoms.resize(count);
+
+		const size_t blocks = (count + EwaldBlock - 1) / EwaldBlock;
+		concurrency::parallel_for(size_t(0), blocks, [&](size_t block)
+			{
+				size_t end = std::min(count, (block + 1) * EwaldBlock);
+				for (size_t iii = block * EwaldBlock; iii < end; ++iii)
+				{
+					const float position[3] = { m_positions[iii].x, m_positions[iii].y, m_positions[iii].z };
+					float* splines = m_splines.data() + iii * stride;
+					for (int axis = 0; axis < 3; ++axis)
+					{
+						const int32_t size = static_cast<int32_t>(m_gridSize[axis]);
+						float u = (position[axis] / cell[axis] + 0.5f) * size;
+						float whole = std::floor(u);
+						int32_t base = static_cast<int32_t>(whole) % size;
+						m_base[iii * 3 + axis] = base < 0 ? base + size : base;
+						BSpline(u - whole, order, splines + axis * order, splines + (3 + axis) * order);
+					}
+				}
+			});
+
+		for (size_t iii = 0; iii < count; ++iii)
+			++m_planeStart[m_base[iii * 3 + 2] + 1];
+		for (size_t plane = 0; plane < k3; ++plane)
+			m_planeStart[plane + 1] += m_planeStart[plane];
+		{
+			std::vector<uint32_t> next(m_planeStart.begin(), m_planeStart.end() - 1);
+			for (size_t iii = 0; iii < count; ++iii)
+				m_planeAtoms[next[m_base[iii * 3 + 2]]++] = static_cast<uint32_t>(iii);
+		}
+
+		// Spread - every task owns a slab of z planes and takes the charges of every atom that
+		// reaches it, so no two tasks write the same grid point
+		const size_t tasks = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), k3));
+		concurrency::parallel_for(size_t(0), tasks, [&](size_t task)
+			{
+				const size_t z0 = k3 * task / tasks;
+				const size_t z1 = k3 * (task + 1) / tasks;
+				std::fill(m_grid.begin() + z0 * k1 * k2, m_grid.begin() + z1 * k1 * k2, 0.0f);
+
+				const size_t reach = std::min(k3, z1 - z0 + order - 1);
+				for (size_t offset = 0; offset < reach; ++offset)
+				{
+					const size_t top = (z0 + offset) % k3;
+					for (uint32_t kkk = m_planeStart[top]; kkk < m_planeStart[top + 1]; ++kkk)
+					{
+						const uint32_t iii = m_planeAtoms[kkk];
+						const float* splines = m_splines.data() + iii * stride;
+						const int32_t* base = m_base.data() + iii * 3;
+						const float charge = m_charges[iii];
+
+						for (unsigned int jz = 0; jz < order; ++jz)
+						{
+							const size_t z = (base[2] + k3 - jz) % k3;
+							if (z < z0 || z >= z1)
+								continue;
+							for (unsigned int jy = 0; jy < order; ++jy)
+							{
+								const size_t y = (base[1] + k2 - jy) % k2;
+								const float weight = charge * splines[2 * order + jz] * splines[order + jy];
+								float* row = m_grid.data() + (z * k2 + y) * k1;
+								for (unsigned int jx = 0; jx < order; ++jx)
+									row[(base[0] + k1 - jx) % k1] += weight * splines[jx];
+							}
+						}
+					}
+				}
+			});
+
+		// Convolve with the influence function - E = 1/2 sum G |S|^2 over the full spectrum, where
+		// every stored kx but 0 and K1/2 stands for itself and its mirror
+		m_transform->Forward(m_grid.data(), m_spectrum.data());
+
+		const size_t width = m_transform->SpectrumWidth();
+		std::vector<double> energies(k3, 0.0);
+		concurrency::parallel_for(size_t(0), k3, [&](size_t kz)
+			{
+				double energy = 0.0;
+				for (size_t ky = 0; ky < k2; ++ky)
+				{
+					const size_t row = (kz * k2 + ky) * width;
+					for (size_t kx = 0; kx < width; ++kx)
+					{
+						const float influence = m_influence[row + kx];
+						FourierTransform::Complex& value = m_spectrum[row + kx];
+						const double multiplicity = kx == 0 || 2 * kx == k1 ? 1.0 : 2.0;
+						energy += multiplicity * influence * std::norm(value);
+						value *= influence;
+					}
+				}
+				energies[kz] = 0.5 * energy;
+			});
+
+		// The potential on the grid
+		m_transform->Inverse(m_spectrum.data(), m_grid.data());
+
+		// Interpolate - F = -q sum of potential times the gradient of the spline weights
+		concurrency::parallel_for(size_t(0), blocks, [&](size_t block)
+			{
+				const float scale[3] = { k1 / cell[0], k2 / cell[1], k3 / cell[2] };
+				size_t end = std::min(count, (block + 1) * EwaldBlock);
+				for (size_t iii = block * EwaldBlock; iii < end; ++iii)
+				{
+					const float* splines = m_splines.data() + iii * stride;
+					const float* weights[3] = { splines, splines + order, splines + 2 * order };
+					const float* slopes[3] = { splines + 3 * order, splines + 4 * order, splines + 5 * order };
+					const int32_t* base = m_base.data() + iii * 3;
+
+					float gx = 0.0f, gy = 0.0f, gz = 0.0f;
+					for (unsigned int jz = 0; jz < order; ++jz)
+					{
+						const size_t z = (base[2] + k3 - jz) % k3;
+						for (unsigned int jy = 0; jy < order; ++jy)
+						{
+							const size_t y = (base[1] + k2 - jy) % k2;
+							const float* row = m_grid.data() + (z * k2 + y) * k1;
+							float sum = 0.0f, sumSlope = 0.0f;
+							for (unsigned int jx = 0; jx < order; ++jx)
+							{
+								const float potential = row[(base[0] + k1 - jx) % k1];
+								sum += potential * weights[0][jx];
+								sumSlope += potential * slopes[0][jx];
+							}
+							gx += sumSlope * weights[1][jy] * weights[2][jz];
+							gy += sum * slopes[1][jy] * weights[2][jz];
+							gz += sum * weights[1][jy] * slopes[2][jz];
+						}
+					}
+
+					const float charge = m_charges[iii];
+					m_forces[iii].x -= charge * scale[0] * gx;
+					m_forces[iii].y -= charge * scale[1] * gy;
+					m_forces[iii].z -= charge * scale[2] * gz;
+				}
+			});
+
+		double energy = 0.0;
+		for (double part : energies)
+			energy += part;
+		return energy;
+	}
+
+	double ParticleMeshEwald::DirectSum(const AtomArrays& atoms, XMFLOAT3* forces)
+	{
+		std::vector<uint32_t> charged;
+		for (size_t iii = 0; iii < atoms.Count(); ++iii)
+			if (atoms.charges[iii] != 0.0f)
+				charged.push_back(static_cast<uint32_t>(iii));
+
+		// Every atom sums its own force over all the others, so the tasks never share a write
+		const size_t count = charged.size();
+		std::vector<double> energies(count, 0.0);
+		concurrency::parallel_for(size_t(0), count, [&](size_t iii)
+			{
+				const XMFLOAT3& a = atoms.positions[charged[iii]];
+				const double charge = atoms.charges[charged[iii]];
+				double fx = 0.0, fy = 0.0, fz = 0.0, energy = 0.0;
+				for (size_t jjj = 0; jjj < count; ++jjj)
+				{
+					const XMFLOAT3& b = atoms.positions[charged[jjj]];
+					double dx = static_cast<double>(a.x) - b.x;
+					double dy = static_cast<double>(a.y) - b.y;
+					double dz = static_cast<double>(a.z) - b.z;
+					double r2 = dx * dx + dy * dy + dz * dz;
+					if (jjj == iii || r2 == 0.0)
+						continue;
+
+					double inverse = 1.0 / std::sqrt(r2);
+					double pair = Constants::CoulombConstant * charge * atoms.charges[charged[jjj]] * inverse;
+					double scale = pair * inverse * inverse;
+					energy += pair;
+					fx += scale * dx;
+					fy += scale * dy;
+					fz += scale * dz;
+				}
+
+				XMFLOAT3& force = forces[charged[iii]];
+				force.x += static_cast<float>(fx);
+				force.y += static_cast<float>(fy);
+				force.z += static_cast<float>(fz);
+				energies[iii] = 0.5 * energy;
+			});
+
+		double energy = 0.0;
+		for (double part : energies)
+			energy += part;
+		return energy;
+	}
+
+	EwaldBenchmark ParticleMeshEwald::Benchmark(const AtomArrays& atoms, unsigned int repetitions)
+	{
+		EwaldBenchmark result = {};
+		const size_t count = atoms.Count();
+		std::vector<XMFLOAT3> mesh(count), direct(count, XMFLOAT3(0.0f, 0.0f, 0.0f));
+
+		// The first call builds the neighbour list and the grid, which a running simulation reuses
+		std::fill(mesh.begin(), mesh.end(), XMFLOAT3(0.0f, 0.0f, 0.0f));
+		result.meshEnergy = AddForces(atoms, mesh.data());
+
+		repetitions = std::max(1u, repetitions);
+		std::vector<XMFLOAT3> scratch(count);
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (unsigned int repetition = 0; repetition < repetitions; ++repetition)
+		{
+			std::fill(scratch.begin(), scratch.end(), XMFLOAT3(0.0f, 0.0f, 0.0f));
+			AddForces(atoms, scratch.data());
+		}
+		result.meshSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / repetitions;
+
+		start = std::chrono::steady_clock::now();
+		result.directEnergy = DirectSum(atoms, direct.data());
+		result.directSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		double difference = 0.0, magnitude = 0.0;
+		for (size_t iii = 0; iii < count; ++iii)
+		{
+			if (atoms.charges[iii] == 0.0f)
+				continue;
+			double dx = mesh[iii].x - direct[iii].x, dy = mesh[iii].y - direct[iii].y, dz = mesh[iii].z - direct[iii].z;
+			difference += dx * dx + dy * dy + dz * dz;
+			magnitude += static_cast<double>(direct[iii].x) * direct[iii].x + static_cast<double>(direct[iii].y) * direct[iii].y + static_cast<double>(direct[iii].z) * direct[iii].z;
+			++result.charged;
+		}
+		result.forceError = magnitude > 0.0 ? std::sqrt(difference / magnitude) : 0.0;
+		return result;
+	}
+}
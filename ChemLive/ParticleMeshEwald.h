@@ -0,0 +1,149 @@
+#pragma once
+
+#include "pch.h"
+#include "ForceProvider.h"
+#include "FourierTransform.h"
+#include "NeighbourList.h"
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+using DirectX::XMFLOAT3;
+using DirectX::XMFLOAT4A;
+
+namespace Simulation
+{
+	// Which part of the sum a provider adds - the default adds all of it. Multiple time stepping
+	// (see Integrator.h) uses one provider for the quickly varying real space pairs and another for
+	// the smooth reciprocal part, which it evaluates less often.
+	enum class EwaldTerms
+	{
+		All,
+		RealSpace,
+		Reciprocal		// With the self energy
+	};
+
+	struct EwaldSettings
+	{
+		float			cutoff = 1.0f;			// nm - real space part
+		double			tolerance = 1.0e-5;		// erfc(beta cutoff) - the accuracy knob, see below
+		float			gridSpacing = 0.0f;		// nm - 0 follows the tolerance
+		unsigned int	order = 4;				// B-spline order, 3 to 8
+		float			padding = 1.0f;			// nm between the box and its images on walled axes - at least the cutoff and the box length
+		float			innerRadius = 0.05f;	// nm - closer pairs get the real space force at this distance
+		EwaldTerms		terms = EwaldTerms::All;
+	};
+
+	struct EwaldComponents
+	{
+		double	real;			// kJ/mol
+		double	reciprocal;
+		double	self;			// Including the neutralising background of a charged system
+	};
+
+	struct EwaldBenchmark
+	{
+		size_t	charged;
+		double	meshSeconds;		// One AddForces, neighbour list build excluded
+		double	directSeconds;		// One DirectSum
+		double	meshEnergy;			// kJ/mol
+		double	directEnergy;
+		double	forceError;			// RMS force difference over RMS direct force
+	};
+
+	/*
+	*	Coulomb forces between charged atoms by smooth particle-mesh Ewald (Essmann et al. 1995).
+	*
+	*	1/r is split at the splitting parameter beta into erfc(beta r)/r, summed over the pairs of a
+	*	neighbour list inside the cutoff, and the smooth erf(beta r)/r, summed on a grid:
+	*
+	*		spread every charge onto the grid with order-n cardinal B-splines
+	*		real-to-complex FFT
+	*		multiply by the influence function (the Fourier transform of erf(beta r)/r with the
+	*		B-spline moduli divided out)
+	*		inverse FFT - the potential on the grid
+	*		interpolate each atom's force from the potential with the same splines
+	*
+	*	The cost goes from O(N^2) to O(N log N). 'tolerance' trades accuracy for speed: it fixes beta
+	*	(erfc(beta cutoff) = tolerance) and with it the grid spacing unless one is given, so 1e-4 runs
+	*	on a coarser grid than 1e-6. A larger cutoff moves work from the grid to the pairs.
+	*
+	*	On periodic axes (see Boundaries.h) the Ewald cell is the box itself and real space pairs
+	*	take the minimum image - the full periodic sum, which needs the box to be at least twice the
+	*	cutoff there. Walled axes have no images, so the cell is the box plus 'padding' on them, and
+	*	at least twice the box. The padding keeps real space pairs away from images, and the dipole
+	*	the images add through the grid is taken out again (SurfaceTerm); what is left shrinks as
+	*	the padding grows. DirectSum and Benchmark measure it: for 1000 to 8000 random charges in
+	*	3 to 5 nm walled boxes the RMS force error against DirectSum is 3e-3 to 7e-3 with a box
+	*	length of padding, and 5e-4 to 1e-3 with two. A box walled all round is better left to
+	*	BarnesHut, which has no images at all.
+	*
+	*	Atoms without charge are skipped altogether - a neutral scene costs a scan of the charges.
+	*/
+	class ParticleMeshEwald : public ForceProvider
+	{
+	public:
+		ParticleMeshEwald(const EwaldSettings& settings = EwaldSettings(), float skin = 0.1f);
+
+		double AddForces(const AtomArrays& atoms, XMFLOAT3* forces) override;
+		void Reset() override;
+		float MinimumPeriod() const override { return m_settings.terms == EwaldTerms::Reciprocal ? 0.0f : m_list.MinimumPeriod(); }
+
+		// Plain Coulomb sum over every pair, without images - O(N^2), for reference
+		static double DirectSum(const AtomArrays& atoms, XMFLOAT3* forces);
+
+		// Time AddForces and DirectSum on the same atoms and compare their results
+		EwaldBenchmark Benchmark(const AtomArrays& atoms, unsigned int repetitions = 3);
+
+		// GET
+		float				SplittingParameter() const { return m_beta; }		// 1/nm
+		size_t				GridSize(int axis) const { return m_gridSize[axis]; }
+		EwaldComponents		Components() const { return m_components; }			// Of the last AddForces
+		const EwaldSettings& Settings() const { return m_settings; }
+
+	private:
+		void Gather(const AtomArrays& atoms);
+		void Setup(XMFLOAT3 boxDimensions, unsigned int periodicAxes);
+		void BuildTable();
+		double RealSpace();
+		double Reciprocal();
+		double SurfaceTerm();		// Of the walled axes
+
+		EwaldSettings							m_settings;
+		float									m_beta;
+
+		// The charged atoms, compacted
+		bool									m_gathered;
+		size_t									m_atomCount;	// Of the arrays the compaction came from
+		std::vector<uint32_t>					m_indices;		// Into the atom arrays
+		std::vector<XMFLOAT3>					m_positions;
+		std::vector<float>						m_charges;
+		std::vector<XMFLOAT3>					m_forces;
+		double									m_selfEnergy;
+
+		// Real space - erfc(beta r)/r as a cubic spline in r^2, like PairForces
+		NeighbourList							m_list;
+		std::vector<XMFLOAT4A>					m_table;
+		float									m_cutoffSquared;
+		float									m_innerSquared;
+		float									m_intervalsPerSquare;
+		float									m_lastInterval;
+		std::vector<std::vector<XMFLOAT3>>		m_windows;
+
+		// Reciprocal space
+		XMFLOAT3								m_box;			// The grid below was set up for this box
+		unsigned int							m_periodicAxes;	// and these periodic axes
+		XMFLOAT3								m_cell;			// nm - box, + padding on walled axes
+		size_t									m_gridSize[3];
+		std::unique_ptr<RealFourierTransform3D>	m_transform;
+		std::vector<float>						m_grid;
+		std::vector<FourierTransform::Complex>	m_spectrum;
+		std::vector<float>						m_influence;	// Per spectrum entry
+		std::vector<float>						m_splines;		// Per atom: weights and slopes on every axis
+		std::vector<int32_t>					m_base;			// Per atom: highest grid index on every axis
+		std::vector<uint32_t>					m_planeStart;	// Atoms sorted by their highest z plane
+		std::vector<uint32_t>					m_planeAtoms;
+
+		EwaldComponents							m_components;
+	};
+}
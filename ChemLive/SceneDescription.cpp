@@ -0,0 +1,921 @@
+#include "pch.h"
+#include "SceneDescription.h"
+#include "AtomGenerator.h"
+#include "Constants.h"
+#include "MappedFile.h"
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <ppl.h>
+#include <stdexcept>
+#include <vector>
+
+namespace Simulation
+{
+	namespace SceneDescription
+	{
+		// Boltzmann constant in amu nm^2 / (ps^2 K)
+		static const double Boltzmann = 0.0083144626;
+
+		// Most lattice sites a single region may try - guards against a tiny lattice constant
+		static const double MaxRegionSites = 4.0e9;
+
+		// Samples a random sphere region may draw for one atom - only a sphere that barely reaches
+		// into the box comes near it
+		static const int MaxSampleAttempts = 1 << 20;
+
+		// Atoms per task for random regions and velocity passes
+		static const size_t ExpandBlock = 16384;
+
+		static const int MaxJsonDepth = 64;
+
+		[[noreturn]] static void Fail(size_t line, const std::string& message)
+		{
+			throw std::runtime_error("SceneDescription: line " + std::to_string(line) + ": " + message);
+		}
+
+		// ---- JSON -------------------------------------------------------------------------------
+
+		struct JsonValue
+		{
+			enum class Type { Null, Boolean, Number, String, Array, Object };
+
+			Type											type = Type::Null;
+			bool											boolean = false;
+			double											number = 0.0;
+			std::string										string;
+			std::vector<JsonValue>							items;
+			std::vector<std::pair<std::string, JsonValue>>	members;
+			size_t											line = 1;
+
+			const JsonValue* Find(const char* key) const
+			{
+				for (const std::pair<std::string, JsonValue>& member : members)
+				{
+					if (member.first == key)
+						return &member.second;
+				}
+				return nullptr;
+			}
+		};
+
+		class JsonParser
+		{
+		public:
+			JsonParser(const char* text, size_t size) : m_cursor(text), m_end(text + size), m_line(1) {}
+
+			JsonValue Parse()
+			{
+				// Skip a UTF-8 byte order mark
+				if (m_end - m_cursor >= 3 && std::memcmp(m_cursor, "\xEF\xBB\xBF", 3) == 0)
+					m_cursor += 3;
+
+				JsonValue root = ParseValue(0);
+				SkipSpace();
+				if (m_cursor != m_end)
+					Fail(m_line, "unexpected text after the scene");
+				return root;
+			}
+
+		private:
+			void SkipSpace()
+			{
+				while (m_cursor < m_end)
+				{
+					if (*m_cursor == '\n')
+						++m_line;
+
+					if (*m_cursor == ' ' || *m_cursor == '\t' || *m_cursor == '\r' || *m_cursor == '\n')
+						++m_cursor;
+					else if (*m_cursor == '/' && m_cursor + 1 < m_end && m_cursor[1] == '/')
+					{
+						while (m_cursor < m_end && *m_cursor != '\n')
+							++m_cursor;
+					}
+					else
+						break;
+				}
+			}
+
+			bool Consume(const char* word)
+			{
+				size_t length = std::strlen(word);
+				if (static_cast<size_t>(m_end - m_cursor) < length || std::memcmp(m_cursor, word, length) != 0)
+					return false;
+				m_cursor += length;
+				return true;
+			}
+
+			JsonValue ParseValue(int depth)
+			{
+				if (depth > MaxJsonDepth)
+					Fail(m_line, "nested too deeply");
+
+				SkipSpace();
+				if (m_cursor == m_end)
+					Fail(m_line, "unexpected end of the scene");
+
+				JsonValue value;
+				value.line = m_line;
+
+				const char c = *m_cursor;
+				if (c == '{')
+				{
+					value.type = JsonValue::Type::Object;
+					++m_cursor;
+					SkipSpace();
+					if (m_cursor < m_end && *m_cursor == '}')
+					{
+						++m_cursor;
+						return value;
+					}
+					while (true)
+					{
+						SkipSpace();
+						if (m_cursor == m_end || *m_cursor != '"')
+							Fail(m_line, "expected a key");
+						std::string key = ParseString();
+						if (value.Find(key.c_str()) != nullptr)
+							Fail(m_line, "duplicate key '" + key + "'");
+
+						SkipSpace();
+						if (m_cursor == m_end || *m_cursor != ':')
+							Fail(m_line, "expected ':' after '" + key + "'");
+						++m_cursor;
+
+						value.members.emplace_back(std::move(key), ParseValue(depth + 1));
+
+						SkipSpace();
+						if (m_cursor < m_end && *m_cursor == ',')
+							++m_cursor;
+						else if (m_cursor < m_end && *m_cursor == '}')
+						{
+							++m_cursor;
+							return value;
+						}
+						else
+							Fail(m_line, "expected ',' or '}'");
+					}
+				}
+				if (c == '[')
+				{
+					value.type = JsonValue::Type::Array;
+					++m_cursor;
+					SkipSpace();
+					if (m_cursor < m_end && *m_cursor == ']')
+					{
+						++m_cursor;
+						return value;
+					}
+					while (true)
+					{
+						value.items.push_back(ParseValue(depth + 1));
+
+						SkipSpace();
+						if (m_cursor < m_end && *m_cursor == ',')
+							++m_cursor;
+						else if (m_cursor < m_end && *m_cursor == ']')
+						{
+							++m_cursor;
+							return value;
+						}
+						else
+							Fail(m_line, "expected ',' or ']'");
+					}
+				}
+				if (c == '"')
+				{
+					value.type = JsonValue::Type::String;
+					value.string = ParseString();
+					return value;
+				}
+				if (Consume("true") || Consume("false"))
+				{
+					value.type = JsonValue::Type::Boolean;
+					value.boolean = m_cursor[-1] == 'e' && m_cursor[-2] == 'u';
+					return value;
+				}
+				if (Consume("null"))
+					return value;
+
+				// from_chars does not accept a leading '+', and neither does JSON
+				std::from_chars_result result = std::from_chars(m_cursor, m_end, value.number);
+				if (result.ec != std::errc() || !std::isfinite(value.number))
+					Fail(m_line, "expected a value");
+				m_cursor = result.ptr;
+				value.type = JsonValue::Type::Number;
+				return value;
+			}
+
+			std::string ParseString()
+			{
+				++m_cursor;		// Opening quote
+
+				std::string out;
+				while (true)
+				{
+					if (m_cursor == m_end || *m_cursor == '\n')
+						Fail(m_line, "unterminated string");
+
+					char c = *m_cursor++;
+					if (c == '"')
+						return out;
+					if (c != '\\')
+					{
+						out.push_back(c);
+						continue;
+					}
+
+					if (m_cursor == m_end)
+						Fail(m_line, "unterminated string");
+					c = *m_cursor++;
+					switch (c)
+					{
+					case '"':	out.push_back('"'); break;
+					case '\\':	out.push_back('\\'); break;
+					case '/':	out.push_back('/'); break;
+					case 'b':	out.push_back('\b'); break;
+					case 'f':	out.push_back('\f'); break;
+					case 'n':	out.push_back('\n'); break;
+					case 'r':	out.push_back('\r'); break;
+					case 't':	out.push_back('\t'); break;
+					case 'u':
+					{
+						unsigned int code = 0;
+						std::from_chars_result result = std::from_chars(m_cursor, std::min(m_cursor + 4, m_end), code, 16);
+						if (result.ec != std::errc() || result.ptr != m_cursor + 4)
+							Fail(m_line, "invalid \\u escape");
+						m_cursor += 4;
+
+						// Names and symbols only - no need for surrogate pairs
+						if (code < 0x80)
+							out.push_back(static_cast<char>(code));
+						else if (code < 0x800)
+						{
+							out.push_back(static_cast<char>(0xC0 | (code >> 6)));
+							out.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+						}
+						else
+						{
+							out.push_back(static_cast<char>(0xE0 | (code >> 12)));
+							out.push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3F)));
+							out.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+						}
+						break;
+					}
+					default:
+						Fail(m_line, "invalid escape in string");
+					}
+				}
+			}
+
+			const char*	m_cursor;
+			const char*	m_end;
+			size_t		m_line;
+		};
+
+		// ---- Reading the description ------------------------------------------------------------
+
+		static void CheckKeys(const JsonValue& object, std::initializer_list<const char*> allowed)
+		{
+			// Catches typos - a misspelled key would otherwise silently fall back to its default
+			for (const std::pair<std::string, JsonValue>& member : object.members)
+			{
+				bool known = false;
+				for (const char* key : allowed)
+					known = known || member.first == key;
+				if (!known)
+					Fail(member.second.line, "unknown key '" + member.first + "'");
+			}
+		}
+
+		static const JsonValue& Object(const JsonValue& value, const char* what)
+		{
+			if (value.type != JsonValue::Type::Object)
+				Fail(value.line, std::string(what) + " must be an object");
+			return value;
+		}
+
+		static double Number(const JsonValue& value, const char* what)
+		{
+			if (value.type != JsonValue::Type::Number)
+				Fail(value.line, std::string(what) + " must be a number");
+			return value.number;
+		}
+
+		static double PositiveNumber(const JsonValue& value, const char* what)
+		{
+			double number = Number(value, what);
+			if (!(number > 0.0))
+				Fail(value.line, std::string(what) + " must be positive");
+			return number;
+		}
+
+		static size_t Count(const JsonValue& value, const char* what)
+		{
+			double number = Number(value, what);
+			if (number < 0.0 || number != std::floor(number) || number > MaxRegionSites)
+				Fail(value.line, std::string(what) + " must be a whole number of atoms");
+			return static_cast<size_t>(number);
+		}
+
+		static bool Boolean(const JsonValue& value, const char* what)
+		{
+			if (value.type != JsonValue::Type::Boolean)
+				Fail(value.line, std::string(what) + " must be true or false");
+			return value.boolean;
+		}
+
+		static XMFLOAT3 Vector(const JsonValue& value, const char* what)
+		{
+			if (value.type != JsonValue::Type::Array || value.items.size() != 3)
+				Fail(value.line, std::string(what) + " must be an array of 3 numbers");
+			return XMFLOAT3(
+				static_cast<float>(Number(value.items[0], what)),
+				static_cast<float>(Number(value.items[1], what)),
+				static_cast<float>(Number(value.items[2], what)));
+		}
+
+		struct Species
+		{
+			int		element = Element::INVALID;
+			int		neutrons = 0;
+			int		charge = 0;
+		};
+
+		static int ParseElement(const JsonValue& value)
+		{
+			if (value.type == JsonValue::Type::Number)
+			{
+				if (value.number == std::floor(value.number) && AtomGenerator::IsValidElement(static_cast<int>(value.number)))
+					return static_cast<int>(value.number);
+			}
+			else if (value.type == JsonValue::Type::String)
+			{
+				for (int element = Element::HYDROGEN; element <= Element::NEON; ++element)
+				{
+					const char* symbol = Constants::ElementSymbols[element];
+					if (value.string.size() == std::strlen(symbol) &&
+						std::equal(value.string.begin(), value.string.end(), symbol, [](char a, char b) { return std::tolower(a) == std::tolower(b); }))
+						return element;
+				}
+			}
+			Fail(value.line, "unknown element");
+		}
+
+		// "element" (+ "neutrons" / "charge") or "species" of a region or atom
+		static Species ParseSpecies(const JsonValue& object, const std::map<std::string, Species>& named)
+		{
+			const JsonValue* element = object.Find("element");
+			const JsonValue* species = object.Find("species");
+			if ((element == nullptr) == (species == nullptr))
+				Fail(object.line, "needs either an \"element\" or a \"species\"");
+
+			Species result;
+			if (species != nullptr)
+			{
+				if (species->type != JsonValue::Type::String || named.count(species->string) == 0)
+					Fail(species->line, "unknown species");
+				result = named.at(species->string);
+			}
+			else
+			{
+				result.element = ParseElement(*element);
+				result.neutrons = Constants::DefaultNeutronCounts[result.element];
+			}
+
+			if (const JsonValue* neutrons = object.Find("neutrons"))
+			{
+				double value = Number(*neutrons, "\"neutrons\"");
+				if (value < 0.0 || value > 200.0 || value != std::floor(value))
+					Fail(neutrons->line, "\"neutrons\" must be a whole number");
+				result.neutrons = static_cast<int>(value);
+			}
+			if (const JsonValue* charge = object.Find("charge"))
+			{
+				double value = Number(*charge, "\"charge\"");
+				if (value != std::floor(value) || value > result.element || value < -result.element)
+					Fail(charge->line, "\"charge\" must be a whole number no larger than the atomic number");
+				result.charge = static_cast<int>(value);
+			}
+			return result;
+		}
+
+		enum class Lattice { None, SC, BCC, FCC, Diamond };
+
+		struct VelocityDistribution
+		{
+			bool		thermal = false;
+			double		temperature = 0.0;
+			XMFLOAT3	value = XMFLOAT3(0.0f, 0.0f, 0.0f);
+			bool		removeDrift = true;
+		};
+
+		struct Region
+		{
+			Species					species;
+			Lattice					lattice = Lattice::None;
+			double					latticeConstant = 0.0;
+			XMFLOAT3				offset = XMFLOAT3(0.0f, 0.0f, 0.0f);		// In lattice constants
+			size_t					randomCount = 0;
+			bool					sphere = false;
+			XMFLOAT3				min, max;					// Of the shape, before clipping
+			XMFLOAT3				center;
+			float					radius = 0.0f;
+			VelocityDistribution	velocity;
+			size_t					line;
+		};
+
+		struct LiteralAtom
+		{
+			Species		species;
+			XMFLOAT3	position;
+			XMFLOAT3	velocity;
+		};
+
+		static VelocityDistribution ParseVelocity(const JsonValue& value)
+		{
+			Object(value, "\"velocity\"");
+			CheckKeys(value, { "temperature", "value", "removeDrift" });
+
+			VelocityDistribution velocity;
+			const JsonValue* temperature = value.Find("temperature");
+			const JsonValue* constant = value.Find("value");
+			if ((temperature == nullptr) == (constant == nullptr))
+				Fail(value.line, "\"velocity\" needs either a \"temperature\" or a \"value\"");
+
+			if (temperature != nullptr)
+			{
+				velocity.thermal = true;
+				velocity.temperature = Number(*temperature, "\"temperature\"");
+				if (velocity.temperature < 0.0)
+					Fail(temperature->line, "\"temperature\" must not be negative");
+			}
+			else
+				velocity.value = Vector(*constant, "\"value\"");
+
+			if (const JsonValue* removeDrift = value.Find("removeDrift"))
+				velocity.removeDrift = Boolean(*removeDrift, "\"removeDrift\"");
+			return velocity;
+		}
+
+		static Region ParseRegion(const JsonValue& value, const std::map<std::string, Species>& species, XMFLOAT3 box)
+		{
+			Object(value, "a region");
+			CheckKeys(value, { "element", "species", "neutrons", "charge", "lattice", "latticeConstant", "offset",
+				"random", "min", "max", "center", "radius", "velocity" });
+
+			Region region;
+			region.line = value.line;
+			region.species = ParseSpecies(value, species);
+
+			const JsonValue* lattice = value.Find("lattice");
+			const JsonValue* random = value.Find("random");
+			if ((lattice == nullptr) == (random == nullptr))
+				Fail(value.line, "a region needs either a \"lattice\" or a \"random\" atom count");
+
+			if (lattice != nullptr)
+			{
+				static const std::pair<const char*, Lattice> names[] = {
+					{ "sc", Lattice::SC }, { "bcc", Lattice::BCC }, { "fcc", Lattice::FCC }, { "diamond", Lattice::Diamond } };
+				for (const std::pair<const char*, Lattice>& name : names)
+				{
+					if (lattice->type == JsonValue::Type::String && lattice->string == name.first)
+						region.lattice = name.second;
+				}
+				if (region.lattice == Lattice::None)
+					Fail(lattice->line, "\"lattice\" must be \"sc\", \"bcc\", \"fcc\" or \"diamond\"");
+
+				const JsonValue* constant = value.Find("latticeConstant");
+				if (constant == nullptr)
+					Fail(value.line, "a lattice region needs a \"latticeConstant\"");
+				region.latticeConstant = PositiveNumber(*constant, "\"latticeConstant\"");
+
+				if (const JsonValue* offset = value.Find("offset"))
+					region.offset = Vector(*offset, "\"offset\"");
+			}
+			else
+			{
+				if (value.Find("latticeConstant") != nullptr || value.Find("offset") != nullptr)
+					Fail(value.line, "\"latticeConstant\" and \"offset\" only apply to lattice regions");
+				region.randomCount = Count(*random, "\"random\"");
+			}
+
+			// Shape - the whole box unless a sub-box or a sphere is given
+			const JsonValue* min = value.Find("min");
+			const JsonValue* max = value.Find("max");
+			const JsonValue* center = value.Find("center");
+			const JsonValue* radius = value.Find("radius");
+			if ((min != nullptr || max != nullptr) && (center != nullptr || radius != nullptr))
+				Fail(value.line, "a region is either a box (\"min\" / \"max\") or a sphere (\"center\" / \"radius\")");
+
+			if (center != nullptr || radius != nullptr)
+			{
+				if (center == nullptr || radius == nullptr)
+					Fail(value.line, "a sphere needs both \"center\" and \"radius\"");
+				region.sphere = true;
+				region.center = Vector(*center, "\"center\"");
+				region.radius = static_cast<float>(PositiveNumber(*radius, "\"radius\""));
+				region.min = XMFLOAT3(region.center.x - region.radius, region.center.y - region.radius, region.center.z - region.radius);
+				region.max = XMFLOAT3(region.center.x + region.radius, region.center.y + region.radius, region.center.z + region.radius);
+			}
+			else
+			{
+				region.min = min != nullptr ? Vector(*min, "\"min\"") : XMFLOAT3(-box.x / 2.0f, -box.y / 2.0f, -box.z / 2.0f);
+				region.max = max != nullptr ? Vector(*max, "\"max\"") : XMFLOAT3(box.x / 2.0f, box.y / 2.0f, box.z / 2.0f);
+				region.center = XMFLOAT3(0.0f, 0.0f, 0.0f);
+				if (!(region.min.x < region.max.x && region.min.y < region.max.y && region.min.z < region.max.z))
+					Fail(value.line, "\"min\" must be below \"max\" on every axis");
+			}
+
+			if (const JsonValue* velocity = value.Find("velocity"))
+				region.velocity = ParseVelocity(*velocity);
+			return region;
+		}
+
+		// ---- Expansion --------------------------------------------------------------------------
+
+		// Counter based random numbers (SplitMix64) - every atom gets its own stream, so the result
+		// does not depend on which thread builds which atom
+		class Random
+		{
+		public:
+			Random(uint64_t seed, uint64_t stream, uint64_t index) :
+				m_state(Mix(seed ^ Mix(stream * 0xD1B54A32D192ED03ull + index)))
+			{
+			}
+
+			double Uniform() { return (Next() >> 11) * (1.0 / 9007199254740992.0); }		// [0, 1)
+
+			double Gaussian()
+			{
+				double radius = std::sqrt(-2.0 * std::log(1.0 - Uniform()));
+				return radius * std::cos(6.283185307179586 * Uniform());
+			}
+
+		private:
+			static uint64_t Mix(uint64_t x)
+			{
+				x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+				x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+				return x ^ (x >> 31);
+			}
+
+			uint64_t Next()
+			{
+				m_state += 0x9E3779B97F4A7C15ull;
+				return Mix(m_state);
+			}
+
+			uint64_t m_state;
+		};
+
+		static XMFLOAT3 InitialVelocity(const VelocityDistribution& distribution, double sigma, Random& random)
+		{
+			if (!distribution.thermal)
+				return distribution.value;
+
+			return XMFLOAT3(
+				static_cast<float>(sigma * random.Gaussian()),
+				static_cast<float>(sigma * random.Gaussian()),
+				static_cast<float>(sigma * random.Gaussian()));
+		}
+
+		// Subtract the mean velocity of atoms [first, first + count) - one species per region, so this
+		// is the same as removing the net momentum
+		static void RemoveDrift(AtomArena& arena, size_t first, size_t count)
+		{
+			if (count < 2)
+				return;
+
+			const size_t blocks = (count + ExpandBlock - 1) / ExpandBlock;
+			std::vector<double> sums(3 * blocks, 0.0);
+			concurrency::parallel_for(size_t(0), blocks, [&](size_t block)
+				{
+					size_t end = std::min(count, (block + 1) * ExpandBlock);
+					for (size_t iii = block * ExpandBlock; iii < end; ++iii)
+					{
+						XMFLOAT3 velocity = static_cast<Atom*>(arena.SlotAt(first + iii))->Velocity();
+						sums[3 * block + 0] += velocity.x;
+						sums[3 * block + 1] += velocity.y;
+						sums[3 * block + 2] += velocity.z;
+					}
+				});
+
+			double mean[3] = { 0.0, 0.0, 0.0 };
+			for (size_t block = 0; block < blocks; ++block)
+			{
+				for (int axis = 0; axis < 3; ++axis)
+					mean[axis] += sums[3 * block + axis];
+			}
+			const XMFLOAT3 drift(static_cast<float>(mean[0] / count), static_cast<float>(mean[1] / count), static_cast<float>(mean[2] / count));
+
+			concurrency::parallel_for(size_t(0), blocks, [&](size_t block)
+				{
+					size_t end = std::min(count, (block + 1) * ExpandBlock);
+					for (size_t iii = block * ExpandBlock; iii < end; ++iii)
+					{
+						Atom* atom = static_cast<Atom*>(arena.SlotAt(first + iii));
+						XMFLOAT3 velocity = atom->Velocity();
+						atom->Velocity(XMFLOAT3(velocity.x - drift.x, velocity.y - drift.y, velocity.z - drift.z));
+					}
+				});
+		}
+
+		static void LatticeBasis(Lattice lattice, std::vector<XMFLOAT3>& basis)
+		{
+			basis = { XMFLOAT3(0.0f, 0.0f, 0.0f) };
+			if (lattice == Lattice::BCC)
+				basis.push_back(XMFLOAT3(0.5f, 0.5f, 0.5f));
+			else if (lattice == Lattice::FCC || lattice == Lattice::Diamond)
+			{
+				basis.push_back(XMFLOAT3(0.5f, 0.5f, 0.0f));
+				basis.push_back(XMFLOAT3(0.5f, 0.0f, 0.5f));
+				basis.push_back(XMFLOAT3(0.0f, 0.5f, 0.5f));
+			}
+
+			if (lattice == Lattice::Diamond)
+			{
+				for (size_t iii = 0; iii < 4; ++iii)
+					basis.push_back(XMFLOAT3(basis[iii].x + 0.25f, basis[iii].y + 0.25f, basis[iii].z + 0.25f));
+			}
+		}
+
+		static void ExpandRegion(const Region& region, size_t regionIndex, uint64_t seed, XMFLOAT3 box, AtomArena& arena)
+		{
+			// Clip the shape to the box - sites are kept in [low, high)
+			const double low[3] = {
+				std::max<double>(region.min.x, -box.x / 2.0), std::max<double>(region.min.y, -box.y / 2.0), std::max<double>(region.min.z, -box.z / 2.0) };
+			const double high[3] = {
+				std::min<double>(region.max.x, box.x / 2.0), std::min<double>(region.max.y, box.y / 2.0), std::min<double>(region.max.z, box.z / 2.0) };
+			if (!(low[0] < high[0] && low[1] < high[1] && low[2] < high[2]))
+				return;		// Entirely outside the box
+
+			const double center[3] = { region.center.x, region.center.y, region.center.z };
+			const double radiusSquared = static_cast<double>(region.radius) * region.radius;
+			auto inside = [&](const double position[3])
+				{
+					for (int axis = 0; axis < 3; ++axis)
+					{
+						if (position[axis] < low[axis] || position[axis] >= high[axis])
+							return false;
+					}
+					if (!region.sphere)
+						return true;
+
+					double dx = position[0] - center[0], dy = position[1] - center[1], dz = position[2] - center[2];
+					return dx * dx + dy * dy + dz * dz <= radiusSquared;
+				};
+
+			const double sigma = region.velocity.thermal ?
+				std::sqrt(Boltzmann * region.velocity.temperature / (region.species.element + region.species.neutrons)) : 0.0;
+			const Element element = static_cast<Element>(region.species.element);
+
+			size_t first = arena.AtomCount();
+			size_t count = 0;
+			if (region.lattice != Lattice::None)
+			{
+				std::vector<XMFLOAT3> basis;
+				LatticeBasis(region.lattice, basis);
+
+				// Lattice anchored to the unclipped shape (a sphere's center is a site), so clipping
+				// never shifts it
+				const double a = region.latticeConstant;
+				const double origin[3] = {
+					(region.sphere ? center[0] : region.min.x) + region.offset.x * a,
+					(region.sphere ? center[1] : region.min.y) + region.offset.y * a,
+					(region.sphere ? center[2] : region.min.z) + region.offset.z * a };
+
+				int64_t firstCell[3], cells[3];
+				for (int axis = 0; axis < 3; ++axis)
+				{
+					firstCell[axis] = static_cast<int64_t>(std::floor((low[axis] - origin[axis]) / a)) - 1;
+					cells[axis] = static_cast<int64_t>(std::ceil((high[axis] - origin[axis]) / a)) + 1 - firstCell[axis];
+				}
+				if (static_cast<double>(cells[0]) * cells[1] * cells[2] * basis.size() > MaxRegionSites)
+					Fail(region.line, "the lattice constant is too small for the region - it would create too many atoms");
+
+				auto site = [&](int64_t cx, int64_t cy, int64_t cz, const XMFLOAT3& b, double position[3])
+					{
+						position[0] = origin[0] + a * (static_cast<double>(cx) + b.x);
+						position[1] = origin[1] + a * (static_cast<double>(cy) + b.y);
+						position[2] = origin[2] + a * (static_cast<double>(cz) + b.z);
+					};
+
+				// Pass 1 - count the sites of every row of cells, which gives each row its first slot
+				const size_t rows = static_cast<size_t>(cells[1] * cells[2]);
+				std::vector<size_t> rowStart(rows + 1, 0);
+				concurrency::parallel_for(size_t(0), rows, [&](size_t row)
+					{
+						int64_t cy = firstCell[1] + static_cast<int64_t>(row % cells[1]);
+						int64_t cz = firstCell[2] + static_cast<int64_t>(row / cells[1]);
+						size_t sites = 0;
+						double position[3];
+						for (int64_t cx = firstCell[0]; cx < firstCell[0] + cells[0]; ++cx)
+						{
+							for (const XMFLOAT3& b : basis)
+							{
+								site(cx, cy, cz, b, position);
+								if (inside(position))
+									++sites;
+							}
+						}
+						rowStart[row + 1] = sites;
+					});
+				for (size_t row = 0; row < rows; ++row)
+					rowStart[row + 1] += rowStart[row];
+
+				count = rowStart[rows];
+				first = arena.AllocateBulk(count);
+
+				// Pass 2 - construct every atom in its slot
+				concurrency::parallel_for(size_t(0), rows, [&](size_t row)
+					{
+						int64_t cy = firstCell[1] + static_cast<int64_t>(row % cells[1]);
+						int64_t cz = firstCell[2] + static_cast<int64_t>(row / cells[1]);
+						size_t index = rowStart[row];
+						double position[3];
+						for (int64_t cx = firstCell[0]; cx < firstCell[0] + cells[0]; ++cx)
+						{
+							for (const XMFLOAT3& b : basis)
+							{
+								site(cx, cy, cz, b, position);
+								if (!inside(position))
+									continue;
+
+								Random random(seed, regionIndex, index);
+								AtomGenerator::CreateAtomAt(arena.SlotAt(first + index), element,
+									XMFLOAT3(static_cast<float>(position[0]), static_cast<float>(position[1]), static_cast<float>(position[2])),
+									InitialVelocity(region.velocity, sigma, random), region.species.neutrons, region.species.charge);
+								++index;
+							}
+						}
+					});
+			}
+			else
+			{
+				// Rejection sampling below never ends if no point of the clipped box is in the sphere
+				if (region.sphere)
+				{
+					double distanceSquared = 0.0;
+					for (int axis = 0; axis < 3; ++axis)
+					{
+						double nearest = std::min(std::max(center[axis], low[axis]), high[axis]);
+						distanceSquared += (nearest - center[axis]) * (nearest - center[axis]);
+					}
+					if (distanceSquared > radiusSquared)
+						Fail(region.line, "the sphere does not reach into the box");
+				}
+
+				count = region.randomCount;
+				first = arena.AllocateBulk(count);
+
+				const size_t blocks = (count + ExpandBlock - 1) / ExpandBlock;
+				concurrency::parallel_for(size_t(0), blocks, [&](size_t block)
+					{
+						size_t end = std::min(count, (block + 1) * ExpandBlock);
+						for (size_t index = block * ExpandBlock; index < end; ++index)
+						{
+							Random random(seed, regionIndex, index);
+
+							// Rejection sampling for spheres - at least half the bounding box is inside
+							// unless the box clips most of the sphere away
+							double position[3];
+							int attempts = 0;
+							do
+							{
+								if (++attempts > MaxSampleAttempts)
+									Fail(region.line, "too little of the sphere is inside the box to place its atoms");
+								for (int axis = 0; axis < 3; ++axis)
+									position[axis] = low[axis] + (high[axis] - low[axis]) * random.Uniform();
+							} while (!inside(position));
+
+							AtomGenerator::CreateAtomAt(arena.SlotAt(first + index), element,
+								XMFLOAT3(static_cast<float>(position[0]), static_cast<float>(position[1]), static_cast<float>(position[2])),
+								InitialVelocity(region.velocity, sigma, random), region.species.neutrons, region.species.charge);
+						}
+					});
+			}
+
+			if (region.velocity.thermal && region.velocity.removeDrift)
+				RemoveDrift(arena, first, count);
+		}
+
+		SceneParameters Build(const char* text, size_t size, AtomArena& arena)
+		{
+			JsonParser parser(text, size);
+			JsonValue root = parser.Parse();
+			Object(root, "The scene");
+			CheckKeys(root, { "box", "simulation", "species", "regions", "atoms" });
+
+			// Everything is read and checked before the first atom is built
+			SceneParameters parameters;
+			parameters.boxDimensions = XMFLOAT3(2.0f, 2.0f, 2.0f);
+			parameters.boxVisible = true;
+			parameters.fixedTimeStep = 0.0;
+			parameters.atomCount = 0;
+			uint64_t seed = 0;
+
+			if (const JsonValue* box = root.Find("box"))
+			{
+				parameters.boxDimensions = Vector(*box, "\"box\"");
+				if (!(parameters.boxDimensions.x > 0.0f && parameters.boxDimensions.y > 0.0f && parameters.boxDimensions.z > 0.0f))
+					Fail(box->line, "\"box\" dimensions must be positive");
+			}
+
+			if (const JsonValue* simulation = root.Find("simulation"))
+			{
+				Object(*simulation, "\"simulation\"");
+				CheckKeys(*simulation, { "timeStep", "boxVisible", "seed" });
+
+				if (const JsonValue* timeStep = simulation->Find("timeStep"))
+					parameters.fixedTimeStep = PositiveNumber(*timeStep, "\"timeStep\"");
+				if (const JsonValue* boxVisible = simulation->Find("boxVisible"))
+					parameters.boxVisible = Boolean(*boxVisible, "\"boxVisible\"");
+				if (const JsonValue* value = simulation->Find("seed"))
+				{
+					double number = Number(*value, "\"seed\"");
+					if (number < 0.0 || number != std::floor(number) || number >= 18446744073709551616.0)
+						Fail(value->line, "\"seed\" must be a whole number");
+					seed = static_cast<uint64_t>(number);
+				}
+			}
+
+			std::map<std::string, Species> species;
+			if (const JsonValue* list = root.Find("species"))
+			{
+				Object(*list, "\"species\"");
+				for (const std::pair<std::string, JsonValue>& entry : list->members)
+				{
+					Object(entry.second, "a species");
+					CheckKeys(entry.second, { "element", "neutrons", "charge" });
+					if (entry.second.Find("element") == nullptr)
+						Fail(entry.second.line, "a species needs an \"element\"");
+					species[entry.first] = ParseSpecies(entry.second, {});
+				}
+			}
+
+			std::vector<Region> regions;
+			if (const JsonValue* list = root.Find("regions"))
+			{
+				if (list->type != JsonValue::Type::Array)
+					Fail(list->line, "\"regions\" must be an array");
+				for (const JsonValue& region : list->items)
+					regions.push_back(ParseRegion(region, species, parameters.boxDimensions));
+			}
+
+			std::vector<LiteralAtom> atoms;
+			if (const JsonValue* list = root.Find("atoms"))
+			{
+				if (list->type != JsonValue::Type::Array)
+					Fail(list->line, "\"atoms\" must be an array");
+				for (const JsonValue& value : list->items)
+				{
+					Object(value, "an atom");
+					CheckKeys(value, { "element", "species", "neutrons", "charge", "position", "velocity" });
+
+					LiteralAtom atom;
+					atom.species = ParseSpecies(value, species);
+					const JsonValue* position = value.Find("position");
+					if (position == nullptr)
+						Fail(value.line, "an atom needs a \"position\"");
+					atom.position = Vector(*position, "\"position\"");
+					const JsonValue* velocity = value.Find("velocity");
+					atom.velocity = velocity != nullptr ? Vector(*velocity, "\"velocity\"") : XMFLOAT3(0.0f, 0.0f, 0.0f);
+					atoms.push_back(atom);
+				}
+			}
+
+			try
+			{
+				for (size_t iii = 0; iii < regions.size(); ++iii)
+					ExpandRegion(regions[iii], iii, seed, parameters.boxDimensions, arena);
+
+				size_t first = arena.AllocateBulk(atoms.size());
+				for (size_t iii = 0; iii < atoms.size(); ++iii)
+				{
+					AtomGenerator::CreateAtomAt(arena.SlotAt(first + iii), static_cast<Element>(atoms[iii].species.element),
+						atoms[iii].position, atoms[iii].velocity, atoms[iii].species.neutrons, atoms[iii].species.charge);
+				}
+			}
+			catch (...)
+			{
+				// A region may have claimed slots it never constructed
+				arena.Clear();
+				throw;
+			}
+
+			parameters.atomCount = arena.AtomCount();
+			return parameters;
+		}
+
+		SceneParameters Load(const std::wstring& filename, AtomArena& arena)
+		{
+			MappedFile file(filename);
+			return Build(reinterpret_cast<const char*>(file.Data()), static_cast<size_t>(file.Size()), arena);
+		}
+	}
+}
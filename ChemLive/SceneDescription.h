@@ -0,0 +1,57 @@
+#pragma once
+
+#include "pch.h"
+#include "AtomArena.h"
+#include <string>
+
+using DirectX::XMFLOAT3;
+
+/*
+*	Declarative scene descriptions (*.clscene) - JSON (// comments allowed) that says how to build
+*	the initial atoms instead of listing them. A description of ten million atoms is a few lines:
+*
+*	{
+*		"box": [60, 60, 60],								// nm, full widths, centered on the origin
+*		"simulation": { "timeStep": 0.001, "boxVisible": true, "seed": 7 },
+*		"species": { "ne22": { "element": "Ne", "neutrons": 12 } },
+*		"regions": [
+*			{ "species": "ne22", "lattice": "fcc", "latticeConstant": 0.4429,
+*			  "velocity": { "temperature": 40 } },
+*			{ "element": "He", "random": 1000, "center": [0, 0, 0], "radius": 2,
+*			  "velocity": { "value": [0, 0, -5] } }
+*		],
+*		"atoms": [ { "element": "C", "position": [0, 0.5, 0], "velocity": [1, 0, 0] } ]
+*	}
+*
+*	A region fills a shape - the box between "min" and "max", or the sphere "center" / "radius",
+*	by default the whole simulation box - either with a lattice ("sc", "bcc", "fcc" or "diamond",
+*	sites at min + latticeConstant * (cell + basis) + "offset") or with a number of uniformly random
+*	positions. Shapes are clipped to the simulation box. Elements are given by symbol or atomic
+*	number, either directly or through a named species that also sets the isotope and charge.
+*
+*	Velocities are a constant "value", or Maxwell-Boltzmann at "temperature" in K for velocities in
+*	nm/ps (masses in amu), with the region's net momentum removed unless "removeDrift" is false.
+*
+*	Regions are expanded in parallel straight into arena slots. Every random number is derived
+*	from the seed and the atom's position in the description, so a description always expands to
+*	the same atoms however many threads do the work.
+*/
+
+namespace Simulation
+{
+	namespace SceneDescription
+	{
+		struct SceneParameters
+		{
+			XMFLOAT3		boxDimensions;
+			bool			boxVisible;
+			double			fixedTimeStep;		// 0 if the description does not set one
+			size_t			atomCount;
+		};
+
+		// Expand the description into 'arena', which must be empty. Throws std::runtime_error (with
+		// the line of the offending value) if the description is invalid, leaving the arena empty.
+		SceneParameters Build(const char* text, size_t size, AtomArena& arena);
+		SceneParameters Load(const std::wstring& filename, AtomArena& arena);
+	}
+}
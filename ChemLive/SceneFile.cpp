@@ -0,0 +1,230 @@
+#include "pch.h"
+#include "SceneFile.h"
+#include "AsyncIO.h"
+#include "AtomGenerator.h"
+#include "MappedFile.h"
+#include <limits>
+#include <ppl.h>
+#include <stdexcept>
+
+namespace Simulation
+{
+	namespace SceneFile
+	{
+		static uint64_t AlignUp(uint64_t value) { return (value + ColumnAlignment - 1) / ColumnAlignment * ColumnAlignment; }
+
+		// Lay out the columns after the header (of headerSize) and element table
+		static void ComputeLayout(SceneHeader& header)
+		{
+			uint64_t atomCount = header.atomCount;
+			header.elementTableOffset = AlignUp(header.headerSize);
+			header.positionsOffset = AlignUp(header.elementTableOffset + header.elementCount * sizeof(SceneElementEntry));
+			header.velocitiesOffset = AlignUp(header.positionsOffset + atomCount * sizeof(XMFLOAT3));
+			header.elementsOffset = AlignUp(header.velocitiesOffset + atomCount * sizeof(XMFLOAT3));
+			header.neutronsOffset = AlignUp(header.elementsOffset + atomCount);
+			header.electronsOffset = AlignUp(header.neutronsOffset + atomCount);
+			header.fileSize = header.electronsOffset + atomCount;
+			header.bondsOffset = 0;
+			if (header.bondCount != 0)
+			{
+				header.bondsOffset = AlignUp(header.fileSize);
+				header.fileSize = header.bondsOffset + header.bondCount * sizeof(SceneBondEntry);
+			}
+		}
+
+		void Save(const std::wstring& filename, AtomArena& arena, const SceneState& state)
+		{
+			SceneHeader header = {};
+			std::memcpy(header.magic, Magic, sizeof(header.magic));
+			header.version = Version;
+			header.headerSize = sizeof(SceneHeader);
+			header.atomCount = arena.AtomCount();
+			header.stepCount = state.stepCount;
+			header.time = state.time;
+			header.boxDimensions[0] = state.boxDimensions.x;
+			header.boxDimensions[1] = state.boxDimensions.y;
+			header.boxDimensions[2] = state.boxDimensions.z;
+			header.boxVisible = state.boxVisible ? 1 : 0;
+			header.periodicAxes = state.periodicAxes;
+			header.elementCount = Element::NEON;
+
+			std::vector<SceneBondEntry> bonds;
+			for (const BondConstraints::Bond& bond : state.bonds)
+			{
+				if (bond.first < header.atomCount && bond.second < header.atomCount)
+					bonds.push_back({ bond.first, bond.second, bond.length, 0 });
+			}
+			header.bondCount = bonds.size();
+			ComputeLayout(header);
+
+			// Columns are written out while the next ones are still being gathered
+			std::unique_ptr<AsyncFileWriter> file;
+			try
+			{
+				file.reset(new AsyncFileWriter(filename));
+			}
+			catch (const std::runtime_error&)
+			{
+				throw std::runtime_error("SceneFile: unable to open the scene file for writing");
+			}
+
+			uint64_t written = 0;
+			auto write = [&](const void* data, uint64_t size)
+			{
+				file->Write(data, static_cast<size_t>(size));
+				written += size;
+			};
+			auto pad = [&](uint64_t offset)
+			{
+				static const char zeros[ColumnAlignment] = {};
+				write(zeros, offset - written);
+			};
+
+			write(&header, sizeof(header));
+
+			pad(header.elementTableOffset);
+			for (uint8_t element = Element::HYDROGEN; element <= Element::NEON; ++element)
+			{
+				SceneElementEntry entry = {};
+				entry.number = element;
+				std::memcpy(entry.symbol, Constants::ElementSymbols[element], std::strlen(Constants::ElementSymbols[element]));
+				entry.radius = Constants::AtomicRadii[element];
+				write(&entry, sizeof(entry));
+			}
+
+			// Each column is gathered out of the arena one chunk at a time and written in one call
+			std::vector<uint8_t> staging(AtomArena::ChunkCapacity * sizeof(XMFLOAT3));
+			auto writeColumn = [&](uint64_t offset, size_t elementSize, auto gather)
+			{
+				pad(offset);
+				for (size_t chunk = 0; chunk < arena.ChunkCount(); ++chunk)
+				{
+					unsigned int count = arena.ChunkAtomCount(chunk);
+					for (unsigned int slot = 0; slot < count; ++slot)
+						gather(arena.At(chunk, slot), staging.data() + slot * elementSize);
+					write(staging.data(), count * elementSize);
+				}
+			};
+			auto toByte = [](int value)
+			{
+				if (value < 0 || value > 255)
+					throw std::runtime_error("SceneFile: particle count does not fit the scene format");
+				return static_cast<uint8_t>(value);
+			};
+
+			writeColumn(header.positionsOffset, sizeof(XMFLOAT3), [](Atom* atom, uint8_t* out) { XMFLOAT3 value = atom->Position(); std::memcpy(out, &value, sizeof(value)); });
+			writeColumn(header.velocitiesOffset, sizeof(XMFLOAT3), [](Atom* atom, uint8_t* out) { XMFLOAT3 value = atom->Velocity(); std::memcpy(out, &value, sizeof(value)); });
+			writeColumn(header.elementsOffset, 1, [](Atom* atom, uint8_t* out) { *out = static_cast<uint8_t>(atom->Element()); });
+			writeColumn(header.neutronsOffset, 1, [&](Atom* atom, uint8_t* out) { *out = toByte(atom->NeutronsCount()); });
+			writeColumn(header.electronsOffset, 1, [&](Atom* atom, uint8_t* out) { *out = toByte(atom->ElectronsCount()); });
+			if (!bonds.empty())
+			{
+				pad(header.bondsOffset);
+				write(bonds.data(), bonds.size() * sizeof(SceneBondEntry));
+			}
+
+			try
+			{
+				file->Close();
+			}
+			catch (const std::runtime_error&)
+			{
+				throw std::runtime_error("SceneFile: failed writing the scene file");
+			}
+			if (written != header.fileSize)
+				throw std::runtime_error("SceneFile: failed writing the scene file");
+		}
+
+		SceneState Load(const std::wstring& filename, AtomArena& arena)
+		{
+			MappedFile file(filename);
+			const uint8_t* data = file.Data();
+
+			// Validate everything up front - nothing below is parsed, only checked and copied
+			// Older versions have a shorter header - whatever it does not reach stays zero
+			SceneHeader header = {};
+			if (file.Size() < MinimumHeaderSize)
+				throw std::runtime_error("SceneFile: file is too small to be a scene");
+			std::memcpy(&header, data, MinimumHeaderSize);
+
+			if (std::memcmp(header.magic, Magic, sizeof(header.magic)) != 0)
+				throw std::runtime_error("SceneFile: not a scene file");
+			if (header.version == 0 || header.version > Version || header.headerSize < MinimumHeaderSize ||
+				header.headerSize > sizeof(SceneHeader) || header.headerSize > file.Size())
+				throw std::runtime_error("SceneFile: unsupported scene version");
+			std::memcpy(&header, data, header.headerSize);
+			if (header.fileSize != file.Size() || header.atomCount > file.Size() || header.bondCount > file.Size() || header.elementCount > 255)
+				throw std::runtime_error("SceneFile: scene file is truncated or corrupt");
+
+			SceneHeader expected = header;
+			ComputeLayout(expected);
+			if (std::memcmp(&expected, &header, sizeof(header)) != 0)
+				throw std::runtime_error("SceneFile: scene file layout is corrupt");
+
+			// Map the file's element numbers onto ours by symbol
+			uint8_t elementMap[256] = { 0 };
+			const SceneElementEntry* table = reinterpret_cast<const SceneElementEntry*>(data + header.elementTableOffset);
+			for (uint32_t iii = 0; iii < header.elementCount; ++iii)
+			{
+				for (uint8_t element = Element::HYDROGEN; element <= Element::NEON; ++element)
+				{
+					if (std::strncmp(table[iii].symbol, Constants::ElementSymbols[element], sizeof(table[iii].symbol)) == 0)
+						elementMap[table[iii].number] = element;
+				}
+			}
+
+			const size_t atomCount = static_cast<size_t>(header.atomCount);
+			const XMFLOAT3* positions = reinterpret_cast<const XMFLOAT3*>(data + header.positionsOffset);
+			const XMFLOAT3* velocities = reinterpret_cast<const XMFLOAT3*>(data + header.velocitiesOffset);
+			const uint8_t* elements = data + header.elementsOffset;
+			const uint8_t* neutrons = data + header.neutronsOffset;
+			const uint8_t* electrons = data + header.electronsOffset;
+
+			for (size_t iii = 0; iii < atomCount; ++iii)
+			{
+				if (elementMap[elements[iii]] == Element::INVALID)
+					throw std::runtime_error("SceneFile: scene contains an unknown element");
+			}
+
+			const size_t bondCount = static_cast<size_t>(header.bondCount);
+			const uint8_t* bonds = data + header.bondsOffset;
+			for (size_t iii = 0; iii < bondCount; ++iii)
+			{
+				SceneBondEntry bond;
+				std::memcpy(&bond, bonds + iii * sizeof(SceneBondEntry), sizeof(bond));
+				if (bond.first >= atomCount || bond.second >= atomCount || bond.first == bond.second ||
+					!(bond.length > 0.0f && bond.length < std::numeric_limits<float>::infinity()))
+					throw std::runtime_error("SceneFile: scene contains an invalid bond");
+			}
+
+			// Claim every slot at once and construct chunk by chunk in parallel
+			size_t first = arena.AllocateBulk(atomCount);
+			size_t chunkCount = (atomCount + AtomArena::ChunkCapacity - 1) / AtomArena::ChunkCapacity;
+			concurrency::parallel_for(size_t(0), chunkCount, [&](size_t chunk)
+				{
+					size_t begin = chunk * AtomArena::ChunkCapacity;
+					size_t end = std::min(begin + AtomArena::ChunkCapacity, atomCount);
+					for (size_t iii = begin; iii < end; ++iii)
+					{
+						Element element = static_cast<Element>(elementMap[elements[iii]]);
+						AtomGenerator::CreateAtomAt(arena.SlotAt(first + iii), element, positions[iii], velocities[iii],
+							neutrons[iii], element - electrons[iii]);
+					}
+				});
+
+			SceneState state;
+			state.boxDimensions = XMFLOAT3(header.boxDimensions[0], header.boxDimensions[1], header.boxDimensions[2]);
+			state.boxVisible = header.boxVisible != 0;
+			state.stepCount = header.stepCount;
+			state.time = header.time;
+			state.periodicAxes = header.periodicAxes;
+			for (size_t iii = 0; iii < bondCount; ++iii)
+			{
+				SceneBondEntry bond;
+				std::memcpy(&bond, bonds + iii * sizeof(SceneBondEntry), sizeof(bond));
+				state.bonds.push_back({ first + static_cast<size_t>(bond.first), first + static_cast<size_t>(bond.second), bond.length });
+			}
+			return state;
+		}
+	}
+}
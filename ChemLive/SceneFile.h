@@ -0,0 +1,100 @@
+#pragma once
+
+#include "pch.h"
+#include "AtomArena.h"
+#include "BondConstraints.h"
+#include <cstdint>
+#include <string>
+
+using DirectX::XMFLOAT3;
+
+/*
+*	Binary scene / checkpoint file (*.clscene). Everything is little-endian and every column
+*	starts on a 64 byte boundary so it can be used straight out of a memory mapping.
+*
+*	[SceneHeader]
+*	[SceneElementEntry] * elementCount
+*	positions	float[3] * atomCount
+*	velocities	float[3] * atomCount
+*	elements	uint8    * atomCount
+*	neutrons	uint8    * atomCount
+*	electrons	uint8    * atomCount
+*	bonds		SceneBondEntry * bondCount		(version 2, absent when there are none)
+*
+*	The columns mirror the per-atom state in the AtomArena, in arena order. Bonds refer to the
+*	atoms by that order.
+*/
+
+namespace Simulation
+{
+	namespace SceneFile
+	{
+		const char Magic[8] = { 'C', 'L', 'S', 'C', 'E', 'N', 'E', '\0' };
+		const uint32_t Version = 2;
+		const uint32_t MinimumHeaderSize = 112;		// Version 1 - fields a file's header does not reach read as zero
+		const uint64_t ColumnAlignment = 64;
+
+		struct SceneHeader
+		{
+			char		magic[8];
+			uint32_t	version;
+			uint32_t	headerSize;			// sizeof(SceneHeader) - lets later versions grow the header
+			uint64_t	fileSize;
+			uint64_t	atomCount;
+			uint64_t	stepCount;
+			float		boxDimensions[3];
+			uint32_t	boxVisible;
+			uint32_t	elementCount;
+			uint32_t	periodicAxes;		// PeriodicAxis flags - 0 (walls all round) in files written before
+			uint64_t	elementTableOffset;
+			uint64_t	positionsOffset;
+			uint64_t	velocitiesOffset;
+			uint64_t	elementsOffset;
+			uint64_t	neutronsOffset;
+			uint64_t	electronsOffset;
+			double		time;				// Simulated time - version 2
+			uint64_t	bondCount;			// Bond constraints - version 2
+			uint64_t	bondsOffset;		// 0 when there are none
+		};
+
+		// Element table - lets a loader check that element numbers mean what it thinks they mean
+		struct SceneElementEntry
+		{
+			uint8_t		number;
+			char		symbol[3];
+			float		radius;
+		};
+
+		// A bond constraint between two atoms of the file
+		struct SceneBondEntry
+		{
+			uint64_t	first;
+			uint64_t	second;
+			float		length;
+			uint32_t	reserved;
+		};
+
+		static_assert(sizeof(SceneHeader) == 136, "SceneHeader layout changed");
+		static_assert(sizeof(SceneElementEntry) == 8, "SceneElementEntry layout changed");
+		static_assert(sizeof(SceneBondEntry) == 24, "SceneBondEntry layout changed");
+
+		// Simulation-wide state stored alongside the atoms
+		struct SceneState
+		{
+			XMFLOAT3			boxDimensions;
+			bool				boxVisible;
+			unsigned long long	stepCount;
+			double				time;
+			unsigned int		periodicAxes;		// PeriodicAxis flags
+			std::vector<BondConstraints::Bond>	bonds;		// By arena number - those to atoms past the end are not saved
+		};
+
+		// Write every atom in 'arena' plus 'state'. Throws std::runtime_error on failure.
+		void Save(const std::wstring& filename, AtomArena& arena, const SceneState& state);
+
+		// Validate the file and append its atoms to 'arena'. Throws std::runtime_error if the file
+		// is invalid, in which case the arena is left untouched. The bonds returned are numbered
+		// in 'arena'.
+		SceneState Load(const std::wstring& filename, AtomArena& arena);
+	}
+}
@@ -0,0 +1,152 @@
+#include "pch.h"
+#include "SharedFramePublisher.h"
+#include <filesystem>
+#include <ppl.h>
+#include <stdexcept>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Simulation
+{
+	using namespace SharedFrameFormat;
+
+	// Atoms copied per task when a frame is published
+	static const size_t CopyBlock = 16384;
+
+	SharedFramePublisher::SharedFramePublisher(const std::wstring& name, size_t atomCount, const SharedFramePublisherSettings& settings) :
+		m_name(SharedFrameRingName(name)),
+		m_settings(settings),
+		m_data(nullptr),
+		m_size(0),
+		m_header(nullptr),
+		m_stepsSinceFrame(0),
+#if defined(_WIN32)
+		m_mapping(nullptr),
+#endif
+		m_framesPublished(0),
+		m_framesDropped(0)
+	{
+		m_settings.slotCount = std::max(2u, m_settings.slotCount);
+		m_settings.frameInterval = std::max(1u, m_settings.frameInterval);
+		if (m_settings.maxAtoms == 0)
+			m_settings.maxAtoms = static_cast<unsigned int>(std::min<size_t>(std::max<size_t>(2 * atomCount, 1024), UINT32_MAX));
+
+		const uint64_t slotSize = SlotSize(m_settings.maxAtoms);
+		m_size = sizeof(RingHeader) + m_settings.slotCount * slotSize;
+
+#if defined(_WIN32)
+		m_mapping = CreateFileMappingFromApp(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, m_size, m_name.c_str());
+		if (m_mapping == nullptr)
+			throw std::runtime_error("SharedFramePublisher: unable to create the shared memory");
+
+		m_data = static_cast<uint8_t*>(MapViewOfFileFromApp(m_mapping, FILE_MAP_WRITE, 0, 0));
+		if (m_data == nullptr)
+		{
+			CloseHandle(m_mapping);
+			throw std::runtime_error("SharedFramePublisher: unable to map the shared memory");
+		}
+#else
+		std::string path = std::filesystem::path(m_name).string();
+
+		// A ring left behind by a simulation that crashed is replaced, not reused
+		shm_unlink(path.c_str());
+		int file = shm_open(path.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+		if (file < 0)
+			throw std::runtime_error("SharedFramePublisher: unable to create the shared memory");
+
+		if (ftruncate(file, static_cast<off_t>(m_size)) != 0)
+		{
+			close(file);
+			shm_unlink(path.c_str());
+			throw std::runtime_error("SharedFramePublisher: unable to size the shared memory");
+		}
+
+		void* view = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+		close(file);
+		if (view == MAP_FAILED)
+		{
+			shm_unlink(path.c_str());
+			throw std::runtime_error("SharedFramePublisher: unable to map the shared memory");
+		}
+		m_data = static_cast<uint8_t*>(view);
+#endif
+
+		// The mapping starts zeroed, so every slot sequence starts at 0 (even, never written)
+		m_header = reinterpret_cast<RingHeader*>(m_data);
+		m_header->version = Version;
+		m_header->headerSize = sizeof(RingHeader);
+		m_header->slotCount = m_settings.slotCount;
+		m_header->maxAtoms = m_settings.maxAtoms;
+		m_header->slotSize = slotSize;
+		m_header->mappingSize = m_size;
+		m_header->published.store(0, std::memory_order_relaxed);
+
+		// Readers check the magic first - only write it once the rest of the header is in place
+		std::atomic_thread_fence(std::memory_order_release);
+		std::memcpy(m_header->magic, Magic, sizeof(m_header->magic));
+	}
+
+	SharedFramePublisher::~SharedFramePublisher()
+	{
+#if defined(_WIN32)
+		UnmapViewOfFile(m_data);
+		CloseHandle(m_mapping);
+#else
+		munmap(m_data, m_size);
+		shm_unlink(std::filesystem::path(m_name).string().c_str());
+#endif
+	}
+
+	void SharedFramePublisher::PublishFrame(unsigned long long step, double time, XMFLOAT3 boxDimensions, const std::vector<Atom*>& atoms)
+	{
+		if (m_stepsSinceFrame++ % m_settings.frameInterval != 0)
+			return;
+
+		if (atoms.size() > m_settings.maxAtoms)
+		{
+			++m_framesDropped;
+			return;
+		}
+
+		const uint64_t frame = m_framesPublished;
+		uint8_t* slot = m_data + sizeof(RingHeader) + (frame % m_settings.slotCount) * m_header->slotSize;
+		SlotHeader* header = reinterpret_cast<SlotHeader*>(slot);
+		uint8_t* positions = slot + sizeof(SlotHeader);
+		uint8_t* elements = positions + static_cast<size_t>(m_settings.maxAtoms) * sizeof(XMFLOAT3);
+
+		// Odd sequence = slot being written. The fence keeps the frame data from becoming visible
+		// before readers can see the slot is busy.
+		uint64_t sequence = header->sequence.load(std::memory_order_relaxed);
+		header->sequence.store(sequence + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+
+		header->frame = frame;
+		header->step = step;
+		header->time = time;
+		header->atomCount = static_cast<uint32_t>(atoms.size());
+		header->boxDimensions[0] = boxDimensions.x;
+		header->boxDimensions[1] = boxDimensions.y;
+		header->boxDimensions[2] = boxDimensions.z;
+
+		const size_t blocks = (atoms.size() + CopyBlock - 1) / CopyBlock;
+		concurrency::parallel_for(size_t(0), blocks, [&](size_t block)
+			{
+				size_t end = std::min(atoms.size(), (block + 1) * CopyBlock);
+				for (size_t iii = block * CopyBlock; iii < end; ++iii)
+				{
+					XMFLOAT3 position = atoms[iii]->Position();
+					std::memcpy(positions + iii * sizeof(XMFLOAT3), &position, sizeof(position));
+					elements[iii] = static_cast<uint8_t>(atoms[iii]->Element());
+				}
+			});
+
+		header->sequence.store(sequence + 2, std::memory_order_release);
+		m_header->published.store(frame + 1, std::memory_order_release);
+		++m_framesPublished;
+	}
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "pch.h"
+#include "Atom.h"
+#include "SharedFrameRing.h"
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace Simulation
+{
+	struct SharedFramePublisherSettings
+	{
+		unsigned int	slotCount = 8;			// Frames kept in the ring - how far a reader can fall behind
+		unsigned int	maxAtoms = 0;			// Largest frame the ring can hold - 0 allows twice the atoms there are now
+		unsigned int	frameInterval = 1;		// Publish every Nth simulation step
+	};
+
+	/*
+	*	Write side of the shared memory frame ring (see SharedFrameRing.h). Publishing copies the
+	*	positions straight into the next slot - there is no queue and no thread, and the writer
+	*	never waits for readers however many there are or however slow they are.
+	*/
+	class SharedFramePublisher
+	{
+	public:
+		// Throws std::runtime_error if the shared memory cannot be created
+		SharedFramePublisher(const std::wstring& name, size_t atomCount, const SharedFramePublisherSettings& settings = SharedFramePublisherSettings());
+		~SharedFramePublisher();		// Removes the name - readers that already mapped the ring keep their mapping
+
+		SharedFramePublisher(const SharedFramePublisher&) = delete;
+		SharedFramePublisher& operator=(const SharedFramePublisher&) = delete;
+
+		// Called from Simulation::Update after every step
+		void PublishFrame(unsigned long long step, double time, XMFLOAT3 boxDimensions, const std::vector<Atom*>& atoms);
+
+		// GET
+		unsigned long long FramesPublished() { return m_framesPublished; }
+		unsigned long long FramesDropped() { return m_framesDropped; }		// Had more atoms than the ring holds
+
+	private:
+		std::wstring							m_name;
+		SharedFramePublisherSettings			m_settings;
+		uint8_t*								m_data;
+		uint64_t								m_size;
+		SharedFrameFormat::RingHeader*			m_header;
+		unsigned long long						m_stepsSinceFrame;
+
+#if defined(_WIN32)
+		HANDLE									m_mapping;
+#endif
+
+		std::atomic<unsigned long long>			m_framesPublished;
+		std::atomic<unsigned long long>			m_framesDropped;
+	};
+}
@@ -0,0 +1,210 @@
+#include "pch.h"
+#include "SharedFrameRing.h"
+#include <filesystem>
+#include <stdexcept>
+#include <thread>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Simulation
+{
+	using namespace SharedFrameFormat;
+
+	// A reader that keeps losing the race for a slot gives up on that frame after this many tries
+	static const int ReadAttempts = 64;
+
+	std::wstring SharedFrameRingName(const std::wstring& name)
+	{
+#if defined(_WIN32)
+		return L"Local\\chemlive-" + name;
+#else
+		return L"/chemlive-" + name;
+#endif
+	}
+
+	SharedFrameReader::SharedFrameReader(const std::wstring& name) :
+		m_header(nullptr),
+		m_data(nullptr),
+		m_size(0),
+		m_next(0)
+#if defined(_WIN32)
+		, m_mapping(nullptr)
+#endif
+	{
+#if defined(_WIN32)
+		m_mapping = OpenFileMappingFromApp(FILE_MAP_READ, FALSE, SharedFrameRingName(name).c_str());
+		if (m_mapping == nullptr)
+			throw std::runtime_error("SharedFrameReader: no frame ring with that name");
+
+		m_data = static_cast<const uint8_t*>(MapViewOfFileFromApp(m_mapping, FILE_MAP_READ, 0, 0));
+		if (m_data == nullptr)
+		{
+			CloseHandle(m_mapping);
+			throw std::runtime_error("SharedFrameReader: unable to map the frame ring");
+		}
+
+		MEMORY_BASIC_INFORMATION information;
+		VirtualQuery(m_data, &information, sizeof(information));
+		m_size = information.RegionSize;
+#else
+		int file = shm_open(std::filesystem::path(SharedFrameRingName(name)).c_str(), O_RDONLY, 0);
+		if (file < 0)
+			throw std::runtime_error("SharedFrameReader: no frame ring with that name");
+
+		struct stat status;
+		if (fstat(file, &status) != 0 || status.st_size < static_cast<off_t>(sizeof(RingHeader)))
+		{
+			close(file);
+			throw std::runtime_error("SharedFrameReader: frame ring is not ready");
+		}
+		m_size = static_cast<uint64_t>(status.st_size);
+
+		void* view = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, file, 0);
+		close(file);
+		if (view == MAP_FAILED)
+			throw std::runtime_error("SharedFrameReader: unable to map the frame ring");
+		m_data = static_cast<const uint8_t*>(view);
+#endif
+
+		// The publisher writes the magic last, so a ring it is still setting up is rejected here
+		m_header = reinterpret_cast<const RingHeader*>(m_data);
+		bool valid = m_size >= sizeof(RingHeader) && std::memcmp(m_header->magic, Magic, sizeof(Magic)) == 0;
+		std::atomic_thread_fence(std::memory_order_acquire);
+		valid = valid && m_header->version == Version && m_header->headerSize == sizeof(RingHeader) && m_header->slotCount != 0 &&
+			m_header->slotSize == SlotSize(m_header->maxAtoms) && m_header->mappingSize <= m_size &&
+			m_header->mappingSize == sizeof(RingHeader) + m_header->slotCount * m_header->slotSize;
+		if (!valid)
+		{
+			Close();
+			throw std::runtime_error("SharedFrameReader: not a frame ring, or an incompatible version");
+		}
+
+		// Start with whatever is the newest frame right now
+		uint64_t published = Published();
+		m_next = published == 0 ? 0 : published - 1;
+	}
+
+	SharedFrameReader::~SharedFrameReader()
+	{
+		Close();
+	}
+
+	void SharedFrameReader::Close()
+	{
+#if defined(_WIN32)
+		if (m_data != nullptr)
+			UnmapViewOfFile(m_data);
+		if (m_mapping != nullptr)
+			CloseHandle(m_mapping);
+		m_mapping = nullptr;
+#else
+		if (m_data != nullptr)
+			munmap(const_cast<uint8_t*>(m_data), m_size);
+#endif
+		m_data = nullptr;
+	}
+
+	uint64_t SharedFrameReader::Published() const
+	{
+		return m_header->published.load(std::memory_order_acquire);
+	}
+
+	bool SharedFrameReader::ReadLatest(SharedFrame& out)
+	{
+		for (int attempt = 0; attempt < ReadAttempts; ++attempt)
+		{
+			uint64_t published = Published();
+			if (published == 0)
+				return false;
+
+			// Fails only if the writer lapped us while copying - try the newer frame
+			if (ReadFrame(published - 1, out))
+			{
+				m_next = published;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool SharedFrameReader::ReadNext(SharedFrame& out, unsigned long long* missed)
+	{
+		for (int attempt = 0; attempt < ReadAttempts; ++attempt)
+		{
+			uint64_t published = Published();
+			if (m_next >= published)
+				return false;
+
+			// The slot of frame 'published' may be being rewritten, so the oldest frame that can still
+			// be read is the one after it
+			uint64_t oldest = published >= m_header->slotCount ? published - m_header->slotCount + 1 : 0;
+			if (m_next < oldest)
+			{
+				if (missed != nullptr)
+					*missed += oldest - m_next;
+				m_next = oldest;
+			}
+
+			if (ReadFrame(m_next, out))
+			{
+				++m_next;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool SharedFrameReader::ReadFrame(uint64_t frame, SharedFrame& out)
+	{
+		const uint8_t* slot = m_data + sizeof(RingHeader) + (frame % m_header->slotCount) * m_header->slotSize;
+		const SlotHeader* header = reinterpret_cast<const SlotHeader*>(slot);
+		const uint8_t* positions = slot + sizeof(SlotHeader);
+		const uint8_t* elements = positions + static_cast<size_t>(m_header->maxAtoms) * sizeof(XMFLOAT3);
+
+		for (int attempt = 0; attempt < ReadAttempts; ++attempt)
+		{
+			uint64_t before = header->sequence.load(std::memory_order_acquire);
+			if (before & 1)
+			{
+				// The writer is in this slot right now - it only stays for one copy
+				std::this_thread::yield();
+				continue;
+			}
+
+			uint64_t slotFrame = header->frame;
+			if (slotFrame != frame)
+			{
+				// Either not written yet or already replaced by a later frame. Only trust that
+				// answer if the slot did not change while it was read.
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if (header->sequence.load(std::memory_order_relaxed) == before)
+					return false;
+				continue;
+			}
+
+			size_t atomCount = std::min<size_t>(header->atomCount, m_header->maxAtoms);
+			out.frame = frame;
+			out.step = header->step;
+			out.time = header->time;
+			out.boxDimensions = XMFLOAT3(header->boxDimensions[0], header->boxDimensions[1], header->boxDimensions[2]);
+			out.positions.resize(atomCount);
+			out.elements.resize(atomCount);
+			if (atomCount != 0)
+			{
+				std::memcpy(out.positions.data(), positions, atomCount * sizeof(XMFLOAT3));
+				std::memcpy(out.elements.data(), elements, atomCount);
+			}
+
+			// Keep the copy only if the writer did not touch the slot meanwhile
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (header->sequence.load(std::memory_order_relaxed) == before)
+				return true;
+		}
+		return false;
+	}
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include "pch.h"
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using DirectX::XMFLOAT3;
+
+/*
+*	Shared memory ring of live simulation frames, for analysis processes on the same machine.
+*
+*	[RingHeader]
+*	slot 0: [SlotHeader] positions float[3] * maxAtoms, elements uint8 * maxAtoms
+*	slot 1: ...													(each slot starts on a 64 byte boundary)
+*
+*	A single writer (SharedFramePublisher, see SharedFramePublisher.h) fills the slots round robin
+*	and never waits for readers. Each slot is guarded by a sequence lock: the writer makes the slot's
+*	sequence odd, writes, then makes it even again, and a reader keeps a copy only if it saw the
+*	same even sequence before and after copying. Readers therefore never block the writer and
+*	never see a torn frame - at worst they retry, or find the frame they wanted already replaced.
+*
+*	Consumer processes only need this header and SharedFrameRing.cpp.
+*/
+
+namespace Simulation
+{
+	namespace SharedFrameFormat
+	{
+		const char Magic[8] = { 'C', 'L', 'R', 'I', 'N', 'G', '\0', '\0' };
+		const uint32_t Version = 1;
+		const uint64_t SlotAlignment = 64;
+
+		struct RingHeader
+		{
+			char					magic[8];
+			uint32_t				version;
+			uint32_t				headerSize;
+			uint32_t				slotCount;
+			uint32_t				maxAtoms;
+			uint64_t				slotSize;
+			uint64_t				mappingSize;
+			std::atomic<uint64_t>	published;			// Frames published so far - frame N lives in slot N % slotCount
+			uint8_t					padding[16];
+		};
+
+		struct SlotHeader
+		{
+			std::atomic<uint64_t>	sequence;			// Odd while the writer is in the slot
+			uint64_t				frame;
+			uint64_t				step;
+			double					time;
+			uint32_t				atomCount;
+			float					boxDimensions[3];
+			uint8_t					padding[16];
+		};
+
+		static_assert(sizeof(RingHeader) == 64, "RingHeader layout changed");
+		static_assert(sizeof(SlotHeader) == 64, "SlotHeader layout changed");
+		static_assert(std::atomic<uint64_t>::is_always_lock_free, "Shared memory sequence numbers must be lock free");
+
+		inline uint64_t SlotSize(uint32_t maxAtoms)
+		{
+			uint64_t size = sizeof(SlotHeader) + static_cast<uint64_t>(maxAtoms) * (sizeof(XMFLOAT3) + 1);
+			return (size + SlotAlignment - 1) / SlotAlignment * SlotAlignment;
+		}
+	}
+
+	struct SharedFrame
+	{
+		uint64_t				frame;				// Publication number - consecutive frames differ by one
+		unsigned long long		step;
+		double					time;
+		XMFLOAT3				boxDimensions;
+		std::vector<XMFLOAT3>	positions;
+		std::vector<uint8_t>	elements;			// Simulation::Element of each atom
+	};
+
+	/*
+	*	Read side of the ring - maps it read-only, so a misbehaving consumer cannot disturb the
+	*	simulation. Reading copies the frame out of shared memory; nothing is ever locked.
+	*/
+	class SharedFrameReader
+	{
+	public:
+		SharedFrameReader(const std::wstring& name);		// Throws std::runtime_error if no ring with that name exists
+		~SharedFrameReader();
+
+		SharedFrameReader(const SharedFrameReader&) = delete;
+		SharedFrameReader& operator=(const SharedFrameReader&) = delete;
+
+		// Copy the most recently published frame. Returns false if nothing has been published yet.
+		bool ReadLatest(SharedFrame& out);
+
+		// Copy the frame after the last one read, for consumers that want every frame. Returns false
+		// if it has not been published yet. If the writer has lapped the reader, skips ahead to the
+		// oldest frame still in the ring and adds the frames lost to 'missed'.
+		bool ReadNext(SharedFrame& out, unsigned long long* missed = nullptr);
+
+		// GET
+		uint64_t	Published() const;
+		uint32_t	SlotCount() const { return m_header->slotCount; }
+		uint32_t	MaxAtoms() const { return m_header->maxAtoms; }
+
+	private:
+		bool ReadFrame(uint64_t frame, SharedFrame& out);
+		void Close();
+
+		const SharedFrameFormat::RingHeader*	m_header;
+		const uint8_t*							m_data;
+		uint64_t								m_size;
+		uint64_t								m_next;			// Frame ReadNext returns next
+
+#if defined(_WIN32)
+		HANDLE									m_mapping;
+#endif
+	};
+
+	// Shared memory object name for a ring - "/chemlive-<name>" on POSIX, "Local\chemlive-<name>" on Windows
+	std::wstring SharedFrameRingName(const std::wstring& name);
+}
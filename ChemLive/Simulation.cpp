@@ -1,128 +1,503 @@
 #include "pch.h"
 #include "Simulation.h"
+#include "Boundaries.h"
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <ppl.h>
+#include <stdexcept>
 
 
 namespace Simulation
 {
-	Simulation::Simulation(const std::shared_ptr<DX::DeviceResources>& deviceResources) :
+	// Scene shown at startup
+	static const char* DefaultScene = R"({
+		"atoms": [
+			{ "element": "H",  "position": [0.0, 0.0, 0.0],   "velocity": [-1.0, 0.0, 0.0] },
+			{ "element": "He", "position": [0.0, 0.75, 0.0],  "velocity": [1.0, -1.0, 0.0] },
+			{ "element": "H",  "position": [0.5, 0.0, 0.0],   "velocity": [-1.0, 1.0, 0.0] },
+			{ "element": "Li", "position": [0.5, 0.5, 0.0],   "velocity": [-1.0, 1.0, 0.0] },
+			{ "element": "Be", "position": [0.5, 0.5, 0.5],   "velocity": [-1.0, 1.0, 1.0] },
+			{ "element": "B",  "position": [0.0, 0.0, 0.5],   "velocity": [0.0, 1.0, 1.0] },
+			{ "element": "C",  "position": [0.5, 0.0, 0.5],   "velocity": [1.0, 1.0, 0.0] },
+			{ "element": "N",  "position": [0.5, 0.5, 0.8],   "velocity": [1.0, 0.5, 1.0] },
+			{ "element": "O",  "position": [0.7, 0.3, 0.1],   "velocity": [0.0, 0.5, 1.0] },
+			{ "element": "F",  "position": [0.2, 0.6, 0.7],   "velocity": [0.0, 0.5, 1.0] },
+			{ "element": "Ne", "position": [-0.7, 0.2, 0.7],  "velocity": [-1.0, 0.5, 1.0] }
+		]
+	})";
+
+	Simulation::Simulation() :
 		m_boxDimensions({ 2.0f, 2.0f, 2.0f }),		// These are the overall dimensions - so the x range is [-5, 5]
 		m_boxVisible(true),
+		m_periodicAxes(PERIODIC_NONE),
 		m_elapsedTime(0.0f),
+		m_simulatedTime(0.0),
+		m_stepCount(0),
+		m_fixedTimeStep(0.0),
 		m_paused(true),
-		m_atomGenerator(AtomGenerator(deviceResources))
+		m_hasResetState(false),
+		m_atomGenerator(&m_atomArena),
+		m_bonds(std::make_shared<BondConstraints>(m_atomArena))
 	{
 
 		// TEMPORARY SETUP ===================================
 
-		
-		XMFLOAT3 initPos = XMFLOAT3(0.0f, 0.0f, 0.0f);
-		XMFLOAT3 initVelocity = XMFLOAT3(-1.0f, 0.0f, 0.0f);
-		AddAtom(m_atomGenerator.CreateAtom(Element::HYDROGEN, initPos, initVelocity));		
-		
-		initPos = XMFLOAT3(0.0f, 0.75f, 0.0f);
-		initVelocity = XMFLOAT3(1.0f, -1.0f, 0.0f);
-		AddAtom(m_atomGenerator.CreateAtom(Element::HELIUM, initPos, initVelocity));		
-		
-		initPos = XMFLOAT3(0.5f, 0.0f, 0.0f);
-		initVelocity = XMFLOAT3(-1.0f, 1.0f, 0.0f);
-		AddAtom(m_atomGenerator.CreateAtom(Element::HYDROGEN, initPos, initVelocity));	
-
-		initPos = XMFLOAT3(0.5f, 0.5f, 0.0f);
-		initVelocity = XMFLOAT3(-1.0f, 1.0f, 0.0f);
-		AddAtom(m_atomGenerator.CreateAtom(Element::LITHIUM, initPos, initVelocity));
-
-		initPos = XMFLOAT3(0.5f, 0.5f, 0.5f);
-		initVelocity = XMFLOAT3(-1.0f, 1.0f, 1.0f);
-		AddAtom(m_atomGenerator.CreateAtom(Element::BERYLLIUM, initPos, initVelocity));
-
-		initPos = XMFLOAT3(0.0f, 0.0f, 0.5f);
-		initVelocity = XMFLOAT3(0.0f, 1.0f, 1.0f);
-		AddAtom(m_atomGenerator.CreateAtom(Element::BORON, initPos, initVelocity));
-
-		initPos = XMFLOAT3(0.5f, 0.0f, 0.5f);
-		initVelocity = XMFLOAT3(1.0f, 1.0f, 0.0f);
-		AddAtom(m_atomGenerator.CreateAtom(Element::CARBON, initPos, initVelocity));
-
-		initPos = XMFLOAT3(0.5f, 0.5f, 0.8f);
-		initVelocity = XMFLOAT3(1.0f, 0.5f, 1.0f);
-		AddAtom(m_atomGenerator.CreateAtom(Element::NITROGEN, initPos, initVelocity));
-
-		initPos = XMFLOAT3(0.7f, 0.3f, 0.1f);
-		initVelocity = XMFLOAT3(0.0f, 0.5f, 1.0f);
-		AddAtom(m_atomGenerator.CreateAtom(Element::OXYGEN, initPos, initVelocity));
-
-		initPos = XMFLOAT3(0.2f, 0.6f, 0.7f);
-		initVelocity = XMFLOAT3(0.0f, 0.5f, 1.0f);
-		AddAtom(m_atomGenerator.CreateAtom(Element::FLOURINE, initPos, initVelocity));
-		
-		initPos = XMFLOAT3(-0.7f, 0.2f, 0.7f);
-		initVelocity = XMFLOAT3(-1.0f, 0.5f, 1.0f);
-		AddAtom(m_atomGenerator.CreateAtom(Element::NEON, initPos, initVelocity));
+		SceneDescription::Build(DefaultScene, std::strlen(DefaultScene), m_atomArena);
+		RebuildAtomList();
 
-		m_paused = false;
+		PlaySimulation();
 	}
 
 	void Simulation::AddAtom(Atom* atom)
 	{
-		// We need to make sure that the atoms are sorted by element type
+		// We need to make sure that the render batches are sorted by element type
 		// So insert the new atom in the first spot after all of the elements with smaller
-		// element numbers
+		// or equal element numbers. Atoms of the same element then stay in arena order,
+		// which keeps this list identical to what RebuildAtomList() produces
 
-		// Get the first index where the current element is greater than or equal to the new atom
+		// Get the first index where the current element is greater than the new atom
 		unsigned int index;
-		for (index = 0; index < m_atoms.size(); ++index)
+		for (index = 0; index < m_atomsByElement.size(); ++index)
 		{
-			if (m_atoms[index]->Element() >= atom->Element())
+			if (m_atomsByElement[index]->Element() > atom->Element())
 				break;
 		}
 
 		// if we got to the end, just add the new atom
 		// else, insert it at the appropriate spot in the vector
-		if (index == m_atoms.size())
-			m_atoms.push_back(atom);
+		if (index == m_atomsByElement.size())
+			m_atomsByElement.push_back(atom);
 		else
-			m_atoms.insert(m_atoms.begin() + index, atom);
+			m_atomsByElement.insert(m_atomsByElement.begin() + index, atom);
 
+		// The simulation order only needs the atom somewhere - the next check sorts it into place
+		m_atoms.push_back(atom);
+		m_spatialSort.Invalidate();
 	}
 	void Simulation::RemoveAtom()
 	{
 
 	}
 
+	size_t Simulation::AddAtoms(size_t count, const int32_t* elements, const float* positions, const float* velocities)
+	{
+		// Validate everything first - the arena must never hold an unconstructed slot
+		for (size_t iii = 0; iii < count; ++iii)
+		{
+			if (!AtomGenerator::IsValidElement(elements[iii]))
+				throw std::runtime_error("Simulation: invalid element in bulk add");
+		}
+
+		size_t first = m_atomArena.AllocateBulk(count);
+		concurrency::parallel_for(size_t(0), count, [&](size_t iii)
+			{
+				XMFLOAT3 position(positions[3 * iii], positions[3 * iii + 1], positions[3 * iii + 2]);
+				XMFLOAT3 velocity = velocities == nullptr ? XMFLOAT3(0.0f, 0.0f, 0.0f) :
+					XMFLOAT3(velocities[3 * iii], velocities[3 * iii + 1], velocities[3 * iii + 2]);
+
+				AtomGenerator::CreateAtomAt(m_atomArena.SlotAt(first + iii), static_cast<Element>(elements[iii]),
+					position, velocity, Constants::DefaultNeutronCounts[elements[iii]], 0);
+			});
+
+		// One pass over the arena instead of an insertion per atom
+		RebuildAtomList();
+		return first;
+	}
+
+	void Simulation::RebuildAtomList()
+	{
+		// Counting sort on the element - arena order is kept within each element
+		size_t elementCounts[Element::NEON + 2] = { 0 };
+		for (size_t chunk = 0; chunk < m_atomArena.ChunkCount(); ++chunk)
+		{
+			for (unsigned int slot = 0; slot < m_atomArena.ChunkAtomCount(chunk); ++slot)
+				++elementCounts[m_atomArena.At(chunk, slot)->Element() + 1];
+		}
+
+		for (unsigned int element = 1; element < Element::NEON + 2; ++element)
+			elementCounts[element] += elementCounts[element - 1];
+
+		m_atomsByElement.resize(m_atomArena.AtomCount());
+		for (size_t chunk = 0; chunk < m_atomArena.ChunkCount(); ++chunk)
+		{
+			for (unsigned int slot = 0; slot < m_atomArena.ChunkAtomCount(chunk); ++slot)
+			{
+				Atom* atom = m_atomArena.At(chunk, slot);
+				m_atomsByElement[elementCounts[atom->Element()]++] = atom;
+			}
+		}
+
+		// Starts out in element order and is sorted spatially on the next step
+		m_atoms = m_atomsByElement;
+		m_spatialSort.Invalidate();
+	}
+
+	void Simulation::PlaySimulation()
+	{
+		// Remember the state from before Play was ever pressed so ResetSimulation can return to it
+		if (!m_hasResetState)
+		{
+			m_resetAtoms = m_atomArena.TakeSnapshot();
+			m_resetBoxDimensions = m_boxDimensions;
+			m_resetPeriodicAxes = m_periodicAxes;
+			m_hasResetState = true;
+		}
+
+		m_paused = false;
+	}
+
 
-	void Simulation::StartRecording()
+	void Simulation::StartRecording(const std::wstring& filename, const TrajectoryRecorderSettings& settings)
 	{
+		StopRecording();
 
+		m_recorder = std::unique_ptr<TrajectoryRecorder>(new TrajectoryRecorder(filename, m_boxDimensions, settings));
 	}
 	void Simulation::StopRecording()
 	{
+		if (m_recorder == nullptr)
+			return;
 
+		// Blocks until the writer thread has flushed the queued frames
+		m_recorder->Stop();
+		m_recorder = nullptr;
 	}
 
-	void Simulation::LoadSimulationFromFile()
+	void Simulation::StartExport(const std::wstring& filename, const TrajectoryExporterSettings& settings)
 	{
+		StopExport();
 
+		m_exporter = std::unique_ptr<TrajectoryExporter>(new TrajectoryExporter(filename, m_boxDimensions, settings));
 	}
-	void Simulation::SaveSimulationToFile()
+	void Simulation::StopExport()
 	{
+		if (m_exporter == nullptr)
+			return;
 
+		// Blocks until every frame in flight has been formatted and written
+		m_exporter->Stop();
+		m_exporter = nullptr;
 	}
 
-	void Simulation::ClearSimulation()
+	void Simulation::StartPublishing(const std::wstring& name, const SharedFramePublisherSettings& settings)
+	{
+		StopPublishing();
+
+		m_publisher = std::unique_ptr<SharedFramePublisher>(new SharedFramePublisher(name, m_atoms.size(), settings));
+	}
+	void Simulation::StopPublishing()
+	{
+		// Nothing in flight - publishing happens inside Update
+		m_publisher = nullptr;
+	}
+
+	void Simulation::StartServer(const FrameServerSettings& settings)
 	{
+		StopServer();
 
+		m_server = std::unique_ptr<FrameServer>(new FrameServer(settings));
+	}
+	void Simulation::StopServer()
+	{
+		// Disconnects the clients - frames they have not received yet are dropped
+		m_server = nullptr;
+	}
+
+	void Simulation::EventDriven(bool enabled)
+	{
+		// The engine loads the atoms on its first Advance, and a new one starts from whatever the
+		// time stepped update left behind
+		if (!enabled)
+			m_hardSpheres = nullptr;
+		else if (m_hardSpheres == nullptr)
+		{
+			m_integrator = nullptr;
+			m_hardSpheres = std::make_unique<HardSphereDynamics>();
+		}
+	}
+
+	void Simulation::ForceDriven(bool enabled)
+	{
+		// Like EventDriven, the integrator loads the atoms on its first step
+		if (!enabled)
+			m_integrator = nullptr;
+		else if (m_integrator == nullptr)
+		{
+			m_hardSpheres = nullptr;
+			m_integrator = std::make_unique<Integrator>();
+			m_integrator->AddForceProvider(std::make_shared<PairForceProvider>());
+			m_electrostatics.clear();
+			Electrostatics();
+			m_integrator->Constraints(m_bonds);
+
+			try
+			{
+				CheckPeriods(m_boxDimensions, m_periodicAxes);
+			}
+			catch (const std::runtime_error&)
+			{
+				m_integrator = nullptr;
+				throw;
+			}
+		}
+	}
+
+	void Simulation::BoxDimensions(XMFLOAT3 dimensions)
+	{
+		CheckPeriods(dimensions, m_periodicAxes);
+		m_boxDimensions = dimensions;
+	}
+
+	void Simulation::PeriodicAxes(unsigned int axes)
+	{
+		axes &= PERIODIC_ALL;
+		CheckPeriods(m_boxDimensions, axes);
+		bool swap = (axes == PERIODIC_NONE) != (m_periodicAxes == PERIODIC_NONE);
+		m_periodicAxes = axes;
+
+		// PME follows its axes by itself, only opening or closing the last one swaps the providers
+		if (swap && m_integrator != nullptr)
+			Electrostatics();
+	}
+
+	void Simulation::CheckPeriods(XMFLOAT3 boxDimensions, unsigned int periodicAxes)
+	{
+		// Pair forces only see the nearest image of a partner (see NeighbourList.h), so a periodic
+		// length under twice their reach would quietly leave pairs out
+		if (m_integrator == nullptr)
+			return;
+
+		const float minimum = m_integrator->MinimumPeriod();
+		const float lengths[3] = { boxDimensions.x, boxDimensions.y, boxDimensions.z };
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			if (Boundaries::IsPeriodic(periodicAxes, axis) && lengths[axis] < minimum)
+				throw std::runtime_error("Simulation: periodic box lengths must be at least twice the cutoff plus skin of the pair forces");
+		}
+	}
+
+	void Simulation::Electrostatics()
+	{
+		for (const auto& provider : m_electrostatics)
+			m_integrator->RemoveForceProvider(provider);
+		m_electrostatics.clear();
+
+		if (m_periodicAxes == PERIODIC_NONE)
+		{
+			// Walled all round there are no images, and the tree code sums the open boundary
+			// Coulomb forces directly - near pairs exactly, so it is a fast force
+			m_electrostatics.push_back(std::make_shared<BarnesHut>());
+			m_integrator->AddForceProvider(m_electrostatics.back());
+		}
+		else
+		{
+			// The Ewald sum in two, so multiple time stepping (Dynamics()->InnerSteps) can leave the
+			// reciprocal part to the outer step
+			EwaldSettings realSpace, reciprocal;
+			realSpace.terms = EwaldTerms::RealSpace;
+			reciprocal.terms = EwaldTerms::Reciprocal;
+			m_electrostatics.push_back(std::make_shared<ParticleMeshEwald>(realSpace));
+			m_integrator->AddForceProvider(m_electrostatics.back());
+			m_electrostatics.push_back(std::make_shared<ParticleMeshEwald>(reciprocal));
+			m_integrator->AddForceProvider(m_electrostatics.back(), ForceSplit::Slow);
+		}
+	}
+
+	void Simulation::ContinuousCollisions(bool enabled)
+	{
+		// Nothing is kept between steps, so it can come and go at any time
+		if (!enabled)
+			m_sweptCollisions = nullptr;
+		else if (m_sweptCollisions == nullptr)
+			m_sweptCollisions = std::make_unique<SweptCollisions>();
+	}
+
+	void Simulation::AdaptiveTimeStepping(bool enabled, const AdaptiveTimeStepSettings& settings)
+	{
+		m_adaptiveTimeStep = enabled ? std::make_unique<AdaptiveTimeStep>(settings) : nullptr;
+	}
+
+	void Simulation::EnableCheckpoints(const std::wstring& directory, const CheckpointSettings& settings)
+	{
+		DisableCheckpoints();
+
+		m_checkpointer = std::unique_ptr<Checkpointer>(new Checkpointer(directory, settings));
+	}
+	void Simulation::DisableCheckpoints()
+	{
+		if (m_checkpointer == nullptr)
+			return;
+
+		m_checkpointer->Wait();
+		m_checkpointer = nullptr;
+	}
+	void Simulation::RestoreCheckpoint(const std::wstring& directory)
+	{
+		// Restore into a separate arena first so that a damaged checkpoint does not destroy the current scene
+		AtomArena restored;
+		CheckpointState state = Checkpointer::Restore(directory, restored);
+		CheckPeriods(state.boxDimensions, state.periodicAxes);
+
+		ClearSimulation();
+		m_atomArena.Swap(restored);
+		RebuildAtomList();
+
+		// The collision pass depends on the order of the list - put it back as it was, sort schedule and all
+		if (!state.order.empty())
+		{
+			for (size_t iii = 0; iii < m_atoms.size(); ++iii)
+				m_atoms[iii] = static_cast<Atom*>(m_atomArena.SlotAt(state.order[iii]));
+			m_spatialSort.Restore(state.sortState);
+		}
+		for (const BondConstraints::Bond& bond : state.bonds)
+			m_bonds->Add(bond.first, bond.second, bond.length);
+
+		m_boxDimensions = state.boxDimensions;
+		m_boxVisible = state.boxVisible;
+		m_stepCount = state.stepCount;
+		m_fixedTimeStep = state.fixedTimeStep;
+		m_simulatedTime = state.time;
+		PeriodicAxes(state.periodicAxes);
+		m_elapsedTime = -1.0f;
+	}
+
+	void Simulation::LoadSimulationFromFile(const std::wstring& filename)
+	{
+		// Load into a separate arena first so that an invalid file does not destroy the current scene
+		AtomArena loaded;
+		SceneFile::SceneState state = SceneFile::Load(filename, loaded);
+		CheckPeriods(state.boxDimensions, state.periodicAxes);
+
+		ClearSimulation();
+		m_atomArena.Swap(loaded);
+		RebuildAtomList();
+		for (const BondConstraints::Bond& bond : state.bonds)
+			m_bonds->Add(bond.first, bond.second, bond.length);
+
+		m_boxDimensions = state.boxDimensions;
+		m_boxVisible = state.boxVisible;
+		m_stepCount = state.stepCount;
+		m_simulatedTime = state.time;
+		PeriodicAxes(state.periodicAxes);
+		m_elapsedTime = -1.0f;
+	}
+	void Simulation::SaveSimulationToFile(const std::wstring& filename)
+	{
+		SceneFile::SceneState state;
+		state.boxDimensions = m_boxDimensions;
+		state.boxVisible = m_boxVisible;
+		state.stepCount = m_stepCount;
+		state.time = m_simulatedTime;
+		state.periodicAxes = m_periodicAxes;
+		state.bonds = m_bonds->Bonds();
+
+		SceneFile::Save(filename, m_atomArena, state);
+	}
+	void Simulation::SaveBrickedScene(const std::wstring& filename, const BrickedSceneFile::SaveSettings& settings)
+	{
+		SceneFile::SceneState state;
+		state.boxDimensions = m_boxDimensions;
+		state.boxVisible = m_boxVisible;
+		state.stepCount = m_stepCount;
+		state.time = m_simulatedTime;
+		state.periodicAxes = m_periodicAxes;
+
+		BrickedSceneFile::Save(filename, m_atomArena, state, settings);
+	}
+	void Simulation::LoadSceneRegion(const std::wstring& filename, XMFLOAT3 regionMin, XMFLOAT3 regionMax)
+	{
+		BrickedSceneFile::Reader reader(filename);
+
+		AtomArena loaded;
+		reader.LoadBricks(reader.QueryBox(regionMin, regionMax), loaded, &regionMin, &regionMax);
+		SceneFile::SceneState state = reader.State();
+		CheckPeriods(state.boxDimensions, m_periodicAxes);
+
+		ClearSimulation();
+		m_atomArena.Swap(loaded);
+		RebuildAtomList();
+
+		m_boxDimensions = state.boxDimensions;
+		m_boxVisible = state.boxVisible;
+		m_stepCount = state.stepCount;
+		m_elapsedTime = -1.0f;
+	}
+	void Simulation::ImportStructure(const std::wstring& filename, const StructureImport::ImportSettings& settings)
+	{
+		AtomArena imported;
+		StructureImport::ImportResult result = StructureImport::Import(filename, imported, settings);
+		CheckPeriods(result.boxDimensions, m_periodicAxes);
+
+		ClearSimulation();
+		m_atomArena.Swap(imported);
+		RebuildAtomList();
+
+		m_boxDimensions = result.boxDimensions;
+		m_elapsedTime = -1.0f;
+	}
+	void Simulation::LoadSceneDescription(const std::wstring& filename)
+	{
+		AtomArena built;
+		SceneDescription::SceneParameters parameters = SceneDescription::Load(filename, built);
+		CheckPeriods(parameters.boxDimensions, m_periodicAxes);
+
+		ClearSimulation();
+		m_atomArena.Swap(built);
+		RebuildAtomList();
+
+		m_boxDimensions = parameters.boxDimensions;
+		m_boxVisible = parameters.boxVisible;
+		if (parameters.fixedTimeStep > 0.0)
+			m_fixedTimeStep = parameters.fixedTimeStep;
+		m_elapsedTime = -1.0f;
+	}
+
+	void Simulation::ClearSimulation()
+	{
+		StopRecording();
+		StopExport();
+		StopPublishing();
+		DisableCheckpoints();
+
+		// The atoms live in the arena, so dropping the list and the chunks is all that is needed
+		m_atoms.clear();
+		m_atomsByElement.clear();
+		m_atomArena.Clear();
+		m_bonds->Clear();
+
+		m_resetAtoms.Release();
+		m_hasResetState = false;
+
+		m_elapsedTime = 0.0f;
+		m_simulatedTime = 0.0;
+		m_stepCount = 0;
+		m_paused = true;
 	}
 	void Simulation::ResetSimulation()
 	{
+		if (!m_hasResetState)
+			return;
 
+		// The pair forces may have changed since - check before anything is restored
+		CheckPeriods(m_resetBoxDimensions, m_resetPeriodicAxes);
+
+		// Swapping the chunk pointers is all it takes - the snapshot keeps sharing the chunks
+		// with the live arena so the simulation can be reset again later
+		m_atomArena.Restore(m_resetAtoms);
+		RebuildAtomList();
+
+		m_boxDimensions = m_resetBoxDimensions;
+		PeriodicAxes(m_resetPeriodicAxes);
+
+		m_paused = true;
+		m_elapsedTime = -1.0f;
+		m_simulatedTime = 0.0;
+		m_stepCount = 0;
 	}
 
 	void Simulation::Update(DX::StepTimer const& timer)
 	{
-		/* This function could be made HIGHLY parallel,
-		* and should probably even execute on the GPU
-		*/
-
 		if (!m_paused)
 		{
 			// if the elapsed time is -1, then the simulation was just unpaused
@@ -131,75 +506,290 @@ namespace Simulation
 				m_elapsedTime = timer.GetTotalSeconds();
 
 			double currentTime = timer.GetTotalSeconds();
-			double timeDelta = currentTime - m_elapsedTime;
-
-			// We probably don't want to simply run the update method without
-			// passing along knowledge of the locations of other atoms
-			// You probably want a read only buffer of all atom locations that
-			// gets passed to the update call for each atom and is later updated
-			// once all atoms have been updated
-
-			for (Atom* atom : m_atoms)
-				atom->Update(timeDelta, m_atoms, m_boxDimensions);
-
-			// The update procedure currently only updates position and takes account of the simulation wall
-			// Here, we need to make updates to account for elastic collisions with other atoms
-			// This is temporary however, because we will need to move past elastic collisions to simulate
-			// real physics
-			// See here for math explanation: https://exploratoria.github.io/exhibits/mechanics/elastic-collisions-in-3d/
-
-			XMFLOAT3 d; // distance between atoms
-			float mag;  // magnitude of the distance vector
-			XMFLOAT3 n; // normal vector between balls
-			XMFLOAT3 vrel; // relative velocity between the atoms
-			XMFLOAT3 vnorm; // relative velocity along the normal direction
-			float vreldotnorm; // the dot product between vrel and vnorm
-			XMFLOAT3 newV1, newV2; // new velocity vectors post-collision
-			for (unsigned int iii = 0; iii < m_atoms.size(); ++iii)
+			double timeDelta = m_fixedTimeStep > 0.0 ? m_fixedTimeStep : currentTime - m_elapsedTime;
+			m_elapsedTime = static_cast<float>(currentTime);
+
+			Advance(timeDelta);
+		}
+	}
+
+	void Simulation::Step(double timeDelta)
+	{
+		// No wall clock here - the step is all there is
+		Advance(timeDelta);
+	}
+
+	void Simulation::Advance(double timeDelta)
+	{
+		/* This function could be made HIGHLY parallel,
+		* and should probably even execute on the GPU
+		*/
+
+		// Atoms are about to be modified in place, so split off any chunks that are still
+		// shared with the reset snapshot (only does work on the first step after Play/Reset)
+		m_atomArena.MakeWritable();
+
+		// Only the order of the list changes - the engines permute their state to match
+		if (m_spatialSort.Update(m_atoms, m_boxDimensions))
+		{
+			if (m_hardSpheres != nullptr)
+				m_hardSpheres->Remap(m_atoms, m_spatialSort.Remap());
+			if (m_integrator != nullptr)
+				m_integrator->Remap(m_atoms, m_spatialSort.Remap());
+		}
+
+		if (m_hardSpheres != nullptr)
+			m_hardSpheres->Advance(timeDelta, m_atoms, m_boxDimensions, m_periodicAxes);
+		else if (m_adaptiveTimeStep != nullptr)
+			timeDelta = StepAdaptive();		// Whatever the clock says
+		else if (m_integrator != nullptr)
+			m_integrator->Step(timeDelta, m_atoms, m_boxDimensions, m_periodicAxes);
+		else
+			StepAtoms(timeDelta);
+
+		// Simulated time is the sum of the steps actually taken - the wall clock base is Update's
+		m_simulatedTime += timeDelta;
+		++m_stepCount;
+		const double currentTime = m_simulatedTime;
+
+		// Hand the new frame to the recorder / exporter / shared memory / server - this only copies positions
+		if (m_recorder != nullptr)
+			m_recorder->SubmitFrame(m_stepCount, currentTime, m_atomsByElement);
+		if (m_exporter != nullptr)
+			m_exporter->SubmitFrame(m_stepCount, currentTime, m_atomsByElement);
+		if (m_publisher != nullptr)
+			m_publisher->PublishFrame(m_stepCount, currentTime, m_boxDimensions, m_atomsByElement);
+		if (m_server != nullptr)
+			m_server->SubmitFrame(m_stepCount, currentTime, m_boxDimensions, m_atomsByElement);
+
+		// The snapshot shares chunks with the arena - the next step only copies the ones the
+		// checkpoint writer has not finished with yet
+		if (m_checkpointer != nullptr && m_checkpointer->Due(m_stepCount))
+		{
+			CheckpointState state;
+			state.boxDimensions = m_boxDimensions;
+			state.boxVisible = m_boxVisible;
+			state.stepCount = m_stepCount;
+			state.fixedTimeStep = m_fixedTimeStep;
+			state.time = m_simulatedTime;
+			state.periodicAxes = m_periodicAxes;
+			m_atomArena.Numbers(m_atoms, state.order);
+			state.sortState = m_spatialSort.State();
+			state.bonds = m_bonds->Bonds();
+			m_checkpointer->Submit(m_atomArena.TakeSnapshot(), state);
+		}
+	}
+	double Simulation::StepAdaptive()
+	{
+		double timeDelta = m_adaptiveTimeStep->Propose(m_atoms);
+
+		// Forces are smooth - the fastest atom alone sets the step
+		if (m_integrator != nullptr)
+		{
+			m_integrator->Step(timeDelta, m_atoms, m_boxDimensions, m_periodicAxes);
+			m_adaptiveTimeStep->Accept(timeDelta);
+			return timeDelta;
+		}
+
+		// Swept collisions leave no overlaps - there is nothing to reject
+		if (m_sweptCollisions != nullptr)
+		{
+			StepAtoms(timeDelta);
+			m_adaptiveTimeStep->Accept(timeDelta);
+			return timeDelta;
+		}
+
+		// Time stepped collisions can overshoot - keep the atoms to take the step again
+		const size_t count = m_atoms.size();
+		m_rollbackPositions.resize(count);
+		m_rollbackVelocities.resize(count);
+		for (size_t iii = 0; iii < count; ++iii)
+		{
+			m_rollbackPositions[iii] = m_atoms[iii]->Position();
+			m_rollbackVelocities[iii] = m_atoms[iii]->Velocity();
+		}
+
+		StepAtoms(timeDelta);
+		while (!m_adaptiveTimeStep->Accept(timeDelta))
+		{
+			for (size_t iii = 0; iii < count; ++iii)
+			{
+				m_atoms[iii]->Position(m_rollbackPositions[iii]);
+				m_atoms[iii]->Velocity(m_rollbackVelocities[iii]);
+			}
+			timeDelta = m_adaptiveTimeStep->Retry(timeDelta);
+			StepAtoms(timeDelta);
+		}
+		return timeDelta;
+	}
+
+	void Simulation::StepAtoms(double timeDelta)
+	{
+		// Impacts are found inside the step rather than after it - no overlap is left for the
+		// adaptive time step to reject, and no contact for it to slow down for
+		if (m_sweptCollisions != nullptr)
+		{
+			m_sweptCollisions->Step(timeDelta, m_atoms, m_boxDimensions, m_periodicAxes);
+			return;
+		}
+
+		// We probably don't want to simply run the update method without
+		// passing along knowledge of the locations of other atoms
+		// You probably want a read only buffer of all atom locations that
+		// gets passed to the update call for each atom and is later updated
+		// once all atoms have been updated
+
+		for (Atom* atom : m_atoms)
+			atom->Update(timeDelta, m_atoms, m_boxDimensions, m_periodicAxes);
+
+		// The update procedure currently only updates position and takes account of the simulation wall
+		// Here, we need to make updates to account for elastic collisions with other atoms
+		// This is temporary however, because we will need to move past elastic collisions to simulate
+		// real physics
+		// See here for math explanation: https://exploratoria.github.io/exhibits/mechanics/elastic-collisions-in-3d/
+
+		// Pairs across a periodic face are found through the halo, so the loops below never
+		// wrap a displacement themselves
+		BuildHalo();
+
+		XMFLOAT3 d; // distance between atoms
+		float mag;  // magnitude of the distance vector
+		XMFLOAT3 n; // normal vector between balls
+		XMFLOAT3 vrel; // relative velocity between the atoms
+		XMFLOAT3 vnorm; // relative velocity along the normal direction
+		float vreldotnorm; // the dot product between vrel and vnorm
+		XMFLOAT3 newV1, newV2; // new velocity vectors post-collision
+
+		// For the adaptive time step - the soonest contact of a pair closing in, and the deepest
+		// overlap of a pair that met during this step
+		const bool gather = m_adaptiveTimeStep != nullptr;
+		double contactTime = std::numeric_limits<double>::infinity();
+		float overlap = 0.0f;
+
+		auto collide = [&](Atom* first, XMFLOAT3 firstPosition, Atom* second, XMFLOAT3 secondPosition)
+		{
+			// check distance between the two atoms
+			d.x = firstPosition.x - secondPosition.x;
+			d.y = firstPosition.y - secondPosition.y;
+			d.z = firstPosition.z - secondPosition.z;
+
+			mag = std::sqrt(d.x * d.x + d.y * d.y + d.z * d.z);
+			const float contact = first->Radius() + second->Radius();
+			if (gather)
 			{
-				for (unsigned int jjj = iii + 1; jjj < m_atoms.size(); ++jjj)
+				// d . vrel < 0 while the atoms close in, at |d . vrel| / mag
+				const XMFLOAT3 v1 = first->Velocity();
+				const XMFLOAT3 v2 = second->Velocity();
+				const float closing = -(d.x * (v1.x - v2.x) + d.y * (v1.y - v2.y) + d.z * (v1.z - v2.z));
+				if (closing > 0.0f)
 				{
-					// check distance between the two atoms
-					// currently assuming a radius of 1 and identical masses
-					d.x = m_atoms[iii]->Position().x - m_atoms[jjj]->Position().x;
-					d.y = m_atoms[iii]->Position().y - m_atoms[jjj]->Position().y;
-					d.z = m_atoms[iii]->Position().z - m_atoms[jjj]->Position().z;
-
-					mag = std::sqrt(d.x * d.x + d.y * d.y + d.z * d.z);
-					if (mag < m_atoms[iii]->Radius() + m_atoms[jjj]->Radius()) // assume radius for each atom is 1
-					{
-						// compute a normalized normal vector between the atoms
-						n.x = d.x / mag;
-						n.y = d.y / mag;
-						n.z = d.z / mag;
-
-						// compute the relative velocity between the atoms
-						vrel.x = m_atoms[iii]->Velocity().x - m_atoms[jjj]->Velocity().x;
-						vrel.y = m_atoms[iii]->Velocity().y - m_atoms[jjj]->Velocity().y;
-						vrel.z = m_atoms[iii]->Velocity().z - m_atoms[jjj]->Velocity().z;
-
-						// compute the relative velocity along the normal direction;
-						vreldotnorm = vrel.x * n.x + vrel.y * n.y + vrel.z * n.z;
-						vnorm.x = vreldotnorm * n.x;
-						vnorm.y = vreldotnorm * n.y;
-						vnorm.z = vreldotnorm * n.z;
-
-						// exchange normal velocities
-						newV1.x = m_atoms[iii]->Velocity().x - vnorm.x;
-						newV1.y = m_atoms[iii]->Velocity().y - vnorm.y;
-						newV1.z = m_atoms[iii]->Velocity().z - vnorm.z;
-						m_atoms[iii]->Velocity(newV1);
-
-						newV2.x = m_atoms[jjj]->Velocity().x + vnorm.x;
-						newV2.y = m_atoms[jjj]->Velocity().y + vnorm.y;
-						newV2.z = m_atoms[jjj]->Velocity().z + vnorm.z;
-						m_atoms[jjj]->Velocity(newV2);
-					}
+					if (mag >= contact)
+						contactTime = std::min(contactTime, static_cast<double>(mag - contact) * mag / closing);
+					else
+						overlap = std::max(overlap, (contact - mag) / contact);
 				}
 			}
+			if (mag < contact)
+			{
+				// compute a normalized normal vector between the atoms
+				n.x = d.x / mag;
+				n.y = d.y / mag;
+				n.z = d.z / mag;
+
+				// compute the relative velocity between the atoms
+				vrel.x = first->Velocity().x - second->Velocity().x;
+				vrel.y = first->Velocity().y - second->Velocity().y;
+				vrel.z = first->Velocity().z - second->Velocity().z;
+
+				// compute the relative velocity along the normal direction;
+				vreldotnorm = vrel.x * n.x + vrel.y * n.y + vrel.z * n.z;
+				vnorm.x = vreldotnorm * n.x;
+				vnorm.y = vreldotnorm * n.y;
+				vnorm.z = vreldotnorm * n.z;
+
+				// exchange normal velocities
+				newV1.x = first->Velocity().x - vnorm.x;
+				newV1.y = first->Velocity().y - vnorm.y;
+				newV1.z = first->Velocity().z - vnorm.z;
+				first->Velocity(newV1);
+
+				newV2.x = second->Velocity().x + vnorm.x;
+				newV2.y = second->Velocity().y + vnorm.y;
+				newV2.z = second->Velocity().z + vnorm.z;
+				second->Velocity(newV2);
+			}
+		};
 
-			m_elapsedTime = currentTime;
+		for (unsigned int iii = 0; iii < m_atoms.size(); ++iii)
+		{
+			for (unsigned int jjj = iii + 1; jjj < m_atoms.size(); ++jjj)
+				collide(m_atoms[iii], m_atoms[iii]->Position(), m_atoms[jjj], m_atoms[jjj]->Position());
+		}
+
+		// Every pair across a face meets twice in the halo - once as a ghost of either atom - so only
+		// the ghosts of the later atom count. A ghost shares its velocity with the atom it copies.
+		for (size_t ghost = 0; ghost < m_haloSources.size(); ++ghost)
+		{
+			unsigned int source = m_haloSources[ghost];
+			for (unsigned int iii = 0; iii < source; ++iii)
+				collide(m_atoms[iii], m_atoms[iii]->Position(), m_atoms[source], m_haloPositions[ghost]);
+		}
+
+		if (gather)
+			m_adaptiveTimeStep->Gather(contactTime, overlap);
+	}
+
+	void Simulation::BuildHalo()
+	{
+		m_haloPositions.clear();
+		m_haloSources.clear();
 
+		if (m_periodicAxes == PERIODIC_NONE || m_atoms.empty())
+			return;
+
+		// Two atoms touch when they are closer than the sum of their radii
+		float reach = 0.0f;
+		for (Atom* atom : m_atoms)
+			reach = std::max(reach, 2.0f * atom->Radius());
+
+		for (unsigned int iii = 0; iii < m_atoms.size(); ++iii)
+		{
+			XMFLOAT3 position = m_atoms[iii]->Position();
+
+			// The shifts each axis allows - none, and the box length towards the face the atom is near
+			float shifts[3][3];
+			int shiftCount[3];
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				float coordinate = (&position.x)[axis];
+				float length = (&m_boxDimensions.x)[axis];
+
+				shifts[axis][0] = 0.0f;
+				shiftCount[axis] = 1;
+				if (!Boundaries::IsPeriodic(m_periodicAxes, axis))
+					continue;
+
+				if (coordinate < -length / 2.0f + reach)
+					shifts[axis][shiftCount[axis]++] = length;
+				if (coordinate > length / 2.0f - reach)
+					shifts[axis][shiftCount[axis]++] = -length;
+			}
+
+			// Every combination but no shift at all - up to 7 ghosts in a corner
+			for (int xxx = 0; xxx < shiftCount[0]; ++xxx)
+			{
+				for (int yyy = 0; yyy < shiftCount[1]; ++yyy)
+				{
+					for (int zzz = 0; zzz < shiftCount[2]; ++zzz)
+					{
+						if (xxx == 0 && yyy == 0 && zzz == 0)
+							continue;
+
+						m_haloPositions.push_back(XMFLOAT3(position.x + shifts[0][xxx], position.y + shifts[1][yyy], position.z + shifts[2][zzz]));
+						m_haloSources.push_back(iii);
+					}
+				}
+			}
 		}
 	}
 }
\ No newline at end of file
@@ -4,6 +4,23 @@
 #include "DeviceResources.h"
 #include "Enums.h"
 #include "SimulationRenderer.h"
+#include "BrickedSceneFile.h"
+#include "Checkpoint.h"
+#include "FrameServer.h"
+#include "HardSphereDynamics.h"
+#include "Integrator.h"
+#include "ParticleMeshEwald.h"
+#include "SceneFile.h"
+#include "SharedFramePublisher.h"
+#include "AdaptiveTimeStep.h"
+#include "BarnesHut.h"
+#include "SpatialSort.h"
+#include "SweptCollisions.h"
+#include "SceneDescription.h"
+#include "StructureImport.h"
+#include "TrajectoryExporter.h"
+#include "TrajectoryRecorder.h"
+#include "AtomArena.h"
 #include "AtomGenerator.h"
 #include "Elements.h"			// <-- includes header files for all elements
 
@@ -21,45 +38,149 @@ namespace Simulation
 	class Simulation
 	{
 	public:
-		Simulation(const std::shared_ptr<DX::DeviceResources>& deviceResources);
+		Simulation();
 
 		void AddAtom(Atom* atom);
 		void RemoveAtom();
 
-		void PlaySimulation() {  m_paused = false; }
+		// Construct 'count' atoms at once (default isotope, neutral). 'positions' and 'velocities' hold
+		// 3 floats per atom; 'velocities' may be nullptr for atoms at rest. Returns the arena index of
+		// the first new atom - the rest follow consecutively. Throws std::runtime_error on an invalid
+		// element, before anything is added.
+		size_t AddAtoms(size_t count, const int32_t* elements, const float* positions, const float* velocities);
+
+		void PlaySimulation();
 		void PauseSimulation() { m_paused = true; m_elapsedTime = -1.0f; }
 		bool IsPaused() { return m_paused; }
 
-		void StartRecording();
+		void StartRecording(const std::wstring& filename, const TrajectoryRecorderSettings& settings = TrajectoryRecorderSettings());
 		void StopRecording();
+		bool IsRecording() { return m_recorder != nullptr; }
+
+		// Export to XYZ / DCD for other tools (see TrajectoryExporter.h)
+		void StartExport(const std::wstring& filename, const TrajectoryExporterSettings& settings = TrajectoryExporterSettings());
+		void StopExport();
+		bool IsExporting() { return m_exporter != nullptr; }
+		TrajectoryExporter* Exporter() { return m_exporter.get(); }
+
+		// Live frames in shared memory for analysis processes (see SharedFrameRing.h). Starting
+		// throws std::runtime_error if the shared memory cannot be created.
+		void StartPublishing(const std::wstring& name, const SharedFramePublisherSettings& settings = SharedFramePublisherSettings());
+		void StopPublishing();
+		bool IsPublishing() { return m_publisher != nullptr; }
+		SharedFramePublisher* Publisher() { return m_publisher.get(); }
+
+		// Stream frames to remote viewers (see FrameServer.h). Starting throws std::runtime_error if
+		// the port cannot be opened. The server keeps running when the scene is cleared or loaded.
+		void StartServer(const FrameServerSettings& settings = FrameServerSettings());
+		void StopServer();
+		bool IsServing() { return m_server != nullptr; }
+		FrameServer* Server() { return m_server.get(); }
+
+		// Periodic incremental checkpoints (see Checkpoint.h). Enabling throws std::runtime_error if
+		// the directory cannot be created. A failed restore leaves the current simulation untouched.
+		void EnableCheckpoints(const std::wstring& directory, const CheckpointSettings& settings = CheckpointSettings());
+		void DisableCheckpoints();		// Waits for the checkpoint being written (if any)
+		Checkpointer* Checkpoints() { return m_checkpointer.get(); }
+		void RestoreCheckpoint(const std::wstring& directory);
+
+		// Binary scene files (see SceneFile.h). Both throw std::runtime_error on failure - a failed
+		// load leaves the current simulation untouched.
+		void LoadSimulationFromFile(const std::wstring& filename);
+		void SaveSimulationToFile(const std::wstring& filename);
+
+		// Spatially bricked scenes (see BrickedSceneFile.h) for scenes too large to load whole.
+		// LoadSceneRegion replaces the simulation with the atoms inside [regionMin, regionMax] and
+		// only reads the bricks that overlap it. Both throw std::runtime_error on failure.
+		void SaveBrickedScene(const std::wstring& filename, const BrickedSceneFile::SaveSettings& settings = BrickedSceneFile::SaveSettings());
+		void LoadSceneRegion(const std::wstring& filename, XMFLOAT3 regionMin, XMFLOAT3 regionMax);
+
+		// Replace the simulation with the first model of an XYZ, PDB or LAMMPS data / dump file.
+		// Throws std::runtime_error on failure, leaving the current simulation untouched.
+		void ImportStructure(const std::wstring& filename, const StructureImport::ImportSettings& settings = {});
 
-		void LoadSimulationFromFile();
-		void SaveSimulationToFile();
+		// Replace the simulation with the atoms built from a declarative scene description (see
+		// SceneDescription.h). Throws std::runtime_error on failure, leaving the current simulation untouched.
+		void LoadSceneDescription(const std::wstring& filename);
 
-		void ClearSimulation();	// Completely delete the entire active simulation
-		void ResetSimulation(); // Reset the simulation state to where it was before ever pressing Play
+		void ClearSimulation();	// Completely delete the entire active simulation (releases all atom storage at once)
+		void ResetSimulation(); // Reset the simulation state to where it was before ever pressing Play - throws std::runtime_error if the box no longer suits the pair forces
 		
 		void Update(DX::StepTimer const& timer);
 
+		// Advance by exactly 'timeDelta', whether or not the simulation is paused - for callers that
+		// drive the simulation themselves instead of the render loop (see ChemLiveAPI.h)
+		void Step(double timeDelta);
+
+		// Exact event driven hard sphere dynamics (see HardSphereDynamics.h) instead of the time
+		// stepped update - same physics, but no overlaps or tunnelling whatever the step
+		void EventDriven(bool enabled);
+		bool IsEventDriven() { return m_hardSpheres != nullptr; }
+		HardSphereDynamics* HardSpheres() { return m_hardSpheres.get(); }
+
+		// Molecular dynamics under forces (see Integrator.h) instead of billiard ball collisions -
+		// starts with Lennard-Jones pair forces and electrostatics between charged atoms, add or
+		// remove providers through Dynamics(). The electrostatics follow PeriodicAxes: PME with any
+		// periodic axis (its reciprocal part the slow force under multiple time stepping), Barnes-Hut
+		// in a box walled all round, where there are no images to sum. The rest are fast forces.
+		void ForceDriven(bool enabled);
+		bool IsForceDriven() { return m_integrator != nullptr; }
+		Integrator* Dynamics() { return m_integrator.get(); }
+
+		// Fixed bond lengths between atoms, by their number in the arena (see BondConstraints.h) -
+		// held by force driven dynamics only, and kept while it is switched off and on
+		BondConstraints& Bonds() { return *m_bonds; }
+
+		// Swept sphere collisions (see SweptCollisions.h) in the time stepped update instead of the
+		// overlap test at the end of every step - nothing tunnels, so the step can be many times larger
+		void ContinuousCollisions(bool enabled);
+		bool IsContinuousCollisions() { return m_sweptCollisions != nullptr; }
+		SweptCollisions* SweptSpheres() { return m_sweptCollisions.get(); }
+
+		// Z-order re-sorting of the atom list (see SpatialSort.h) - on by default
+		void SpatialSorting(bool enabled) {	m_spatialSort.Enabled(enabled); }
+		SpatialSort& SpatialOrder() {		return m_spatialSort; }
+
+		// Choose every step's dt from how fast the atoms move and how soon they meet (see
+		// AdaptiveTimeStep.h) instead of the fixed or wall clock step - the step passed to Step and
+		// the fixed time step are ignored while it is on. Event driven dynamics is exact at any step
+		// and keeps the one it is given.
+		void AdaptiveTimeStepping(bool enabled, const AdaptiveTimeStepSettings& settings = AdaptiveTimeStepSettings());
+		bool IsAdaptiveTimeStepping() { return m_adaptiveTimeStep != nullptr; }
+		AdaptiveTimeStep* TimeStepControl() { return m_adaptiveTimeStep.get(); }
+
 		// GET
-		std::vector<Atom*> Atoms() {		return m_atoms; }
+		const std::vector<Atom*>& Atoms() {	return m_atoms; }			// In simulation (Z-) order
+		const std::vector<Atom*>& AtomsByElement() { return m_atomsByElement; }	// Render batches - see m_atomsByElement
+		AtomArena&	Arena() {				return m_atomArena; }		// Atoms in storage order - see AtomArena.h
 
 		XMFLOAT3	BoxDimensions() {		return m_boxDimensions; }
 		//LENGTH_UNIT BoxDimensionUnits() {	return m_boxDimensionUnits; }
 		bool		BoxVisible() {			return m_boxVisible; }
+		unsigned int PeriodicAxes() {		return m_periodicAxes; }	// PeriodicAxis flags
 
-		float		ElapsedTime() {			return m_elapsedTime; }
+		float		ElapsedTime() {			return m_elapsedTime; }		// Wall clock base of the next Update
+		double		SimulatedTime() {		return m_simulatedTime; }	// ps - the sum of the steps taken
+		unsigned long long StepCount() {	return m_stepCount; }
+		double		FixedTimeStep() {		return m_fixedTimeStep; }
 		//TIME_UNIT	ElapsedTimeUnit() {		return m_elapsedTimeUnit; }
 
-		// SET
-		void BoxDimensions(XMFLOAT3 dimensions) {	m_boxDimensions = dimensions; }
+		// SET - BoxDimensions and PeriodicAxes throw std::runtime_error under force driven dynamics if
+		// a periodic length would be shorter than the forces allow (see NeighbourList.h)
+		void BoxDimensions(XMFLOAT3 dimensions);
 		//void BoxDimensionUnits(LENGTH_UNIT unit) {	m_boxDimensionUnits = unit; }
 		void BoxVisible(bool visible) {				m_boxVisible = visible; }
+		void PeriodicAxes(unsigned int axes);									// Walls on the rest
 
 		void ElapsedTime(float time) {				m_elapsedTime = time; }
+		void SimulatedTime(double time) {			m_simulatedTime = time; }
+		void FixedTimeStep(double timeStep) {		m_fixedTimeStep = timeStep; }
 		//void ElapsedTimeUnit(TIME_UNIT timeUnit) {	m_elapsedTimeUnit = timeUnit; }
 
 	private:
+		// Atom storage - must be declared before the generator that constructs into it
+		AtomArena	  m_atomArena;
+
 		// Atom Generator
 		AtomGenerator m_atomGenerator;
 
@@ -67,15 +188,75 @@ namespace Simulation
 		XMFLOAT3	m_boxDimensions;		// 3 floats to hold the MAX x,y,z dimensions for the simulation box (ex. if x = 10, then x-axis = [-10, 10])
 		//LENGTH_UNIT m_boxDimensionUnits;	// The m_dimensions values will all be interpretted to be a specific unit
 		bool		m_boxVisible;			// If true, the dimension box will be outlined
+		unsigned int m_periodicAxes;		// PeriodicAxis flags - atoms leaving through these faces come back through the opposite ones
 
 		// Time
-		float		m_elapsedTime;
+		float		m_elapsedTime;			// Wall clock time of the last Update - -1 when it has to be picked up again (after Play, a load, ...)
+		double		m_simulatedTime;		// Sum of the steps taken - double, so a small step still counts after a long run
+		unsigned long long m_stepCount;		// Number of Update steps taken while playing
+		double		m_fixedTimeStep;		// Time advanced per step - 0 follows the wall clock, anything else makes runs reproducible
 		//TIME_UNIT	m_elapsedTimeUnit;
 
 		// Atoms
-		std::vector<Atom*> m_atoms;			// List of Atoms active in the simulation
+		std::vector<Atom*> m_atoms;			// List of Atoms active in the simulation (owned by m_atomArena), re-sorted along a Z-order curve now and then
+		std::vector<Atom*> m_atomsByElement;	// The same atoms sorted by element, arena order within an element - one render batch per
+											// element, and a stable order for the recorded / exported / published frames
+		void RebuildAtomList();				// Rebuild both lists from the arena
+
+		// Spatial sorting of m_atoms
+		SpatialSort m_spatialSort;
+
+		void Advance(double timeDelta);							// One step - shared by Update and Step
+		void StepAtoms(double timeDelta);						// Time stepped motion and collisions
+		double StepAdaptive();									// One adaptive step, taken again until accepted - returns its dt
+		void BuildHalo();										// Ghost copies of the atoms near periodic faces
+		void Electrostatics();									// Long range providers to suit m_periodicAxes
+		void CheckPeriods(XMFLOAT3 boxDimensions, unsigned int periodicAxes);	// Throws if a periodic length is too short for the forces
+
+		// Halo - an atom within a contact distance of a periodic face is copied to the far side of
+		// the box (to every far side near a corner), so collisions across a face are ordinary pairs
+		std::vector<XMFLOAT3>		m_haloPositions;
+		std::vector<unsigned int>	m_haloSources;		// Index into m_atoms of the atom each ghost copies
+
+		// Continuous collision detection - null when the time stepped update tests for overlaps
+		std::unique_ptr<SweptCollisions>	m_sweptCollisions;
+
+		// Adaptive time step - null when the step is fixed or follows the wall clock
+		std::unique_ptr<AdaptiveTimeStep>	m_adaptiveTimeStep;
+		std::vector<XMFLOAT3>				m_rollbackPositions;	// Of m_atoms before a time stepped step that may be rejected
+		std::vector<XMFLOAT3>				m_rollbackVelocities;
+
+		// Reset State - captured the first time Play is pressed. The snapshot shares chunks with
+		// m_atomArena, so capturing it is cheap and memory is only duplicated for chunks that change.
+		AtomArena::Snapshot m_resetAtoms;
+		XMFLOAT3			m_resetBoxDimensions;
+		unsigned int		m_resetPeriodicAxes;
+		bool				m_hasResetState;
 
 		// State
 		bool m_paused;
+
+		// Recording - null when not recording
+		std::unique_ptr<TrajectoryRecorder> m_recorder;
+
+		// Export - null when not exporting
+		std::unique_ptr<TrajectoryExporter> m_exporter;
+
+		// Shared memory frames - null when not publishing
+		std::unique_ptr<SharedFramePublisher> m_publisher;
+
+		// Frame server - null when not serving
+		std::unique_ptr<FrameServer> m_server;
+
+		// Checkpoints - null when disabled
+		std::unique_ptr<Checkpointer> m_checkpointer;
+
+		// Event driven dynamics - null when time stepping
+		std::unique_ptr<HardSphereDynamics> m_hardSpheres;
+
+		// Force driven dynamics - null when time stepping
+		std::unique_ptr<Integrator> m_integrator;
+		std::shared_ptr<BondConstraints> m_bonds;
+		std::vector<std::shared_ptr<ForceProvider>> m_electrostatics;	// The integrator's long range providers - see Electrostatics()
 	};
 }
\ No newline at end of file
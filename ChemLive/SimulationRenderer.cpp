@@ -32,6 +32,8 @@ namespace Simulation
 
 		CreateBox();
 
+		m_sphereMesh = std::unique_ptr<SphereMesh>(new SphereMesh(m_deviceResources));
+
 		m_loadingComplete = true;
 	}
 
@@ -351,20 +353,7 @@ namespace Simulation
 		*/
 		auto context = m_deviceResources->GetD3DDeviceContext();
 
-		// Compute the view/projection matrix
-		XMMATRIX viewProjectionMatrix = m_viewMatrix * m_projectionMatrix;
-
-		context->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
-		context->IASetInputLayout(m_inputLayout.get());
-
-		// Attach our vertex shader.
-		context->VSSetShader(m_vertexShader.get(), nullptr, 0);
-
-		// Attach our pixel shader.
-		context->PSSetShader(m_pixelShader.get(), nullptr, 0);
-
-		// Update the Material constant buffer and Light constant buffer then bind it to the pixel shader
-		context->UpdateSubresource(m_lightPropertiesConstantBuffer.get(), 0, nullptr, &m_lightProperties, 0, 0);
+		XMMATRIX viewProjectionMatrix = PreparePipeline();
 
 		// Set the current element to invalid so that the first atom will set the material properties
 		Element currentElement = Element::INVALID;
@@ -403,9 +392,75 @@ namespace Simulation
 				}				
 			}
 
-			atom->Render(viewProjectionMatrix);
+			m_sphereMesh->Render(atom->Position(), atom->Radius(), viewProjectionMatrix);
+		}
+
+		RenderBox(viewProjectionMatrix);
+	}
+
+	void SimulationRenderer::Render(const TrajectoryFrame& frame)
+	{
+		// Loading is asynchronous. Only draw geometry after it's loaded.
+		if (!m_loadingComplete)
+		{
+			return;
+		}
+
+		// Same pipeline as for live atoms - recorded frames keep the element sorted order of
+		// the simulation, so the material only changes a handful of times per frame
+		auto context = m_deviceResources->GetD3DDeviceContext();
+
+		XMMATRIX viewProjectionMatrix = PreparePipeline();
+
+		unsigned int currentElement = Element::INVALID;
+		for (size_t iii = 0; iii < frame.positions.size(); ++iii)
+		{
+			unsigned int element = frame.elements[iii];
+			if (element == Element::INVALID || element >= m_materialProperties.size())
+				continue;
+
+			if (element != currentElement)
+			{
+				currentElement = element;
+
+				context->UpdateSubresource(m_materialPropertiesConstantBuffer.get(), 0, nullptr, m_materialProperties[currentElement], 0, 0);
+
+				ID3D11Buffer* const psConstantBuffers[] = { m_materialPropertiesConstantBuffer.get(), m_lightPropertiesConstantBuffer.get() };
+				context->PSSetConstantBuffers1(0, 2, psConstantBuffers, nullptr, nullptr);
+			}
+
+			m_sphereMesh->Render(frame.positions[iii], Constants::AtomicRadii[element], viewProjectionMatrix);
 		}
 
+		RenderBox(viewProjectionMatrix);
+	}
+
+	XMMATRIX SimulationRenderer::PreparePipeline()
+	{
+		auto context = m_deviceResources->GetD3DDeviceContext();
+
+		// Compute the view/projection matrix
+		XMMATRIX viewProjectionMatrix = m_viewMatrix * m_projectionMatrix;
+
+		context->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+		context->IASetInputLayout(m_inputLayout.get());
+
+		// Attach our vertex shader.
+		context->VSSetShader(m_vertexShader.get(), nullptr, 0);
+
+		// Attach our pixel shader.
+		context->PSSetShader(m_pixelShader.get(), nullptr, 0);
+
+		// Update the Material constant buffer and Light constant buffer then bind it to the pixel shader
+		context->UpdateSubresource(m_lightPropertiesConstantBuffer.get(), 0, nullptr, &m_lightProperties, 0, 0);
+
+		return viewProjectionMatrix;
+	}
+
+	void SimulationRenderer::RenderBox(XMMATRIX viewProjectionMatrix)
+	{
+		auto context = m_deviceResources->GetD3DDeviceContext();
+
 		// Draw Box =============================================================================
 		UINT stride = sizeof(VertexPositionNormal);
 		UINT offset = 0;
@@ -629,6 +684,8 @@ namespace Simulation
 
 		m_boxVertexBuffer = nullptr;
 		m_boxMaterialPropertiesConstantBuffer = nullptr;
+
+		m_sphereMesh = nullptr;
 	}
 
 	void SimulationRenderer::UpdateBoxDimensions(XMFLOAT3 newBoxDimensions)
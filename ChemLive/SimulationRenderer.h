@@ -7,8 +7,10 @@
 #include "HLSLStructures.h"
 #include "MoveLookController.h"
 #include "StepTimer.h"
+#include "TrajectoryReader.h"
 #include "DirectXHelper.h"
 #include "Pane.h"
+#include "SphereMesh.h"
 #include <algorithm>
 #include <cmath>
 #include <pplawait.h>
@@ -33,11 +35,13 @@ namespace Simulation
 
 		// Render
 		void Render(const std::vector<Atom*> &atoms);
+		void Render(const TrajectoryFrame& frame);		// Draw a recorded frame instead of the live atoms
 
 		void UpdateBoxDimensions(XMFLOAT3 newBoxDimensions);		// Update the eye location if box dimensions change
 		void BoxDimensions(XMFLOAT3 dims) { m_boxDimensions = dims; }
 
 		void SetViewMatrix(XMMATRIX viewMatrix) { m_viewMatrix = viewMatrix; }
+		XMMATRIX ViewProjectionMatrix() { return m_viewMatrix * m_projectionMatrix; }
 
 		// Pointer methods (used for picking / highlighting atoms)
 		void PointerMoved(Point point, D2D1_RECT_F renderPaneRect, const std::vector<Atom*>& atoms);
@@ -91,6 +95,9 @@ namespace Simulation
 		void CreateBox();
 		void CreateStaticResources();
 
+		XMMATRIX PreparePipeline();				// Returns the view/projection matrix
+		void RenderBox(XMMATRIX viewProjectionMatrix);
+
 
 		bool SphereIntersection(XMVECTOR rayOrigin, XMVECTOR rayDirection, Atom* atom, float& distance);
 		
@@ -117,6 +124,9 @@ namespace Simulation
 		winrt::com_ptr<ID3D11PixelShader>	m_pixelShader;
 		winrt::com_ptr<ID3D11InputLayout>	m_inputLayout;
 
+		// One sphere mesh shared by every atom - each draw only changes the model matrix
+		std::unique_ptr<SphereMesh>			m_sphereMesh;
+
 		winrt::com_ptr<ID3D11Buffer>		m_modelViewProjectionBuffer;
 		ModelViewProjectionConstantBuffer	m_modelViewProjectionBufferData;
 		XMMATRIX							m_viewMatrix;
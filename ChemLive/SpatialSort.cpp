@@ -0,0 +1,134 @@
+#include "pch.h"
+#include "SpatialSort.h"
+#include "Morton.h"
+#include <algorithm>
+#include <cmath>
+#include <ppl.h>
+#include <stdexcept>
+
+namespace Simulation
+{
+	// Atoms per task
+	static const size_t SortBlock = 8192;
+
+	SpatialSort::SpatialSort(const SpatialSortSettings& settings) :
+		m_settings(settings),
+		m_interval(settings.firstInterval),
+		m_stepsToCheck(settings.firstInterval),
+		m_force(false),
+		m_statistics()
+	{
+		if (settings.firstInterval == 0 || settings.maximumInterval < settings.firstInterval || !(settings.disorder > 0.0f && settings.disorder < 1.0f))
+			throw std::runtime_error("SpatialSort: the intervals must be positive and in order, with a disorder between 0 and 1");
+
+		m_statistics.interval = m_interval;
+	}
+
+	bool SpatialSort::Update(std::vector<Atom*>& atoms, XMFLOAT3 boxDimensions)
+	{
+		if (!m_settings.enabled || atoms.size() < 2)
+			return false;
+		if (m_stepsToCheck > 0)
+		{
+			--m_stepsToCheck;
+			return false;
+		}
+		if (atoms.size() >= 0xFFFFFFFF)
+			throw std::runtime_error("SpatialSort: too many atoms");
+
+		++m_statistics.checks;
+		Code(atoms, boxDimensions);
+		const float disorder = Disorder();
+		m_statistics.disorder = disorder;
+
+		const bool sort = m_force || disorder >= m_settings.disorder;
+		if (sort)
+			Sort(atoms);
+
+		// Decayed well past the threshold - check sooner; hardly decayed - check later
+		if (!m_force)
+		{
+			if (disorder >= 2.0f * m_settings.disorder)
+				m_interval = std::max(1u, m_interval / 2);
+			else if (disorder < 0.5f * m_settings.disorder)
+				m_interval = std::min(m_settings.maximumInterval, m_interval * 2);
+		}
+		m_force = false;
+		m_stepsToCheck = m_interval - 1;
+		m_statistics.interval = m_interval;
+		return sort;
+	}
+
+	void SpatialSort::Restore(const SpatialSortState& state)
+	{
+		// Kept within this sort's settings, which need not be the ones the state was taken under
+		m_interval = std::min(m_settings.maximumInterval, std::max(1u, state.interval));
+		m_stepsToCheck = std::min(m_interval, state.stepsToCheck);
+		m_force = state.force;
+		m_statistics.interval = m_interval;
+	}
+
+	void SpatialSort::Code(const std::vector<Atom*>& atoms, XMFLOAT3 boxDimensions)
+	{
+		// About one cell per atom, in one cube around the box
+		const size_t count = atoms.size();
+		const unsigned int bits = std::min(Morton::Bits, std::max(1u, static_cast<unsigned int>(std::ceil(std::log2(std::cbrt(static_cast<double>(count)))))));
+		const float edge = std::max(std::max(boxDimensions.x, boxDimensions.y), std::max(boxDimensions.z, 1.0e-3f));
+		const float scale = static_cast<float>(1u << bits) / edge;
+		const float last = static_cast<float>((1u << bits) - 1);
+
+		m_codes.resize(count);
+		const size_t blocks = (count + SortBlock - 1) / SortBlock;
+		concurrency::parallel_for(size_t(0), blocks, [&](size_t block)
+			{
+				size_t end = std::min(count, (block + 1) * SortBlock);
+				for (size_t iii = block * SortBlock; iii < end; ++iii)
+				{
+					// Atoms a little outside the box (before the walls catch them) go in the outer cells
+					const XMFLOAT3 position = atoms[iii]->Position();
+					uint32_t x = static_cast<uint32_t>(std::min(last, std::max(0.0f, (position.x + edge / 2.0f) * scale)));
+					uint32_t y = static_cast<uint32_t>(std::min(last, std::max(0.0f, (position.y + edge / 2.0f) * scale)));
+					uint32_t z = static_cast<uint32_t>(std::min(last, std::max(0.0f, (position.z + edge / 2.0f) * scale)));
+					m_codes[iii] = std::make_pair(Morton::Code(x, y, z), static_cast<uint32_t>(iii));
+				}
+			});
+	}
+
+	float SpatialSort::Disorder() const
+	{
+		const size_t count = m_codes.size();
+		const size_t blocks = (count + SortBlock - 1) / SortBlock;
+		std::vector<size_t> descents(blocks, 0);
+		concurrency::parallel_for(size_t(0), blocks, [&](size_t block)
+			{
+				size_t found = 0;
+				size_t end = std::min(count, (block + 1) * SortBlock);
+				for (size_t iii = std::max<size_t>(1, block * SortBlock); iii < end; ++iii)
+					found += m_codes[iii].first < m_codes[iii - 1].first ? 1 : 0;
+				descents[block] = found;
+			});
+
+		size_t total = 0;
+		for (size_t found : descents)
+			total += found;
+		return static_cast<float>(total) / static_cast<float>(count - 1);
+	}
+
+	void SpatialSort::Sort(std::vector<Atom*>& atoms)
+	{
+		++m_statistics.sorts;
+
+		// Ties keep their list order, so a sort of a sorted list changes nothing
+		concurrency::parallel_sort(m_codes.begin(), m_codes.end());
+
+		const size_t count = atoms.size();
+		m_remap.resize(count);
+		m_sorted.resize(count);
+		concurrency::parallel_for(size_t(0), count, [&](size_t iii)
+			{
+				m_remap[iii] = m_codes[iii].second;
+				m_sorted[iii] = atoms[m_codes[iii].second];
+			});
+		atoms.swap(m_sorted);
+	}
+}
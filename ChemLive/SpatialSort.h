@@ -0,0 +1,96 @@
+#pragma once
+
+#include "pch.h"
+#include "Atom.h"
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+using DirectX::XMFLOAT3;
+
+namespace Simulation
+{
+	struct SpatialSortSettings
+	{
+		bool			enabled = true;
+		unsigned int	firstInterval = 16;		// Steps to the first check
+		unsigned int	maximumInterval = 1024;	// Steps between checks at most, however slowly the order decays
+		float			disorder = 0.1f;		// Fraction of atoms out of Z-order that triggers a sort
+	};
+
+	// Where the check schedule stands - enough to carry on exactly after a restart
+	struct SpatialSortState
+	{
+		unsigned int	interval;
+		unsigned int	stepsToCheck;
+		bool			force;
+	};
+
+	struct SpatialSortStatistics
+	{
+		unsigned long long	checks;
+		unsigned long long	sorts;
+		unsigned int		interval;		// Steps to the next check
+		float				disorder;		// Found by the last check
+	};
+
+	/*
+	*	Keeps the simulation's atom list in Z-order (Morton order) over the box, so atoms close in
+	*	space are close in the list - and in the arrays the integrator and the pair kernels build
+	*	from it. As the atoms diffuse the order decays and neighbour loops miss the cache more and
+	*	more; re-sorting puts them back in step.
+	*
+	*	How often depends on how fast the order decays. Every 'interval' steps a check codes the
+	*	atoms in their current order and counts the ones whose code is smaller than the one before
+	*	- 0 right after a sort, about half in a random order. Past 'disorder' the list is sorted
+	*	(in parallel); the interval halves when the order had decayed well past it and doubles when
+	*	it had hardly decayed, so a liquid is sorted every few dozen steps and a crystal almost
+	*	never. The grid behind the codes has about one cell per atom, so atoms jiggling inside their
+	*	cells do not count as disorder.
+	*
+	*	After a sort, Remap() gives the old index of every atom - whoever keeps per-atom state by
+	*	index (Integrator, HardSphereDynamics) permutes it instead of reloading.
+	*/
+	class SpatialSort
+	{
+	public:
+		SpatialSort(const SpatialSortSettings& settings = SpatialSortSettings());
+
+		// Once per step - returns true if 'atoms' was re-sorted
+		bool Update(std::vector<Atom*>& atoms, XMFLOAT3 boxDimensions);
+
+		// Sort on the next Update, e.g. after the atoms were replaced
+		void Invalidate() { m_stepsToCheck = 0; m_force = true; }
+
+		// Where the schedule stands - Restore expects a list in the order it had then
+		SpatialSortState State() const { return { m_interval, m_stepsToCheck, m_force }; }
+		void Restore(const SpatialSortState& state);
+
+		// Of the last sort: atoms[iii] was atoms[Remap()[iii]] before it
+		const std::vector<uint32_t>& Remap() const { return m_remap; }
+
+		// GET
+		SpatialSortStatistics		Statistics() const { return m_statistics; }
+		const SpatialSortSettings&	Settings() const { return m_settings; }
+		bool						Enabled() const { return m_settings.enabled; }
+
+		// SET
+		void Enabled(bool enabled) { m_settings.enabled = enabled; Invalidate(); }
+
+	private:
+		void Code(const std::vector<Atom*>& atoms, XMFLOAT3 boxDimensions);
+		float Disorder() const;
+		void Sort(std::vector<Atom*>& atoms);
+
+		SpatialSortSettings							m_settings;
+		unsigned int								m_interval;
+		unsigned int								m_stepsToCheck;
+		bool										m_force;
+
+		std::vector<std::pair<uint64_t, uint32_t>>	m_codes;		// Code and index, in list order until sorted
+		std::vector<uint32_t>						m_remap;
+		std::vector<Atom*>							m_sorted;		// Scratch for Sort
+
+		SpatialSortStatistics						m_statistics;
+	};
+}
@@ -0,0 +1,1182 @@
+#include "pch.h"
+#include "StructureImport.h"
+#include "AtomGenerator.h"
+#include "MappedFile.h"
+#include <cctype>
+#include <cfloat>
+#include <charconv>
+#include <cwctype>
+#include <filesystem>
+#include <ppl.h>
+#include <stdexcept>
+#include <string_view>
+
+namespace Simulation
+{
+	namespace StructureImport
+	{
+		// Files are parsed in pieces of about this size - large enough that the per chunk overhead
+		// vanishes, small enough that a big file keeps every core busy
+		static const size_t ParseChunkSize = 4 << 20;
+
+		// =========================================================================================
+		// Tokenizing
+
+		static bool IsSpace(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+		static bool IsAlpha(char c) { return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z'); }
+		static bool IsDigit(char c) { return c >= '0' && c <= '9'; }
+
+		static std::string_view Trim(const char* begin, const char* end)
+		{
+			while (begin < end && IsSpace(*begin))
+				++begin;
+			while (end > begin && IsSpace(end[-1]))
+				--end;
+			return std::string_view(begin, end - begin);
+		}
+
+		static bool StartsWith(std::string_view text, const char* prefix)
+		{
+			return text.compare(0, std::strlen(prefix), prefix) == 0;
+		}
+
+		// Whitespace separated fields of one line. A field starting with '#' ends the line.
+		class Tokenizer
+		{
+		public:
+			Tokenizer(const char* begin, const char* end) : m_current(begin), m_end(end) {}
+			Tokenizer(std::string_view text) : m_current(text.data()), m_end(text.data() + text.size()) {}
+
+			bool Next(std::string_view& token)
+			{
+				while (m_current < m_end && IsSpace(*m_current))
+					++m_current;
+				if (m_current == m_end || *m_current == '#')
+					return false;
+
+				const char* start = m_current;
+				while (m_current < m_end && !IsSpace(*m_current))
+					++m_current;
+				token = std::string_view(start, m_current - start);
+				return true;
+			}
+
+			// Split the rest of the line into 'tokens' and return how many there were
+			size_t All(std::string_view* tokens, size_t capacity)
+			{
+				size_t count = 0;
+				std::string_view token;
+				while (count < capacity && Next(token))
+					tokens[count++] = token;
+				return count;
+			}
+
+		private:
+			const char* m_current;
+			const char* m_end;
+		};
+
+		static bool ParseFloat(std::string_view token, float& value)
+		{
+			const char* begin = token.data();
+			const char* end = begin + token.size();
+			if (begin < end && *begin == '+')		// from_chars does not accept a leading '+'
+				++begin;
+
+			std::from_chars_result result = std::from_chars(begin, end, value);
+			return result.ec == std::errc() && result.ptr == end;
+		}
+
+		static bool ParseInt(std::string_view token, long long& value)
+		{
+			const char* begin = token.data();
+			const char* end = begin + token.size();
+			if (begin < end && *begin == '+')
+				++begin;
+
+			std::from_chars_result result = std::from_chars(begin, end, value);
+			return result.ec == std::errc() && result.ptr == end;
+		}
+
+		// Sequential line reader for the (small) headers in front of the atom records
+		class LineReader
+		{
+		public:
+			LineReader(const char* begin, const char* end) : m_current(begin), m_end(end) {}
+
+			bool Next(std::string_view& line)
+			{
+				if (m_current >= m_end)
+					return false;
+
+				const char* newline = static_cast<const char*>(std::memchr(m_current, '\n', m_end - m_current));
+				const char* lineEnd = newline ? newline : m_end;
+				line = std::string_view(m_current, lineEnd - m_current);
+				m_current = newline ? newline + 1 : m_end;
+				return true;
+			}
+
+			const char* Position() const { return m_current; }
+
+		private:
+			const char* m_current;
+			const char* m_end;
+		};
+
+		// Calls function(lineBegin, lineEnd) for every line in [begin, end) until it returns false.
+		// The '\n' is not part of the line.
+		template <typename Function>
+		static void ForEachLine(const char* begin, const char* end, Function function)
+		{
+			while (begin < end)
+			{
+				const char* newline = static_cast<const char*>(std::memchr(begin, '\n', end - begin));
+				const char* lineEnd = newline ? newline : end;
+				if (!function(begin, lineEnd))
+					return;
+				begin = newline ? newline + 1 : end;
+			}
+		}
+
+		[[noreturn]] static void Fail(const char* fileBegin, const char* where, const std::string& message)
+		{
+			if (where == nullptr)
+				throw std::runtime_error("StructureImport: " + message);
+
+			size_t line = 1 + std::count(fileBegin, where, '\n');
+			throw std::runtime_error("StructureImport: line " + std::to_string(line) + ": " + message);
+		}
+
+		// =========================================================================================
+		// Elements
+
+		// Case-insensitive element symbol ("C", "Ne", "NE") or atomic number ("6"). Returns 0 if the
+		// element is not one the simulation supports.
+		static int ElementFromSymbol(std::string_view symbol)
+		{
+			if (!symbol.empty() && IsDigit(symbol[0]))
+			{
+				long long number;
+				if (!ParseInt(symbol, number) || number < Element::HYDROGEN || number > Element::NEON)
+					return 0;
+				return static_cast<int>(number);
+			}
+
+			if (symbol.empty() || symbol.size() > 2)
+				return 0;
+
+			char first = static_cast<char>(std::toupper(static_cast<unsigned char>(symbol[0])));
+			char second = symbol.size() == 2 ? static_cast<char>(std::tolower(static_cast<unsigned char>(symbol[1]))) : '\0';
+			for (int element = Element::HYDROGEN; element <= Element::NEON; ++element)
+			{
+				const char* candidate = Constants::ElementSymbols[element];
+				if (candidate[0] == first && candidate[1] == second)
+					return element;
+			}
+			return 0;
+		}
+
+		// Element whose most common isotope has (about) this mass in amu, 0 if there is none
+		static int ElementFromMass(float mass)
+		{
+			for (int element = Element::HYDROGEN; element <= Element::NEON; ++element)
+			{
+				float elementMass = static_cast<float>(element + Constants::DefaultNeutronCounts[element]);
+				if (std::fabs(mass - elementMass) < 0.6f)
+					return element;
+			}
+			return 0;
+		}
+
+		// Atoms carry whole electrons, so only integral charges (ions) are kept - the partial charges
+		// of force fields like "full" water are dropped rather than rounded into ions
+		static int IonCharge(float charge)
+		{
+			float rounded = std::round(charge);
+			return std::fabs(charge - rounded) < 0.01f ? static_cast<int>(rounded) : 0;
+		}
+
+		static std::string UnsupportedElement(std::string_view symbol)
+		{
+			return "unsupported element '" + std::string(symbol) + "'";
+		}
+
+		// =========================================================================================
+		// Parallel record parsing shared by every format
+
+		enum class LineKind
+		{
+			Skip,		// Blank line, comment, or a record type that is not an atom
+			Record,		// One atom
+			Stop		// Nothing after this line belongs to the first model / frame
+		};
+
+		// One atom as read from the file, in file units
+		struct AtomRecord
+		{
+			int			element;
+			XMFLOAT3	position;
+			XMFLOAT3	velocity;
+			int			charge;
+			long long	id;
+		};
+
+		// Axis aligned box in file units
+		struct Box
+		{
+			bool		known = false;
+			XMFLOAT3	lower = XMFLOAT3(0.0f, 0.0f, 0.0f);
+			XMFLOAT3	upper = XMFLOAT3(0.0f, 0.0f, 0.0f);
+		};
+
+		// Maps file coordinates to simulation coordinates
+		struct Placement
+		{
+			XMFLOAT3	center;			// In file units - ends up at the origin
+			float		lengthScale;
+			float		velocityScale;
+		};
+
+		struct TextChunk
+		{
+			const char*		begin;
+			const char*		end;
+			const char*		stop = nullptr;			// Start of the Stop line, if it is in this chunk
+			size_t			recordCount = 0;
+			size_t			firstRecord = 0;		// Index of the chunk's first record within the section
+
+			const char*		errorAt = nullptr;
+			std::string		error;
+
+			XMFLOAT3		lower = XMFLOAT3(FLT_MAX, FLT_MAX, FLT_MAX);
+			XMFLOAT3		upper = XMFLOAT3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		};
+
+		struct RecordsResult
+		{
+			size_t			count;
+			const char*		stop;					// Start of the Stop line, or nullptr
+			XMFLOAT3		lower;					// Bounds of the imported positions, in simulation units
+			XMFLOAT3		upper;
+		};
+
+		// Split [begin, end) into pieces of about ParseChunkSize that end on line boundaries
+		static std::vector<TextChunk> SplitLines(const char* begin, const char* end)
+		{
+			std::vector<TextChunk> chunks;
+			while (begin < end)
+			{
+				const char* split = end;
+				if (static_cast<size_t>(end - begin) > ParseChunkSize)
+				{
+					const char* newline = static_cast<const char*>(std::memchr(begin + ParseChunkSize, '\n', end - begin - ParseChunkSize));
+					split = newline ? newline + 1 : end;
+				}
+
+				TextChunk chunk;
+				chunk.begin = begin;
+				chunk.end = split;
+				chunks.push_back(chunk);
+				begin = split;
+			}
+			return chunks;
+		}
+
+		static void ThrowFirstError(const std::vector<TextChunk>& chunks, const char* fileBegin)
+		{
+			for (const TextChunk& chunk : chunks)
+			{
+				if (chunk.errorAt != nullptr)
+					Fail(fileBegin, chunk.errorAt, chunk.error);
+			}
+		}
+
+		/*
+		*	Construct an atom for every Record line in [begin, end) up to the first Stop line (and at
+		*	most 'expectedCount' of them when that is not 0 - e.g. the count at the top of an XYZ file).
+		*	'classify' must be cheap: the first pass runs it over every line just to count records.
+		*	'parse' fills an AtomRecord and returns false with a message if the line is invalid.
+		*	If 'ids' is given it receives the AtomRecord::id of every atom, in arena order.
+		*/
+		template <typename Classify, typename Parse>
+		static RecordsResult ImportRecords(const char* fileBegin, const char* begin, const char* end, size_t expectedCount,
+			const Placement& placement, AtomArena& arena, Classify classify, Parse parse, std::vector<long long>* ids = nullptr)
+		{
+			std::vector<TextChunk> chunks = SplitLines(begin, end);
+
+			// Pass 1 - count the records in every chunk
+			concurrency::parallel_for(size_t(0), chunks.size(), [&](size_t index)
+				{
+					TextChunk& chunk = chunks[index];
+					ForEachLine(chunk.begin, chunk.end, [&](const char* lineBegin, const char* lineEnd)
+						{
+							LineKind kind = classify(lineBegin, lineEnd);
+							if (kind == LineKind::Stop)
+							{
+								chunk.stop = lineBegin;
+								return false;
+							}
+							if (kind == LineKind::Record)
+								++chunk.recordCount;
+							return true;
+						});
+				});
+
+			// Every chunk now knows where its atoms go. Chunks after the first Stop line do not count.
+			RecordsResult result = {};
+			size_t total = 0;
+			size_t activeChunks = 0;
+			for (TextChunk& chunk : chunks)
+			{
+				chunk.firstRecord = total;
+				total += chunk.recordCount;
+				++activeChunks;
+				if (chunk.stop != nullptr)
+				{
+					result.stop = chunk.stop;
+					break;
+				}
+			}
+			chunks.resize(activeChunks);
+
+			if (expectedCount != 0 && total < expectedCount)
+				Fail(fileBegin, nullptr, "the file ends after " + std::to_string(total) + " of " + std::to_string(expectedCount) + " atoms");
+
+			size_t count = expectedCount != 0 ? expectedCount : total;
+			if (count == 0)
+				Fail(fileBegin, nullptr, "the file does not contain any atoms");
+
+			if (ids != nullptr)
+				ids->resize(count);
+
+			// Pass 2 - parse the records straight into their arena slots
+			size_t first = arena.AllocateBulk(count);
+			concurrency::parallel_for(size_t(0), chunks.size(), [&](size_t index)
+				{
+					TextChunk& chunk = chunks[index];
+					size_t record = chunk.firstRecord;
+
+					ForEachLine(chunk.begin, chunk.stop != nullptr ? chunk.stop : chunk.end, [&](const char* lineBegin, const char* lineEnd)
+						{
+							if (record >= count)
+								return false;
+							if (classify(lineBegin, lineEnd) != LineKind::Record)
+								return true;
+
+							AtomRecord atom = {};
+							if (!parse(lineBegin, lineEnd, atom, chunk.error))
+							{
+								chunk.errorAt = lineBegin;
+								return false;
+							}
+
+							XMFLOAT3 position(
+								(atom.position.x - placement.center.x) * placement.lengthScale,
+								(atom.position.y - placement.center.y) * placement.lengthScale,
+								(atom.position.z - placement.center.z) * placement.lengthScale);
+							XMFLOAT3 velocity(
+								atom.velocity.x * placement.velocityScale,
+								atom.velocity.y * placement.velocityScale,
+								atom.velocity.z * placement.velocityScale);
+
+							AtomGenerator::CreateAtomAt(arena.SlotAt(first + record), static_cast<Element>(atom.element),
+								position, velocity, Constants::DefaultNeutronCounts[atom.element], atom.charge);
+
+							chunk.lower = XMFLOAT3(std::min(chunk.lower.x, position.x), std::min(chunk.lower.y, position.y), std::min(chunk.lower.z, position.z));
+							chunk.upper = XMFLOAT3(std::max(chunk.upper.x, position.x), std::max(chunk.upper.y, position.y), std::max(chunk.upper.z, position.z));
+
+							if (ids != nullptr)
+								(*ids)[record] = atom.id;
+
+							++record;
+							return true;
+						});
+				});
+
+			ThrowFirstError(chunks, fileBegin);
+
+			result.count = count;
+			result.lower = chunks[0].lower;
+			result.upper = chunks[0].upper;
+			for (const TextChunk& chunk : chunks)
+			{
+				result.lower = XMFLOAT3(std::min(result.lower.x, chunk.lower.x), std::min(result.lower.y, chunk.lower.y), std::min(result.lower.z, chunk.lower.z));
+				result.upper = XMFLOAT3(std::max(result.upper.x, chunk.upper.x), std::max(result.upper.y, chunk.upper.y), std::max(result.upper.z, chunk.upper.z));
+			}
+			return result;
+		}
+
+		static Placement MakePlacement(const Box& box, const ImportSettings& settings)
+		{
+			Placement placement;
+			placement.center = box.known ?
+				XMFLOAT3((box.lower.x + box.upper.x) * 0.5f, (box.lower.y + box.upper.y) * 0.5f, (box.lower.z + box.upper.z) * 0.5f) :
+				XMFLOAT3(0.0f, 0.0f, 0.0f);
+			placement.lengthScale = settings.lengthScale;
+			placement.velocityScale = settings.velocityScale;
+			return placement;
+		}
+
+		// Center the atoms in a box fitted around them (used when the file has no box)
+		static XMFLOAT3 FitBox(AtomArena& arena, const RecordsResult& records, const ImportSettings& settings)
+		{
+			XMFLOAT3 offset(
+				-(records.lower.x + records.upper.x) * 0.5f,
+				-(records.lower.y + records.upper.y) * 0.5f,
+				-(records.lower.z + records.upper.z) * 0.5f);
+
+			concurrency::parallel_for(size_t(0), arena.ChunkCount(), [&](size_t chunk)
+				{
+					unsigned int count = arena.ChunkAtomCount(chunk);
+					for (unsigned int slot = 0; slot < count; ++slot)
+					{
+						Atom* atom = arena.At(chunk, slot);
+						XMFLOAT3 position = atom->Position();
+						atom->Position(XMFLOAT3(position.x + offset.x, position.y + offset.y, position.z + offset.z));
+					}
+				});
+
+			return XMFLOAT3(
+				records.upper.x - records.lower.x + 2.0f * settings.padding,
+				records.upper.y - records.lower.y + 2.0f * settings.padding,
+				records.upper.z - records.lower.z + 2.0f * settings.padding);
+		}
+
+		static XMFLOAT3 BoxDimensions(const Box& box, const ImportSettings& settings)
+		{
+			return XMFLOAT3(
+				(box.upper.x - box.lower.x) * settings.lengthScale,
+				(box.upper.y - box.lower.y) * settings.lengthScale,
+				(box.upper.z - box.lower.z) * settings.lengthScale);
+		}
+
+		// =========================================================================================
+		// XYZ
+		//
+		//	<atom count>
+		//	<comment - extended XYZ puts Lattice="ax ay az bx by bz cx cy cz" here>
+		//	<symbol or atomic number> x y z ...
+
+		static Box ParseLattice(std::string_view comment)
+		{
+			Box box;
+			size_t start = comment.find("Lattice=\"");
+			if (start == std::string_view::npos)
+				return box;
+
+			size_t close = comment.find('"', start + 9);
+			if (close == std::string_view::npos)
+				return box;
+
+			std::string_view fields[9];
+			Tokenizer tokens(comment.substr(start + 9, close - start - 9));
+			float lattice[9];
+			if (tokens.All(fields, 9) != 9)
+				return box;
+			for (int iii = 0; iii < 9; ++iii)
+			{
+				if (!ParseFloat(fields[iii], lattice[iii]))
+					return box;
+			}
+
+			// Only the diagonal is used - the simulation box is axis aligned
+			box.upper = XMFLOAT3(lattice[0], lattice[4], lattice[8]);
+			box.known = box.upper.x > 0.0f && box.upper.y > 0.0f && box.upper.z > 0.0f;
+			return box;
+		}
+
+		static ImportResult ImportXYZ(const char* data, const char* end, AtomArena& arena, const ImportSettings& settings)
+		{
+			LineReader lines(data, end);
+			std::string_view line;
+			long long count = 0;
+			if (!lines.Next(line) || !ParseInt(Trim(line.data(), line.data() + line.size()), count) || count <= 0)
+				Fail(data, data, "expected the number of atoms on the first line");
+
+			std::string_view comment;
+			if (!lines.Next(comment))
+				Fail(data, nullptr, "missing the comment line");
+
+			Box box = ParseLattice(comment);
+
+			auto classify = [](const char* begin, const char* end)
+			{
+				return Trim(begin, end).empty() ? LineKind::Skip : LineKind::Record;
+			};
+
+			auto parse = [](const char* begin, const char* end, AtomRecord& atom, std::string& error)
+			{
+				Tokenizer tokens(begin, end);
+				std::string_view symbol, x, y, z;
+				if (!tokens.Next(symbol) || !tokens.Next(x) || !tokens.Next(y) || !tokens.Next(z))
+				{
+					error = "expected 'element x y z'";
+					return false;
+				}
+
+				atom.element = ElementFromSymbol(symbol);
+				if (atom.element == 0)
+				{
+					error = UnsupportedElement(symbol);
+					return false;
+				}
+
+				if (!ParseFloat(x, atom.position.x) || !ParseFloat(y, atom.position.y) || !ParseFloat(z, atom.position.z))
+				{
+					error = "invalid coordinates";
+					return false;
+				}
+				return true;
+			};
+
+			// Records past 'count' belong to the next frame and are ignored
+			RecordsResult records = ImportRecords(data, lines.Position(), end, static_cast<size_t>(count),
+				MakePlacement(box, settings), arena, classify, parse);
+
+			ImportResult result;
+			result.format = ImportFormat::XYZ;
+			result.atomCount = records.count;
+			result.boxDimensions = box.known ? BoxDimensions(box, settings) : FitBox(arena, records, settings);
+			return result;
+		}
+
+		// =========================================================================================
+		// PDB - ATOM / HETATM records of the first MODEL, box from CRYST1
+
+		// Field at the 1-based, inclusive column range used by the PDB specification
+		static std::string_view Columns(const char* begin, const char* end, size_t first, size_t last)
+		{
+			size_t length = end - begin;
+			if (first > length)
+				return std::string_view();
+			return Trim(begin + first - 1, begin + std::min(last, length));
+		}
+
+		static ImportResult ImportPDB(const char* data, const char* end, AtomArena& arena, const ImportSettings& settings)
+		{
+			// The header is short - read it sequentially up to the first atom
+			Box box;
+			LineReader lines(data, end);
+			const char* firstAtom = end;
+			std::string_view line;
+			while (true)
+			{
+				const char* lineBegin = lines.Position();
+				if (!lines.Next(line))
+					break;
+
+				if (StartsWith(line, "ATOM") || StartsWith(line, "HETATM"))
+				{
+					firstAtom = lineBegin;
+					break;
+				}
+
+				if (StartsWith(line, "CRYST1"))
+				{
+					const char* lineEnd = line.data() + line.size();
+					XMFLOAT3 cell;
+					if (ParseFloat(Columns(line.data(), lineEnd, 7, 15), cell.x) &&
+						ParseFloat(Columns(line.data(), lineEnd, 16, 24), cell.y) &&
+						ParseFloat(Columns(line.data(), lineEnd, 25, 33), cell.z))
+					{
+						// A unit cube is the placeholder written for structures without a cell (NMR etc.)
+						box.upper = cell;
+						box.known = cell.x > 1.0f && cell.y > 1.0f && cell.z > 1.0f;
+					}
+				}
+			}
+
+			auto classify = [](const char* begin, const char* end)
+			{
+				size_t length = end - begin;
+				if (length >= 6 && (std::memcmp(begin, "ATOM  ", 6) == 0 || std::memcmp(begin, "HETATM", 6) == 0))
+					return LineKind::Record;
+				if (length >= 6 && std::memcmp(begin, "ENDMDL", 6) == 0)
+					return LineKind::Stop;
+				if (length >= 3 && std::memcmp(begin, "END", 3) == 0 && (length == 3 || IsSpace(begin[3])))
+					return LineKind::Stop;
+				return LineKind::Skip;
+			};
+
+			auto parse = [](const char* begin, const char* end, AtomRecord& atom, std::string& error)
+			{
+				if (!ParseFloat(Columns(begin, end, 31, 38), atom.position.x) ||
+					!ParseFloat(Columns(begin, end, 39, 46), atom.position.y) ||
+					!ParseFloat(Columns(begin, end, 47, 54), atom.position.z))
+				{
+					error = "invalid coordinates";
+					return false;
+				}
+
+				std::string_view symbol = Columns(begin, end, 77, 78);
+				if (!symbol.empty())
+				{
+					atom.element = ElementFromSymbol(symbol);
+				}
+				else
+				{
+					// Old files leave the element column empty - derive it from the atom name, where two
+					// letter elements start in column 13 and one letter elements in column 14
+					std::string_view name = Columns(begin, end, 13, 16);
+					while (!name.empty() && IsDigit(name[0]))
+						name.remove_prefix(1);
+					size_t letters = 0;
+					while (letters < name.size() && letters < 2 && IsAlpha(name[letters]))
+						++letters;
+					symbol = name.substr(0, letters);
+
+					atom.element = begin + 12 < end && !IsSpace(begin[12]) && !IsDigit(begin[12]) ? ElementFromSymbol(symbol) : 0;
+					if (atom.element == 0 && !symbol.empty())
+						atom.element = ElementFromSymbol(symbol.substr(0, 1));
+				}
+
+				if (atom.element == 0)
+				{
+					error = UnsupportedElement(symbol);
+					return false;
+				}
+
+				// Charge is written as e.g. "2+" or "1-"
+				std::string_view charge = Columns(begin, end, 79, 80);
+				if (charge.size() == 2 && IsDigit(charge[0]) && (charge[1] == '+' || charge[1] == '-'))
+					atom.charge = (charge[0] - '0') * (charge[1] == '-' ? -1 : 1);
+
+				return true;
+			};
+
+			RecordsResult records = ImportRecords(data, firstAtom, end, 0, MakePlacement(box, settings), arena, classify, parse);
+
+			ImportResult result;
+			result.format = ImportFormat::PDB;
+			result.atomCount = records.count;
+			result.boxDimensions = box.known ? BoxDimensions(box, settings) : FitBox(arena, records, settings);
+			return result;
+		}
+
+		// =========================================================================================
+		// LAMMPS data file (write_data)
+
+		// Element of every LAMMPS atom type (0 = unknown), from the settings or from the file
+		static std::vector<int> TypeElements(const ImportSettings& settings, std::vector<int> fromFile)
+		{
+			if (fromFile.size() < settings.typeElements.size())
+				fromFile.resize(settings.typeElements.size(), 0);
+
+			for (size_t type = 1; type < settings.typeElements.size(); ++type)
+			{
+				if (AtomGenerator::IsValidElement(settings.typeElements[type]))
+					fromFile[type] = settings.typeElements[type];
+			}
+			return fromFile;
+		}
+
+		static bool ElementOfType(const std::vector<int>& typeElements, std::string_view field, AtomRecord& atom, std::string& error)
+		{
+			long long type;
+			if (!ParseInt(field, type) || type < 1)
+			{
+				error = "invalid atom type";
+				return false;
+			}
+
+			atom.element = static_cast<size_t>(type) < typeElements.size() ? typeElements[static_cast<size_t>(type)] : 0;
+			if (atom.element == 0)
+			{
+				error = "atom type " + std::to_string(type) + " has no element - add the element symbol as a comment in Masses or set ImportSettings::typeElements";
+				return false;
+			}
+			return true;
+		}
+
+		// Section headers are the only lines that start with a letter
+		static LineKind ClassifyDataLine(const char* begin, const char* end)
+		{
+			std::string_view line = Trim(begin, end);
+			if (line.empty() || line[0] == '#')
+				return LineKind::Skip;
+			return IsAlpha(line[0]) ? LineKind::Stop : LineKind::Record;
+		}
+
+		// Column layout of the Atoms section for the atom styles that have coordinates
+		struct AtomStyle
+		{
+			int typeColumn;
+			int chargeColumn;		// -1 if the style has no charge
+			int positionColumn;
+			int columnCount;		// Without the optional image flags
+		};
+
+		static bool FindAtomStyle(std::string_view name, AtomStyle& style)
+		{
+			if (name == "atomic")											style = { 1, -1, 2, 5 };
+			else if (name == "charge")										style = { 1, 2, 3, 6 };
+			else if (name == "full")										style = { 2, 3, 4, 7 };
+			else if (name == "molecular" || name == "bond" || name == "angle")	style = { 2, -1, 3, 6 };
+			else if (name == "sphere")										style = { 1, -1, 4, 7 };
+			else
+				return false;
+			return true;
+		}
+
+		static ImportResult ImportLAMMPSData(const char* data, const char* end, AtomArena& arena, const ImportSettings& settings)
+		{
+			LineReader lines(data, end);
+			std::string_view line;
+			lines.Next(line);		// The first line is always a comment
+
+			Box box;
+			bool bounds[3] = { false, false, false };
+			long long atomCount = 0;
+			std::vector<int> massElements;
+			const char* atomsBegin = nullptr;
+			std::string_view styleName;
+
+			// Header keywords, then every section up to Atoms
+			while (atomsBegin == nullptr)
+			{
+				const char* lineBegin = lines.Position();
+				if (!lines.Next(line))
+					break;
+
+				std::string_view fields[4];
+				size_t fieldCount = Tokenizer(line).All(fields, 4);
+				if (fieldCount == 0)
+					continue;
+
+				if (!IsAlpha(fields[0][0]))
+				{
+					float lower, upper;
+					if (fieldCount == 2 && fields[1] == "atoms")
+					{
+						if (!ParseInt(fields[0], atomCount))
+							Fail(data, lineBegin, "invalid atom count");
+					}
+					else if (fieldCount == 4 && ParseFloat(fields[0], lower) && ParseFloat(fields[1], upper))
+					{
+						int axis = fields[2] == "xlo" ? 0 : fields[2] == "ylo" ? 1 : fields[2] == "zlo" ? 2 : -1;
+						if (axis >= 0)
+						{
+							(&box.lower.x)[axis] = lower;
+							(&box.upper.x)[axis] = upper;
+							bounds[axis] = true;
+						}
+					}
+					continue;
+				}
+
+				// Section header
+				if (fields[0] == "Atoms")
+				{
+					atomsBegin = lines.Position();
+					size_t comment = line.find('#');
+					if (comment != std::string_view::npos)
+						styleName = Trim(line.data() + comment + 1, line.data() + line.size());
+					break;
+				}
+
+				bool masses = fields[0] == "Masses";
+				while (true)
+				{
+					const char* bodyLine = lines.Position();
+					std::string_view body;
+					if (!lines.Next(body))
+						break;
+					if (ClassifyDataLine(body.data(), body.data() + body.size()) == LineKind::Stop)
+					{
+						lines = LineReader(bodyLine, end);		// Let the outer loop see the next header
+						break;
+					}
+					if (!masses)
+						continue;
+
+					// "type mass # symbol" - prefer the symbol, fall back to the mass
+					std::string_view massFields[2];
+					long long type;
+					float mass;
+					if (Tokenizer(body).All(massFields, 2) != 2 || !ParseInt(massFields[0], type) || type < 1 || !ParseFloat(massFields[1], mass))
+						continue;
+
+					int element = ElementFromMass(mass);
+					size_t comment = body.find('#');
+					if (comment != std::string_view::npos)
+					{
+						std::string_view symbol;
+						if (Tokenizer(body.substr(comment + 1)).Next(symbol) && ElementFromSymbol(symbol) != 0)
+							element = ElementFromSymbol(symbol);
+					}
+
+					if (massElements.size() <= static_cast<size_t>(type))
+						massElements.resize(static_cast<size_t>(type) + 1, 0);
+					massElements[static_cast<size_t>(type)] = element;
+				}
+			}
+
+			if (atomsBegin == nullptr)
+				Fail(data, nullptr, "no Atoms section");
+			if (atomCount <= 0)
+				Fail(data, nullptr, "missing the 'atoms' header line");
+			box.known = bounds[0] && bounds[1] && bounds[2];
+
+			// Atom style from the section comment, or guessed from the column count of the first record
+			AtomStyle style;
+			std::string_view styleToken;
+			if (Tokenizer(styleName).Next(styleToken))
+			{
+				if (!FindAtomStyle(styleToken, style))
+					Fail(data, nullptr, "unsupported atom style '" + std::string(styleToken) + "'");
+			}
+			else
+			{
+				size_t columns = 0;
+				ForEachLine(atomsBegin, end, [&](const char* begin, const char* lineEnd)
+					{
+						if (ClassifyDataLine(begin, lineEnd) != LineKind::Record)
+							return true;
+						std::string_view fields[16];
+						columns = Tokenizer(begin, lineEnd).All(fields, 16);
+						return false;
+					});
+
+				if (columns == 5 || columns == 8)			FindAtomStyle("atomic", style);
+				else if (columns == 6 || columns == 9)		FindAtomStyle("charge", style);
+				else if (columns == 7 || columns == 10)		FindAtomStyle("full", style);
+				else
+					Fail(data, nullptr, "cannot tell the atom style - add it as a comment after 'Atoms'");
+			}
+
+			std::vector<int> typeElements = TypeElements(settings, massElements);
+
+			auto parse = [&](const char* begin, const char* end, AtomRecord& atom, std::string& error)
+			{
+				std::string_view fields[16];
+				size_t count = Tokenizer(begin, end).All(fields, 16);
+				if (count < static_cast<size_t>(style.columnCount))
+				{
+					error = "expected " + std::to_string(style.columnCount) + " columns";
+					return false;
+				}
+
+				if (!ParseInt(fields[0], atom.id) || !ElementOfType(typeElements, fields[style.typeColumn], atom, error))
+				{
+					if (error.empty())
+						error = "invalid atom id";
+					return false;
+				}
+
+				if (style.chargeColumn >= 0)
+				{
+					float charge;
+					if (!ParseFloat(fields[style.chargeColumn], charge))
+					{
+						error = "invalid charge";
+						return false;
+					}
+					atom.charge = IonCharge(charge);
+				}
+
+				if (!ParseFloat(fields[style.positionColumn], atom.position.x) ||
+					!ParseFloat(fields[style.positionColumn + 1], atom.position.y) ||
+					!ParseFloat(fields[style.positionColumn + 2], atom.position.z))
+				{
+					error = "invalid coordinates";
+					return false;
+				}
+				return true;
+			};
+
+			std::vector<long long> ids;
+			RecordsResult records = ImportRecords(data, atomsBegin, end, static_cast<size_t>(atomCount),
+				MakePlacement(box, settings), arena, ClassifyDataLine, parse, &ids);
+
+			// write_data puts the Velocities section ("id vx vy vz") straight after Atoms. Atoms are not
+			// necessarily in id order, so look them up through a sorted id -> index table.
+			if (records.stop != nullptr && StartsWith(Trim(records.stop, end), "Velocities"))
+			{
+				std::vector<std::pair<long long, size_t>> indices(ids.size());
+				concurrency::parallel_for(size_t(0), ids.size(), [&](size_t index) { indices[index] = { ids[index], index }; });
+				concurrency::parallel_sort(indices.begin(), indices.end());
+
+				const char* velocitiesBegin = static_cast<const char*>(std::memchr(records.stop, '\n', end - records.stop));
+				std::vector<TextChunk> chunks = SplitLines(velocitiesBegin ? velocitiesBegin + 1 : end, end);
+				concurrency::parallel_for(size_t(0), chunks.size(), [&](size_t index)
+					{
+						TextChunk& chunk = chunks[index];
+						ForEachLine(chunk.begin, chunk.end, [&](const char* begin, const char* lineEnd)
+							{
+								LineKind kind = ClassifyDataLine(begin, lineEnd);
+								if (kind != LineKind::Record)
+									return kind == LineKind::Skip;
+
+								std::string_view fields[4];
+								long long id;
+								XMFLOAT3 velocity;
+								if (Tokenizer(begin, lineEnd).All(fields, 4) != 4 || !ParseInt(fields[0], id) ||
+									!ParseFloat(fields[1], velocity.x) || !ParseFloat(fields[2], velocity.y) || !ParseFloat(fields[3], velocity.z))
+								{
+									chunk.errorAt = begin;
+									chunk.error = "expected 'id vx vy vz'";
+									return false;
+								}
+
+								auto found = std::lower_bound(indices.begin(), indices.end(), std::make_pair(id, size_t(0)));
+								if (found == indices.end() || found->first != id)
+								{
+									chunk.errorAt = begin;
+									chunk.error = "velocity for unknown atom id " + std::to_string(id);
+									return false;
+								}
+
+								Atom* atom = reinterpret_cast<Atom*>(arena.SlotAt(found->second));
+								atom->Velocity(XMFLOAT3(velocity.x * settings.velocityScale, velocity.y * settings.velocityScale, velocity.z * settings.velocityScale));
+								return true;
+							});
+					});
+
+				ThrowFirstError(chunks, data);
+			}
+
+			ImportResult result;
+			result.format = ImportFormat::LAMMPSData;
+			result.atomCount = records.count;
+			result.boxDimensions = box.known ? BoxDimensions(box, settings) : FitBox(arena, records, settings);
+			return result;
+		}
+
+		// =========================================================================================
+		// LAMMPS dump - first timestep of a 'dump atom' / 'dump custom' file
+
+		static ImportResult ImportLAMMPSDump(const char* data, const char* end, AtomArena& arena, const ImportSettings& settings)
+		{
+			LineReader lines(data, end);
+			std::string_view line;
+			Box box;
+			long long atomCount = 0;
+			const char* atomsBegin = nullptr;
+			std::string_view columnNames;
+
+			while (atomsBegin == nullptr && lines.Next(line))
+			{
+				const char* itemLine = line.data();
+				if (StartsWith(line, "ITEM: NUMBER OF ATOMS"))
+				{
+					if (!lines.Next(line) || !ParseInt(Trim(line.data(), line.data() + line.size()), atomCount))
+						Fail(data, itemLine, "expected the number of atoms");
+				}
+				else if (StartsWith(line, "ITEM: BOX BOUNDS"))
+				{
+					// Triclinic files add a tilt factor - the bounds still describe the enclosing box
+					for (int axis = 0; axis < 3; ++axis)
+					{
+						std::string_view fields[2];
+						if (!lines.Next(line) || Tokenizer(line).All(fields, 2) != 2 ||
+							!ParseFloat(fields[0], (&box.lower.x)[axis]) || !ParseFloat(fields[1], (&box.upper.x)[axis]))
+							Fail(data, itemLine, "invalid box bounds");
+					}
+					box.known = true;
+				}
+				else if (StartsWith(line, "ITEM: ATOMS"))
+				{
+					columnNames = line.substr(11);
+					atomsBegin = lines.Position();
+				}
+			}
+
+			if (atomsBegin == nullptr || !box.known || atomCount <= 0)
+				Fail(data, nullptr, "not a LAMMPS dump file (missing NUMBER OF ATOMS, BOX BOUNDS or ATOMS)");
+
+			// Find the columns this importer understands
+			struct DumpColumns
+			{
+				int id = -1, type = -1, element = -1, mass = -1, q = -1;
+				int position[3] = { -1, -1, -1 };
+				int velocity[3] = { -1, -1, -1 };
+				bool scaled = false;
+				int count = 0;
+			} columns;
+
+			const char* axisNames = "xyz";
+			Tokenizer names(columnNames);
+			std::string_view name;
+			for (int column = 0; names.Next(name); ++column, ++columns.count)
+			{
+				if (name == "id")			columns.id = column;
+				else if (name == "type")	columns.type = column;
+				else if (name == "element")	columns.element = column;
+				else if (name == "mass")	columns.mass = column;
+				else if (name == "q")		columns.q = column;
+
+				for (int axis = 0; axis < 3; ++axis)
+				{
+					char axisName = axisNames[axis];
+					if (name.size() >= 1 && name[0] == axisName && (name.size() == 1 || name.substr(1) == "u"))
+						columns.position[axis] = column;
+					else if (name.size() >= 2 && name[0] == axisName && name[1] == 's' && (name.size() == 2 || name.substr(2) == "u"))
+					{
+						columns.position[axis] = column;
+						columns.scaled = true;
+					}
+					else if (name.size() == 2 && name[0] == 'v' && name[1] == axisName)
+						columns.velocity[axis] = column;
+				}
+			}
+
+			if (columns.position[0] < 0 || columns.position[1] < 0 || columns.position[2] < 0)
+				Fail(data, nullptr, "the dump has no x y z columns");
+
+			std::vector<int> typeElements = TypeElements(settings, {});
+			bool byType = columns.type >= 0 && !typeElements.empty();
+			if (!byType && columns.element < 0 && columns.mass < 0)
+				Fail(data, nullptr, "the dump has no element or mass column - set ImportSettings::typeElements");
+
+			auto classify = [](const char* begin, const char* end)
+			{
+				std::string_view line = Trim(begin, end);
+				if (line.empty())
+					return LineKind::Skip;
+				return StartsWith(line, "ITEM:") ? LineKind::Stop : LineKind::Record;
+			};
+
+			auto parse = [&](const char* begin, const char* end, AtomRecord& atom, std::string& error)
+			{
+				std::string_view fields[32];
+				if (Tokenizer(begin, end).All(fields, 32) < static_cast<size_t>(columns.count))
+				{
+					error = "expected " + std::to_string(columns.count) + " columns";
+					return false;
+				}
+
+				if (byType)
+				{
+					if (!ElementOfType(typeElements, fields[columns.type], atom, error))
+						return false;
+				}
+				else if (columns.element >= 0)
+				{
+					atom.element = ElementFromSymbol(fields[columns.element]);
+					if (atom.element == 0)
+					{
+						error = UnsupportedElement(fields[columns.element]);
+						return false;
+					}
+				}
+				else
+				{
+					float mass;
+					atom.element = ParseFloat(fields[columns.mass], mass) ? ElementFromMass(mass) : 0;
+					if (atom.element == 0)
+					{
+						error = "no supported element has mass " + std::string(fields[columns.mass]);
+						return false;
+					}
+				}
+
+				for (int axis = 0; axis < 3; ++axis)
+				{
+					float& coordinate = (&atom.position.x)[axis];
+					if (!ParseFloat(fields[columns.position[axis]], coordinate))
+					{
+						error = "invalid coordinates";
+						return false;
+					}
+					if (columns.scaled)
+						coordinate = (&box.lower.x)[axis] + coordinate * ((&box.upper.x)[axis] - (&box.lower.x)[axis]);
+
+					if (columns.velocity[axis] >= 0 && !ParseFloat(fields[columns.velocity[axis]], (&atom.velocity.x)[axis]))
+					{
+						error = "invalid velocity";
+						return false;
+					}
+				}
+
+				float charge;
+				if (columns.q >= 0 && ParseFloat(fields[columns.q], charge))
+					atom.charge = IonCharge(charge);
+
+				return true;
+			};
+
+			RecordsResult records = ImportRecords(data, atomsBegin, end, static_cast<size_t>(atomCount),
+				MakePlacement(box, settings), arena, classify, parse);
+
+			ImportResult result;
+			result.format = ImportFormat::LAMMPSDump;
+			result.atomCount = records.count;
+			result.boxDimensions = BoxDimensions(box, settings);
+			return result;
+		}
+
+		// =========================================================================================
+
+		ImportFormat DetectFormat(const std::wstring& filename, const char* data, size_t size)
+		{
+			std::wstring extension = std::filesystem::path(filename).extension().wstring();
+			std::transform(extension.begin(), extension.end(), extension.begin(), [](wchar_t c) { return static_cast<wchar_t>(std::towlower(c)); });
+
+			if (extension == L".xyz")											return ImportFormat::XYZ;
+			if (extension == L".pdb" || extension == L".ent")					return ImportFormat::PDB;
+			if (extension == L".data" || extension == L".lmp")					return ImportFormat::LAMMPSData;
+			if (extension == L".dump" || extension == L".lammpstrj")			return ImportFormat::LAMMPSDump;
+
+			// Fall back to the first few lines
+			LineReader lines(data, data + std::min<size_t>(size, 4096));
+			std::string_view line;
+			if (!lines.Next(line))
+				return ImportFormat::Detect;
+
+			long long count;
+			if (StartsWith(line, "ITEM:"))
+				return ImportFormat::LAMMPSDump;
+			if (ParseInt(Trim(line.data(), line.data() + line.size()), count))
+				return ImportFormat::XYZ;
+
+			const char* pdbRecords[] = { "HEADER", "TITLE ", "REMARK", "CRYST1", "MODEL ", "ATOM  ", "HETATM", "COMPND" };
+			for (const char* record : pdbRecords)
+			{
+				if (StartsWith(line, record))
+					return ImportFormat::PDB;
+			}
+
+			// The first line of a data file is a free comment - look for its "N atoms" line
+			while (lines.Next(line))
+			{
+				std::string_view fields[3];
+				if (Tokenizer(line).All(fields, 3) == 2 && fields[1] == "atoms")
+					return ImportFormat::LAMMPSData;
+			}
+			return ImportFormat::Detect;
+		}
+
+		ImportResult Import(const std::wstring& filename, AtomArena& arena, const ImportSettings& settings)
+		{
+			if (arena.AtomCount() != 0)
+				throw std::runtime_error("StructureImport: atoms must be imported into an empty arena");
+
+			MappedFile file(filename);
+			const char* data = reinterpret_cast<const char*>(file.Data());
+			const char* end = data + file.Size();
+
+			ImportFormat format = settings.format;
+			if (format == ImportFormat::Detect)
+				format = DetectFormat(filename, data, static_cast<size_t>(file.Size()));
+
+			try
+			{
+				switch (format)
+				{
+				case ImportFormat::XYZ:			return ImportXYZ(data, end, arena, settings);
+				case ImportFormat::PDB:			return ImportPDB(data, end, arena, settings);
+				case ImportFormat::LAMMPSData:	return ImportLAMMPSData(data, end, arena, settings);
+				case ImportFormat::LAMMPSDump:	return ImportLAMMPSDump(data, end, arena, settings);
+				default:
+					throw std::runtime_error("StructureImport: unrecognized file format");
+				}
+			}
+			catch (...)
+			{
+				// Slots claimed by a failed pass may never have been constructed
+				arena.Clear();
+				throw;
+			}
+		}
+	}
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "pch.h"
+#include "AtomArena.h"
+#include "Enums.h"
+#include <string>
+#include <vector>
+
+using DirectX::XMFLOAT3;
+
+/*
+*	Importers for structures written by other tools: XYZ, PDB and LAMMPS data / dump files.
+*
+*	Files are memory mapped and split into large chunks on line boundaries. Every chunk is
+*	parsed on its own thread in two passes - the first only counts the atom records (memchr
+*	line splitting), which gives every chunk the arena index of its first atom, and the second
+*	tokenizes the records (std::from_chars) and constructs the atoms directly in their arena
+*	slots. Nothing goes through std::istream or an intermediate atom list.
+*
+*	Only the first model / frame of a file is imported. Lengths are converted with
+*	ImportSettings::lengthScale and the structure is centered in the simulation box, which is
+*	taken from the file when it has one (PDB CRYST1, extended XYZ Lattice, LAMMPS bounds).
+*/
+
+namespace Simulation
+{
+	namespace StructureImport
+	{
+		enum class ImportFormat
+		{
+			Detect,			// From the file extension, falling back to the file contents
+			XYZ,
+			PDB,
+			LAMMPSData,		// write_data output: Masses + Atoms (+ Velocities) sections
+			LAMMPSDump		// dump custom / atom output: first timestep only
+		};
+
+		struct ImportSettings
+		{
+			ImportFormat		format = ImportFormat::Detect;
+			float				lengthScale = 0.1f;		// File length unit -> simulation unit (Angstrom -> nm)
+			float				velocityScale = 0.1f;	// Applied to velocities read from LAMMPS files
+			float				padding = 0.2f;			// Added around the atoms when the file has no box
+
+			// LAMMPS atom type -> element, indexed by type (index 0 is unused). Takes precedence over
+			// the element symbols / masses found in the file.
+			std::vector<Element> typeElements;
+		};
+
+		struct ImportResult
+		{
+			ImportFormat		format;
+			size_t				atomCount;
+			XMFLOAT3			boxDimensions;
+		};
+
+		// Import every atom of the first model in 'filename' into 'arena', which must be empty.
+		// Throws std::runtime_error (with the offending line number when there is one) if the file
+		// cannot be read or parsed, in which case the arena is left empty.
+		ImportResult Import(const std::wstring& filename, AtomArena& arena, const ImportSettings& settings = {});
+
+		// Guess the format from the extension, or from the first bytes of the file if that fails
+		ImportFormat DetectFormat(const std::wstring& filename, const char* data, size_t size);
+	}
+}
@@ -0,0 +1,441 @@
+#include "pch.h"
+#include "SweptCollisions.h"
+#include "Boundaries.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <ppl.h>
+#include <stdexcept>
+
+namespace Simulation
+{
+	// Spheres per task when loading, searching, predicting and writing back
+	static const size_t SphereBlock = 4096;
+
+	// Cells per sphere at most - one fast atom or a few huge ones would otherwise ask for a huge grid
+	static const double MaxCellsPerSphere = 2.0;
+
+	// How much further than its straight path a sphere is searched for partners, for the course
+	// changes inside a step - a light atom hit by a heavy one can come out almost twice as fast
+	static const double SweepSlack = 2.0;
+
+	SweptCollisions::SweptCollisions() :
+		m_timeDelta(0.0),
+		m_largestReach(0.0),
+		m_statistics()
+	{
+	}
+
+	void SweptCollisions::Step(double timeDelta, const std::vector<Atom*>& atoms, XMFLOAT3 boxDimensions, unsigned int periodicAxes)
+	{
+		++m_statistics.steps;
+		if (atoms.empty() || !(timeDelta > 0.0))
+			return;
+		if (atoms.size() >= 0xFFFFFFFF)
+			throw std::runtime_error("SweptCollisions: too many atoms");
+
+		Load(atoms, timeDelta, boxDimensions, periodicAxes);
+		BroadPhase();
+
+		// Every pair once, predicted in parallel and heaped in one go
+		const size_t count = m_spheres.size();
+		const size_t blocks = (count + SphereBlock - 1) / SphereBlock;
+		std::vector<std::vector<Event>> predicted(blocks);
+		concurrency::parallel_for(size_t(0), blocks, [&](size_t block)
+			{
+				size_t end = std::min(count, (block + 1) * SphereBlock);
+				for (size_t iii = block * SphereBlock; iii < end; ++iii)
+					Predict(static_cast<uint32_t>(iii), true, predicted[block]);
+			});
+
+		std::vector<Event> events;
+		for (const std::vector<Event>& part : predicted)
+			events.insert(events.end(), part.begin(), part.end());
+		m_queue = std::priority_queue<Event, std::vector<Event>, std::greater<Event>>(std::greater<Event>(), std::move(events));
+
+		while (!m_queue.empty())
+		{
+			Event event = m_queue.top();
+			m_queue.pop();
+
+			if (event.countA != m_spheres[event.a].count ||
+				(event.type == EventType::Collision && event.countB != m_spheres[event.b].count))
+			{
+				++m_statistics.staleEvents;
+				continue;
+			}
+
+			if (event.type == EventType::Collision)
+				Collide(event);
+			else
+				Bounce(event);
+		}
+
+		WriteBack(atoms);
+	}
+
+	void SweptCollisions::Load(const std::vector<Atom*>& atoms, double timeDelta, XMFLOAT3 boxDimensions, unsigned int periodicAxes)
+	{
+		m_timeDelta = timeDelta;
+		const XMFLOAT3 periods = Boundaries::Periods(boxDimensions, periodicAxes);
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			m_halfBox[axis] = 0.5 * (&boxDimensions.x)[axis];
+			m_period[axis] = (&periods.x)[axis];
+			m_inversePeriod[axis] = m_period[axis] > 0.0 ? 1.0 / m_period[axis] : 0.0;
+		}
+
+		const size_t count = atoms.size();
+		m_spheres.resize(count);
+		const size_t blocks = (count + SphereBlock - 1) / SphereBlock;
+		concurrency::parallel_for(size_t(0), blocks, [&](size_t block)
+			{
+				size_t end = std::min(count, (block + 1) * SphereBlock);
+				for (size_t iii = block * SphereBlock; iii < end; ++iii)
+				{
+					Atom* atom = atoms[iii];
+					const XMFLOAT3 position = atom->Position();
+					const XMFLOAT3 velocity = atom->Velocity();
+
+					Sphere& sphere = m_spheres[iii];
+					for (int axis = 0; axis < 3; ++axis)
+					{
+						sphere.position[axis] = (&position.x)[axis];
+						sphere.velocity[axis] = (&velocity.x)[axis];
+					}
+					sphere.time = 0.0;
+					sphere.radius = atom->Radius();
+					sphere.mass = atom->Mass();
+					sphere.sweep = std::sqrt(sphere.velocity[0] * sphere.velocity[0] + sphere.velocity[1] * sphere.velocity[1] + sphere.velocity[2] * sphere.velocity[2]);
+					sphere.count = 0;
+				}
+			});
+	}
+
+	void SweptCollisions::BroadPhase()
+	{
+		const size_t count = m_spheres.size();
+
+		// Load left the speeds in 'sweep' - an atom slower than the mean sweeps as if it had the mean
+		// speed, since one fast collision partner is enough to give it that much
+		double meanSpeed = 0.0;
+		for (const Sphere& sphere : m_spheres)
+			meanSpeed += sphere.sweep;
+		meanSpeed /= static_cast<double>(count);
+
+		double largestRadius = 0.0, largestSweep = 0.0, meanSweep = 0.0;
+		for (Sphere& sphere : m_spheres)
+		{
+			sphere.sweep = SweepSlack * m_timeDelta * std::max(sphere.sweep, meanSpeed);
+			largestRadius = std::max(largestRadius, sphere.radius);
+			largestSweep = std::max(largestSweep, sphere.sweep);
+			meanSweep += sphere.sweep;
+		}
+		meanSweep /= static_cast<double>(count);
+		m_largestReach = largestRadius + largestSweep;
+
+		// Cells as wide as a typical pair reaches - a fast atom searches more of them rather than
+		// every atom searching cells sized for the fastest
+		double width = std::max(2.0 * (largestRadius + meanSweep), 1.0e-6);
+		double cells = 1.0;
+		for (int axis = 0; axis < 3; ++axis)
+			cells *= std::max(1.0, std::floor(2.0 * m_halfBox[axis] / width));
+		const double maxCells = std::max(1.0, MaxCellsPerSphere * static_cast<double>(count));
+		if (cells > maxCells)
+			width *= std::cbrt(cells / maxCells);
+
+		size_t cellCount = 1;
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			m_cells[axis] = std::max(1, static_cast<int32_t>(std::floor(2.0 * m_halfBox[axis] / width)));
+			m_cellWidth[axis] = std::max(2.0 * m_halfBox[axis], 1.0e-6) / m_cells[axis];
+			cellCount *= static_cast<size_t>(m_cells[axis]);
+		}
+
+		// Counting sort of the spheres by cell - atoms a little outside a wall go in the outer cells
+		m_cellStart.assign(cellCount + 1, 0);
+		for (Sphere& sphere : m_spheres)
+		{
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				double coordinate = sphere.position[axis] - m_period[axis] * std::floor(sphere.position[axis] * m_inversePeriod[axis] + 0.5);
+				int32_t cell = static_cast<int32_t>(std::floor((coordinate + m_halfBox[axis]) / m_cellWidth[axis]));
+				sphere.cell[axis] = std::min(m_cells[axis] - 1, std::max(0, cell));
+			}
+			++m_cellStart[(sphere.cell[2] * m_cells[1] + sphere.cell[1]) * m_cells[0] + sphere.cell[0] + 1];
+		}
+		for (size_t cell = 0; cell < cellCount; ++cell)
+			m_cellStart[cell + 1] += m_cellStart[cell];
+
+		std::vector<uint32_t> fill(m_cellStart.begin(), m_cellStart.end() - 1);
+		m_cellSpheres.resize(count);
+		for (uint32_t iii = 0; iii < count; ++iii)
+		{
+			const Sphere& sphere = m_spheres[iii];
+			m_cellSpheres[fill[(sphere.cell[2] * m_cells[1] + sphere.cell[1]) * m_cells[0] + sphere.cell[0]]++] = iii;
+		}
+
+		// Candidates per block, then back to back in sphere order
+		const size_t blocks = (count + SphereBlock - 1) / SphereBlock;
+		std::vector<std::vector<uint32_t>> found(blocks);
+		m_candidateStart.assign(count + 1, 0);
+		concurrency::parallel_for(size_t(0), blocks, [&](size_t block)
+			{
+				size_t end = std::min(count, (block + 1) * SphereBlock);
+				for (size_t iii = block * SphereBlock; iii < end; ++iii)
+				{
+					const size_t before = found[block].size();
+					FindCandidates(static_cast<uint32_t>(iii), found[block]);
+					m_candidateStart[iii + 1] = static_cast<uint32_t>(found[block].size() - before);
+				}
+			});
+
+		for (size_t iii = 0; iii < count; ++iii)
+			m_candidateStart[iii + 1] += m_candidateStart[iii];
+		m_candidates.resize(m_candidateStart[count]);
+		for (size_t block = 0; block < blocks; ++block)
+			std::copy(found[block].begin(), found[block].end(), m_candidates.begin() + m_candidateStart[block * SphereBlock]);
+
+		// Every pair is listed by both of its spheres
+		m_statistics.candidatePairs = m_candidates.size() / 2;
+	}
+
+	void SweptCollisions::FindCandidates(uint32_t iii, std::vector<uint32_t>& candidates)
+	{
+		const Sphere& sphere = m_spheres[iii];
+
+		// Far enough to find every partner j with |d| <= ri + rj + sweep i + sweep j
+		const double reach = sphere.radius + sphere.sweep + m_largestReach;
+
+		// The cells in reach on every axis - clamped at walls, wrapped around periodic axes, where
+		// a grid narrower than the reach would otherwise list one twice
+		std::vector<int32_t> cells[3];
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			const int32_t span = static_cast<int32_t>(std::ceil(reach / m_cellWidth[axis]));
+			if (m_period[axis] > 0.0 && 2 * span + 1 >= m_cells[axis])
+			{
+				for (int32_t cell = 0; cell < m_cells[axis]; ++cell)
+					cells[axis].push_back(cell);
+				continue;
+			}
+			for (int32_t cell = sphere.cell[axis] - span; cell <= sphere.cell[axis] + span; ++cell)
+			{
+				if (m_period[axis] > 0.0)
+					cells[axis].push_back((cell % m_cells[axis] + m_cells[axis]) % m_cells[axis]);
+				else if (cell >= 0 && cell < m_cells[axis])
+					cells[axis].push_back(cell);
+			}
+		}
+
+		for (int32_t zzz : cells[2])
+		{
+			for (int32_t yyy : cells[1])
+			{
+				for (int32_t xxx : cells[0])
+				{
+					const size_t cell = (static_cast<size_t>(zzz) * m_cells[1] + yyy) * m_cells[0] + xxx;
+					for (uint32_t slot = m_cellStart[cell]; slot < m_cellStart[cell + 1]; ++slot)
+					{
+						const uint32_t jjj = m_cellSpheres[slot];
+						if (jjj == iii)
+							continue;
+
+						const Sphere& other = m_spheres[jjj];
+						double dr[3];
+						for (int axis = 0; axis < 3; ++axis)
+							dr[axis] = sphere.position[axis] - other.position[axis];
+						MinimumImage(dr);
+
+						const double limit = sphere.radius + other.radius + sphere.sweep + other.sweep;
+						if (dr[0] * dr[0] + dr[1] * dr[1] + dr[2] * dr[2] <= limit * limit)
+							candidates.push_back(jjj);
+					}
+				}
+			}
+		}
+	}
+
+	void SweptCollisions::WriteBack(const std::vector<Atom*>& atoms)
+	{
+		const size_t count = m_spheres.size();
+		const size_t blocks = (count + SphereBlock - 1) / SphereBlock;
+		concurrency::parallel_for(size_t(0), blocks, [&](size_t block)
+			{
+				size_t end = std::min(count, (block + 1) * SphereBlock);
+				for (size_t iii = block * SphereBlock; iii < end; ++iii)
+				{
+					Move(static_cast<uint32_t>(iii), m_timeDelta);
+					Sphere& sphere = m_spheres[iii];
+
+					// Back through the opposite face on periodic axes, and never past a wall the sphere fits between
+					float position[3];
+					for (int axis = 0; axis < 3; ++axis)
+					{
+						double coordinate = sphere.position[axis];
+						if (m_period[axis] > 0.0)
+							coordinate -= m_period[axis] * std::floor(coordinate * m_inversePeriod[axis] + 0.5);
+						else if (sphere.radius < m_halfBox[axis])
+							coordinate = std::min(m_halfBox[axis] - sphere.radius, std::max(sphere.radius - m_halfBox[axis], coordinate));
+						position[axis] = static_cast<float>(coordinate);
+					}
+
+					atoms[iii]->Position(XMFLOAT3(position[0], position[1], position[2]));
+					atoms[iii]->Velocity(XMFLOAT3(static_cast<float>(sphere.velocity[0]), static_cast<float>(sphere.velocity[1]), static_cast<float>(sphere.velocity[2])));
+				}
+			});
+	}
+
+	void SweptCollisions::Move(uint32_t iii, double time)
+	{
+		Sphere& sphere = m_spheres[iii];
+		double dt = time - sphere.time;
+		if (dt == 0.0)
+			return;
+
+		sphere.position[0] += sphere.velocity[0] * dt;
+		sphere.position[1] += sphere.velocity[1] * dt;
+		sphere.position[2] += sphere.velocity[2] * dt;
+		sphere.time = time;
+	}
+
+	void SweptCollisions::Predict(uint32_t iii, bool laterOnly, std::vector<Event>& events)
+	{
+		const Sphere& sphere = m_spheres[iii];
+
+		// The first wall in the way - none on periodic axes, or where the sphere does not fit
+		Event wall = {};
+		wall.time = std::numeric_limits<double>::infinity();
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			double velocity = sphere.velocity[axis];
+			if (velocity == 0.0 || m_period[axis] > 0.0 || sphere.radius >= m_halfBox[axis])
+				continue;
+
+			double bound = velocity > 0.0 ? m_halfBox[axis] - sphere.radius : sphere.radius - m_halfBox[axis];
+			double time = sphere.time + std::max(0.0, (bound - sphere.position[axis]) / velocity);
+			if (time < wall.time)
+			{
+				wall.time = time;
+				wall.axis = static_cast<uint8_t>(axis);
+				wall.direction = velocity > 0.0 ? 1 : -1;
+			}
+		}
+		if (wall.time <= m_timeDelta)
+		{
+			wall.type = EventType::Wall;
+			wall.a = iii;
+			wall.countA = sphere.count;
+			events.push_back(wall);
+		}
+
+		for (uint32_t slot = m_candidateStart[iii]; slot < m_candidateStart[iii + 1]; ++slot)
+		{
+			const uint32_t jjj = m_candidates[slot];
+			if (laterOnly && jjj < iii)
+				continue;
+
+			// Relative motion, with the partner brought up to this sphere's time
+			const Sphere& other = m_spheres[jjj];
+			const double lag = sphere.time - other.time;
+			double dr[3], dv[3];
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				dr[axis] = sphere.position[axis] - (other.position[axis] + other.velocity[axis] * lag);
+				dv[axis] = sphere.velocity[axis] - other.velocity[axis];
+			}
+			MinimumImage(dr);
+
+			const double b = dr[0] * dv[0] + dr[1] * dv[1] + dr[2] * dv[2];
+			if (b >= 0.0)
+				continue;		// Moving apart
+
+			const double dvv = dv[0] * dv[0] + dv[1] * dv[1] + dv[2] * dv[2];
+			const double drr = dr[0] * dr[0] + dr[1] * dr[1] + dr[2] * dr[2];
+			const double sigma = sphere.radius + other.radius;
+			const double gap = drr - sigma * sigma;
+			const double discriminant = b * b - dvv * gap;
+			if (discriminant < 0.0)
+				continue;		// Miss
+
+			// Smaller root of |dr + dv t| = sigma, in the form that does not cancel. Pairs that
+			// already overlap (left by the discrete pass or an edit) collide right away.
+			const double time = sphere.time + (gap > 0.0 ? gap / (std::sqrt(discriminant) - b) : 0.0);
+			if (time > m_timeDelta)
+				continue;		// Not this step
+
+			Event event = {};
+			event.time = time;
+			event.type = EventType::Collision;
+			event.a = iii;
+			event.b = jjj;
+			event.countA = sphere.count;
+			event.countB = other.count;
+			events.push_back(event);
+		}
+	}
+
+	void SweptCollisions::Collide(const Event& event)
+	{
+		++m_statistics.collisions;
+
+		Move(event.a, event.time);
+		Move(event.b, event.time);
+		Sphere& a = m_spheres[event.a];
+		Sphere& b = m_spheres[event.b];
+
+		double dr[3], dv[3];
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			dr[axis] = a.position[axis] - b.position[axis];
+			dv[axis] = a.velocity[axis] - b.velocity[axis];
+		}
+		MinimumImage(dr);
+		const double drr = dr[0] * dr[0] + dr[1] * dr[1] + dr[2] * dr[2];
+		const double approach = dr[0] * dv[0] + dr[1] * dv[1] + dr[2] * dv[2];
+
+		// Elastic impulse along the line of centres
+		if (drr > 0.0 && approach < 0.0)
+		{
+			const double impulse = 2.0 * approach / (drr * (a.mass + b.mass));
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				a.velocity[axis] -= impulse * b.mass * dr[axis];
+				b.velocity[axis] += impulse * a.mass * dr[axis];
+			}
+		}
+		++a.count;
+		++b.count;
+
+		m_predicted.clear();
+		Predict(event.a, false, m_predicted);
+		Predict(event.b, false, m_predicted);
+		for (const Event& predicted : m_predicted)
+			m_queue.push(predicted);
+	}
+
+	void SweptCollisions::Bounce(const Event& event)
+	{
+		++m_statistics.wallBounces;
+
+		Move(event.a, event.time);
+		Sphere& sphere = m_spheres[event.a];
+
+		// Exactly on the wall, whatever the rounding on the way there
+		sphere.position[event.axis] = event.direction * (m_halfBox[event.axis] - sphere.radius);
+		if (sphere.velocity[event.axis] * event.direction > 0.0)
+			sphere.velocity[event.axis] = -sphere.velocity[event.axis];
+		++sphere.count;
+
+		m_predicted.clear();
+		Predict(event.a, false, m_predicted);
+		for (const Event& predicted : m_predicted)
+			m_queue.push(predicted);
+	}
+
+	void SweptCollisions::MinimumImage(double dr[3])
+	{
+		for (int axis = 0; axis < 3; ++axis)
+			dr[axis] -= m_period[axis] * std::nearbyint(dr[axis] * m_inversePeriod[axis]);
+	}
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include "pch.h"
+#include "Atom.h"
+#include <cstdint>
+#include <functional>
+#include <queue>
+#include <vector>
+
+using DirectX::XMFLOAT3;
+
+namespace Simulation
+{
+	struct SweptCollisionStatistics
+	{
+		unsigned long long	steps;
+		unsigned long long	collisions;
+		unsigned long long	wallBounces;
+		unsigned long long	staleEvents;		// Popped after one of their atoms had already changed course
+		size_t				candidatePairs;		// Found by the broad phase of the last step
+	};
+
+	/*
+	*	Continuous collision detection for the time stepped update. The discrete pass only sees a
+	*	collision once two spheres already overlap at the end of a step, so a small or fast atom
+	*	goes straight through another one when the step is large. Here every atom sweeps its sphere
+	*	along its path through the step instead:
+	*
+	*		broad phase		the atoms are binned in a grid, and every pair whose swept spheres can
+	*						meet within the step (|d| <= r1 + r2 + (|v1| + |v2|) dt, with some slack
+	*						for course changes inside the step) becomes a candidate
+	*		narrow phase	the time of impact of every candidate pair, and of every atom with the
+	*						walls, is solved in closed form
+	*		resolution		the impacts are handled in time order through a priority queue - an atom
+	*						that bounces gets its impacts for the rest of the step predicted again
+	*						against its candidates, and its old ones go stale
+	*
+	*	then every atom flies the rest of the way to the end of the step. Collisions are the same
+	*	elastic impulse along the line of centres as HardSphereDynamics.
+	*
+	*	Unlike HardSphereDynamics nothing is kept between steps, so atoms may be moved, added or
+	*	edited freely between them. The price is that a partner found only after a course change
+	*	within a step - one the slack did not cover - is met at the start of the next step instead,
+	*	slightly overlapping.
+	*/
+	class SweptCollisions
+	{
+	public:
+		SweptCollisions();
+
+		// Move every atom by exactly 'timeDelta', resolving every impact inside it in time order
+		void Step(double timeDelta, const std::vector<Atom*>& atoms, XMFLOAT3 boxDimensions, unsigned int periodicAxes = PERIODIC_NONE);
+
+		// GET
+		SweptCollisionStatistics Statistics() { return m_statistics; }
+
+	private:
+		enum class EventType : uint8_t { Collision, Wall };
+
+		struct Event
+		{
+			double		time;
+			uint32_t	a;
+			uint32_t	b;				// Collisions only
+			uint32_t	countA;			// Counters of a and b when the event was predicted
+			uint32_t	countB;
+			EventType	type;
+			uint8_t		axis;			// Walls only
+			int8_t		direction;		// -1 or +1
+
+			bool operator>(const Event& other) const { return time > other.time; }
+		};
+
+		struct Sphere
+		{
+			double		position[3];	// At 'time'
+			double		velocity[3];
+			double		time;
+			double		radius;
+			double		mass;
+			double		sweep;			// How far the sphere may travel this step, slack included
+			uint32_t	count;			// Bumped whenever the velocity changes
+			int32_t		cell[3];
+		};
+
+		void Load(const std::vector<Atom*>& atoms, double timeDelta, XMFLOAT3 boxDimensions, unsigned int periodicAxes);
+		void BroadPhase();
+		void FindCandidates(uint32_t iii, std::vector<uint32_t>& candidates);
+		void WriteBack(const std::vector<Atom*>& atoms);
+
+		void Move(uint32_t iii, double time);
+
+		// Impacts of sphere iii from its current time to the end of the step - 'laterOnly' skips
+		// candidates with a lower index, so predicting every sphere finds every pair once
+		void Predict(uint32_t iii, bool laterOnly, std::vector<Event>& events);
+		void Collide(const Event& event);
+		void Bounce(const Event& event);
+
+		void MinimumImage(double dr[3]);
+
+		std::vector<Sphere>		m_spheres;
+		double					m_timeDelta;
+		double					m_halfBox[3];
+		double					m_period[3];		// Box length on the periodic axes, 0 on the walled ones
+		double					m_inversePeriod[3];
+
+		// Grid of the broad phase - sphere indices sorted by cell
+		int32_t					m_cells[3];
+		double					m_cellWidth[3];
+		std::vector<uint32_t>	m_cellStart;		// One past the last cell too
+		std::vector<uint32_t>	m_cellSpheres;
+		double					m_largestReach;		// Radius plus sweep of any sphere
+
+		// Candidates of every sphere, back to back
+		std::vector<uint32_t>	m_candidateStart;	// One past the last sphere too
+		std::vector<uint32_t>	m_candidates;
+
+		std::priority_queue<Event, std::vector<Event>, std::greater<Event>> m_queue;
+		std::vector<Event>		m_predicted;		// Scratch for Predict
+
+		SweptCollisionStatistics m_statistics;
+	};
+}
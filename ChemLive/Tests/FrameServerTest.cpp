@@ -0,0 +1,320 @@
+#include "pch.h"
+#include "FrameServer.h"
+#include <cstdio>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/*
+*	A frame server on a loopback port, with two plain TCP clients:
+*
+*	- a viewer that subscribes to atom ranges, then switches to a region. Every frame is submitted
+*	  only once the viewer has decoded the one before, so it must receive all of them - keyframes
+*	  and the delta frames after them - and each must decode to the submitted positions within
+*	  the quantization step, with the atoms its selection picks.
+*	- a client that subscribes and never reads. It must be sent far fewer frames, while the
+*	  viewer above still misses none.
+*/
+
+using namespace Simulation;
+
+namespace
+{
+	const size_t AtomCount = 40000;
+	const unsigned long long RangeFrames = 120;			// Frames with the range subscription...
+	const unsigned long long FrameCount = 240;			// ... then with the region one
+	const float BoxLength = 10.0f;
+	const unsigned int PositionBits = 16;
+	const int ReceiveTimeout = 10000;					// ms
+
+	const std::vector<std::pair<uint32_t, uint32_t>> SubscribedRanges = { { 100, 500 }, { 20000, 1000 }, { 39990, 50 } };
+	const XMFLOAT3 RegionMin(-2.0f, -2.0f, -2.0f);
+	const XMFLOAT3 RegionMax(2.0f, 2.0f, 2.0f);
+
+	class TestAtom : public Atom
+	{
+	public:
+		TestAtom() : Atom(Element::HYDROGEN, XMFLOAT3(0.0f, 0.0f, 0.0f), XMFLOAT3(0.0f, 0.0f, 0.0f)) {}
+		void Update(double, const std::vector<Atom*>&, XMFLOAT3, unsigned int) override {}
+
+		void Place(XMFLOAT3 position, Simulation::Element element)
+		{
+			m_position = position;
+			m_element = element;
+		}
+	};
+
+	// Somewhere in the box, different for every atom and step - so the delta frames are not empty
+	XMFLOAT3 Position(size_t index, unsigned long long step)
+	{
+		float coordinates[3];
+		for (uint64_t axis = 0; axis < 3; ++axis)
+		{
+			uint64_t hash = (index * 3 + axis) * 0x9E3779B97F4A7C15ull + step * 0xD1B54A32D192ED03ull;
+			hash ^= hash >> 31;
+			hash *= 0xBF58476D1CE4E5B9ull;
+			hash ^= hash >> 29;
+			coordinates[axis] = (static_cast<float>(hash >> 40) / static_cast<float>(1ull << 24) - 0.5f) * 0.98f * BoxLength;
+		}
+		return XMFLOAT3(coordinates[0], coordinates[1], coordinates[2]);
+	}
+
+	Simulation::Element ElementOf(size_t index)
+	{
+		return static_cast<Simulation::Element>(1 + index % 10);
+	}
+
+	// Atoms each subscription picks, by the same rules as the server
+	std::vector<uint32_t> RangeSelection()
+	{
+		std::vector<uint32_t> indices;
+		for (const std::pair<uint32_t, uint32_t>& range : SubscribedRanges)
+		{
+			for (uint32_t iii = range.first; iii < std::min<size_t>(AtomCount, range.first + range.second); ++iii)
+				indices.push_back(iii);
+		}
+		return indices;
+	}
+
+	std::vector<uint32_t> RegionSelection(unsigned long long step)
+	{
+		std::vector<uint32_t> indices;
+		for (size_t iii = 0; iii < AtomCount; ++iii)
+		{
+			XMFLOAT3 p = Position(iii, step);
+			if (p.x >= RegionMin.x && p.x <= RegionMax.x && p.y >= RegionMin.y && p.y <= RegionMax.y && p.z >= RegionMin.z && p.z <= RegionMax.z)
+				indices.push_back(static_cast<uint32_t>(iii));
+		}
+		return indices;
+	}
+
+	int Connect(uint16_t port, int receiveBuffer)
+	{
+		int connection = socket(AF_INET, SOCK_STREAM, 0);
+		if (connection < 0)
+			return -1;
+		if (receiveBuffer != 0)
+			setsockopt(connection, SOL_SOCKET, SO_RCVBUF, &receiveBuffer, sizeof(receiveBuffer));
+
+		sockaddr_in address = {};
+		address.sin_family = AF_INET;
+		address.sin_port = htons(port);
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if (connect(connection, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+		{
+			close(connection);
+			return -1;
+		}
+		return connection;
+	}
+
+	bool SendMessage(int connection, const std::vector<uint8_t>& message)
+	{
+		std::vector<uint8_t> framed(sizeof(uint32_t) + message.size());
+		uint32_t size = static_cast<uint32_t>(message.size());
+		std::memcpy(framed.data(), &size, sizeof(size));
+		std::memcpy(framed.data() + sizeof(size), message.data(), message.size());
+		return send(connection, framed.data(), framed.size(), 0) == static_cast<ssize_t>(framed.size());
+	}
+
+	bool Subscribe(int connection, const FrameStreamFormat::Subscription& subscription)
+	{
+		return SendMessage(connection, FrameStreamFormat::EncodeSubscription(subscription));
+	}
+
+	bool ReceiveAll(int connection, void* data, size_t size)
+	{
+		uint8_t* bytes = static_cast<uint8_t*>(data);
+		while (size > 0)
+		{
+			pollfd readable = { connection, POLLIN, 0 };
+			if (poll(&readable, 1, ReceiveTimeout) <= 0)
+				return false;
+
+			ssize_t received = recv(connection, bytes, size, 0);
+			if (received <= 0)
+				return false;
+			bytes += received;
+			size -= static_cast<size_t>(received);
+		}
+		return true;
+	}
+
+	bool ReceiveMessage(int connection, std::vector<uint8_t>& message)
+	{
+		uint32_t size;
+		if (!ReceiveAll(connection, &size, sizeof(size)) || size == 0)
+			return false;
+		message.resize(size);
+		return ReceiveAll(connection, message.data(), size);
+	}
+
+	class Viewer
+	{
+	public:
+		int					connection = -1;
+		FrameStreamDecoder	decoder;
+		bool				regionRequested = false;
+		bool				regionSelected = false;		// A keyframe has carried the region's atoms
+		uint64_t			lastFrame = 0;
+		unsigned long long	frames = 0;
+		unsigned long long	keyframes = 0;
+		unsigned long long	deltas = 0;
+		unsigned long long	regionDeltas = 0;			// ... of them with the region's atoms
+
+		// Frames are only sent once the server has read the subscription, which it answers with Hello
+		bool WaitForHello()
+		{
+			std::vector<uint8_t> message;
+			while (!decoder.Connected())
+			{
+				if (!ReceiveMessage(connection, message))
+					return false;
+				decoder.Decode(message.data(), message.size());
+			}
+			return true;
+		}
+
+		// Read until the frame of 'step' is decoded. Returns the first problem found, or nullptr.
+		const char* Receive(unsigned long long step)
+		{
+			std::vector<uint8_t> message;
+			for (;;)
+			{
+				if (!ReceiveMessage(connection, message))
+					return "no frame arrived";
+				if (!decoder.Decode(message.data(), message.size()))
+					return "a frame failed to decode";
+
+				const StreamedFrame& frame = decoder.Frame();
+				const bool keyframe = (message[1] & FrameStreamFormat::FrameKeyframe) != 0;
+				if (frames != 0 && frame.frame != lastFrame + 1)
+					return "the viewer missed a frame";
+				lastFrame = frame.frame;
+				++frames;
+
+				if (const char* problem = Check(frame, keyframe))
+					return problem;
+				if (frame.step == step)
+					return nullptr;
+			}
+		}
+
+	private:
+		std::vector<uint32_t> m_selection;
+
+		const char* Check(const StreamedFrame& frame, bool keyframe)
+		{
+			if (keyframe)
+			{
+				// After asking for the region, the next keyframes may still carry the ranges until the
+				// server has read the request
+				++keyframes;
+				if (regionRequested && frame.indices == RegionSelection(frame.step))
+					regionSelected = true;
+				else if (regionSelected || frame.indices != RangeSelection())
+					return "a keyframe picked the wrong atoms";
+				m_selection = frame.indices;
+			}
+			else
+			{
+				if (frame.indices != m_selection)
+					return "a delta frame changed the atoms";
+				++deltas;
+				if (regionSelected)
+					++regionDeltas;
+			}
+
+			const float tolerance = BoxLength / static_cast<float>((1u << PositionBits) - 1);
+			for (size_t iii = 0; iii < frame.indices.size(); ++iii)
+			{
+				XMFLOAT3 expected = Position(frame.indices[iii], frame.step);
+				const XMFLOAT3& decoded = frame.positions[iii];
+				if (std::fabs(decoded.x - expected.x) > tolerance || std::fabs(decoded.y - expected.y) > tolerance ||
+					std::fabs(decoded.z - expected.z) > tolerance)
+					return "a position is off by more than the quantization step";
+				if (frame.elements[iii] != ElementOf(frame.indices[iii]))
+					return "an element does not match";
+			}
+			return nullptr;
+		}
+	};
+
+	int Fail(const char* message)
+	{
+		std::fprintf(stderr, "%s\n", message);
+		return 1;
+	}
+}
+
+int main()
+{
+	std::vector<TestAtom> storage(AtomCount);
+	std::vector<Atom*> atoms;
+	for (TestAtom& atom : storage)
+		atoms.push_back(&atom);
+
+	FrameServerSettings settings;
+	settings.port = 0;
+	settings.keyframeInterval = 10;
+	settings.positionBits = PositionBits;
+	FrameServer server(settings);
+
+	// The stalled client asks for every atom through a small receive buffer, and never reads
+	int stalled = Connect(server.Port(), 4096);
+	Viewer viewer;
+	viewer.connection = Connect(server.Port(), 0);
+	if (stalled < 0 || viewer.connection < 0)
+		return Fail("unable to connect to the server");
+
+	FrameStreamFormat::Subscription everything;
+	FrameStreamFormat::Subscription ranges;
+	ranges.selection = FrameStreamFormat::Selection::Ranges;
+	ranges.ranges = SubscribedRanges;
+	if (!Subscribe(stalled, everything) || !Subscribe(viewer.connection, ranges) || !viewer.WaitForHello())
+		return Fail("unable to subscribe");
+
+	for (unsigned long long step = 0; step < FrameCount; ++step)
+	{
+		if (step == RangeFrames)
+		{
+			FrameStreamFormat::Subscription region;
+			region.selection = FrameStreamFormat::Selection::Region;
+			region.regionMin = RegionMin;
+			region.regionMax = RegionMax;
+			if (!Subscribe(viewer.connection, region))
+				return Fail("unable to change the subscription");
+			viewer.regionRequested = true;
+		}
+
+		for (size_t iii = 0; iii < AtomCount; ++iii)
+			storage[iii].Place(Position(iii, step), ElementOf(iii));
+		server.SubmitFrame(step, step * 0.002, XMFLOAT3(BoxLength, BoxLength, BoxLength), atoms);
+
+		if (const char* problem = viewer.Receive(step))
+		{
+			std::fprintf(stderr, "step %llu: ", step);
+			return Fail(problem);
+		}
+	}
+
+	FrameServerStatistics statistics = server.Statistics();
+	const unsigned long long stalledFrames = statistics.framesSent - viewer.frames;
+	std::printf("viewer: %llu frames (%llu keyframes, %llu deltas, %llu of them in the region), skipped %llu\n",
+		viewer.frames, viewer.keyframes, viewer.deltas, viewer.regionDeltas, viewer.decoder.FramesSkipped());
+	std::printf("stalled client: %llu of %llu frames, server skipped %llu\n", stalledFrames, statistics.framesSubmitted, statistics.framesSkipped);
+
+	close(stalled);
+	close(viewer.connection);
+
+	if (viewer.frames != FrameCount || viewer.decoder.FramesSkipped() != 0)
+		return Fail("the viewer did not receive every frame");
+	if (!viewer.regionSelected || viewer.regionDeltas == 0 || viewer.deltas < viewer.keyframes)
+		return Fail("the viewer was not sent keyframes followed by deltas for both subscriptions");
+	if (statistics.framesSkipped == 0 || stalledFrames * 2 > statistics.framesSubmitted)
+		return Fail("the stalled client was not decimated");
+	return 0;
+}
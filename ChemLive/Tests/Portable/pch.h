@@ -0,0 +1,65 @@
+#pragma once
+
+/*
+*	Stand-in for the app's precompiled header when simulation sources are built outside the UWP
+*	project (see CMakeLists.txt). Windows gets the real DirectXMath; elsewhere only the few
+*	DirectXMath names the tested sources use are defined here.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <DirectXMath.h>
+#else
+namespace DirectX
+{
+	struct XMFLOAT3
+	{
+		float x, y, z;
+
+		XMFLOAT3() = default;
+		constexpr XMFLOAT3(float _x, float _y, float _z) : x(_x), y(_y), z(_z) {}
+	};
+
+	struct XMVECTOR
+	{
+		float v[4];
+	};
+
+	struct XMMATRIX
+	{
+		float m[4][4];
+	};
+
+	inline XMVECTOR XMVectorMultiply(XMVECTOR a, XMVECTOR b)
+	{
+		return XMVECTOR{ { a.v[0] * b.v[0], a.v[1] * b.v[1], a.v[2] * b.v[2], a.v[3] * b.v[3] } };
+	}
+
+	// c - a * b
+	inline XMVECTOR XMVectorNegativeMultiplySubtract(XMVECTOR a, XMVECTOR b, XMVECTOR c)
+	{
+		return XMVECTOR{ { c.v[0] - a.v[0] * b.v[0], c.v[1] - a.v[1] * b.v[1], c.v[2] - a.v[2] * b.v[2], c.v[3] - a.v[3] * b.v[3] } };
+	}
+
+	// Halves to even, as XMVectorRound does
+	inline XMVECTOR XMVectorRound(XMVECTOR a)
+	{
+		return XMVECTOR{ { std::nearbyint(a.v[0]), std::nearbyint(a.v[1]), std::nearbyint(a.v[2]), std::nearbyint(a.v[3]) } };
+	}
+
+	inline XMMATRIX XMMatrixTranslation(float x, float y, float z)
+	{
+		return XMMATRIX{ { { 1.0f, 0.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f, 0.0f }, { 0.0f, 0.0f, 1.0f, 0.0f }, { x, y, z, 1.0f } } };
+	}
+}
+#endif
@@ -0,0 +1,14 @@
+#pragma once
+
+// Stand-in for the Parallel Patterns Library outside Windows - runs the loop body in order on the
+// calling thread, which is all the tested sources need (see CMakeLists.txt)
+
+namespace concurrency
+{
+	template <typename Index, typename Function>
+	void parallel_for(Index first, Index last, const Function& function)
+	{
+		for (Index iii = first; iii < last; ++iii)
+			function(iii);
+	}
+}
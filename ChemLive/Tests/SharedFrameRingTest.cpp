@@ -0,0 +1,144 @@
+#include "pch.h"
+#include "SharedFramePublisher.h"
+#include <cstdio>
+#include <thread>
+
+#if defined(_WIN32)
+#define TEST_PROCESS_ID GetCurrentProcessId()
+#else
+#include <unistd.h>
+#define TEST_PROCESS_ID getpid()
+#endif
+
+/*
+*	Four readers against one writer on a small ring, so the writer laps them all the time. Every
+*	frame the writer publishes is recognisable from its step alone - atom N sits at (step, N, -step)
+*	and its element cycles with the step - so any copy mixing two frames shows up. The ReadNext
+*	readers also check they never see a frame twice or out of order.
+*/
+
+using namespace Simulation;
+
+namespace
+{
+	const size_t AtomCount = 20000;
+	const unsigned long long FrameCount = 2000;
+	const int ReaderCount = 4;
+
+	class TestAtom : public Atom
+	{
+	public:
+		TestAtom() : Atom(Element::HYDROGEN, XMFLOAT3(0.0f, 0.0f, 0.0f), XMFLOAT3(0.0f, 0.0f, 0.0f)) {}
+		void Update(double, const std::vector<Atom*>&, XMFLOAT3, unsigned int) override {}
+
+		void Frame(unsigned long long step, size_t index)
+		{
+			m_position = XMFLOAT3(static_cast<float>(step), static_cast<float>(index), -static_cast<float>(step));
+			m_element = static_cast<Simulation::Element>(1 + step % 10);
+		}
+	};
+
+	// First problem found in the frame, or nullptr if it is whole
+	const char* Check(const SharedFrame& frame)
+	{
+		if (frame.positions.size() != AtomCount || frame.elements.size() != AtomCount)
+			return "wrong atom count";
+		if (frame.time != frame.step * 0.5 || frame.boxDimensions.x != 1.0f || frame.boxDimensions.z != 3.0f)
+			return "header does not match the step";
+
+		const float step = static_cast<float>(frame.step);
+		const uint8_t element = static_cast<uint8_t>(1 + frame.step % 10);
+		for (size_t iii = 0; iii < AtomCount; ++iii)
+		{
+			const XMFLOAT3& position = frame.positions[iii];
+			if (position.x != step || position.y != static_cast<float>(iii) || position.z != -step || frame.elements[iii] != element)
+				return "torn frame - atoms from another step";
+		}
+		return nullptr;
+	}
+}
+
+int main()
+{
+	const std::wstring name = L"ringtest-" + std::to_wstring(TEST_PROCESS_ID);
+
+	std::vector<TestAtom> storage(AtomCount);
+	std::vector<Atom*> atoms;
+	for (TestAtom& atom : storage)
+		atoms.push_back(&atom);
+
+	SharedFramePublisherSettings settings;
+	settings.slotCount = 4;
+	SharedFramePublisher publisher(name, AtomCount, settings);
+
+	std::atomic<bool> writing(true);
+	std::atomic<int> failures(0);
+	std::vector<unsigned long long> reads(ReaderCount, 0);
+	std::vector<std::thread> readers;
+
+	for (int reader = 0; reader < ReaderCount; ++reader)
+	{
+		readers.emplace_back([&, reader]()
+			{
+				// Half follow the latest frame, half try to take every one
+				const bool everyFrame = (reader % 2) != 0;
+				SharedFrameReader ring(name);
+				SharedFrame frame;
+				unsigned long long missed = 0;
+				uint64_t last = 0;
+
+				for (;;)
+				{
+					bool done = !writing.load();
+					bool read = everyFrame ? ring.ReadNext(frame, &missed) : ring.ReadLatest(frame);
+					if (!read)
+					{
+						if (done)
+							break;
+						continue;
+					}
+
+					const char* problem = Check(frame);
+					if (problem == nullptr && everyFrame && reads[reader] != 0 && frame.frame <= last)
+						problem = "frame repeated or out of order";
+					if (problem != nullptr)
+					{
+						std::fprintf(stderr, "reader %d, frame %llu: %s\n", reader, static_cast<unsigned long long>(frame.frame), problem);
+						++failures;
+						return;
+					}
+
+					last = frame.frame;
+					++reads[reader];
+
+					// The latest frame stays readable after the writer stops, so stop rereading it
+					if (done && !everyFrame)
+						break;
+				}
+			});
+	}
+
+	for (unsigned long long step = 0; step < FrameCount; ++step)
+	{
+		for (size_t iii = 0; iii < AtomCount; ++iii)
+			storage[iii].Frame(step, iii);
+		publisher.PublishFrame(step, step * 0.5, XMFLOAT3(1.0f, 2.0f, 3.0f), atoms);
+	}
+	writing = false;
+
+	for (std::thread& thread : readers)
+		thread.join();
+
+	for (int reader = 0; reader < ReaderCount; ++reader)
+	{
+		std::printf("reader %d: %llu frames\n", reader, reads[reader]);
+		if (reads[reader] == 0)
+		{
+			std::fprintf(stderr, "reader %d never read a frame\n", reader);
+			++failures;
+		}
+	}
+	std::printf("%llu frames published, %d failures\n", publisher.FramesPublished(), failures.load());
+
+	return failures == 0 && publisher.FramesPublished() == FrameCount ? 0 : 1;
+}
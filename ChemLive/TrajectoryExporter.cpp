@@ -0,0 +1,477 @@
+#include "pch.h"
+#include "TrajectoryExporter.h"
+#include <charconv>
+#include <cstddef>
+#include <stdexcept>
+
+namespace Simulation
+{
+	namespace
+	{
+		// First Fortran record of a DCD file. Every field is 4 bytes, so there is no padding.
+		struct DCDHeader
+		{
+			int32_t		recordStart;		// 84
+			char		cord[4];			// "CORD"
+			int32_t		frameCount;			// NSET
+			int32_t		firstStep;			// ISTART
+			int32_t		stepsPerFrame;		// NSAVC
+			int32_t		stepCount;			// NSTEP
+			int32_t		unused0[5];
+			float		timeStep;			// DELTA
+			int32_t		hasUnitCell;
+			int32_t		unused1[8];
+			int32_t		charmmVersion;
+			int32_t		recordEnd;			// 84
+		};
+		static_assert(sizeof(DCDHeader) == 92, "DCDHeader layout changed");
+
+		// Offsets patched by Stop() once the number of frames is known
+		const uint64_t DCDFrameCountOffset = offsetof(DCDHeader, frameCount);
+		const uint64_t DCDStepCountOffset = offsetof(DCDHeader, stepCount);
+
+		// Longest XYZ atom line: symbol + 3 * (separator + to_chars of any float) + newline
+		const size_t MaxXYZLineLength = 2 + 3 * 64 + 1;
+
+		// Fixed point float to text. Coordinates are small, so formatting the value as an integer
+		// number of 10^-decimals units is exact and much cheaper than general float formatting.
+		char* FormatFixed(char* out, char* end, float value, int decimals, double power)
+		{
+			double scaled = std::round(static_cast<double>(value) * power);
+			if (!(std::fabs(scaled) < 1e15))
+				return std::to_chars(out, end, value, std::chars_format::fixed, decimals).ptr;
+
+			long long units = static_cast<long long>(scaled);
+			if (units < 0)
+			{
+				*out++ = '-';
+				units = -units;
+			}
+
+			long long divisor = static_cast<long long>(power);
+			out = std::to_chars(out, end, units / divisor).ptr;
+			if (decimals > 0)
+			{
+				// Write the fraction right to left so its leading zeros are kept
+				*out = '.';
+				long long fraction = units % divisor;
+				for (int digit = decimals; digit > 0; --digit)
+				{
+					out[digit] = static_cast<char>('0' + fraction % 10);
+					fraction /= 10;
+				}
+				out += decimals + 1;
+			}
+			return out;
+		}
+
+		template <typename T>
+		void Append(std::vector<char>& output, const T& value)
+		{
+			const char* bytes = reinterpret_cast<const char*>(&value);
+			output.insert(output.end(), bytes, bytes + sizeof(T));
+		}
+	}
+
+	TrajectoryExporter::TrajectoryExporter(const std::wstring& filename, XMFLOAT3 boxDimensions, const TrajectoryExporterSettings& settings) :
+		m_settings(settings),
+		m_boxDimensions(boxDimensions),
+		m_inFlight(0),
+		m_peakInFlight(0),
+		m_submitting(0),
+		m_nextSequence(0),
+		m_stopping(false),
+		m_stepsSinceFrame(0),
+		m_nextWrite(0),
+		m_dcdHeaderWritten(false),
+		m_dcdAtomCount(0),
+		m_dcdFirstStep(0),
+		m_dcdLastStep(0),
+		m_startTime(std::chrono::steady_clock::now()),
+		m_framesWritten(0),
+		m_framesDropped(0),
+		m_bytesWritten(0),
+		m_failed(false)
+	{
+		m_settings.frameInterval = std::max(1u, m_settings.frameInterval);
+		m_settings.queueCapacity = std::max(1u, m_settings.queueCapacity);
+		m_settings.xyzDecimals = std::min(m_settings.xyzDecimals, 9u);
+		if (m_settings.workerThreads == 0)
+			m_settings.workerThreads = std::max(2u, std::thread::hardware_concurrency()) - 1;
+
+		try
+		{
+			m_file.reset(new AsyncFileWriter(filename));
+		}
+		catch (const std::runtime_error&)
+		{
+			throw std::runtime_error("TrajectoryExporter: unable to open the export file for writing");
+		}
+
+		for (unsigned int iii = 0; iii < m_settings.workerThreads; ++iii)
+			m_workers.emplace_back(&TrajectoryExporter::WorkerThread, this);
+		m_writer = std::thread(&TrajectoryExporter::WriterThread, this);
+	}
+
+	TrajectoryExporter::~TrajectoryExporter()
+	{
+		Stop();
+	}
+
+	void TrajectoryExporter::SubmitFrame(unsigned long long step, double time, const std::vector<Atom*>& atoms)
+	{
+		if (m_stepsSinceFrame++ % m_settings.frameInterval != 0 || m_failed)
+			return;
+
+		std::unique_ptr<Frame> frame;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			if (m_stopping)
+				return;
+
+			if (m_inFlight >= m_settings.queueCapacity)
+			{
+				if (m_settings.queuePolicy == RecordingQueuePolicy::DropFrame)
+				{
+					++m_framesDropped;
+					return;
+				}
+
+				m_frameWritten.wait(lock, [this] { return m_inFlight < m_settings.queueCapacity || m_stopping; });
+				if (m_stopping)
+					return;
+			}
+
+			++m_inFlight;
+			++m_submitting;
+			m_peakInFlight = std::max(m_peakInFlight, m_inFlight);
+
+			if (!m_freeFrames.empty())
+			{
+				frame = std::move(m_freeFrames.back());
+				m_freeFrames.pop_back();
+			}
+		}
+
+		if (frame == nullptr)
+			frame = std::unique_ptr<Frame>(new Frame());
+
+		// This copy is the only export work done on the simulation thread
+		frame->step = step;
+		frame->time = time;
+		frame->positions.resize(atoms.size());
+		frame->elements.resize(atoms.size());
+		for (size_t iii = 0; iii < atoms.size(); ++iii)
+		{
+			frame->positions[iii] = atoms[iii]->Position();
+			frame->elements[iii] = static_cast<uint8_t>(atoms[iii]->Element());
+		}
+
+		bool stopping;
+		{
+			// Sequence numbers are taken under the same lock as the queue so they match queue order
+			std::lock_guard<std::mutex> lock(m_mutex);
+			frame->sequence = m_nextSequence++;
+			m_pending.push_back(std::move(frame));
+			--m_submitting;
+			stopping = m_stopping;
+		}
+
+		// Workers waiting to stop must also see that the last submission has arrived
+		if (stopping)
+			m_frameQueued.notify_all();
+		else
+			m_frameQueued.notify_one();
+	}
+
+	void TrajectoryExporter::Stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_stopping)
+				return;
+			m_stopping = true;
+		}
+		m_frameQueued.notify_all();
+		m_frameFormatted.notify_one();
+		m_frameWritten.notify_all();
+
+		// Workers finish everything queued, then the writer writes everything formatted
+		for (std::thread& worker : m_workers)
+		{
+			if (worker.joinable())
+				worker.join();
+		}
+		if (m_writer.joinable())
+			m_writer.join();
+
+		if (!m_failed && m_dcdHeaderWritten)
+		{
+			int32_t frameCount = static_cast<int32_t>(m_framesWritten);
+			int32_t stepCount = static_cast<int32_t>(m_dcdLastStep - m_dcdFirstStep + m_settings.frameInterval);
+			try
+			{
+				m_file->WriteAt(DCDFrameCountOffset, &frameCount, sizeof(frameCount));
+				m_file->WriteAt(DCDStepCountOffset, &stepCount, sizeof(stepCount));
+			}
+			catch (const std::runtime_error&)
+			{
+				m_failed = true;
+			}
+		}
+
+		try
+		{
+			m_file->Close();
+		}
+		catch (const std::runtime_error&)
+		{
+			m_failed = true;
+		}
+	}
+
+	TrajectoryExportStatistics TrajectoryExporter::Statistics()
+	{
+		TrajectoryExportStatistics statistics = {};
+		statistics.framesWritten = m_framesWritten;
+		statistics.framesDropped = m_framesDropped;
+		statistics.bytesWritten = m_bytesWritten;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			statistics.queueDepth = m_inFlight;
+			statistics.peakQueueDepth = m_peakInFlight;
+		}
+
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_startTime).count();
+		if (seconds > 0.0)
+		{
+			statistics.framesPerSecond = statistics.framesWritten / seconds;
+			statistics.megabytesPerSecond = statistics.bytesWritten / (1024.0 * 1024.0) / seconds;
+		}
+		return statistics;
+	}
+
+	void TrajectoryExporter::WorkerThread()
+	{
+		while (true)
+		{
+			std::unique_ptr<Frame> frame;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_frameQueued.wait(lock, [this] { return !m_pending.empty() || (m_stopping && m_submitting == 0); });
+
+				if (m_pending.empty())
+					return;
+
+				frame = std::move(m_pending.front());
+				m_pending.pop_front();
+			}
+
+			frame->output.clear();
+			if (!m_failed)
+			{
+				if (m_settings.format == ExportFormat::XYZ)
+					FormatXYZ(*frame);
+				else
+					FormatDCD(*frame);
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_formatted[frame->sequence] = std::move(frame);
+			}
+			m_frameFormatted.notify_one();
+		}
+	}
+
+	void TrajectoryExporter::WriterThread()
+	{
+		while (true)
+		{
+			std::unique_ptr<Frame> frame;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_frameFormatted.wait(lock, [this] { return m_formatted.count(m_nextWrite) != 0 || (m_stopping && m_inFlight == 0); });
+
+				// Everything in flight is written before the writer stops
+				auto next = m_formatted.find(m_nextWrite);
+				if (next == m_formatted.end())
+					return;
+
+				frame = std::move(next->second);
+				m_formatted.erase(next);
+			}
+
+			if (!m_failed)
+			{
+				if (m_settings.format == ExportFormat::DCD)
+				{
+					if (!m_dcdHeaderWritten)
+						WriteDCDHeader(*frame);
+
+					// DCD cannot change its atom count part way through
+					if (frame->positions.size() != m_dcdAtomCount)
+					{
+						++m_framesDropped;
+						frame->output.clear();
+					}
+					else
+					{
+						m_dcdLastStep = frame->step;
+					}
+				}
+
+				if (!frame->output.empty())
+				{
+					Write(frame->output.data(), frame->output.size());
+					if (!m_failed)
+						++m_framesWritten;
+				}
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				++m_nextWrite;
+				--m_inFlight;
+				m_freeFrames.push_back(std::move(frame));
+			}
+			m_frameWritten.notify_one();
+
+			// When stopping, the writer may now be the one to see that nothing is left
+			m_frameFormatted.notify_one();
+		}
+	}
+
+	void TrajectoryExporter::FormatXYZ(Frame& frame)
+	{
+		const size_t atomCount = frame.positions.size();
+		const float scale = m_settings.lengthScale;
+		const XMFLOAT3 offset(m_boxDimensions.x * 0.5f, m_boxDimensions.y * 0.5f, m_boxDimensions.z * 0.5f);
+		const int decimals = static_cast<int>(m_settings.xyzDecimals);
+		const double power = std::pow(10.0, decimals);
+
+		std::string comment = std::to_string(atomCount) + "\nLattice=\"" +
+			std::to_string(m_boxDimensions.x * scale) + " 0 0 0 " +
+			std::to_string(m_boxDimensions.y * scale) + " 0 0 0 " +
+			std::to_string(m_boxDimensions.z * scale) + "\" Properties=species:S:1:pos:R:3 step=" +
+			std::to_string(frame.step) + " time=" + std::to_string(frame.time) + "\n";
+
+		std::vector<char>& output = frame.output;
+		output.resize(comment.size() + atomCount * 32);
+		std::memcpy(output.data(), comment.data(), comment.size());
+		size_t used = comment.size();
+
+		for (size_t iii = 0; iii < atomCount; ++iii)
+		{
+			if (output.size() - used < MaxXYZLineLength)
+				output.resize(std::max(output.size() * 2, used + MaxXYZLineLength));
+
+			char* line = output.data() + used;
+			char* end = output.data() + output.size();
+
+			const char* symbol = Constants::ElementSymbols[frame.elements[iii]];
+			while (*symbol != '\0')
+				*line++ = *symbol++;
+
+			const XMFLOAT3& position = frame.positions[iii];
+			const float coordinates[3] = {
+				(position.x + offset.x) * scale,
+				(position.y + offset.y) * scale,
+				(position.z + offset.z) * scale
+			};
+			for (float coordinate : coordinates)
+			{
+				*line++ = ' ';
+				line = FormatFixed(line, end, coordinate, decimals, power);
+			}
+			*line++ = '\n';
+
+			used = line - output.data();
+		}
+
+		output.resize(used);
+	}
+
+	void TrajectoryExporter::FormatDCD(Frame& frame)
+	{
+		const int32_t atomCount = static_cast<int32_t>(frame.positions.size());
+		const int32_t blockSize = atomCount * static_cast<int32_t>(sizeof(float));
+		const float scale = m_settings.lengthScale;
+
+		std::vector<char>& output = frame.output;
+		output.reserve(sizeof(int32_t) * 2 + sizeof(double) * 6 + 3 * (sizeof(int32_t) * 2 + static_cast<size_t>(blockSize)));
+
+		// Unit cell record - CHARMM order is A, gamma, B, beta, alpha, C (right angles)
+		const double cell[6] = {
+			m_boxDimensions.x * scale, 90.0,
+			m_boxDimensions.y * scale, 90.0, 90.0,
+			m_boxDimensions.z * scale
+		};
+		Append(output, static_cast<int32_t>(sizeof(cell)));
+		Append(output, cell);
+		Append(output, static_cast<int32_t>(sizeof(cell)));
+
+		// One Fortran record per axis
+		const float offsets[3] = { m_boxDimensions.x * 0.5f, m_boxDimensions.y * 0.5f, m_boxDimensions.z * 0.5f };
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			Append(output, blockSize);
+			size_t start = output.size();
+			output.resize(start + static_cast<size_t>(blockSize));
+			float* block = reinterpret_cast<float*>(output.data() + start);
+			for (int32_t iii = 0; iii < atomCount; ++iii)
+				block[iii] = ((&frame.positions[iii].x)[axis] + offsets[axis]) * scale;
+			Append(output, blockSize);
+		}
+	}
+
+	void TrajectoryExporter::WriteDCDHeader(const Frame& frame)
+	{
+		m_dcdHeaderWritten = true;
+		m_dcdAtomCount = static_cast<uint32_t>(frame.positions.size());
+		m_dcdFirstStep = frame.step;
+
+		DCDHeader header = {};
+		header.recordStart = header.recordEnd = sizeof(DCDHeader) - 2 * sizeof(int32_t);
+		std::memcpy(header.cord, "CORD", 4);
+		header.firstStep = static_cast<int32_t>(frame.step);
+		header.stepsPerFrame = static_cast<int32_t>(m_settings.frameInterval);
+		header.timeStep = 0.0f;			// Simulation time has no physical unit yet
+		header.hasUnitCell = 1;
+		header.charmmVersion = 24;
+		Write(&header, sizeof(header));
+
+		// Title record - a single 80 character line
+		char title[80];
+		std::memset(title, ' ', sizeof(title));
+		const char text[] = "Exported by ChemLive";
+		std::memcpy(title, text, sizeof(text) - 1);
+		int32_t titleRecord = sizeof(int32_t) + sizeof(title);
+		int32_t titleCount = 1;
+		Write(&titleRecord, sizeof(titleRecord));
+		Write(&titleCount, sizeof(titleCount));
+		Write(title, sizeof(title));
+		Write(&titleRecord, sizeof(titleRecord));
+
+		int32_t atomRecord = sizeof(int32_t);
+		int32_t atomCount = static_cast<int32_t>(m_dcdAtomCount);
+		Write(&atomRecord, sizeof(atomRecord));
+		Write(&atomCount, sizeof(atomCount));
+		Write(&atomRecord, sizeof(atomRecord));
+	}
+
+	void TrajectoryExporter::Write(const void* data, size_t size)
+	{
+		try
+		{
+			m_file->Write(data, size);
+		}
+		catch (const std::runtime_error&)
+		{
+			m_failed = true;
+			return;
+		}
+
+		m_bytesWritten += size;
+	}
+}
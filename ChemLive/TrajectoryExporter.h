@@ -0,0 +1,129 @@
+#pragma once
+
+#include "pch.h"
+#include "AsyncIO.h"
+#include "Atom.h"
+#include "TrajectoryRecorder.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace Simulation
+{
+	enum class ExportFormat
+	{
+		XYZ,		// Extended XYZ text - one block per frame, Lattice and step in the comment line
+		DCD			// CHARMM / NAMD binary - fixed atom count, unit cell record per frame
+	};
+
+	struct TrajectoryExporterSettings
+	{
+		ExportFormat			format = ExportFormat::XYZ;
+		unsigned int			frameInterval = 1;		// Export every Nth simulation step
+		unsigned int			workerThreads = 0;		// Formatting threads - 0 uses every core but one
+		unsigned int			queueCapacity = 16;		// Frames in flight (queued, being formatted or waiting to be written)
+		RecordingQueuePolicy	queuePolicy = RecordingQueuePolicy::DropFrame;
+		unsigned int			xyzDecimals = 4;		// Digits after the decimal point of XYZ coordinates
+		float					lengthScale = 10.0f;	// Simulation length unit -> file unit (nm -> Angstrom)
+	};
+
+	struct TrajectoryExportStatistics
+	{
+		unsigned long long		framesWritten;
+		unsigned long long		framesDropped;
+		unsigned long long		bytesWritten;
+		unsigned int			queueDepth;				// Frames in flight right now
+		unsigned int			peakQueueDepth;
+		double					framesPerSecond;		// Averaged since the export started
+		double					megabytesPerSecond;
+	};
+
+	/*
+	*	Exports every Nth simulation frame to a file other tools can read (XYZ or DCD).
+	*
+	*	Like the TrajectoryRecorder, the simulation thread only copies positions into a pooled
+	*	frame. Frames are then formatted in parallel by a pool of worker threads (fixed point
+	*	integer formatting for XYZ, raw float blocks for DCD) and handed to a single writer thread, which writes
+	*	them in submission order. Coordinates are written relative to the box corner, so they
+	*	lie in [0, box) like most tools expect.
+	*/
+	class TrajectoryExporter
+	{
+	public:
+		TrajectoryExporter(const std::wstring& filename, XMFLOAT3 boxDimensions, const TrajectoryExporterSettings& settings);
+		~TrajectoryExporter();
+
+		// Called from Simulation::Update after every step
+		void SubmitFrame(unsigned long long step, double time, const std::vector<Atom*>& atoms);
+
+		// Write every frame still in flight and close the file
+		void Stop();
+
+		// GET
+		TrajectoryExportStatistics Statistics();
+		bool Failed() { return m_failed; }		// The file could not be written - export stopped
+
+	private:
+		struct Frame
+		{
+			unsigned long long		sequence;		// Order in which the frame must be written
+			unsigned long long		step;
+			double					time;
+			std::vector<XMFLOAT3>	positions;
+			std::vector<uint8_t>	elements;
+			std::vector<char>		output;			// Formatted bytes, filled in by a worker
+		};
+
+		void WorkerThread();
+		void WriterThread();
+		void FormatXYZ(Frame& frame);
+		void FormatDCD(Frame& frame);
+		void WriteDCDHeader(const Frame& frame);
+		void Write(const void* data, size_t size);
+
+		TrajectoryExporterSettings				m_settings;
+		XMFLOAT3								m_boxDimensions;
+		std::unique_ptr<AsyncFileWriter>		m_file;
+
+		// Pipeline: m_pending -> workers -> m_formatted -> writer. Frames count as in flight from
+		// SubmitFrame until they are written, which bounds the memory used when the disk is slow.
+		std::mutex								m_mutex;
+		std::condition_variable					m_frameQueued;		// Something for the workers
+		std::condition_variable					m_frameFormatted;	// Something for the writer
+		std::condition_variable					m_frameWritten;		// Room for SubmitFrame
+		std::deque<std::unique_ptr<Frame>>		m_pending;
+		std::map<unsigned long long, std::unique_ptr<Frame>> m_formatted;
+		std::vector<std::unique_ptr<Frame>>		m_freeFrames;
+		unsigned int							m_inFlight;
+		unsigned int							m_peakInFlight;
+		unsigned int							m_submitting;		// Frames being copied by SubmitFrame, not yet queued
+		unsigned long long						m_nextSequence;
+		bool									m_stopping;
+
+		std::vector<std::thread>				m_workers;
+		std::thread								m_writer;
+
+		unsigned long long						m_stepsSinceFrame;
+
+		// Writer thread state
+		unsigned long long						m_nextWrite;		// Sequence number the writer waits for
+		bool									m_dcdHeaderWritten;
+		uint32_t								m_dcdAtomCount;
+		unsigned long long						m_dcdFirstStep;
+		unsigned long long						m_dcdLastStep;
+
+		// Statistics
+		std::chrono::steady_clock::time_point	m_startTime;
+		std::atomic<unsigned long long>			m_framesWritten;
+		std::atomic<unsigned long long>			m_framesDropped;
+		std::atomic<unsigned long long>			m_bytesWritten;
+		std::atomic<bool>						m_failed;
+	};
+}
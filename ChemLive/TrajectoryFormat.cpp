@@ -0,0 +1,155 @@
+#include "pch.h"
+#include "TrajectoryFormat.h"
+#include "EntropyCoder.h"
+
+namespace Simulation
+{
+	namespace TrajectoryFormat
+	{
+		// Longest varint of a uint32
+		static const size_t MaxVarintSize = 5;
+
+		static void WriteVarint(uint32_t value, std::vector<uint8_t>& out)
+		{
+			while (value >= 0x80)
+			{
+				out.push_back(static_cast<uint8_t>(value | 0x80));
+				value >>= 7;
+			}
+			out.push_back(static_cast<uint8_t>(value));
+		}
+
+		static bool ReadVarint(const uint8_t*& data, const uint8_t* end, uint32_t& value)
+		{
+			value = 0;
+			for (unsigned int shift = 0; shift < 35; shift += 7)
+			{
+				if (data == end)
+					return false;
+
+				uint8_t byte = *data++;
+				value |= static_cast<uint32_t>(byte & 0x7F) << shift;
+				if ((byte & 0x80) == 0)
+					return true;
+			}
+			return false;
+		}
+
+		// Map signed deltas onto unsigned values so small moves in either direction stay small
+		static uint32_t ZigZag(int32_t value) { return (static_cast<uint32_t>(value) << 1) ^ static_cast<uint32_t>(value >> 31); }
+		static int32_t UnZigZag(uint32_t value) { return static_cast<int32_t>(value >> 1) ^ -static_cast<int32_t>(value & 1); }
+
+		void Quantize(const XMFLOAT3* positions, size_t count, XMFLOAT3 boxDimensions, uint32_t bits, uint32_t* quantized)
+		{
+			const float maxValue = static_cast<float>((1u << bits) - 1);
+			const float scale[3] = { maxValue / boxDimensions.x, maxValue / boxDimensions.y, maxValue / boxDimensions.z };
+			const float half[3] = { boxDimensions.x / 2.0f, boxDimensions.y / 2.0f, boxDimensions.z / 2.0f };
+
+			for (size_t iii = 0; iii < count; ++iii)
+			{
+				const float value[3] = { positions[iii].x, positions[iii].y, positions[iii].z };
+				for (unsigned int axis = 0; axis < 3; ++axis)
+				{
+					float q = (value[axis] + half[axis]) * scale[axis] + 0.5f;
+					q = std::min(std::max(q, 0.0f), maxValue);
+					quantized[3 * iii + axis] = static_cast<uint32_t>(q);
+				}
+			}
+		}
+
+		void Dequantize(const uint32_t* quantized, size_t count, XMFLOAT3 boxDimensions, uint32_t bits, XMFLOAT3* positions)
+		{
+			const float maxValue = static_cast<float>((1u << bits) - 1);
+			const float step[3] = { boxDimensions.x / maxValue, boxDimensions.y / maxValue, boxDimensions.z / maxValue };
+
+			for (size_t iii = 0; iii < count; ++iii)
+			{
+				positions[iii].x = quantized[3 * iii + 0] * step[0] - boxDimensions.x / 2.0f;
+				positions[iii].y = quantized[3 * iii + 1] * step[1] - boxDimensions.y / 2.0f;
+				positions[iii].z = quantized[3 * iii + 2] * step[2] - boxDimensions.z / 2.0f;
+			}
+		}
+
+		void EncodeChunk(const uint32_t* quantized, const uint32_t* previous, const uint8_t* elements,
+			uint32_t firstAtom, uint32_t atomCount, std::vector<uint8_t>& out)
+		{
+			size_t headerStart = out.size();
+			out.resize(headerStart + sizeof(ChunkHeader));
+
+			ChunkHeader header = {};
+			header.firstAtom = firstAtom;
+			header.atomCount = atomCount;
+
+			// Elements (keyframes only) - long runs of the same element compress to almost nothing
+			if (previous == nullptr)
+			{
+				size_t before = out.size();
+				EntropyCoder::Compress(elements + firstAtom, atomCount, out);
+				header.elementsSize = static_cast<uint32_t>(out.size() - before);
+			}
+
+			// Positions - zigzag varints of the difference to the previous frame (or to zero)
+			std::vector<uint8_t> varints;
+			varints.reserve(3 * static_cast<size_t>(atomCount));
+
+			const uint32_t* current = quantized + 3 * static_cast<size_t>(firstAtom);
+			const uint32_t* reference = previous == nullptr ? nullptr : previous + 3 * static_cast<size_t>(firstAtom);
+			for (size_t iii = 0; iii < 3 * static_cast<size_t>(atomCount); ++iii)
+			{
+				int32_t delta = static_cast<int32_t>(current[iii] - (reference == nullptr ? 0 : reference[iii]));
+				WriteVarint(ZigZag(delta), varints);
+			}
+
+			size_t before = out.size();
+			EntropyCoder::Compress(varints.data(), varints.size(), out);
+			header.positionsRawSize = static_cast<uint32_t>(varints.size());
+			header.positionsSize = static_cast<uint32_t>(out.size() - before);
+
+			std::memcpy(out.data() + headerStart, &header, sizeof(ChunkHeader));
+		}
+
+		size_t DecodeChunk(const uint8_t* data, size_t size, bool keyframe, uint32_t frameAtomCount,
+			const uint32_t* previous, uint32_t* quantized, uint8_t* elements)
+		{
+			if (size < sizeof(ChunkHeader))
+				return 0;
+
+			ChunkHeader header;
+			std::memcpy(&header, data, sizeof(ChunkHeader));
+
+			size_t total = sizeof(ChunkHeader) + static_cast<size_t>(header.elementsSize) + header.positionsSize;
+			if (total > size || static_cast<uint64_t>(header.firstAtom) + header.atomCount > frameAtomCount)
+				return 0;
+			if (!keyframe && previous == nullptr)
+				return 0;
+			if (header.positionsRawSize > 3 * static_cast<size_t>(header.atomCount) * MaxVarintSize)
+				return 0;		// More than the atoms can need - checked before it sizes the buffer below
+
+			const uint8_t* block = data + sizeof(ChunkHeader);
+			if (keyframe)
+			{
+				if (!EntropyCoder::Decompress(block, header.elementsSize, elements + header.firstAtom, header.atomCount))
+					return 0;
+				block += header.elementsSize;
+			}
+
+			std::vector<uint8_t> varints(header.positionsRawSize);
+			if (!EntropyCoder::Decompress(block, header.positionsSize, varints.data(), varints.size()))
+				return 0;
+
+			const uint8_t* cursor = varints.data();
+			const uint8_t* end = cursor + varints.size();
+			size_t first = 3 * static_cast<size_t>(header.firstAtom);
+			for (size_t iii = first; iii < first + 3 * static_cast<size_t>(header.atomCount); ++iii)
+			{
+				uint32_t value;
+				if (!ReadVarint(cursor, end, value))
+					return 0;
+
+				quantized[iii] = (keyframe ? 0 : previous[iii]) + static_cast<uint32_t>(UnZigZag(value));
+			}
+
+			return total;
+		}
+	}
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include "pch.h"
+#include <cstdint>
+#include <vector>
+
+using DirectX::XMFLOAT3;
+
+/*
+*	On-disk layout of a recorded trajectory (*.cltraj). Everything is little-endian.
+*
+*	[FileHeader]
+*	[FrameHeader][ChunkHeader][elements][positions] ... [ChunkHeader][elements][positions]
+*	...one record per recorded frame...
+*	[IndexEntry] * frameCount		<- written when recording stops, located by FileHeader::indexOffset
+*
+*	Positions are quantized to 'positionBits' per axis relative to the box. A keyframe stores
+*	the quantized values and the element of every atom; other frames store only the difference
+*	to the previous recorded frame. Each chunk of atoms is entropy coded on its own, so chunks
+*	can be encoded and decoded independently (and in parallel).
+*/
+
+namespace Simulation
+{
+	namespace TrajectoryFormat
+	{
+		const char Magic[8] = { 'C', 'L', 'T', 'R', 'A', 'J', '\0', '\0' };
+		const uint32_t Version = 1;
+		const uint32_t FrameMagic = 0x454D5246;	// "FRME"
+
+		const uint32_t MinPositionBits = 8;
+		const uint32_t MaxPositionBits = 24;	// a float mantissa cannot carry more than this anyway
+
+		// FrameHeader::flags
+		const uint32_t FrameKeyframe = 0x1;
+
+		struct FileHeader
+		{
+			char		magic[8];
+			uint32_t	version;
+			uint32_t	positionBits;
+			float		boxDimensions[3];
+			uint32_t	keyframeInterval;	// recorded frames between keyframes
+			uint32_t	frameInterval;		// simulation steps between recorded frames
+			uint32_t	atomsPerChunk;
+			uint64_t	frameCount;			// filled in when the recording is closed
+			uint64_t	indexOffset;		// 0 if the recording was not closed cleanly
+		};
+
+		struct FrameHeader
+		{
+			uint32_t	magic;
+			uint32_t	flags;
+			uint64_t	step;				// simulation step this frame was taken at
+			double		time;
+			uint32_t	atomCount;
+			uint32_t	chunkCount;
+			uint64_t	payloadSize;		// bytes of chunk data following this header
+		};
+
+		struct ChunkHeader
+		{
+			uint32_t	firstAtom;
+			uint32_t	atomCount;
+			uint32_t	elementsSize;		// compressed size of the element block (keyframes only)
+			uint32_t	positionsRawSize;	// size of the varint stream before compression
+			uint32_t	positionsSize;		// compressed size of the position block
+			uint32_t	reserved;
+		};
+
+		struct IndexEntry
+		{
+			uint64_t	offset;				// file offset of the FrameHeader
+			uint64_t	step;
+			uint32_t	flags;
+			uint32_t	reserved;
+		};
+
+		static_assert(sizeof(FileHeader) == 56, "FileHeader layout changed");
+		static_assert(sizeof(FrameHeader) == 40, "FrameHeader layout changed");
+		static_assert(sizeof(ChunkHeader) == 24, "ChunkHeader layout changed");
+		static_assert(sizeof(IndexEntry) == 24, "IndexEntry layout changed");
+
+		// Quantize positions (3 values per atom) relative to a box centered on the origin
+		void Quantize(const XMFLOAT3* positions, size_t count, XMFLOAT3 boxDimensions, uint32_t bits, uint32_t* quantized);
+		void Dequantize(const uint32_t* quantized, size_t count, XMFLOAT3 boxDimensions, uint32_t bits, XMFLOAT3* positions);
+
+		// Encode 'atomCount' atoms starting at 'firstAtom' as one chunk (ChunkHeader + data) appended to 'out'.
+		// 'previous' holds the quantized positions of the previous recorded frame, or is nullptr for a keyframe.
+		// 'elements' is only read for keyframes.
+		void EncodeChunk(const uint32_t* quantized, const uint32_t* previous, const uint8_t* elements,
+			uint32_t firstAtom, uint32_t atomCount, std::vector<uint8_t>& out);
+
+		// Decode the chunk at 'data' into the frame-wide arrays. 'previous' must hold the previous
+		// frame for delta frames (it may alias 'quantized'). Returns the number of bytes consumed,
+		// or 0 if the chunk is malformed.
+		size_t DecodeChunk(const uint8_t* data, size_t size, bool keyframe, uint32_t frameAtomCount,
+			const uint32_t* previous, uint32_t* quantized, uint8_t* elements);
+	}
+}
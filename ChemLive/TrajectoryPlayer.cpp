@@ -0,0 +1,148 @@
+#include "pch.h"
+#include "TrajectoryPlayer.h"
+
+namespace Simulation
+{
+	TrajectoryPlayer::TrajectoryPlayer(const std::wstring& filename, unsigned int prefetchDepth) :
+		m_reader(filename),
+		m_prefetchDepth(std::max(1u, prefetchDepth)),
+		m_playhead(0),
+		m_stopping(false)
+	{
+		m_prefetcher = std::thread(&TrajectoryPlayer::PrefetchThread, this);
+	}
+
+	TrajectoryPlayer::~TrajectoryPlayer()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stopping = true;
+		}
+		m_playheadMoved.notify_all();
+
+		if (m_prefetcher.joinable())
+			m_prefetcher.join();
+	}
+
+	size_t TrajectoryPlayer::Playhead()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_playhead;
+	}
+
+	void TrajectoryPlayer::Seek(size_t frame)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_reader.FrameCount() == 0)
+				return;
+
+			m_playhead = std::min(frame, m_reader.FrameCount() - 1);
+			EvictOutsideWindow();
+		}
+		m_playheadMoved.notify_one();
+	}
+
+	void TrajectoryPlayer::Advance()
+	{
+		Seek(Playhead() + 1);
+	}
+
+	std::shared_ptr<const TrajectoryFrame> TrajectoryPlayer::CurrentFrame()
+	{
+		size_t playhead;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			playhead = m_playhead;
+
+			auto found = m_frames.find(playhead);
+			if (found != m_frames.end())
+				return found->second;
+		}
+
+		// Prefetch miss (usually right after a seek) - decode it here rather than wait
+		std::shared_ptr<TrajectoryFrame> frame = TakeFreeFrame();
+		if (!m_reader.DecodeFrame(playhead, m_playheadDecoder, *frame))
+			return nullptr;
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (playhead == m_playhead)
+			m_frames[playhead] = frame;
+
+		return frame;
+	}
+
+	void TrajectoryPlayer::PrefetchThread()
+	{
+		TrajectoryReader::Decoder decoder;
+
+		while (true)
+		{
+			size_t target;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_playheadMoved.wait(lock, [&] { return m_stopping || NextFrameToPrefetch(target); });
+				if (m_stopping)
+					return;
+			}
+
+			std::shared_ptr<TrajectoryFrame> frame = TakeFreeFrame();
+			bool decoded = m_reader.DecodeFrame(target, decoder, *frame);
+
+			std::lock_guard<std::mutex> lock(m_mutex);
+
+			// The playhead may have moved while decoding - only keep frames that are still wanted.
+			// A frame that fails to decode is stored as null so it is not retried endlessly.
+			if (target >= m_playhead && target < m_playhead + m_prefetchDepth && m_frames.count(target) == 0)
+				m_frames[target] = decoded ? frame : nullptr;
+			else
+				m_freeFrames.push_back(frame);
+		}
+	}
+
+	bool TrajectoryPlayer::NextFrameToPrefetch(size_t& frame)
+	{
+		size_t end = std::min(m_playhead + m_prefetchDepth, m_reader.FrameCount());
+		for (size_t candidate = m_playhead; candidate < end; ++candidate)
+		{
+			if (m_frames.count(candidate) == 0)
+			{
+				frame = candidate;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void TrajectoryPlayer::EvictOutsideWindow()
+	{
+		for (auto iter = m_frames.begin(); iter != m_frames.end();)
+		{
+			if (iter->first < m_playhead || iter->first >= m_playhead + m_prefetchDepth)
+			{
+				// Frames still held by the renderer are simply released instead of recycled
+				if (iter->second != nullptr && iter->second.use_count() == 1)
+					m_freeFrames.push_back(iter->second);
+				iter = m_frames.erase(iter);
+			}
+			else
+			{
+				++iter;
+			}
+		}
+	}
+
+	std::shared_ptr<TrajectoryFrame> TrajectoryPlayer::TakeFreeFrame()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (!m_freeFrames.empty())
+			{
+				std::shared_ptr<TrajectoryFrame> frame = m_freeFrames.back();
+				m_freeFrames.pop_back();
+				return frame;
+			}
+		}
+		return std::make_shared<TrajectoryFrame>();
+	}
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "pch.h"
+#include "TrajectoryReader.h"
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace Simulation
+{
+	/*
+	*	Plays back a recorded trajectory for the SimulationRenderer. A prefetch thread keeps
+	*	the next 'prefetchDepth' frames after the playhead decoded, so stepping through the
+	*	recording normally just picks up a frame that is already waiting. Seeking moves the
+	*	playhead and restarts the prefetch from the keyframe before it.
+	*/
+	class TrajectoryPlayer
+	{
+	public:
+		TrajectoryPlayer(const std::wstring& filename, unsigned int prefetchDepth = 16);
+		~TrajectoryPlayer();
+
+		void Seek(size_t frame);
+		void Advance();				// Move the playhead forward one frame (stops at the last frame)
+
+		// Frame at the playhead - decoded on the calling thread if the prefetcher has not
+		// reached it yet. Returns nullptr if the frame is corrupt.
+		std::shared_ptr<const TrajectoryFrame> CurrentFrame();
+
+		// GET
+		size_t		FrameCount() { return m_reader.FrameCount(); }
+		size_t		Playhead();
+		XMFLOAT3	BoxDimensions() { return m_reader.BoxDimensions(); }
+		const TrajectoryReader& Reader() { return m_reader; }
+
+	private:
+		void PrefetchThread();
+		bool NextFrameToPrefetch(size_t& frame);		// m_mutex must be held
+		void EvictOutsideWindow();						// m_mutex must be held
+		std::shared_ptr<TrajectoryFrame> TakeFreeFrame();
+
+		TrajectoryReader							m_reader;
+		TrajectoryReader::Decoder					m_playheadDecoder;		// Used by CurrentFrame() on a prefetch miss
+		unsigned int								m_prefetchDepth;
+
+		std::mutex									m_mutex;
+		std::condition_variable						m_playheadMoved;
+		std::map<size_t, std::shared_ptr<TrajectoryFrame>> m_frames;		// Decoded frames in [playhead, playhead + depth)
+		std::vector<std::shared_ptr<TrajectoryFrame>> m_freeFrames;		// Evicted frames, recycled to avoid reallocating
+		size_t										m_playhead;
+		bool										m_stopping;
+		std::thread									m_prefetcher;
+	};
+}
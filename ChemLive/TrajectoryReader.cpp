@@ -0,0 +1,203 @@
+#include "pch.h"
+#include "TrajectoryReader.h"
+#include <atomic>
+#include <ppl.h>
+#include <stdexcept>
+
+namespace Simulation
+{
+	TrajectoryReader::TrajectoryReader(const std::wstring& filename) :
+		m_file(filename),
+		m_index(nullptr),
+		m_frameCount(0)
+	{
+		if (m_file.Size() < sizeof(TrajectoryFormat::FileHeader))
+			throw std::runtime_error("TrajectoryReader: file is too small to be a trajectory");
+
+		std::memcpy(&m_header, m_file.Data(), sizeof(m_header));
+		if (std::memcmp(m_header.magic, TrajectoryFormat::Magic, sizeof(m_header.magic)) != 0)
+			throw std::runtime_error("TrajectoryReader: not a trajectory file");
+		if (m_header.version != TrajectoryFormat::Version)
+			throw std::runtime_error("TrajectoryReader: unsupported trajectory version");
+		if (m_header.positionBits < TrajectoryFormat::MinPositionBits || m_header.positionBits > TrajectoryFormat::MaxPositionBits)
+			throw std::runtime_error("TrajectoryReader: invalid position precision");
+
+		// Use the index written when the recording was closed. The mapping is page aligned and
+		// the index is at an 8 byte multiple, so it can be used in place.
+		uint64_t indexSize = m_header.frameCount * sizeof(TrajectoryFormat::IndexEntry);
+		bool indexValid = m_header.indexOffset != 0 &&
+			m_header.indexOffset % alignof(TrajectoryFormat::IndexEntry) == 0 &&
+			m_header.frameCount <= m_file.Size() / sizeof(TrajectoryFormat::IndexEntry) &&
+			m_header.indexOffset <= m_file.Size() - indexSize;
+
+		if (indexValid)
+		{
+			m_index = reinterpret_cast<const TrajectoryFormat::IndexEntry*>(m_file.Data() + m_header.indexOffset);
+			m_frameCount = static_cast<size_t>(m_header.frameCount);
+		}
+		else
+		{
+			RebuildIndex();
+		}
+
+		for (size_t frame = 0; frame < m_frameCount; ++frame)
+		{
+			if (m_index[frame].flags & TrajectoryFormat::FrameKeyframe)
+				m_keyframes.push_back(frame);
+		}
+
+		if (m_frameCount > 0 && (m_keyframes.empty() || m_keyframes.front() != 0))
+			throw std::runtime_error("TrajectoryReader: trajectory does not start with a keyframe");
+	}
+
+	void TrajectoryReader::RebuildIndex()
+	{
+		// The recording was interrupted before the index was written. Hop from frame header to
+		// frame header - only the headers are touched, not the compressed frame data.
+		uint64_t offset = sizeof(TrajectoryFormat::FileHeader);
+		while (offset + sizeof(TrajectoryFormat::FrameHeader) <= m_file.Size())
+		{
+			TrajectoryFormat::FrameHeader header;
+			std::memcpy(&header, m_file.Data() + offset, sizeof(header));
+
+			uint64_t end = offset + sizeof(header) + header.payloadSize;
+			if (header.magic != TrajectoryFormat::FrameMagic || header.payloadSize > m_file.Size() || end > m_file.Size())
+				break;		// Truncated final frame
+
+			TrajectoryFormat::IndexEntry entry = {};
+			entry.offset = offset;
+			entry.step = header.step;
+			entry.flags = header.flags;
+			m_rebuiltIndex.push_back(entry);
+
+			offset = end;
+		}
+
+		m_index = m_rebuiltIndex.data();
+		m_frameCount = m_rebuiltIndex.size();
+	}
+
+	size_t TrajectoryReader::FrameAtStep(unsigned long long step) const
+	{
+		// Steps increase monotonically through the recording
+		size_t low = 0;
+		size_t high = m_frameCount;
+		while (low < high)
+		{
+			size_t middle = low + (high - low) / 2;
+			if (m_index[middle].step <= step)
+				low = middle + 1;
+			else
+				high = middle;
+		}
+		return low == 0 ? 0 : low - 1;
+	}
+
+	size_t TrajectoryReader::KeyframeFor(size_t frame) const
+	{
+		auto keyframe = std::upper_bound(m_keyframes.begin(), m_keyframes.end(), frame);
+		return keyframe == m_keyframes.begin() ? 0 : *(keyframe - 1);
+	}
+
+	bool TrajectoryReader::DecodeFrame(size_t frame, Decoder& decoder, TrajectoryFrame& out) const
+	{
+		if (frame >= m_frameCount)
+			return false;
+
+		// Continue from the decoder's current frame when it lies between the keyframe and the
+		// requested frame, otherwise start over at the keyframe
+		size_t keyframe = KeyframeFor(frame);
+		size_t start = keyframe;
+		if (decoder.m_frame != Decoder::NoFrame && decoder.m_frame >= keyframe && decoder.m_frame <= frame)
+			start = decoder.m_frame + 1;
+
+		for (size_t next = start; next <= frame; ++next)
+		{
+			if (!ApplyFrame(next, decoder))
+			{
+				decoder.m_frame = Decoder::NoFrame;
+				return false;
+			}
+		}
+
+		TrajectoryFormat::FrameHeader header;
+		std::memcpy(&header, m_file.Data() + m_index[frame].offset, sizeof(header));
+
+		size_t atomCount = decoder.m_elements.size();
+		out.step = header.step;
+		out.time = header.time;
+		out.positions.resize(atomCount);
+		out.elements.assign(decoder.m_elements.begin(), decoder.m_elements.end());
+		TrajectoryFormat::Dequantize(decoder.m_quantized.data(), atomCount, BoxDimensions(), m_header.positionBits, out.positions.data());
+
+		return true;
+	}
+
+	bool TrajectoryReader::ApplyFrame(size_t frame, Decoder& decoder) const
+	{
+		uint64_t offset = m_index[frame].offset;
+		if (offset > m_file.Size() || m_file.Size() - offset < sizeof(TrajectoryFormat::FrameHeader))
+			return false;
+
+		TrajectoryFormat::FrameHeader header;
+		std::memcpy(&header, m_file.Data() + offset, sizeof(header));
+
+		const uint8_t* payload = m_file.Data() + offset + sizeof(header);
+		uint64_t available = m_file.Size() - offset - sizeof(header);
+		if (header.magic != TrajectoryFormat::FrameMagic || header.payloadSize > available)
+			return false;
+
+		bool keyframe = (header.flags & TrajectoryFormat::FrameKeyframe) != 0;
+		if (keyframe)
+		{
+			decoder.m_quantized.resize(3 * static_cast<size_t>(header.atomCount));
+			decoder.m_elements.resize(header.atomCount);
+		}
+		else if (decoder.m_frame != frame - 1 || decoder.m_elements.size() != header.atomCount)
+		{
+			return false;
+		}
+
+		// Every chunk needs at least its header in the payload, which bounds the count before it
+		// sizes anything
+		if (header.chunkCount > header.payloadSize / sizeof(TrajectoryFormat::ChunkHeader))
+			return false;
+
+		// Find where each chunk starts (only the chunk headers are read), then decode them in parallel.
+		// The chunks must cover the atoms in order, so no two of them write the same atoms.
+		std::vector<size_t> chunkOffsets(header.chunkCount);
+		size_t cursor = 0;
+		uint64_t nextAtom = 0;
+		for (uint32_t chunk = 0; chunk < header.chunkCount; ++chunk)
+		{
+			TrajectoryFormat::ChunkHeader chunkHeader;
+			if (header.payloadSize - cursor < sizeof(chunkHeader))
+				return false;
+			std::memcpy(&chunkHeader, payload + cursor, sizeof(chunkHeader));
+			if (chunkHeader.firstAtom != nextAtom)
+				return false;
+			nextAtom += chunkHeader.atomCount;
+
+			chunkOffsets[chunk] = cursor;
+			cursor += sizeof(chunkHeader) + static_cast<size_t>(chunkHeader.elementsSize) + chunkHeader.positionsSize;
+			if (cursor > header.payloadSize)
+				return false;
+		}
+		if (nextAtom != header.atomCount)
+			return false;
+
+		std::atomic<bool> valid(true);
+		concurrency::parallel_for(0u, header.chunkCount, [&](uint32_t chunk)
+			{
+				size_t consumed = TrajectoryFormat::DecodeChunk(
+					payload + chunkOffsets[chunk], static_cast<size_t>(header.payloadSize) - chunkOffsets[chunk],
+					keyframe, header.atomCount,
+					decoder.m_quantized.data(), decoder.m_quantized.data(), decoder.m_elements.data());
+				if (consumed == 0)
+					valid = false;
+			});
+
+		decoder.m_frame = frame;
+		return valid;
+	}
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "pch.h"
+#include "MappedFile.h"
+#include "TrajectoryFormat.h"
+#include <string>
+#include <vector>
+
+namespace Simulation
+{
+	// One fully decoded trajectory frame, ready to render
+	struct TrajectoryFrame
+	{
+		unsigned long long		step;
+		double					time;
+		std::vector<XMFLOAT3>	positions;
+		std::vector<uint8_t>	elements;		// Simulation::Element of each atom
+	};
+
+	/*
+	*	Random access to a recorded trajectory (see TrajectoryRecorder). The file is memory
+	*	mapped and the frame index is read straight out of the mapping, so opening a file
+	*	and seeking to any frame never reads the file linearly: a frame is rebuilt from the
+	*	nearest keyframe before it plus at most keyframeInterval deltas.
+	*
+	*	The reader itself is immutable once opened and may be shared between threads. Each
+	*	thread decodes through its own Decoder, which remembers the last frame it produced so
+	*	that playing forward only applies a single delta per frame.
+	*/
+	class TrajectoryReader
+	{
+	public:
+		class Decoder
+		{
+		public:
+			Decoder() : m_frame(NoFrame) {}
+
+		private:
+			friend class TrajectoryReader;
+			static const size_t NoFrame = static_cast<size_t>(-1);
+
+			size_t					m_frame;		// Frame currently held in m_quantized / m_elements
+			std::vector<uint32_t>	m_quantized;
+			std::vector<uint8_t>	m_elements;
+		};
+
+		TrajectoryReader(const std::wstring& filename);		// Throws std::runtime_error if the file is not a valid trajectory
+
+		bool DecodeFrame(size_t frame, Decoder& decoder, TrajectoryFrame& out) const;
+
+		// GET
+		size_t				FrameCount() const { return m_frameCount; }
+		XMFLOAT3			BoxDimensions() const { return { m_header.boxDimensions[0], m_header.boxDimensions[1], m_header.boxDimensions[2] }; }
+		unsigned long long	FrameStep(size_t frame) const { return m_index[frame].step; }
+		size_t				FrameAtStep(unsigned long long step) const;		// Last frame taken at or before 'step'
+		size_t				KeyframeFor(size_t frame) const;				// Keyframe that 'frame' is decoded from
+
+	private:
+		void RebuildIndex();
+		bool ApplyFrame(size_t frame, Decoder& decoder) const;
+
+		MappedFile								m_file;
+		TrajectoryFormat::FileHeader			m_header;
+
+		const TrajectoryFormat::IndexEntry*		m_index;			// Points into the mapping, or into m_rebuiltIndex
+		size_t									m_frameCount;
+		std::vector<TrajectoryFormat::IndexEntry> m_rebuiltIndex;	// Only used if the recording was not closed cleanly
+		std::vector<size_t>						m_keyframes;
+	};
+}
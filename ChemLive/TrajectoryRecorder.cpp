@@ -0,0 +1,238 @@
+#include "pch.h"
+#include "TrajectoryRecorder.h"
+#include <ppl.h>
+#include <stdexcept>
+
+namespace Simulation
+{
+	TrajectoryRecorder::TrajectoryRecorder(const std::wstring& filename, XMFLOAT3 boxDimensions, const TrajectoryRecorderSettings& settings) :
+		m_settings(settings),
+		m_stopping(false),
+		m_stepsSinceFrame(0),
+		m_fileOffset(0),
+		m_framesWritten(0),
+		m_framesDropped(0),
+		m_bytesWritten(0),
+		m_failed(false)
+	{
+		m_settings.frameInterval = std::max(1u, m_settings.frameInterval);
+		m_settings.keyframeInterval = std::max(1u, m_settings.keyframeInterval);
+		m_settings.atomsPerChunk = std::max(1u, m_settings.atomsPerChunk);
+		m_settings.queueCapacity = std::max(1u, m_settings.queueCapacity);
+		m_settings.positionBits = std::min(std::max(m_settings.positionBits, TrajectoryFormat::MinPositionBits), TrajectoryFormat::MaxPositionBits);
+
+		try
+		{
+			m_file.reset(new AsyncFileWriter(filename));
+		}
+		catch (const std::runtime_error&)
+		{
+			throw std::runtime_error("TrajectoryRecorder: unable to open the trajectory file for writing");
+		}
+
+		m_header = {};
+		std::memcpy(m_header.magic, TrajectoryFormat::Magic, sizeof(m_header.magic));
+		m_header.version = TrajectoryFormat::Version;
+		m_header.positionBits = m_settings.positionBits;
+		m_header.boxDimensions[0] = boxDimensions.x;
+		m_header.boxDimensions[1] = boxDimensions.y;
+		m_header.boxDimensions[2] = boxDimensions.z;
+		m_header.keyframeInterval = m_settings.keyframeInterval;
+		m_header.frameInterval = m_settings.frameInterval;
+		m_header.atomsPerChunk = m_settings.atomsPerChunk;
+
+		Write(&m_header, sizeof(m_header));
+
+		m_writer = std::thread(&TrajectoryRecorder::WriterThread, this);
+	}
+
+	TrajectoryRecorder::~TrajectoryRecorder()
+	{
+		Stop();
+	}
+
+	void TrajectoryRecorder::SubmitFrame(unsigned long long step, double time, const std::vector<Atom*>& atoms)
+	{
+		if (m_stepsSinceFrame++ % m_settings.frameInterval != 0 || m_failed)
+			return;
+
+		std::unique_ptr<Frame> frame;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			if (m_stopping)
+				return;
+
+			if (m_queue.size() >= m_settings.queueCapacity)
+			{
+				if (m_settings.queuePolicy == RecordingQueuePolicy::DropFrame)
+				{
+					++m_framesDropped;
+					return;
+				}
+
+				m_frameTaken.wait(lock, [this] { return m_queue.size() < m_settings.queueCapacity || m_stopping; });
+			}
+
+			if (!m_freeFrames.empty())
+			{
+				frame = std::move(m_freeFrames.back());
+				m_freeFrames.pop_back();
+			}
+		}
+
+		if (frame == nullptr)
+			frame = std::unique_ptr<Frame>(new Frame());
+
+		// This copy is the only recording work done on the simulation thread
+		frame->step = step;
+		frame->time = time;
+		frame->positions.resize(atoms.size());
+		frame->elements.resize(atoms.size());
+		for (size_t iii = 0; iii < atoms.size(); ++iii)
+		{
+			frame->positions[iii] = atoms[iii]->Position();
+			frame->elements[iii] = static_cast<uint8_t>(atoms[iii]->Element());
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_queue.push_back(std::move(frame));
+		}
+		m_frameQueued.notify_one();
+	}
+
+	void TrajectoryRecorder::Stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_stopping)
+				return;
+			m_stopping = true;
+		}
+		m_frameQueued.notify_one();
+		m_frameTaken.notify_all();
+
+		if (m_writer.joinable())
+			m_writer.join();
+
+		if (!m_failed)
+		{
+			// Append the frame index and point the header at it. A recording that was never
+			// closed still plays back - the reader then rebuilds the index by walking the frames.
+			uint64_t indexOffset = m_fileOffset;
+			if (!m_index.empty())
+				Write(m_index.data(), m_index.size() * sizeof(TrajectoryFormat::IndexEntry));
+
+			m_header.frameCount = m_index.size();
+			m_header.indexOffset = indexOffset;
+			try
+			{
+				m_file->WriteAt(0, &m_header, sizeof(m_header));
+			}
+			catch (const std::runtime_error&)
+			{
+				m_failed = true;
+			}
+		}
+
+		try
+		{
+			m_file->Close();
+		}
+		catch (const std::runtime_error&)
+		{
+			m_failed = true;
+		}
+	}
+
+	void TrajectoryRecorder::WriterThread()
+	{
+		while (true)
+		{
+			std::unique_ptr<Frame> frame;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_frameQueued.wait(lock, [this] { return !m_queue.empty() || m_stopping; });
+
+				// Stop() only ends the thread once everything queued has been written
+				if (m_queue.empty())
+					return;
+
+				frame = std::move(m_queue.front());
+				m_queue.pop_front();
+			}
+			m_frameTaken.notify_one();
+
+			if (!m_failed)
+				WriteFrame(*frame);
+
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_freeFrames.push_back(std::move(frame));
+		}
+	}
+
+	void TrajectoryRecorder::WriteFrame(const Frame& frame)
+	{
+		const uint32_t atomCount = static_cast<uint32_t>(frame.positions.size());
+		const bool keyframe = m_index.size() % m_settings.keyframeInterval == 0 || 3 * static_cast<size_t>(atomCount) != m_previous.size();
+
+		XMFLOAT3 box = { m_header.boxDimensions[0], m_header.boxDimensions[1], m_header.boxDimensions[2] };
+		m_current.resize(3 * static_cast<size_t>(atomCount));
+		TrajectoryFormat::Quantize(frame.positions.data(), atomCount, box, m_header.positionBits, m_current.data());
+
+		// Chunks are independent, so encode them in parallel
+		const uint32_t chunkCount = (atomCount + m_settings.atomsPerChunk - 1) / m_settings.atomsPerChunk;
+		m_chunks.resize(chunkCount);
+		concurrency::parallel_for(0u, chunkCount, [&](uint32_t chunk)
+			{
+				uint32_t firstAtom = chunk * m_settings.atomsPerChunk;
+				uint32_t count = std::min(m_settings.atomsPerChunk, atomCount - firstAtom);
+
+				m_chunks[chunk].clear();
+				TrajectoryFormat::EncodeChunk(m_current.data(), keyframe ? nullptr : m_previous.data(),
+					frame.elements.data(), firstAtom, count, m_chunks[chunk]);
+			});
+
+		TrajectoryFormat::FrameHeader header = {};
+		header.magic = TrajectoryFormat::FrameMagic;
+		header.flags = keyframe ? TrajectoryFormat::FrameKeyframe : 0;
+		header.step = frame.step;
+		header.time = frame.time;
+		header.atomCount = atomCount;
+		header.chunkCount = chunkCount;
+		for (const std::vector<uint8_t>& chunk : m_chunks)
+			header.payloadSize += chunk.size();
+
+		TrajectoryFormat::IndexEntry entry = {};
+		entry.offset = m_fileOffset;
+		entry.step = frame.step;
+		entry.flags = header.flags;
+
+		Write(&header, sizeof(header));
+		for (const std::vector<uint8_t>& chunk : m_chunks)
+			Write(chunk.data(), chunk.size());
+
+		if (m_failed)
+			return;
+
+		m_index.push_back(entry);
+		m_previous.swap(m_current);
+		++m_framesWritten;
+	}
+
+	void TrajectoryRecorder::Write(const void* data, size_t size)
+	{
+		try
+		{
+			m_file->Write(data, size);
+		}
+		catch (const std::runtime_error&)
+		{
+			m_failed = true;
+			return;
+		}
+
+		m_fileOffset += size;
+		m_bytesWritten += size;
+	}
+}
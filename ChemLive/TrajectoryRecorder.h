@@ -0,0 +1,100 @@
+#pragma once
+
+#include "pch.h"
+#include "AsyncIO.h"
+#include "Atom.h"
+#include "TrajectoryFormat.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace Simulation
+{
+	// What to do when the writer thread falls behind and the frame queue is full
+	enum class RecordingQueuePolicy
+	{
+		DropFrame,		// Skip the new frame - the simulation step never waits on the disk
+		Block			// Wait for the writer - no frames are lost, but Update may stall
+	};
+
+	struct TrajectoryRecorderSettings
+	{
+		unsigned int			frameInterval = 1;		// Record every Nth simulation step
+		unsigned int			positionBits = 16;		// Quantization per axis, relative to the box
+		unsigned int			keyframeInterval = 60;	// Recorded frames between keyframes (bounds the cost of a seek)
+		unsigned int			atomsPerChunk = 65536;	// Atoms per independently compressed chunk
+		unsigned int			queueCapacity = 8;		// Frames that may wait for the writer thread
+		RecordingQueuePolicy	queuePolicy = RecordingQueuePolicy::DropFrame;
+	};
+
+	/*
+	*	Streams every Nth simulation frame to a trajectory file (see TrajectoryFormat.h).
+	*	The simulation thread only copies positions into a pooled frame buffer and hands it to
+	*	a bounded queue; quantizing, delta coding, compressing and writing all happen on a
+	*	background writer thread.
+	*/
+	class TrajectoryRecorder
+	{
+	public:
+		TrajectoryRecorder(const std::wstring& filename, XMFLOAT3 boxDimensions, const TrajectoryRecorderSettings& settings);
+		~TrajectoryRecorder();
+
+		// Called from Simulation::Update after every step
+		void SubmitFrame(unsigned long long step, double time, const std::vector<Atom*>& atoms);
+
+		// Write any queued frames, append the frame index and close the file
+		void Stop();
+
+		// GET
+		unsigned long long FramesWritten() { return m_framesWritten; }
+		unsigned long long FramesDropped() { return m_framesDropped; }
+		unsigned long long BytesWritten() { return m_bytesWritten; }
+		bool			   Failed() { return m_failed; }		// The file could not be written - recording stopped
+
+	private:
+		struct Frame
+		{
+			unsigned long long		step;
+			double					time;
+			std::vector<XMFLOAT3>	positions;
+			std::vector<uint8_t>	elements;
+		};
+
+		void WriterThread();
+		void WriteFrame(const Frame& frame);
+		void Write(const void* data, size_t size);
+
+		TrajectoryRecorderSettings				m_settings;
+		TrajectoryFormat::FileHeader			m_header;
+		std::unique_ptr<AsyncFileWriter>		m_file;
+
+		// Queue between the simulation thread and the writer thread
+		std::mutex								m_mutex;
+		std::condition_variable					m_frameQueued;
+		std::condition_variable					m_frameTaken;
+		std::deque<std::unique_ptr<Frame>>		m_queue;
+		std::vector<std::unique_ptr<Frame>>		m_freeFrames;		// Recycled so steady state recording does not allocate
+		bool									m_stopping;
+		std::thread								m_writer;
+
+		unsigned long long						m_stepsSinceFrame;
+
+		// Writer thread state
+		std::vector<uint32_t>					m_previous;			// Quantized positions of the last written frame
+		std::vector<uint32_t>					m_current;
+		std::vector<std::vector<uint8_t>>		m_chunks;
+		std::vector<TrajectoryFormat::IndexEntry> m_index;
+		uint64_t								m_fileOffset;
+
+		// Statistics
+		std::atomic<unsigned long long>			m_framesWritten;
+		std::atomic<unsigned long long>			m_framesDropped;
+		std::atomic<unsigned long long>			m_bytesWritten;
+		std::atomic<bool>						m_failed;
+	};
+}